@@ -150,6 +150,135 @@ int ren_most_occurred_number(int nums[], int size){
      return returnvalue ; 
 }
 
+// ============================================================================
+// Single-pass temporal statistics
+// ============================================================================
+void ln_temporal_moments_init(ln_temporal_moments& m, const uint64_t nr_voxels) {
+    m.nr_voxels = nr_voxels;
+    m.nr_volumes = 0;
+    m.global_mean = 0;
+    m.global_m2 = 0;
+    m.mean.assign(nr_voxels, 0);
+    m.m2.assign(nr_voxels, 0);
+    m.m3.assign(nr_voxels, 0);
+    m.m4.assign(nr_voxels, 0);
+    m.first.assign(nr_voxels, 0);
+    m.prev.assign(nr_voxels, 0);
+    m.lag1.assign(nr_voxels, 0);
+    m.comoment_global.assign(nr_voxels, 0);
+    m.odd_even.assign(nr_voxels, 0);
+}
+
+void ln_temporal_moments_update(ln_temporal_moments& m, const float* volume) {
+    ///////////////////////////////////////////////////////////////////////////
+    // NOTE: Central moments are updated with Welford's method extended to
+    // the 3rd and 4th moments (Terriberry 2007). The lag-1 products are
+    // summed on data shifted by the first time point, which keeps them well
+    // conditioned without a second pass over the data.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint64_t nr_voxels = m.nr_voxels;
+    const double n1 = static_cast<double>(m.nr_volumes);
+    const double n = n1 + 1;
+    const double sign = (m.nr_volumes % 2 == 0) ? 1 : -1;
+
+    // Volume average (for the correlation with the global time course)
+    double g = 0;
+    for (uint64_t i = 0; i < nr_voxels; ++i) {
+        g += volume[i];
+    }
+    g /= static_cast<double>(nr_voxels);
+    const double g_delta = g - m.global_mean;
+    m.global_mean += g_delta / n;
+    m.global_m2 += g_delta * (g - m.global_mean);
+
+    double* mean = m.mean.data();
+    double* m2 = m.m2.data();
+    double* m3 = m.m3.data();
+    double* m4 = m.m4.data();
+    double* first = m.first.data();
+    double* prev = m.prev.data();
+    double* lag1 = m.lag1.data();
+    double* comoment = m.comoment_global.data();
+    double* odd_even = m.odd_even.data();
+
+    if (m.nr_volumes == 0) {
+        for (uint64_t i = 0; i < nr_voxels; ++i) {
+            first[i] = volume[i];
+        }
+    }
+
+    const double g_new = g - m.global_mean;
+    for (uint64_t i = 0; i < nr_voxels; ++i) {
+        const double x = volume[i];
+        const double delta = x - mean[i];
+        const double delta_n = delta / n;
+        const double delta_n2 = delta_n * delta_n;
+        const double term1 = delta * delta_n * n1;
+
+        mean[i] += delta_n;
+        m4[i] += term1 * delta_n2 * (n * n - 3 * n + 3)
+                 + 6 * delta_n2 * m2[i] - 4 * delta_n * m3[i];
+        m3[i] += term1 * delta_n * (n - 2) - 3 * delta_n * m2[i];
+        m2[i] += term1;
+
+        comoment[i] += delta * g_new;
+        lag1[i] += (x - first[i]) * (prev[i] - first[i]);
+        odd_even[i] += sign * x;
+        prev[i] = x;
+    }
+    m.nr_volumes++;
+}
+
+void ln_temporal_moments_finalize(const ln_temporal_moments& m,
+                                  float* mean, float* stdev, float* skew,
+                                  float* kurt, float* autocorr, float* correl,
+                                  float* noise) {
+    // NOTE: Definitions match ren_average, ren_stdev, ren_skew, ren_kurt,
+    // ren_autocor and ren_correl. Any output pointer can be NULL.
+    const double n = static_cast<double>(m.nr_volumes);
+    const uint64_t nr_pairs = m.nr_volumes / 2;
+
+    for (uint64_t i = 0; i < m.nr_voxels; ++i) {
+        const double m2 = m.m2[i];
+        double val;
+        if (mean) {
+            mean[i] = m.mean[i];
+        }
+        if (stdev) {
+            val = std::sqrt(m2 / (n - 1));
+            stdev[i] = (val != val) ? 0 : val;
+        }
+        if (skew) {
+            val = (m.m3[i] / n) / std::pow(m2 / (n - 1), 1.5);
+            skew[i] = (val != val) ? 0 : val;
+        }
+        if (kurt) {
+            val = n * m.m4[i] / (m2 * m2) - 3;
+            kurt[i] = (val != val) ? 0 : val;
+        }
+        if (autocorr) {
+            // Lag-1 sum around the mean, expanded from the shifted sums
+            const double my = m.mean[i] - m.first[i];
+            const double y_last = m.prev[i] - m.first[i];
+            val = m.lag1[i] - my * (2 * n * my - y_last) + (n - 1) * my * my;
+            val /= m2;
+            autocorr[i] = (val != val) ? 0 : val;
+        }
+        if (correl) {
+            val = m.comoment_global[i] / std::sqrt(m2 * m.global_m2);
+            correl[i] = (val != val) ? 0 : val;
+        }
+        if (noise) {
+            // Only complete odd-even pairs contribute
+            val = m.odd_even[i];
+            if (m.nr_volumes % 2 == 1) {
+                val -= m.prev[i];
+            }
+            noise[i] = val / std::sqrt(static_cast<double>(nr_pairs));
+        }
+    }
+}
+
 float dist(float x1, float y1, float z1, float x2, float y2, float z2,
            float dX, float dY, float dZ) {
     return sqrt(pow((x1 - x2) * dX, 2) + pow((y1 - y2) * dY, 2)
@@ -344,6 +473,74 @@ nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii
 }
 
 
+void cast_to_float32(const void* data, const int datatype,
+                     const uint64_t nr_values, float* data_out) {
+    // Cast a raw buffer of any nifti datatype into float32. Used for whole
+    // images as well as for single volumes that are read brick by brick.
+    // NOTE(Faruk): See nifti1.h for notes on data types
+    // ------------------------------------------------------------------------
+    if (datatype == 2) {  // NIFTI_TYPE_UINT8
+        const uint8_t* nii_data = static_cast<const uint8_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 512) {  // NIFTI_TYPE_UINT16
+        const uint16_t* nii_data = static_cast<const uint16_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 768) {  // NIFTI_TYPE_UINT32
+        const uint32_t* nii_data = static_cast<const uint32_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 1280) {  // NIFTI_TYPE_UINT64
+        const uint64_t* nii_data = static_cast<const uint64_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 256) {  // NIFTI_TYPE_INT8
+        const int8_t* nii_data = static_cast<const int8_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 4) {  // NIFTI_TYPE_INT16
+        const int16_t* nii_data = static_cast<const int16_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 8) {  // NIFTI_TYPE_INT32
+        const int32_t* nii_data = static_cast<const int32_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 1024) {  // NIFTI_TYPE_INT64
+        const int64_t* nii_data = static_cast<const int64_t*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 16) {  // NIFTI_TYPE_FLOAT32
+        const float* nii_data = static_cast<const float*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else if (datatype == 64) {  // NIFTI_TYPE_FLOAT64
+        const double* nii_data = static_cast<const double*>(data);
+        for (uint64_t i = 0; i < nr_values; ++i) {
+            *(data_out + i) = static_cast<float>(*(nii_data + i));
+        }
+    } else {
+        cout << "Warning! Unrecognized nifti data type!" << endl;
+    }
+
+    // Replace nans with zeros
+    for (uint64_t i = 0; i < nr_values; ++i) {
+        if (*(data_out + i) != *(data_out + i)) {
+            *(data_out + i) = 0;
+        }
+    }
+}
+
 nifti_image* copy_nifti_as_float32(nifti_image* nii) {
     ///////////////////////////////////////////////////////////////////////////
     // NOTE(Renzo): Fixing potential problems with different input datatypes //
@@ -369,68 +566,7 @@ nifti_image* copy_nifti_as_float32(nifti_image* nii) {
     nii_new->data = calloc(nr_voxels, nii_new->nbyper);
     float* nii_new_data = static_cast<float*>(nii_new->data);
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (uint64_t i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
-    }
-
-    // Replace nans with zeros
-    for (uint64_t i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i) != *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
-        }
-    }
+    cast_to_float32(nii->data, nii->datatype, nr_voxels, nii_new_data);
 
     return nii_new;
 }
@@ -1103,6 +1239,1164 @@ nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
     return nii_smooth;
 }
 
+// ============================================================================
+// UVD spatial index
+// ============================================================================
+void ln_uvd_grid_build(ln_uvd_grid& grid,
+                       const float* u, const float* v, const float* d,
+                       const uint32_t nr_points,
+                       const float cell_uv, const float cell_d) {
+    float max_u = 0, max_v = 0, max_d = 0;
+    grid.min_u = 0, grid.min_v = 0, grid.min_d = 0;
+    if (nr_points > 0) {
+        grid.min_u = max_u = u[0];
+        grid.min_v = max_v = v[0];
+        grid.min_d = max_d = d[0];
+    }
+    for (uint32_t i = 1; i < nr_points; ++i) {
+        grid.min_u = std::min(grid.min_u, u[i]);
+        grid.min_v = std::min(grid.min_v, v[i]);
+        grid.min_d = std::min(grid.min_d, d[i]);
+        max_u = std::max(max_u, u[i]);
+        max_v = std::max(max_v, v[i]);
+        max_d = std::max(max_d, d[i]);
+    }
+
+    // NOTE: Cells are never made smaller than needed to keep the grid at
+    // most 1024 cells wide per axis, otherwise tiny windows would allocate
+    // huge, mostly empty grids. Cells are also grown until there are at most
+    // a few cells per point, so that memory follows the number of points.
+    const int max_cells = 1024;
+    grid.cell_uv = std::max(cell_uv, std::max(max_u - grid.min_u, max_v - grid.min_v) / max_cells);
+    grid.cell_d = std::max(cell_d, (max_d - grid.min_d) / max_cells);
+    if (grid.cell_uv <= 0) grid.cell_uv = 1;
+    if (grid.cell_d <= 0) grid.cell_d = 1;
+    const uint64_t max_total_cells = 4 * static_cast<uint64_t>(nr_points) + 64;
+    while (true) {
+        grid.nu = static_cast<int>((max_u - grid.min_u) / grid.cell_uv) + 1;
+        grid.nv = static_cast<int>((max_v - grid.min_v) / grid.cell_uv) + 1;
+        grid.nd = static_cast<int>((max_d - grid.min_d) / grid.cell_d) + 1;
+        if (static_cast<uint64_t>(grid.nu) * grid.nv * grid.nd <= max_total_cells) break;
+        grid.cell_uv *= 1.25f;
+        grid.cell_d *= 1.25f;
+    }
+
+    // Counting sort of points into cells (stable, keeps ascending ids)
+    const uint64_t nr_cells = static_cast<uint64_t>(grid.nu) * grid.nv * grid.nd;
+    std::vector<uint32_t> point_cell(nr_points);
+    grid.cell_start.assign(nr_cells + 1, 0);
+    for (uint32_t i = 0; i < nr_points; ++i) {
+        int iu = std::min(static_cast<int>((u[i] - grid.min_u) / grid.cell_uv), grid.nu - 1);
+        int iv = std::min(static_cast<int>((v[i] - grid.min_v) / grid.cell_uv), grid.nv - 1);
+        int id = std::min(static_cast<int>((d[i] - grid.min_d) / grid.cell_d), grid.nd - 1);
+        point_cell[i] = (static_cast<uint64_t>(id) * grid.nv + iv) * grid.nu + iu;
+        grid.cell_start[point_cell[i] + 1]++;
+    }
+    for (uint64_t c = 0; c < nr_cells; ++c) {
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    }
+    std::vector<uint32_t> fill(grid.cell_start.begin(), grid.cell_start.end() - 1);
+    grid.point_ids.resize(nr_points);
+    for (uint32_t i = 0; i < nr_points; ++i) {
+        grid.point_ids[fill[point_cell[i]]++] = i;
+    }
+}
+
+void ln_uvd_grid_cell_bounds(const ln_uvd_grid& grid,
+                             const float u0, const float v0, const float d0,
+                             const float radius, const float half_height,
+                             int& iu0, int& iu1, int& iv0, int& iv1,
+                             int& id0, int& id1) {
+    // Inclusive range of cells that overlap the cylinder's bounding box
+    iu0 = std::max(static_cast<int>(std::floor((u0 - radius - grid.min_u) / grid.cell_uv)), 0);
+    iu1 = std::min(static_cast<int>(std::floor((u0 + radius - grid.min_u) / grid.cell_uv)), grid.nu - 1);
+    iv0 = std::max(static_cast<int>(std::floor((v0 - radius - grid.min_v) / grid.cell_uv)), 0);
+    iv1 = std::min(static_cast<int>(std::floor((v0 + radius - grid.min_v) / grid.cell_uv)), grid.nv - 1);
+    id0 = std::max(static_cast<int>(std::floor((d0 - half_height - grid.min_d) / grid.cell_d)), 0);
+    id1 = std::min(static_cast<int>(std::floor((d0 + half_height - grid.min_d) / grid.cell_d)), grid.nd - 1);
+}
+
+void ln_uvd_grid_query_cylinder(const ln_uvd_grid& grid,
+                                const float* u, const float* v, const float* d,
+                                const float u0, const float v0, const float d0,
+                                const float radius, const float half_height,
+                                std::vector<uint32_t>& neighbors) {
+    // Same window test as the brute force loops used to do: strict inequality
+    // for both the depth and the UV distance. Neighbors are appended.
+    const float radius_sqr = radius * radius;
+    int iu0, iu1, iv0, iv1, id0, id1;
+    ln_uvd_grid_cell_bounds(grid, u0, v0, d0, radius, half_height,
+                            iu0, iu1, iv0, iv1, id0, id1);
+
+    for (int id = id0; id <= id1; ++id) {
+        for (int iv = iv0; iv <= iv1; ++iv) {
+            const uint64_t row = (static_cast<uint64_t>(id) * grid.nv + iv) * grid.nu;
+            const uint32_t first = grid.cell_start[row + iu0];
+            const uint32_t last = grid.cell_start[row + iu1 + 1];
+            for (uint32_t k = first; k < last; ++k) {
+                const uint32_t j = grid.point_ids[k];
+                if (std::abs(d0 - d[j]) < half_height) {
+                    float dist_uv = (u0 - u[j]) * (u0 - u[j]) + (v0 - v[j]) * (v0 - v[j]);
+                    if (dist_uv < radius_sqr) {
+                        neighbors.push_back(j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Flattening mapping
+// ============================================================================
+// NOTE: Binary layout in native byte order:
+//     "LNFLATM2", 6 x int64 dimensions, int64 number of entries,
+//     int64 number of fill sources (0 or bins),
+//     int64 voxel_id[entries], int64 bin_id[entries], float weight[entries],
+//     float bin_domain[bins], int64 fill_source[fill sources]
+static const char ln_flat_mapping_magic[8] = {'L', 'N', 'F', 'L', 'A', 'T', 'M', '2'};
+
+bool ln_flat_mapping_write(const char* path, const ln_flat_mapping& mapping) {
+    const int64_t nr_bins = mapping.bins_u * mapping.bins_v * mapping.bins_d;
+    const int64_t nr_entries = mapping.voxel_id.size();
+    const int64_t nr_fill = mapping.fill_source.size();
+    if (static_cast<int64_t>(mapping.bin_id.size()) != nr_entries
+        || static_cast<int64_t>(mapping.weight.size()) != nr_entries
+        || static_cast<int64_t>(mapping.bin_domain.size()) != nr_bins
+        || (nr_fill != 0 && nr_fill != nr_bins)) {
+        return false;
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        return false;
+    }
+    const int64_t header[8] = {mapping.size_x, mapping.size_y, mapping.size_z,
+                               mapping.bins_u, mapping.bins_v, mapping.bins_d,
+                               nr_entries, nr_fill};
+    bool ok = fwrite(ln_flat_mapping_magic, 1, 8, fp) == 8
+        && fwrite(header, sizeof(int64_t), 8, fp) == 8
+        && fwrite(mapping.voxel_id.data(), sizeof(int64_t), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fwrite(mapping.bin_id.data(), sizeof(int64_t), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fwrite(mapping.weight.data(), sizeof(float), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fwrite(mapping.bin_domain.data(), sizeof(float), nr_bins, fp) == static_cast<size_t>(nr_bins)
+        && fwrite(mapping.fill_source.data(), sizeof(int64_t), nr_fill, fp) == static_cast<size_t>(nr_fill);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) {
+        log_output(path);
+    }
+    return ok;
+}
+
+bool ln_flat_mapping_read(const char* path, ln_flat_mapping& mapping) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char magic[8];
+    int64_t header[8];
+    if (fread(magic, 1, 8, fp) != 8
+        || memcmp(magic, ln_flat_mapping_magic, 8) != 0
+        || fread(header, sizeof(int64_t), 8, fp) != 8) {
+        fclose(fp);
+        return false;
+    }
+    for (int i = 0; i != 8; ++i) {
+        if (header[i] < 0 || (i < 6 && header[i] == 0)) {
+            fclose(fp);
+            return false;
+        }
+    }
+    mapping.size_x = header[0];
+    mapping.size_y = header[1];
+    mapping.size_z = header[2];
+    mapping.bins_u = header[3];
+    mapping.bins_v = header[4];
+    mapping.bins_d = header[5];
+    const int64_t nr_entries = header[6];
+    const int64_t nr_voxels = mapping.size_x * mapping.size_y * mapping.size_z;
+    const int64_t nr_bins = mapping.bins_u * mapping.bins_v * mapping.bins_d;
+    const int64_t nr_fill = header[7];
+    if (nr_fill != 0 && nr_fill != nr_bins) {
+        fclose(fp);
+        return false;
+    }
+
+    mapping.voxel_id.resize(nr_entries);
+    mapping.bin_id.resize(nr_entries);
+    mapping.weight.resize(nr_entries);
+    mapping.bin_domain.resize(nr_bins);
+    mapping.fill_source.resize(nr_fill);
+    bool ok = fread(mapping.voxel_id.data(), sizeof(int64_t), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fread(mapping.bin_id.data(), sizeof(int64_t), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fread(mapping.weight.data(), sizeof(float), nr_entries, fp) == static_cast<size_t>(nr_entries)
+        && fread(mapping.bin_domain.data(), sizeof(float), nr_bins, fp) == static_cast<size_t>(nr_bins)
+        && fread(mapping.fill_source.data(), sizeof(int64_t), nr_fill, fp) == static_cast<size_t>(nr_fill);
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+
+    // Guard against indexing outside of the images
+    for (int64_t n = 0; n != nr_entries; ++n) {
+        if (mapping.voxel_id[n] < 0 || mapping.voxel_id[n] >= nr_voxels
+            || mapping.bin_id[n] < 0 || mapping.bin_id[n] >= nr_bins
+            || !(mapping.weight[n] >= 0)) {
+            return false;
+        }
+    }
+    for (int64_t i = 0; i != nr_fill; ++i) {
+        if (mapping.fill_source[i] < 0 || mapping.fill_source[i] >= nr_bins) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ============================================================================
+// Geodesic floods on voxel graphs
+// ============================================================================
+void ln_voxel_graph_build(ln_voxel_graph& graph,
+                          const int32_t* voi_id, const uint32_t nr_voi,
+                          const std::vector<bool>& is_target,
+                          const std::vector<bool>& face_only,
+                          const uint32_t size_x, const uint32_t size_y,
+                          const uint32_t size_z,
+                          const float dX, const float dY, const float dZ) {
+    const uint64_t nr_voxels = static_cast<uint64_t>(size_x) * size_y * size_z;
+    const int64_t size_xy = static_cast<int64_t>(size_x) * size_y;
+
+    // Lengths of the 27 offsets (dx, dy, dz) in -1, 0, 1 (center unused)
+    float length[27];
+    for (int dz = -1; dz <= 1; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                length[(dz + 1) * 9 + (dy + 1) * 3 + dx + 1] =
+                    sqrt((dx != 0) * dX * dX + (dy != 0) * dY * dY + (dz != 0) * dZ * dZ);
+            }
+        }
+    }
+    // Single jumps are the voxel sizes themselves
+    length[12] = dX, length[14] = dX;
+    length[10] = dY, length[16] = dY;
+    length[4] = dZ, length[22] = dZ;
+    graph.min_weight = std::min(dX, std::min(dY, dZ));
+
+    // Remap volume indices to node indices
+    std::vector<int32_t> node_id(nr_voxels, -1);
+    graph.node.assign(voi_id, voi_id + nr_voi);
+    for (uint32_t n = 0; n != nr_voi; ++n) {
+        node_id[voi_id[n]] = n;
+    }
+
+    graph.offset.assign(nr_voi + 1, 0);
+    graph.target.clear();
+    graph.weight.clear();
+    graph.target.reserve(static_cast<uint64_t>(nr_voi) * 8);
+    graph.weight.reserve(static_cast<uint64_t>(nr_voi) * 8);
+    for (uint32_t n = 0; n != nr_voi; ++n) {
+        const int64_t i = voi_id[n];
+        uint32_t ix, iy, iz;
+        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+        const bool face = !face_only.empty() && face_only[i];
+
+        const int z0 = (iz == 0) ? 0 : -1, z1 = (iz == size_z - 1) ? 0 : 1;
+        const int y0 = (iy == 0) ? 0 : -1, y1 = (iy == size_y - 1) ? 0 : 1;
+        const int x0 = (ix == 0) ? 0 : -1, x1 = (ix == size_x - 1) ? 0 : 1;
+        for (int dz = z0; dz <= z1; ++dz) {
+            for (int dy = y0; dy <= y1; ++dy) {
+                for (int dx = x0; dx <= x1; ++dx) {
+                    const int jumps = (dx != 0) + (dy != 0) + (dz != 0);
+                    if (jumps == 0 || (face && jumps > 1)) continue;
+                    const int64_t j = i + dx + dy * static_cast<int64_t>(size_x) + dz * size_xy;
+                    if (!is_target[j] || node_id[j] < 0) continue;
+                    graph.target.push_back(node_id[j]);
+                    graph.weight.push_back(length[(dz + 1) * 9 + (dy + 1) * 3 + dx + 1]);
+                }
+            }
+        }
+        graph.offset[n + 1] = graph.target.size();
+    }
+}
+
+// NOTE: Replaces the step-synchronous floods ("loop over all voxels of
+// interest until nothing changes") and gives exactly the same results:
+// - Seeds are the nodes with step 1, starting from their current distance.
+// - Zero distance means unvisited, so zero distance seeds can be overtaken.
+//   The first step is therefore replayed in node order.
+// - Among equally short paths, values (e.g. Voronoi labels) are taken from
+//   the neighbour reached in the fewest steps, then from the lowest node.
+// Nodes are then settled in order of distance using buckets as wide as the
+// shortest edge. Nodes within a bucket can not improve each other, so they
+// are final once their bucket is reached (no heap needed).
+void ln_voxel_graph_flood(const ln_voxel_graph& graph, float* dist_data,
+                          int32_t* step_data, float* value_data) {
+    const uint32_t nr_nodes = graph.node.size();
+    const uint32_t no_parent = std::numeric_limits<uint32_t>::max();
+    const float width = graph.min_weight > 0 ? graph.min_weight : 1;
+    std::vector<float> dist(nr_nodes);
+    std::vector<int32_t> step(nr_nodes);
+    std::vector<uint32_t> parent(nr_nodes, no_parent);
+    for (uint32_t n = 0; n != nr_nodes; ++n) {
+        dist[n] = dist_data[graph.node[n]];
+        step[n] = step_data[graph.node[n]] == 1 ? 1 : 0;
+    }
+
+    typedef std::pair<float, uint32_t> entry;
+    std::vector<std::vector<entry> > bucket;
+    uint64_t b = 0;  // Current bucket
+
+    auto relax = [&](const uint32_t n) {
+        for (uint32_t e = graph.offset[n]; e != graph.offset[n + 1]; ++e) {
+            const uint32_t m = graph.target[e];
+            const float d = dist[n] + graph.weight[e];
+            if (d < dist[m] || dist[m] == 0) {
+                dist[m] = d;
+                step[m] = step[n] + 1;
+                parent[m] = n;
+                const uint64_t k = std::max(static_cast<uint64_t>(d / width), b);
+                if (k >= bucket.size()) {
+                    bucket.resize(k + 1);
+                }
+                bucket[k].push_back(entry(d, m));
+            } else if (d == dist[m] && (step[n] + 1 < step[m]
+                       || (step[n] + 1 == step[m] && n < parent[m]))) {
+                step[m] = step[n] + 1;
+                parent[m] = n;
+            }
+        }
+    };
+
+    // First step, seeds overtaken by an earlier seed are not processed
+    for (uint32_t n = 0; n != nr_nodes; ++n) {
+        if (step[n] == 1) {
+            relax(n);
+        }
+    }
+
+    for (b = 0; b < bucket.size(); ++b) {
+        for (uint64_t k = 0; k < bucket[b].size(); ++k) {
+            const entry top = bucket[b][k];
+            const uint32_t n = top.second;
+            if (top.first != dist[n]) continue;  // Outdated entry
+            if (value_data != NULL) {
+                value_data[graph.node[n]] = value_data[graph.node[parent[n]]];
+            }
+            relax(n);
+        }
+        std::vector<entry>().swap(bucket[b]);
+    }
+
+    for (uint32_t n = 0; n != nr_nodes; ++n) {
+        dist_data[graph.node[n]] = dist[n];
+        step_data[graph.node[n]] = step[n];
+    }
+}
+
+void ln_farthest_points_init(ln_farthest_points& fp, const ln_voxel_graph& graph,
+                             const std::vector<float>& tie_break) {
+    const uint32_t nr_nodes = graph.node.size();
+    const float inf = std::numeric_limits<float>::infinity();
+    fp.dist.assign(nr_nodes, inf);
+    fp.tie_break = tie_break;
+    fp.heap.clear();
+    fp.heap.reserve(nr_nodes);
+    for (uint32_t n = 0; n != nr_nodes; ++n) {
+        fp.heap.push_back(std::make_tuple(inf, fp.tie_break[n], n));
+    }
+    std::make_heap(fp.heap.begin(), fp.heap.end());
+}
+
+void ln_farthest_points_add(ln_farthest_points& fp, const ln_voxel_graph& graph,
+                            const uint32_t node) {
+    // NOTE: Only nodes that get closer to the new pick are visited. Paths
+    // through any other node can not be shorter than what is already known.
+    typedef std::pair<float, uint32_t> entry;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > queue;
+    fp.dist[node] = 0;
+    queue.push(entry(0, node));
+    while (!queue.empty()) {
+        const entry top = queue.top();
+        queue.pop();
+        const uint32_t n = top.second;
+        if (top.first != fp.dist[n]) continue;  // Outdated entry
+        for (uint32_t e = graph.offset[n]; e != graph.offset[n + 1]; ++e) {
+            const uint32_t m = graph.target[e];
+            const float d = top.first + graph.weight[e];
+            if (d < fp.dist[m]) {
+                fp.dist[m] = d;
+                queue.push(entry(d, m));
+                fp.heap.push_back(std::make_tuple(d, fp.tie_break[m], m));
+                std::push_heap(fp.heap.begin(), fp.heap.end());
+            }
+        }
+    }
+}
+
+bool ln_farthest_points_next(ln_farthest_points& fp, uint32_t& node) {
+    while (!fp.heap.empty()) {
+        const std::tuple<float, float, uint32_t>& top = fp.heap.front();
+        const uint32_t n = std::get<2>(top);
+        if (std::get<0>(top) == fp.dist[n] && fp.dist[n] > 0) {
+            node = n;
+            return true;
+        }
+        std::pop_heap(fp.heap.begin(), fp.heap.end());
+        fp.heap.pop_back();
+    }
+    return false;  // Every node is picked
+}
+
+// ============================================================================
+// Euclidean distance transform
+// ============================================================================
+// NOTE: Separable lower envelope of parabolas (Felzenszwalb & Huttenlocher,
+// 2012). Squared distances are transformed along x, then y, then z. Every
+// line is done in linear time, so the whole transform is O(nr_voxels)
+// regardless of how far the seeds are. Only finite values take part in the
+// envelope of a line, so seedless lines stay infinite.
+static void ln_distance_transform_line(float* f, int32_t* id, const uint32_t n,
+                                       const double w, std::vector<uint32_t>& v,
+                                       std::vector<double>& h, std::vector<double>& z,
+                                       std::vector<float>& g,
+                                       std::vector<int32_t>& g_id) {
+    const float inf = std::numeric_limits<float>::infinity();
+    const double w2 = w * w;
+
+    // Lower envelope of the parabolas rooted at finite samples. The
+    // intersection with the previous parabola is only divided out once the
+    // new parabola is kept.
+    int k = -1;
+    for (uint32_t q = 0; q != n; ++q) {
+        if (f[q] == inf) continue;
+        const double hq = f[q] + w2 * q * q;
+        double num = 0, den = 1;
+        while (k >= 0) {
+            num = hq - h[k];
+            den = 2 * w2 * (q - static_cast<double>(v[k]));
+            if (num > z[k] * den) break;
+            k -= 1;
+        }
+        k += 1;
+        v[k] = q;
+        h[k] = hq;
+        z[k] = (k == 0) ? -std::numeric_limits<double>::infinity() : num / den;
+        z[k + 1] = std::numeric_limits<double>::infinity();
+    }
+    if (k < 0) return;
+
+    // Sample the envelope
+    int e = 0;
+    for (uint32_t q = 0; q != n; ++q) {
+        while (z[e + 1] < q) e += 1;
+        const double d = static_cast<double>(q) - v[e];
+        g[q] = w2 * d * d + f[v[e]];
+        if (id != NULL) g_id[q] = id[v[e]];
+    }
+    std::copy(g.begin(), g.begin() + n, f);
+    if (id != NULL) std::copy(g_id.begin(), g_id.begin() + n, id);
+}
+
+void ln_distance_transform_3D(const std::vector<bool>& is_seed, float* dist_data,
+                              int32_t* nearest_data,
+                              const uint32_t size_x, const uint32_t size_y,
+                              const uint32_t size_z,
+                              const float dX, const float dY, const float dZ) {
+    const uint64_t nr_voxels = static_cast<uint64_t>(size_x) * size_y * size_z;
+    const uint64_t size_xy = static_cast<uint64_t>(size_x) * size_y;
+    const float inf = std::numeric_limits<float>::infinity();
+    const bool track = nearest_data != NULL;
+
+    // Squared distances are kept in the output until the end
+    for (uint64_t i = 0; i != nr_voxels; ++i) {
+        dist_data[i] = is_seed[i] ? 0 : inf;
+        if (track) nearest_data[i] = is_seed[i] ? i : -1;
+    }
+
+    // NOTE: Lines along y and z are strided in memory. They are therefore
+    // transformed in blocks of neighbouring lines along x, which are gathered
+    // (and scattered back) one cache line friendly row at a time.
+    const uint32_t block = 16;
+    const uint32_t size_max = std::max(size_x, std::max(size_y, size_z));
+    std::vector<float> f(size_max * block), g(size_max);
+    std::vector<int32_t> id(track ? size_max * block : 0), g_id(size_max);
+    std::vector<double> h(size_max), z(size_max + 1);
+    std::vector<uint32_t> v(size_max);
+
+    // Along x, lines are contiguous
+    for (uint64_t start = 0; start < nr_voxels; start += size_x) {
+        ln_distance_transform_line(dist_data + start,
+                                   track ? nearest_data + start : NULL,
+                                   size_x, dX, v, h, z, g, g_id);
+    }
+
+    // Along y (stride size_x) and z (stride size_xy)
+    for (int axis = 1; axis != 3; ++axis) {
+        const uint32_t n = (axis == 1) ? size_y : size_z;
+        const uint64_t stride = (axis == 1) ? size_x : size_xy;
+        const double w = (axis == 1) ? dY : dZ;
+        const uint32_t nr_planes = (axis == 1) ? size_z : size_y;
+        const uint64_t plane_stride = (axis == 1) ? size_xy : size_x;
+
+        for (uint32_t plane = 0; plane != nr_planes; ++plane) {
+            for (uint32_t x0 = 0; x0 < size_x; x0 += block) {
+                const uint32_t nr_lines = std::min(block, size_x - x0);
+                const uint64_t start = plane * plane_stride + x0;
+                for (uint32_t q = 0; q != n; ++q) {
+                    for (uint32_t b = 0; b != nr_lines; ++b) {
+                        f[b * n + q] = dist_data[start + q * stride + b];
+                        if (track) id[b * n + q] = nearest_data[start + q * stride + b];
+                    }
+                }
+                for (uint32_t b = 0; b != nr_lines; ++b) {
+                    ln_distance_transform_line(&f[b * n], track ? &id[b * n] : NULL,
+                                               n, w, v, h, z, g, g_id);
+                }
+                for (uint32_t q = 0; q != n; ++q) {
+                    for (uint32_t b = 0; b != nr_lines; ++b) {
+                        dist_data[start + q * stride + b] = f[b * n + q];
+                        if (track) nearest_data[start + q * stride + b] = id[b * n + q];
+                    }
+                }
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i != nr_voxels; ++i) {
+        dist_data[i] = sqrt(dist_data[i]);
+    }
+}
+
+// ============================================================================
+// Finite difference stencils
+// ============================================================================
+bool ln_stencil_from_name(const char* name, ln_stencil_type& stencil) {
+    const std::string n(name);
+    if (n == "central") {
+        stencil = LN_STENCIL_CENTRAL;
+    } else if (n == "sobel") {
+        stencil = LN_STENCIL_SOBEL;
+    } else if (n == "scharr") {
+        stencil = LN_STENCIL_SCHARR;
+    } else if (n == "second_order") {
+        stencil = LN_STENCIL_SECOND_ORDER;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// NOTE: The sweep goes row by row (along x). Every kernel below works on
+// whole rows through plain pointer offsets, without index conversions or
+// per voxel boundary checks, so that the compiler can vectorize the interior.
+// Rows of the first and last voxels along x, and rows without neighbouring
+// rows along y or z, are handled separately.
+
+// out[x] = a[x] - b[x], or zero when a row is missing
+static inline void ln_stencil_row_difference(const float* a, const float* b,
+                                             float* out, const uint32_t n) {
+    if (a == NULL || b == NULL) {
+        std::fill(out, out + n, 0.f);
+        return;
+    }
+    for (uint32_t x = 0; x != n; ++x) {
+        out[x] = a[x] - b[x];
+    }
+}
+
+// out[x] = f[x-1] - f[x+1], zero at both ends
+static inline void ln_stencil_row_central(const float* f, float* out, const uint32_t n) {
+    out[0] = 0;
+    for (uint32_t x = 1; x < n - 1; ++x) {
+        out[x] = f[x - 1] - f[x + 1];
+    }
+    out[n - 1] = 0;
+}
+
+// out[x] = prev[x] - 2 f[x] + next[x], zero when a row is missing
+static inline void ln_stencil_row_second_order(const float* prev, const float* f,
+                                               const float* next, float* out,
+                                               const uint32_t n) {
+    if (prev == NULL || next == NULL) {
+        std::fill(out, out + n, 0.f);
+        return;
+    }
+    for (uint32_t x = 0; x != n; ++x) {
+        out[x] = prev[x] - 2 * f[x] + next[x];
+    }
+}
+
+// Central difference of central gradients across rows. The gradients at the
+// neighbouring rows are zero when those rows are outermost (prev2 or next2
+// missing), and the result is zero when the row itself is outermost.
+static inline void ln_stencil_row_nested(const float* prev2, const float* f,
+                                         const float* next2, const bool interior,
+                                         float* out, const uint32_t n) {
+    std::fill(out, out + n, 0.f);
+    if (!interior) return;
+    if (prev2 != NULL) {
+        for (uint32_t x = 0; x != n; ++x) {
+            out[x] = prev2[x] - f[x];
+        }
+    }
+    if (next2 != NULL) {
+        for (uint32_t x = 0; x != n; ++x) {
+            out[x] = out[x] - (f[x] - next2[x]);
+        }
+    }
+}
+
+// out[x] = w_side * (f[x-1] + f[x+1]) + w_center * f[x], edges replicated
+template <int W_SIDE, int W_CENTER>
+static inline void ln_stencil_row_smooth(const float* f, float* out, const uint32_t n) {
+    if (n == 1) {
+        out[0] = (2 * W_SIDE + W_CENTER) * f[0];
+        return;
+    }
+    out[0] = W_SIDE * (f[0] + f[1]) + W_CENTER * f[0];
+    for (uint32_t x = 1; x < n - 1; ++x) {
+        out[x] = W_SIDE * (f[x - 1] + f[x + 1]) + W_CENTER * f[x];
+    }
+    out[n - 1] = W_SIDE * (f[n - 2] + f[n - 1]) + W_CENTER * f[n - 1];
+}
+
+// Sobel (1, 2, 1) and Scharr (3, 10, 3) gradients of one row
+template <int W_SIDE, int W_CENTER>
+static void ln_stencil_row_smoothed_gradients(
+    const float* data, const int64_t y, const int64_t z,
+    const uint32_t size_x, const uint32_t size_y, const uint32_t size_z,
+    float* gra_x, float* gra_y, float* gra_z, std::vector<float>& tmp) {
+    const int64_t size_xy = static_cast<int64_t>(size_x) * size_y;
+    const int w[3] = {W_SIDE, W_CENTER, W_SIDE};
+    auto row = [&](int64_t yy, int64_t zz) {
+        yy = std::min(std::max(yy, int64_t(0)), int64_t(size_y) - 1);
+        zz = std::min(std::max(zz, int64_t(0)), int64_t(size_z) - 1);
+        return data + zz * size_xy + yy * size_x;
+    };
+    float* acc = tmp.data();
+
+    // Along x: difference of the row smoothed across y and z
+    std::fill(acc, acc + size_x, 0.f);
+    for (int dz = -1; dz <= 1; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            const float* f = row(y + dy, z + dz);
+            const float weight = w[dy + 1] * w[dz + 1];
+            for (uint32_t x = 0; x != size_x; ++x) {
+                acc[x] += weight * f[x];
+            }
+        }
+    }
+    ln_stencil_row_central(acc, gra_x, size_x);
+
+    // Along y: difference smoothed across z, then across x
+    if (y > 0 && y < size_y - 1) {
+        std::fill(acc, acc + size_x, 0.f);
+        for (int dz = -1; dz <= 1; ++dz) {
+            const float* a = row(y - 1, z + dz);
+            const float* b = row(y + 1, z + dz);
+            const float weight = w[dz + 1];
+            for (uint32_t x = 0; x != size_x; ++x) {
+                acc[x] += weight * (a[x] - b[x]);
+            }
+        }
+        ln_stencil_row_smooth<W_SIDE, W_CENTER>(acc, gra_y, size_x);
+    } else {
+        std::fill(gra_y, gra_y + size_x, 0.f);
+    }
+
+    // Along z: difference smoothed across y, then across x
+    if (z > 0 && z < size_z - 1) {
+        std::fill(acc, acc + size_x, 0.f);
+        for (int dy = -1; dy <= 1; ++dy) {
+            const float* a = row(y + dy, z - 1);
+            const float* b = row(y + dy, z + 1);
+            const float weight = w[dy + 1];
+            for (uint32_t x = 0; x != size_x; ++x) {
+                acc[x] += weight * (a[x] - b[x]);
+            }
+        }
+        ln_stencil_row_smooth<W_SIDE, W_CENTER>(acc, gra_z, size_x);
+    } else {
+        std::fill(gra_z, gra_z + size_x, 0.f);
+    }
+}
+
+void ln_stencil_sweep_3D(const float* data, const uint32_t size_x,
+                         const uint32_t size_y, const uint32_t size_z,
+                         const ln_stencil_type gradient_stencil,
+                         const ln_stencil_type laplacian_stencil,
+                         ln_stencil_outputs& out) {
+    const int64_t size_xy = static_cast<int64_t>(size_x) * size_y;
+    const bool do_gradients = out.gra_x != NULL || out.gra_y != NULL
+                              || out.gra_z != NULL || out.magnitude != NULL;
+
+    // Row of (y, z), NULL when outside of the volume
+    auto row = [&](const int64_t y, const int64_t z) -> const float* {
+        if (y < 0 || y >= size_y || z < 0 || z >= size_z) return NULL;
+        return data + z * size_xy + y * size_x;
+    };
+
+    std::vector<float> gx(size_x), gy(size_x), gz(size_x);
+    std::vector<float> lx(size_x), ly(size_x), lz(size_x);
+    std::vector<float> tmp(size_x);
+
+    for (int64_t z = 0; z != size_z; ++z) {
+        for (int64_t y = 0; y != size_y; ++y) {
+            const int64_t start = z * size_xy + y * size_x;
+            const float* f = data + start;
+
+            // ----------------------------------------------------------------
+            // Gradients
+            // ----------------------------------------------------------------
+            if (do_gradients) {
+                if (gradient_stencil == LN_STENCIL_SOBEL) {
+                    ln_stencil_row_smoothed_gradients<1, 2>(
+                        data, y, z, size_x, size_y, size_z,
+                        gx.data(), gy.data(), gz.data(), tmp);
+                } else if (gradient_stencil == LN_STENCIL_SCHARR) {
+                    ln_stencil_row_smoothed_gradients<3, 10>(
+                        data, y, z, size_x, size_y, size_z,
+                        gx.data(), gy.data(), gz.data(), tmp);
+                } else {
+                    ln_stencil_row_central(f, gx.data(), size_x);
+                    const bool in_y = y > 0 && y < size_y - 1;
+                    const bool in_z = z > 0 && z < size_z - 1;
+                    ln_stencil_row_difference(in_y ? row(y - 1, z) : NULL,
+                                              row(y + 1, z), gy.data(), size_x);
+                    ln_stencil_row_difference(in_z ? row(y, z - 1) : NULL,
+                                              row(y, z + 1), gz.data(), size_x);
+                }
+
+                for (uint32_t x = 0; x != size_x; ++x) {
+                    float gra_x = gx[x], gra_y = gy[x], gra_z = gz[x];
+                    const float magnitude = sqrt(gra_x*gra_x + gra_y*gra_y + gra_z*gra_z);
+                    if (out.normalize) {
+                        gra_x /= magnitude;
+                        gra_y /= magnitude;
+                        gra_z /= magnitude;
+                    }
+                    if (out.gra_x != NULL) out.gra_x[start + x] = gra_x;
+                    if (out.gra_y != NULL) out.gra_y[start + x] = gra_y;
+                    if (out.gra_z != NULL) out.gra_z[start + x] = gra_z;
+                    if (out.magnitude != NULL) out.magnitude[start + x] = magnitude;
+                }
+            }
+
+            // ----------------------------------------------------------------
+            // Laplacian
+            // ----------------------------------------------------------------
+            if (out.laplacian == NULL) continue;
+            float* lap = out.laplacian + start;
+
+            if (laplacian_stencil == LN_STENCIL_SECOND_ORDER) {
+                lx[0] = 0, lx[size_x - 1] = 0;
+                for (uint32_t x = 1; x < size_x - 1; ++x) {
+                    lx[x] = f[x - 1] - 2 * f[x] + f[x + 1];
+                }
+                ln_stencil_row_second_order(row(y - 1, z), f, row(y + 1, z),
+                                            ly.data(), size_x);
+                ln_stencil_row_second_order(row(y, z - 1), f, row(y, z + 1),
+                                            lz.data(), size_x);
+            } else {
+                // Central difference of the central gradients, which are zero
+                // on the outermost voxels. Same arithmetic as two passes.
+                lx[0] = 0, lx[size_x - 1] = 0;
+                for (uint32_t x = 1; x + 1 < size_x; ++x) {
+                    const float g_prev = (x >= 2) ? f[x - 2] - f[x] : 0;
+                    const float g_next = (x + 2 < size_x) ? f[x] - f[x + 2] : 0;
+                    lx[x] = g_prev - g_next;
+                }
+                const bool in_y = y > 0 && y < size_y - 1;
+                const bool in_z = z > 0 && z < size_z - 1;
+                ln_stencil_row_nested(in_y ? row(y - 2, z) : NULL, f,
+                                      in_y ? row(y + 2, z) : NULL, in_y,
+                                      ly.data(), size_x);
+                ln_stencil_row_nested(in_z ? row(y, z - 2) : NULL, f,
+                                      in_z ? row(y, z + 2) : NULL, in_z,
+                                      lz.data(), size_x);
+            }
+            for (uint32_t x = 0; x != size_x; ++x) {
+                lap[x] = lx[x] + ly[x] + lz[x];
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Circular (phase) stencils
+// ============================================================================
+// NOTE: Same arithmetic as the original per neighbour branches, written as
+// selects so that rows vectorize: among b - a, 2 pi + b - a and
+// b - (2 pi + a), take the first one whose magnitude is smallest.
+static inline float ln_circular_difference(const float a, const float b) {
+    const float TWOPI = 2.0f * 3.14159265358979f;
+    const float diff1 = b - a;
+    const float diff2 = TWOPI + b - a;
+    const float diff3 = b - (TWOPI + a);
+    const float best = (std::abs(diff3) < std::abs(diff1)) ? diff3 : diff1;
+    return (std::abs(diff2) < std::abs(diff1)) ? diff2 : best;
+}
+
+// out[x] = circular difference of a[x] and b[x], zero when a row is missing
+static inline void ln_circular_row_difference(const float* a, const float* b,
+                                              float* out, const uint32_t n) {
+    if (a == NULL || b == NULL) {
+        std::fill(out, out + n, 0.f);
+        return;
+    }
+    for (uint32_t x = 0; x != n; ++x) {
+        out[x] = ln_circular_difference(a[x], b[x]);
+    }
+}
+
+// out[x] = circular difference of f[x-1] and f[x+1], zero at both ends
+static inline void ln_circular_row_central(const float* f, float* out, const uint32_t n) {
+    out[0] = 0;
+    for (uint32_t x = 1; x < n - 1; ++x) {
+        out[x] = ln_circular_difference(f[x - 1], f[x + 1]);
+    }
+    out[n - 1] = 0;
+}
+
+void ln_phase_stencil_sweep_3D(const float* phase, const uint32_t size_x,
+                               const uint32_t size_y, const uint32_t size_z,
+                               ln_phase_stencil_outputs& out) {
+    const uint64_t size_xy = static_cast<uint64_t>(size_x) * size_y;
+    const bool do_second = out.laplacian != NULL || out.gra2_x != NULL
+                           || out.gra2_y != NULL || out.gra2_z != NULL
+                           || out.jolt != NULL;
+
+    // Gradients of three planes (z-1, z, z+1), addressed by z % 3
+    std::vector<float> planes(9 * size_xy);
+    auto gradient = [&](const int c, const int64_t z) -> float* {
+        return planes.data() + ((z % 3) * 3 + c) * size_xy;
+    };
+    auto row = [&](const float* volume, const int64_t y, const int64_t z) -> const float* {
+        if (y < 0 || y >= size_y || z < 0 || z >= size_z) return NULL;
+        return volume + z * size_xy + y * size_x;
+    };
+
+    // First derivatives of one plane
+    auto compute_gradients = [&](const int64_t z) {
+        float* gx = gradient(0, z);
+        float* gy = gradient(1, z);
+        float* gz = gradient(2, z);
+        const bool in_z = z > 0 && z < size_z - 1 && !out.mode_2D;
+        for (int64_t y = 0; y != size_y; ++y) {
+            const bool in_y = y > 0 && y < size_y - 1;
+            ln_circular_row_central(row(phase, y, z), gx + y * size_x, size_x);
+            ln_circular_row_difference(in_y ? row(phase, y - 1, z) : NULL,
+                                       row(phase, y + 1, z), gy + y * size_x, size_x);
+            ln_circular_row_difference(in_z ? row(phase, y, z - 1) : NULL,
+                                       row(phase, y, z + 1), gz + y * size_x, size_x);
+        }
+    };
+
+    std::vector<float> d_x(size_x), d_y(size_x), d_z(size_x);
+    std::vector<float> lap(size_x), jolt(size_x);
+    const float* g_prev[3];
+    const float* g_next[3];
+    float* gra2[3] = {out.gra2_x, out.gra2_y, out.gra2_z};
+
+    if (size_z > 0) compute_gradients(0);
+    for (int64_t z = 0; z != size_z; ++z) {
+        if (z + 1 < size_z) compute_gradients(z + 1);
+        const uint64_t start = z * size_xy;
+        const float* gra[3] = {gradient(0, z), gradient(1, z), gradient(2, z)};
+
+        // --------------------------------------------------------------------
+        // First derivatives
+        // --------------------------------------------------------------------
+        if (out.gra_x != NULL) std::copy(gra[0], gra[0] + size_xy, out.gra_x + start);
+        if (out.gra_y != NULL) std::copy(gra[1], gra[1] + size_xy, out.gra_y + start);
+        if (out.gra_z != NULL) std::copy(gra[2], gra[2] + size_xy, out.gra_z + start);
+        if (out.phase_jump != NULL) {
+            for (uint64_t i = 0; i != size_xy; ++i) {
+                if (out.mode_2D) {
+                    out.phase_jump[start + i] = (std::abs(gra[0][i]) + std::abs(gra[1][i])) / 2;
+                } else {
+                    out.phase_jump[start + i] =
+                        (std::abs(gra[0][i]) + std::abs(gra[1][i]) + std::abs(gra[2][i])) / 3;
+                }
+            }
+        }
+        if (!do_second) continue;
+
+        // --------------------------------------------------------------------
+        // Second derivatives
+        // --------------------------------------------------------------------
+        // NOTE: Derivatives along z are taken for every gradient, also in 2D
+        // mode, as the separate passes did. D_zz is left out in 2D mode.
+        const bool in_z = z > 0 && z < size_z - 1;
+        for (int c = 0; c != 3; ++c) {
+            g_prev[c] = in_z ? gradient(c, z - 1) : NULL;
+            g_next[c] = in_z ? gradient(c, z + 1) : NULL;
+        }
+        for (int64_t y = 0; y != size_y; ++y) {
+            const uint64_t offset = y * size_x;
+            const bool in_y = y > 0 && y < size_y - 1;
+            if (out.laplacian != NULL) std::fill(lap.begin(), lap.end(), 0.f);
+            if (out.jolt != NULL) std::fill(jolt.begin(), jolt.end(), 0.f);
+
+            for (int c = 0; c != 3; ++c) {
+                if (c == 2 && out.mode_2D) break;
+                const float* g = gra[c] + offset;
+                ln_circular_row_central(g, d_x.data(), size_x);
+                ln_circular_row_difference(in_y ? g - size_x : NULL,
+                                           in_y ? g + size_x : NULL, d_y.data(), size_x);
+                ln_circular_row_difference(in_z ? g_prev[c] + offset : NULL,
+                                           in_z ? g_next[c] + offset : NULL,
+                                           d_z.data(), size_x);
+
+                // Laplacian takes the derivative of each gradient along its own axis
+                const float* d_own = (c == 0) ? d_x.data() : (c == 1) ? d_y.data() : d_z.data();
+                if (out.laplacian != NULL) {
+                    for (uint32_t x = 0; x != size_x; ++x) lap[x] += d_own[x];
+                }
+                if (gra2[c] != NULL || out.jolt != NULL) {
+                    for (uint32_t x = 0; x != size_x; ++x) {
+                        const float l1 = (std::abs(d_x[x]) + std::abs(d_y[x])
+                                          + std::abs(d_z[x])) / 3;
+                        if (gra2[c] != NULL) gra2[c][start + offset + x] = l1;
+                        if (out.jolt != NULL) jolt[x] += l1;
+                    }
+                }
+            }
+
+            if (out.laplacian != NULL) {
+                std::copy(lap.begin(), lap.end(), out.laplacian + start + offset);
+            }
+            if (out.jolt != NULL) {
+                const double nr_terms = out.mode_2D ? 2. : 3.;
+                for (uint32_t x = 0; x != size_x; ++x) {
+                    out.jolt[start + offset + x] = jolt[x] / nr_terms;
+                }
+            }
+        }
+        if (out.mode_2D && out.gra2_z != NULL) {
+            std::fill(out.gra2_z + start, out.gra2_z + start + size_xy, 0.f);
+        }
+    }
+}
+
+// ============================================================================
+// Running window projections
+// ============================================================================
+bool ln_projection_from_name(const char* name, ln_projection_type& type) {
+    const std::string n(name);
+    if (n == "min") {
+        type = LN_PROJECTION_MIN;
+    } else if (n == "max") {
+        type = LN_PROJECTION_MAX;
+    } else if (n == "mean") {
+        type = LN_PROJECTION_MEAN;
+    } else if (n == "median") {
+        type = LN_PROJECTION_MEDIAN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// NOTE: The line kernels below process `nr_lines` lines at once. Element p
+// of line l is at in[p * in_stride + l], so lines are contiguous across l and
+// the inner loops over l vectorize. A single gathered line has nr_lines = 1.
+template <bool IS_MAX>
+static inline float ln_extremum(const float a, const float b) {
+    return IS_MAX ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+template <bool IS_MAX>
+static void ln_running_extremum_lines(const float* in, const int64_t in_stride,
+                                      float* out, const int64_t out_stride,
+                                      const int64_t length, const int64_t nr_lines,
+                                      const int64_t range, std::vector<float>& g,
+                                      std::vector<float>& h) {
+    // van Herk/Gil-Werman: the line is padded by `range` neutral values on
+    // both sides and cut into blocks of the window width. g holds running
+    // extrema from the start of each block, h from its end. Any window covers
+    // the tail of one block and the head of the next.
+    const float pad = IS_MAX ? -std::numeric_limits<float>::infinity()
+                             : std::numeric_limits<float>::infinity();
+    const int64_t width = 2 * range + 1;
+    const int64_t length_padded = length + 2 * range;
+    g.resize(length_padded * nr_lines);
+    h.resize(length_padded * nr_lines);
+
+    for (int64_t q = 0; q != length_padded; ++q) {
+        const int64_t p = q - range;
+        float* gq = &g[q * nr_lines];
+        if (p < 0 || p >= length) {
+            std::fill(gq, gq + nr_lines, pad);
+        } else {
+            std::copy(in + p * in_stride, in + p * in_stride + nr_lines, gq);
+        }
+        std::copy(gq, gq + nr_lines, &h[q * nr_lines]);
+        if (q % width != 0) {
+            const float* gp = gq - nr_lines;
+            for (int64_t l = 0; l != nr_lines; ++l) {
+                gq[l] = ln_extremum<IS_MAX>(gq[l], gp[l]);
+            }
+        }
+    }
+    for (int64_t q = length_padded - 2; q >= 0; --q) {
+        if (q % width != width - 1) {
+            float* hq = &h[q * nr_lines];
+            const float* hn = hq + nr_lines;
+            for (int64_t l = 0; l != nr_lines; ++l) {
+                hq[l] = ln_extremum<IS_MAX>(hq[l], hn[l]);
+            }
+        }
+    }
+    for (int64_t p = 0; p != length; ++p) {
+        const float* hp = &h[p * nr_lines];
+        const float* gp = &g[(p + 2 * range) * nr_lines];
+        float* op = out + p * out_stride;
+        for (int64_t l = 0; l != nr_lines; ++l) {
+            op[l] = ln_extremum<IS_MAX>(hp[l], gp[l]);
+        }
+    }
+}
+
+static void ln_running_mean_lines(const float* in, const int64_t in_stride,
+                                  float* out, const int64_t out_stride,
+                                  const int64_t length, const int64_t nr_lines,
+                                  const int64_t range, std::vector<double>& sums) {
+    // Prefix sums (in double precision): sums[p] is the sum of elements before p
+    sums.assign((length + 1) * nr_lines, 0.);
+    for (int64_t p = 0; p != length; ++p) {
+        const float* ip = in + p * in_stride;
+        const double* sp = &sums[p * nr_lines];
+        double* sn = &sums[(p + 1) * nr_lines];
+        for (int64_t l = 0; l != nr_lines; ++l) {
+            sn[l] = sp[l] + ip[l];
+        }
+    }
+    for (int64_t p = 0; p != length; ++p) {
+        const int64_t first = std::max(p - range, static_cast<int64_t>(0));
+        const int64_t last = std::min(p + range, length - 1);
+        const double* sf = &sums[first * nr_lines];
+        const double* sl = &sums[(last + 1) * nr_lines];
+        const double count = static_cast<double>(last - first + 1);
+        float* op = out + p * out_stride;
+        for (int64_t l = 0; l != nr_lines; ++l) {
+            op[l] = static_cast<float>((sl[l] - sf[l]) / count);
+        }
+    }
+}
+
+static void ln_running_median_line(const float* in, float* out, const int64_t length,
+                                   const int64_t range, std::vector<float>& window) {
+    for (int64_t p = 0; p != length; ++p) {
+        const int64_t first = std::max(p - range, static_cast<int64_t>(0));
+        const int64_t last = std::min(p + range, length - 1);
+        window.assign(in + first, in + last + 1);
+        const int64_t n = window.size();
+        std::nth_element(window.begin(), window.begin() + n / 2, window.end());
+        float m = window[n / 2];
+        if (n % 2 == 0) {  // even, average the two middle values
+            m = (m + *std::max_element(window.begin(), window.begin() + n / 2)) / 2.0;
+        }
+        out[p] = m;
+    }
+}
+
+static void ln_running_projection_lines(const float* in, const int64_t in_stride,
+                                        float* out, const int64_t out_stride,
+                                        const int64_t length, const int64_t nr_lines,
+                                        const int64_t range, const ln_projection_type type,
+                                        std::vector<float>& g, std::vector<float>& h,
+                                        std::vector<double>& sums) {
+    switch (type) {
+        case LN_PROJECTION_MIN:
+            ln_running_extremum_lines<false>(in, in_stride, out, out_stride, length,
+                                             nr_lines, range, g, h);
+            break;
+        case LN_PROJECTION_MAX:
+            ln_running_extremum_lines<true>(in, in_stride, out, out_stride, length,
+                                            nr_lines, range, g, h);
+            break;
+        case LN_PROJECTION_MEAN:
+            ln_running_mean_lines(in, in_stride, out, out_stride, length, nr_lines,
+                                  range, sums);
+            break;
+        case LN_PROJECTION_MEDIAN:
+            // Only called on single gathered lines
+            ln_running_median_line(in, out, length, range, g);
+            break;
+    }
+}
+
+void ln_running_projection_3D(const float* data, float* data_out,
+                              const int64_t size_x, const int64_t size_y, const int64_t size_z,
+                              const int dir_x, const int dir_y, const int dir_z,
+                              const int64_t range, const ln_projection_type type) {
+    const int64_t nxy = size_x * size_y;
+    const int64_t nr_voxels = nxy * size_z;
+    const int64_t BATCH = 256;  // Lines filtered together along y or z
+    std::vector<float> g, h;
+    std::vector<double> sums;
+
+    if (range <= 0 || (dir_x == 0 && dir_y == 0 && dir_z == 0)) {
+        std::copy(data, data + nr_voxels, data_out);
+        return;
+    }
+
+    // ------------------------------------------------------------------------
+    // Along y or z: neighbouring lines are contiguous in memory, so batches of
+    // them are filtered together without gathering.
+    // ------------------------------------------------------------------------
+    const bool along_y = dir_x == 0 && dir_y != 0 && dir_z == 0;
+    const bool along_z = dir_x == 0 && dir_y == 0 && dir_z != 0;
+    if ((along_y || along_z) && type != LN_PROJECTION_MEDIAN) {
+        const int64_t length = along_y ? size_y : size_z;
+        const int64_t stride = along_y ? size_x : nxy;
+        const int64_t lines_per_plane = along_y ? size_x : nxy;
+        const int64_t nr_planes = along_y ? size_z : 1;
+        for (int64_t k = 0; k != nr_planes; ++k) {
+            const int64_t base = k * nxy;
+            for (int64_t l0 = 0; l0 < lines_per_plane; l0 += BATCH) {
+                const int64_t n = std::min(BATCH, lines_per_plane - l0);
+                ln_running_projection_lines(data + base + l0, stride, data_out + base + l0,
+                                            stride, length, n, range, type, g, h, sums);
+            }
+        }
+        return;
+    }
+
+    // ------------------------------------------------------------------------
+    // Any other direction: gather each line, filter it and scatter it back.
+    // Lines start at voxels whose previous voxel along the direction is
+    // outside of the image.
+    // ------------------------------------------------------------------------
+    const int64_t step = dir_x + dir_y * size_x + dir_z * nxy;
+    std::vector<float> line_in, line_out;
+    for (int64_t z = 0; z != size_z; ++z) {
+        for (int64_t y = 0; y != size_y; ++y) {
+            for (int64_t x = 0; x != size_x; ++x) {
+                const int64_t px = x - dir_x, py = y - dir_y, pz = z - dir_z;
+                if (px >= 0 && px < size_x && py >= 0 && py < size_y && pz >= 0 && pz < size_z) {
+                    continue;
+                }
+                line_in.clear();
+                int64_t cx = x, cy = y, cz = z;
+                while (cx >= 0 && cx < size_x && cy >= 0 && cy < size_y && cz >= 0 && cz < size_z) {
+                    line_in.push_back(*(data + cz * nxy + cy * size_x + cx));
+                    cx += dir_x, cy += dir_y, cz += dir_z;
+                }
+                const int64_t length = line_in.size();
+                line_out.resize(length);
+                ln_running_projection_lines(line_in.data(), 1, line_out.data(), 1, length, 1,
+                                            range, type, g, h, sums);
+                const int64_t start = z * nxy + y * size_x + x;
+                for (int64_t p = 0; p != length; ++p) {
+                    *(data_out + start + p * step) = line_out[p];
+                }
+            }
+        }
+    }
+}
+
 // ============================================================================
 // WIP NOLAD...
 // ============================================================================
@@ -1155,63 +2449,65 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
     float w_dY = ln_gaussian(dy, fwhm);
     float w_dZ = ln_gaussian(dz, fwhm);
 
-    // Loop over every data point
-    int ix, iy, iz, it, j;
+    // NOTE: Neighbours are visited row by row in the same order as the
+    // voxel-wise formulation (self, -x, +x, -y, +y, -z, +z), so sums are
+    // accumulated identically. Buffers are swapped instead of copied.
+    const int nxy = nx * ny;
+    float* src = data_in;
+    float* dst = data_temp;
     for (int n = 0; n != nr_iterations; ++n) {
 
         if (log) std::printf("    Iteration: %i/%i\n", n+1, nr_iterations);
 
-        for (int i = 0; i != data_size; ++i) {
-
-            std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
-            float new_val = 0, total_weight = 0;
-
-            // Start with the voxel itself
-            new_val += *(data_in + i) * w_0;
-            total_weight += w_0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0) {
-                j = sub2ind_4D(ix-1, iy, iz, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dX;
-                total_weight += w_dX;
-            }
-            if (ix < nx-1) {
-                j = sub2ind_4D(ix+1, iy, iz, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dX;
-                total_weight += w_dX;
-            }
-            if (iy > 0) {
-                j = sub2ind_4D(ix, iy-1, iz, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dY;
-                total_weight += w_dY;
-            }
-            if (iy < ny-1) {
-                j = sub2ind_4D(ix, iy+1, iz, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dY;
-                total_weight += w_dY;
-            }
-            if (iz > 0) {
-                j = sub2ind_4D(ix, iy, iz-1, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dZ;
-                total_weight += w_dZ;
-            }
-            if (iz < nz-1) {
-                j = sub2ind_4D(ix, iy, iz+1, it, nx, ny, nz);
-                new_val += *(data_in + j) * w_dZ;
-                total_weight += w_dZ;
+        for (int it = 0; it != nt; ++it) {
+            for (int iz = 0; iz != nz; ++iz) {
+                for (int iy = 0; iy != ny; ++iy) {
+                    const int row = ((it*nz + iz)*ny + iy) * nx;
+                    const float* in = src + row;
+                    float* out = dst + row;
+                    for (int ix = 0; ix != nx; ++ix) {
+                        float new_val = 0, total_weight = 0;
+
+                        // Start with the voxel itself
+                        new_val += in[ix] * w_0;
+                        total_weight += w_0;
+
+                        // 1-jump neighbours
+                        if (ix > 0) {
+                            new_val += in[ix-1] * w_dX;
+                            total_weight += w_dX;
+                        }
+                        if (ix < nx-1) {
+                            new_val += in[ix+1] * w_dX;
+                            total_weight += w_dX;
+                        }
+                        if (iy > 0) {
+                            new_val += in[ix-nx] * w_dY;
+                            total_weight += w_dY;
+                        }
+                        if (iy < ny-1) {
+                            new_val += in[ix+nx] * w_dY;
+                            total_weight += w_dY;
+                        }
+                        if (iz > 0) {
+                            new_val += in[ix-nxy] * w_dZ;
+                            total_weight += w_dZ;
+                        }
+                        if (iz < nz-1) {
+                            new_val += in[ix+nxy] * w_dZ;
+                            total_weight += w_dZ;
+                        }
+                        out[ix] = new_val / total_weight;
+                    }
+                }
             }
-
-            // ----------------------------------------------------------------
-            *(data_temp + i) = new_val / total_weight;
         }
+        std::swap(src, dst);
+    }
 
-        // Swap image data for the next iteration
-        for (int i = 0; i != data_size; ++i) {
-            *(data_in + i) = *(data_temp + i);
-        }
+    // Result must end up in the input buffer
+    if (src != data_in) {
+        std::copy(src, src + data_size, data_in);
     }
     free(data_temp);
 }
@@ -1219,67 +2515,45 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
 
 void ln_compute_gradients_3D(const float* data_in, float* data_grad_x, float* data_grad_y, float* data_grad_z, 
                              const int nx, const int ny, const int nz, const int nt) {
-
-    int data_size = nx * ny * nz * nt;
-
-    // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
-        std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
-
-        // --------------------------------------------------------------------
-        // 1-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0 && ix < nx-1) {
-            j = sub2ind_4D(ix-1, iy, iz, it, nx, ny, nz);
-            k = sub2ind_4D(ix+1, iy, iz, it, nx, ny, nz);
-            *(data_grad_x + i) = *(data_in + j) - *(data_in + k);
-        }
-        if (iy > 0 && iy < ny-1) {
-            j = sub2ind_4D(ix, iy-1, iz, it, nx, ny, nz);
-            k = sub2ind_4D(ix, iy+1, iz, it, nx, ny, nz);
-            *(data_grad_y + i)  = *(data_in + j) - *(data_in + k);
-        }
-        if (iz > 0 && iz < nz-1) {
-            j = sub2ind_4D(ix, iy, iz-1, it, nx, ny, nz);
-            k = sub2ind_4D(ix, iy, iz+1, it, nx, ny, nz);
-            *(data_grad_z + i)  = *(data_in + j) - *(data_in + k);
-        }
-    }
+    ln_compute_gradients_3D_over_x(data_in, data_grad_x, nx, ny, nz, nt);
+    ln_compute_gradients_3D_over_y(data_in, data_grad_y, nx, ny, nz, nt);
+    ln_compute_gradients_3D_over_z(data_in, data_grad_z, nx, ny, nz, nt);
 }
 
 
+// NOTE: The gradients below are written as `previous - next` neighbour and
+// are zero on the borders of their own axis.
 void ln_compute_gradients_3D_over_x(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
-
-    int data_size = nx * ny * nz * nt;
-
-    // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
-        std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
-        if (ix > 0 && ix < nx-1) {
-            j = sub2ind_4D(ix-1, iy, iz, it, nx, ny, nz);
-            k = sub2ind_4D(ix+1, iy, iz, it, nx, ny, nz);
-            *(data_out + i) = *(data_in + j) - *(data_in + k);
-        }
+    const int nr_rows = ny * nz * nt;
+    for (int r = 0; r != nr_rows; ++r) {
+        const float* in = data_in + r * nx;
+        float* out = data_out + r * nx;
+        out[0] = 0;
+        for (int x = 1; x < nx-1; ++x) {
+            out[x] = in[x-1] - in[x+1];
+        }
+        if (nx > 1) out[nx-1] = 0;
     }
 }
 
 
 void ln_compute_gradients_3D_over_y(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
-
-    int data_size = nx * ny * nz * nt;
-
-    // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
-        std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
-        if (iy > 0 && iy < ny-1) {
-            j = sub2ind_4D(ix, iy-1, iz, it, nx, ny, nz);
-            k = sub2ind_4D(ix, iy+1, iz, it, nx, ny, nz);
-            *(data_out + i)  = *(data_in + j) - *(data_in + k);
+    const int nr_slices = nz * nt;
+    for (int s = 0; s != nr_slices; ++s) {
+        const float* in = data_in + s * nx * ny;
+        float* out = data_out + s * nx * ny;
+        for (int y = 0; y != ny; ++y) {
+            if (y == 0 || y == ny-1) {
+                std::fill(out + y*nx, out + (y+1)*nx, 0.f);
+                continue;
+            }
+            const float* prev = in + (y-1)*nx;
+            const float* next = in + (y+1)*nx;
+            for (int x = 0; x != nx; ++x) {
+                out[y*nx + x] = prev[x] - next[x];
+            }
         }
     }
 }
@@ -1287,17 +2561,20 @@ void ln_compute_gradients_3D_over_y(const float* data_in, float* data_out,
 
 void ln_compute_gradients_3D_over_z(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
-
-    int data_size = nx * ny * nz * nt;
-
-    // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
-        std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
-        if (iz > 0 && iz < nz-1) {
-            j = sub2ind_4D(ix, iy, iz-1, it, nx, ny, nz);
-            k = sub2ind_4D(ix, iy, iz+1, it, nx, ny, nz);
-            *(data_out + i)  = *(data_in + j) - *(data_in + k);
+    const int nxy = nx * ny;
+    for (int t = 0; t != nt; ++t) {
+        const float* in = data_in + t * nxy * nz;
+        float* out = data_out + t * nxy * nz;
+        for (int z = 0; z != nz; ++z) {
+            if (z == 0 || z == nz-1) {
+                std::fill(out + z*nxy, out + (z+1)*nxy, 0.f);
+                continue;
+            }
+            const float* prev = in + (z-1)*nxy;
+            const float* next = in + (z+1)*nxy;
+            for (int i = 0; i != nxy; ++i) {
+                out[z*nxy + i] = prev[i] - next[i];
+            }
         }
     }
 }
@@ -1305,135 +2582,175 @@ void ln_compute_gradients_3D_over_z(const float* data_in, float* data_out,
 
 void ln_compute_hessian_3D(const float* data_in, float* data_shorthessian,
                            const int nx, const int ny, const int nz, const int nt, 
-                           const int dx, const int dy, const int dz, const int vscale) {
+                           const int dx, const int dy, const int dz, const int vscale, const bool log) {
     // NOTE: Hessian data should be 6 times larger than the input
-    // NOTE: Hessian values are saved consecutively for each voxel
-    //     *(data_shorthessian + i*6 + 0) = 2nd derivative xx
-    //     *(data_shorthessian + i*6 + 1) = 2nd derivative xy yx
-    //     *(data_shorthessian + i*6 + 2) = 2nd derivative xz zx
-    //     *(data_shorthessian + i*6 + 3) = 2nd derivative yy
-    //     *(data_shorthessian + i*6 + 4) = 2nd derivative yz zy
-    //     *(data_shorthessian + i*6 + 5) = 2nd derivative zz
+    // NOTE: Hessian values are saved as six consecutive volumes (SoA):
+    //     *(data_shorthessian + 0*data_size + i) = 2nd derivative xx
+    //     *(data_shorthessian + 1*data_size + i) = 2nd derivative xy yx
+    //     *(data_shorthessian + 2*data_size + i) = 2nd derivative xz zx
+    //     *(data_shorthessian + 3*data_size + i) = 2nd derivative yy
+    //     *(data_shorthessian + 4*data_size + i) = 2nd derivative yz zy
+    //     *(data_shorthessian + 5*data_size + i) = 2nd derivative zz
 
     int data_size = nx * ny * nz * nt;
     float FWHM = 1.0;
+    float* h = data_shorthessian;
 
     // Allocate memory (NOTE: I have prioritized RAM optimization)
     float* data_grad_1st = (float*)malloc(data_size * sizeof(float));
-    float* data_grad_2nd = (float*)malloc(data_size * sizeof(float));
 
-    // x 
+    // x, xx, xy, xz
     ln_compute_gradients_3D_over_x(data_in, data_grad_1st, nx, ny, nz, nt);
     if (vscale > 0) {
-        std::printf("\n  Smoothing 1st gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
-        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale);
-    }
-
-    // xx
-    ln_compute_gradients_3D_over_x(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 0) =  *(data_grad_2nd + i);
-    }
-
-    // xy
-    ln_compute_gradients_3D_over_y(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 1) =  *(data_grad_2nd + i);
-    }
-
-    // xz
-    ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 2) =  *(data_grad_2nd + i);
+        if (log) std::printf("\n  Smoothing 1st gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
+        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale, log);
     }
+    ln_compute_gradients_3D_over_x(data_grad_1st, h + 0*data_size, nx, ny, nz, nt);
+    ln_compute_gradients_3D_over_y(data_grad_1st, h + 1*data_size, nx, ny, nz, nt);
+    ln_compute_gradients_3D_over_z(data_grad_1st, h + 2*data_size, nx, ny, nz, nt);
 
-    // y
+    // y, yy, yz
     ln_compute_gradients_3D_over_y(data_in, data_grad_1st, nx, ny, nz, nt);
     if (vscale > 0) {
-        std::printf("\n  Smoothing 2nd gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
-        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale);
-    }
-
-    // yy
-    ln_compute_gradients_3D_over_y(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 3) =  *(data_grad_2nd + i);
-    }
-
-    // yz
-    ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 4) =  *(data_grad_2nd + i);
+        if (log) std::printf("\n  Smoothing 2nd gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
+        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale, log);
     }
+    ln_compute_gradients_3D_over_y(data_grad_1st, h + 3*data_size, nx, ny, nz, nt);
+    ln_compute_gradients_3D_over_z(data_grad_1st, h + 4*data_size, nx, ny, nz, nt);
 
-    // z
+    // z, zz
     ln_compute_gradients_3D_over_z(data_in, data_grad_1st, nx, ny, nz, nt);
     if (vscale > 0) {
-        std::printf("\n  Smoothing 3rd gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
-        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale);
+        if (log) std::printf("\n  Smoothing 3rd gradient (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, vscale);
+        ln_smooth_gaussian_iterative_3D(data_grad_1st, nx, ny, nz, nt, dx, dy, dz, FWHM, vscale, log);
     }
-
-    // zz
-    ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_shorthessian + i*6 + 5) =  *(data_grad_2nd + i);
-    } 
+    ln_compute_gradients_3D_over_z(data_grad_1st, h + 5*data_size, nx, ny, nz, nt);
 
     free(data_grad_1st);
-    free(data_grad_2nd);
 }
 
-void ln_compute_eigen_values_3D(const float* data_shorthessian, float* data_eigval1, float* data_eigval2, float* data_eigval3,
-                                const int nx, const int ny, const int nz, const int nt) {
+// ----------------------------------------------------------------------------
+// Per voxel kernels shared by the batch functions below. They only touch
+// registers so that the SoA loops calling them stay simple streaming loops.
+// ----------------------------------------------------------------------------
+static inline void ln_eigen_values_sym3(const float a, const float b, const float c,
+                                        const float d, const float e, const float f,
+                                        float& lambda1, float& lambda2, float& lambda3) {
+    // NOTE: Implementing Delledalle et al. 2017, Hal (closed form).
+    // a, b, c are xx, yy, zz and d, e, f are xy, yz, xz.
+    float x1 = a*a + b*b + c*c - a*b - a*c - b*c + 3 * (d*d + f*f + e*e);
+
+    float t1 = 2*a - b - c;
+    float t2 = 2*b - a - c;
+    float t3 = 2*c - a - b;
+    float x2 = - t1 * t2 * t3 + 9*( t3*(d*d) + t2*(f*f) + t1*(e*e) ) - 54*( d*e*f );
+
+    // atan2 covers the three cases of the paper (x2 > 0, x2 < 0, x2 = 0).
+    // Rounding can push x1 or the discriminant below zero; clamp them.
+    if (!(x1 > 0)) x1 = 0;
+    float disc = 4 * (x1*x1) * x1 - x2*x2;
+    if (!(disc > 0)) disc = 0;
+    float phi = std::atan2(std::sqrt(disc), x2);
+
+    // cos((phi -+ pi)/3) expanded around cos(phi/3) and sin(phi/3)
+    const float SQRT3 = 1.7320508075688772f;
+    float cp = std::cos(phi / 3);
+    float sp = std::sin(phi / 3);
+    float s = std::sqrt(x1);
+    float trace = a + b + c;
+
+    lambda1 = (trace - 2*s*cp) / 3;
+    lambda2 = (trace + s*(cp + SQRT3*sp)) / 3;
+    lambda3 = (trace + s*(cp - SQRT3*sp)) / 3;
+
+    if (std::isnan(lambda1)) lambda1 = 0;
+    if (std::isnan(lambda2)) lambda2 = 0;
+    if (std::isnan(lambda3)) lambda3 = 0;
+}
+
+static inline void ln_diffusion_weights_sym3(const float lambda1, const float lambda2, const float lambda3,
+                                             float& w1, float& w2, float& w3) {
+    // Apply compositional closure to the eigen value magnitudes
+    float eigvalsum = std::abs(lambda1) + std::abs(lambda2) + std::abs(lambda3);
+    if (eigvalsum == 0) {
+        w1 = 0;
+        w2 = 0;
+        w3 = 0;
+        return;
+    }
+    w1 = 1 - std::abs(lambda1) / eigvalsum;
+    w2 = 1 - std::abs(lambda2) / eigvalsum;
+    w3 = 1 - std::abs(lambda3) / eigvalsum;
+
+    // Reclose for balance
+    eigvalsum = w1 + w2 + w3;
+    w1 /= eigvalsum;
+    w2 /= eigvalsum;
+    w3 /= eigvalsum;
+
+    // Preserve signs
+    w1 = std::copysign(w1, lambda1);
+    w2 = std::copysign(w2, lambda2);
+    w3 = std::copysign(w3, lambda3);
+}
+
+static inline void ln_update_tensor_sym3(float& a, float& b, float& c, float& d, float& e, float& f,
+                                         const float lambda1, const float lambda2, const float lambda3) {
     // NOTE: Implementing Delledalle et al. 2017, Hal.
-    // NOTE: I simplified complex conjugates as I do not have complex values.
 
-    int data_size = nx * ny * nz * nt;
+    // Following Deledalle Eq. 11
+    float t1, t2, m1, m2, m3;
 
-    for (uint32_t i = 0; i != data_size; ++i) {
-        float a = *(data_shorthessian + i*6 + 0);  // xx
-        float b = *(data_shorthessian + i*6 + 3);  // yy
-        float c = *(data_shorthessian + i*6 + 5);  // zz
-        float d = *(data_shorthessian + i*6 + 1);  // xy, yx
-        float e = *(data_shorthessian + i*6 + 4);  // yz, zy
-        float f = *(data_shorthessian + i*6 + 2);  // xz, zx
+    t1 = d * (c - lambda1) - e * f;
+    t2 = f * (b - lambda1) - d * e;
+    m1 = (t2 == 0) ? 0 : t1 / t2;
 
-        // --------------------------------------------------------------------
-        // Compute eigen values 3D
-        // --------------------------------------------------------------------
-        float x1 = a*a + b*b + c*c - a*b - a*c - b*c + 3 * (d*d + f*f + e*e);
-
-        float t1 = 2*a - b - c;
-        float t2 = 2*b - a - c;
-        float t3 = 2*c - a - b;
-        float x2 = - t1 * t2 * t3 + 9*( t3*(d*d) + t2*(f*f) + t1*(e*e) ) - 54*( d*e*f );
-
-        float phi;
-        if (x2 > 0) {
-            phi = std::atan2( 0, std::sqrt( 4.*( (x1*x1)*x1 ) - x2*x2 ) / x2 );
-        }   else if (x2 < 0) {
-            phi = std::atan2( 0, std::sqrt( 4.*( (x1*x1)*x1 ) - x2*x2 ) / x2 ) + M_PI;
-        } else {
-            phi = M_PI / 2.;
-        }
+    t1 = d * (c - lambda2) - e * f;
+    t2 = f * (b - lambda2) - d * e;
+    m2 = (t2 == 0) ? 0 : t1 / t2;
 
-        float lambda1 = ( a + b + c - 2.*std::sqrt( x1 ) * std::cos( phi/3. ) ) / 3.;
-        float lambda2 = ( a + b + c + 2.*std::sqrt( x1 ) * std::cos( (phi - M_PI)/3. ) ) / 3.;
-        float lambda3 = ( a + b + c + 2.*std::sqrt( x1 ) * std::cos( (phi + M_PI)/3. ) ) / 3.;
+    t1 = d * (c - lambda3) - e * f;
+    t2 = f * (b - lambda3) - d * e;
+    m3 = (t2 == 0) ? 0 : t1 / t2;
 
-        if (std::isnan(lambda1)) {
-            lambda1 = 0.;
-        }
-        if (std::isnan(lambda2)) {
-            lambda2 = 0.;
-        }
-        if (std::isnan(lambda3)) {
-            lambda3 = 0.;
-        }
+    // Following Deledalle Eq. 14
+    float y1, y2, y3, n1, n2, n3, lambda1_hat, lambda2_hat, lambda3_hat;
+    float ff = (f == 0) ? 1 : f;
+
+    y1 = (lambda1 - c - e*m1);
+    y2 = (lambda2 - c - e*m2);
+    y3 = (lambda3 - c - e*m3);
+
+    n1 = 1 + m1*m1 + (y1*y1) / (ff*ff);
+    n2 = 1 + m2*m2 + (y2*y2) / (ff*ff);
+    n3 = 1 + m3*m3 + (y3*y3) / (ff*ff);
+
+    lambda1_hat = lambda1 / n1;
+    lambda2_hat = lambda2 / n2;
+    lambda3_hat = lambda3 / n3;
+
+    // Following Deledalle Eq. 13
+    a = ( lambda1_hat*(y1*y1) + lambda2_hat*(y2*y2) + lambda3_hat*(y3*y3) ) / (ff*ff);
+    b = lambda1_hat*(m1*m1) + lambda2_hat*(m2*m2) + lambda3_hat*(m3*m3);
+    c = lambda1_hat + lambda2_hat + lambda3_hat;
+    d = ( lambda1_hat*m1*y1 + lambda2_hat*m2*y2 + lambda3_hat*m3*y3 ) / ff;
+    e = lambda1_hat*m1 + lambda2_hat*m2 + lambda3_hat*m3;
+    f = ( lambda1_hat*y1 + lambda2_hat*y2 + lambda3_hat*y3 ) / ff;
+}
+
+void ln_compute_eigen_values_3D(const float* data_shorthessian, float* data_eigval1, float* data_eigval2, float* data_eigval3,
+                                const int nx, const int ny, const int nz, const int nt) {
+    int data_size = nx * ny * nz * nt;
+    const float* h_xx = data_shorthessian + 0*data_size;
+    const float* h_xy = data_shorthessian + 1*data_size;
+    const float* h_xz = data_shorthessian + 2*data_size;
+    const float* h_yy = data_shorthessian + 3*data_size;
+    const float* h_yz = data_shorthessian + 4*data_size;
+    const float* h_zz = data_shorthessian + 5*data_size;
 
-        *(data_eigval1 + i) = lambda1;
-        *(data_eigval2 + i) = lambda2;
-        *(data_eigval3 + i) = lambda3;
+    for (int i = 0; i != data_size; ++i) {
+        ln_eigen_values_sym3(h_xx[i], h_yy[i], h_zz[i], h_xy[i], h_yz[i], h_xz[i],
+                             data_eigval1[i], data_eigval2[i], data_eigval3[i]);
     }
 }
 
@@ -1447,12 +2764,12 @@ void ln_compute_eigen_vectors_3D(const float* data_shorthessian,
     int data_size = nx * ny * nz * nt;
 
     for (uint32_t i = 0; i != data_size; ++i) {
-        float a = *(data_shorthessian + i*6 + 0);  // xx
-        float b = *(data_shorthessian + i*6 + 3);  // yy
-        float c = *(data_shorthessian + i*6 + 5);  // zz
-        float d = *(data_shorthessian + i*6 + 1);  // xy, yx
-        float e = *(data_shorthessian + i*6 + 4);  // yz, zy
-        float f = *(data_shorthessian + i*6 + 2);  // xz, zx
+        float a = *(data_shorthessian + 0*data_size + i);  // xx
+        float b = *(data_shorthessian + 3*data_size + i);  // yy
+        float c = *(data_shorthessian + 5*data_size + i);  // zz
+        float d = *(data_shorthessian + 1*data_size + i);  // xy, yx
+        float e = *(data_shorthessian + 4*data_size + i);  // yz, zy
+        float f = *(data_shorthessian + 2*data_size + i);  // xz, zx
 
         float lambda1 = *(data_eigval1 + i);
         float lambda2 = *(data_eigval2 + i);
@@ -1592,94 +2909,17 @@ void ln_compute_eigen_vectors_3D(const float* data_shorthessian,
 void ln_update_shorthessian(float* data_shorthessian,
                             const float* data_eigval1, const float* data_eigval2, const float* data_eigval3,
                             const int nx, const int ny, const int nz, const int nt) {
-
-    // NOTE: Implementing Delledalle et al. 2017, Hal.
-
     int data_size = nx * ny * nz * nt;
+    float* h_xx = data_shorthessian + 0*data_size;
+    float* h_xy = data_shorthessian + 1*data_size;
+    float* h_xz = data_shorthessian + 2*data_size;
+    float* h_yy = data_shorthessian + 3*data_size;
+    float* h_yz = data_shorthessian + 4*data_size;
+    float* h_zz = data_shorthessian + 5*data_size;
 
-    for (uint32_t i = 0; i != data_size; ++i) {
-        float a = *(data_shorthessian + i*6 + 0);  // xx
-        float b = *(data_shorthessian + i*6 + 3);  // yy
-        float c = *(data_shorthessian + i*6 + 5);  // zz
-        float d = *(data_shorthessian + i*6 + 1);  // xy, yx
-        float e = *(data_shorthessian + i*6 + 4);  // yz, zy
-        float f = *(data_shorthessian + i*6 + 2);  // xz, zx
-
-        float lambda1 = *(data_eigval1 + i);
-        float lambda2 = *(data_eigval2 + i);
-        float lambda3 = *(data_eigval3 + i);
-
-        // --------------------------------------------------------------------
-        // Following Deledalle Eq. 11
-        // --------------------------------------------------------------------
-        float t1, t2, m1, m2, m3, v1, v2, v3;
-
-        t1 = d * (c - lambda1) - e * f;
-        t2 = f * (b - lambda1) - d * e;
-        if (t2 == 0) {
-            m1 = 0;
-        } else {
-            m1 = t1 / t2;            
-        }
-
-        t1 = d * (c - lambda2) - e * f;
-        t2 = f * (b - lambda2) - d * e;
-        if (t2 == 0) {
-            m2 = 0;
-        } else {
-            m2 = t1 / t2;            
-        }
-
-        t1 = d * (c - lambda3) - e * f;
-        t2 = f * (b - lambda3) - d * e;
-        if (t2 == 0) {
-            m3 = 0;
-        } else {
-            m3 = t1 / t2;            
-        }
-
-        // --------------------------------------------------------------------
-        // Following Deledalle Eq. 14
-        // --------------------------------------------------------------------
-        float y1, y2, y3, n1, n2, n3, lambda1_hat, lambda2_hat, lambda3_hat;
-
-        if (f == 0) {
-            f = 1;
-        } 
-
-        y1 = (lambda1 - c - e*m1);
-        y2 = (lambda2 - c - e*m2);
-        y3 = (lambda3 - c - e*m3);
-
-        n1 = 1 + m1*m1 + (y1*y1) / (f*f);
-        n2 = 1 + m2*m2 + (y2*y2) / (f*f);
-        n3 = 1 + m3*m3 + (y3*y3) / (f*f);
-
-        lambda1_hat = lambda1 / n1;
-        lambda2_hat = lambda2 / n2;
-        lambda3_hat = lambda3 / n3;
-
-        // --------------------------------------------------------------------
-        // Following Deledalle Eq. 13
-        // --------------------------------------------------------------------
-        float a_hat, b_hat, c_hat, d_hat, e_hat, f_hat;
-
-        a_hat = ( lambda1_hat*(y1*y1) + lambda2_hat*(y2*y2) + lambda3_hat*(y3*y3) ) / (f*f);
-        b_hat = lambda1_hat*(m1*m1) + lambda2_hat*(m2*m2) + lambda3_hat*(m3*m3);
-        c_hat = lambda1_hat + lambda2_hat + lambda3_hat;
-        d_hat = ( lambda1_hat*m1*y1 + lambda2_hat*m2*y2 + lambda3_hat*m3*y3 ) / f;
-        e_hat = lambda1_hat*m1 + lambda2_hat*m2 + lambda3_hat*m3;
-        f_hat = ( lambda1_hat*y1 + lambda2_hat*y2 + lambda3_hat*y3 ) / f;            
-
-        // --------------------------------------------------------------------
-        // Update short Hessian
-        // --------------------------------------------------------------------        
-        *(data_shorthessian + i*6 + 0) = a_hat;  // xx
-        *(data_shorthessian + i*6 + 3) = b_hat;  // yy
-        *(data_shorthessian + i*6 + 5) = c_hat;  // zz
-        *(data_shorthessian + i*6 + 1) = d_hat;  // xy, yx
-        *(data_shorthessian + i*6 + 4) = e_hat;  // yz, zy
-        *(data_shorthessian + i*6 + 2) = f_hat;  // xz, zx
+    for (int i = 0; i != data_size; ++i) {
+        ln_update_tensor_sym3(h_xx[i], h_yy[i], h_zz[i], h_xy[i], h_yz[i], h_xz[i],
+                              data_eigval1[i], data_eigval2[i], data_eigval3[i]);
     }
 }
 
@@ -1687,37 +2927,91 @@ void ln_multiply_matrix_vector_3D(const float* data_shorthessian,
                                   float* data_gra1, float* data_gra2, float* data_gra3,
                                   const int nx, const int ny, const int nz, const int nt) {
     int data_size = nx * ny * nz * nt;
-    for (uint32_t i = 0; i != data_size; ++i) {
-        float a = *(data_shorthessian + i*6 + 0);  // xx
-        float b = *(data_shorthessian + i*6 + 3);  // yy
-        float c = *(data_shorthessian + i*6 + 5);  // zz
-        float d = *(data_shorthessian + i*6 + 1);  // xy, yx
-        float e = *(data_shorthessian + i*6 + 4);  // yz, zy
-        float f = *(data_shorthessian + i*6 + 2);  // xz, zx 
-
-        float g1 = *(data_gra1 + i);
-        float g2 = *(data_gra2 + i);
-        float g3 = *(data_gra3 + i);
+    const float* h_xx = data_shorthessian + 0*data_size;
+    const float* h_xy = data_shorthessian + 1*data_size;
+    const float* h_xz = data_shorthessian + 2*data_size;
+    const float* h_yy = data_shorthessian + 3*data_size;
+    const float* h_yz = data_shorthessian + 4*data_size;
+    const float* h_zz = data_shorthessian + 5*data_size;
 
-        *(data_gra1 + i) = a*g1 + d*g2 + f*g3;
-        *(data_gra2 + i) = d*g1 + b*g2 + e*g3;
-        *(data_gra3 + i) = f*g1 + e*g2 + c*g3;
+    for (int i = 0; i != data_size; ++i) {
+        float g1 = data_gra1[i];
+        float g2 = data_gra2[i];
+        float g3 = data_gra3[i];
+        data_gra1[i] = h_xx[i]*g1 + h_xy[i]*g2 + h_xz[i]*g3;
+        data_gra2[i] = h_xy[i]*g1 + h_yy[i]*g2 + h_yz[i]*g3;
+        data_gra3[i] = h_xz[i]*g1 + h_yz[i]*g2 + h_zz[i]*g3;
     }
 }
 
-void ln_compute_divergence_3D(float* data_out, const float* data_gra1, const float* data_gra2, const float* data_gra3,
-                              const int nx, const int ny, const int nz, const int nt) {
+void ln_compute_diffusion_flux_3D(float* data_shorthessian,
+                                  float* data_gra1, float* data_gra2, float* data_gra3,
+                                  const int nx, const int ny, const int nz, const int nt,
+                                  float* data_eigval1, float* data_eigval2, float* data_eigval3,
+                                  float* data_diffw1, float* data_diffw2, float* data_diffw3) {
+    // NOTE: Fuses eigen values, diffusion weights, tensor update and
+    // tensor-gradient product into one pass over the SoA Hessian.
     int data_size = nx * ny * nz * nt;
+    float* h_xx = data_shorthessian + 0*data_size;
+    float* h_xy = data_shorthessian + 1*data_size;
+    float* h_xz = data_shorthessian + 2*data_size;
+    float* h_yy = data_shorthessian + 3*data_size;
+    float* h_yz = data_shorthessian + 4*data_size;
+    float* h_zz = data_shorthessian + 5*data_size;
 
-    float* data_out1 = (float*)malloc(data_size * sizeof(float));
-    float* data_out2 = (float*)malloc(data_size * sizeof(float));
-    float* data_out3 = (float*)malloc(data_size * sizeof(float));
-
-    ln_compute_gradients_3D_over_x(data_gra1, data_out1, nx, ny, nz, nt);
-    ln_compute_gradients_3D_over_y(data_gra2, data_out2, nx, ny, nz, nt);
-    ln_compute_gradients_3D_over_z(data_gra3, data_out3, nx, ny, nz, nt);
+    for (int i = 0; i != data_size; ++i) {
+        float a = h_xx[i], b = h_yy[i], c = h_zz[i];
+        float d = h_xy[i], e = h_yz[i], f = h_xz[i];
+
+        float lambda1, lambda2, lambda3, w1, w2, w3;
+        ln_eigen_values_sym3(a, b, c, d, e, f, lambda1, lambda2, lambda3);
+        ln_diffusion_weights_sym3(lambda1, lambda2, lambda3, w1, w2, w3);
+        ln_update_tensor_sym3(a, b, c, d, e, f, w1, w2, w3);
+
+        h_xx[i] = a, h_yy[i] = b, h_zz[i] = c;
+        h_xy[i] = d, h_yz[i] = e, h_xz[i] = f;
+
+        float g1 = data_gra1[i];
+        float g2 = data_gra2[i];
+        float g3 = data_gra3[i];
+        data_gra1[i] = a*g1 + d*g2 + f*g3;
+        data_gra2[i] = d*g1 + b*g2 + e*g3;
+        data_gra3[i] = f*g1 + e*g2 + c*g3;
+
+        if (data_eigval1 != NULL) {
+            data_eigval1[i] = lambda1;
+            data_eigval2[i] = lambda2;
+            data_eigval3[i] = lambda3;
+        }
+        if (data_diffw1 != NULL) {
+            data_diffw1[i] = w1;
+            data_diffw2[i] = w2;
+            data_diffw3[i] = w3;
+        }
+    }
+}
 
-    for (uint32_t i = 0; i != data_size; ++i) {
-        *(data_out + i) = *(data_out1 + i) + *(data_out2 + i) + *(data_out3 + i);
+void ln_compute_divergence_3D(float* data_out, const float* data_gra1, const float* data_gra2, const float* data_gra3,
+                              const int nx, const int ny, const int nz, const int nt) {
+    // NOTE: Single pass over the output; each term is zero on the borders
+    // of its own axis, like ln_compute_gradients_3D_over_x/y/z.
+    const int nxy = nx * ny;
+    const int nxyz = nxy * nz;
+    for (int t = 0; t != nt; ++t) {
+        for (int z = 0; z != nz; ++z) {
+            const bool inner_z = z > 0 && z < nz-1;
+            for (int y = 0; y != ny; ++y) {
+                const bool inner_y = y > 0 && y < ny-1;
+                const int row = t*nxyz + z*nxy + y*nx;
+                for (int x = 0; x != nx; ++x) {
+                    const int i = row + x;
+                    float v = 0;
+                    if (x > 0 && x < nx-1) v += data_gra1[i-1] - data_gra1[i+1];
+                    if (inner_y) v += data_gra2[i-nx] - data_gra2[i+nx];
+                    if (inner_z) v += data_gra3[i-nxy] - data_gra3[i+nxy];
+                    data_out[i] = v;
+                }
+            }
+        }
     }
 }
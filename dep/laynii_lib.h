@@ -9,6 +9,8 @@
 #include <tuple>
 #include <algorithm>
 #include <limits>
+#include <queue>
+#include <functional>
 #include "./nifti2_io.h"
 
 using namespace std;
@@ -25,6 +27,30 @@ double ren_autocor(double arr[], int size);
 int ren_most_occurred_number(int nums[], int size);
 //int ren_add_if_new(int arr[], int size); 
 
+// Per-voxel running moments of a time series, updated one volume at a time
+// (Welford/Terriberry). Volumes can be fed in any chunking, so the full 4D
+// data never has to be in memory.
+struct ln_temporal_moments {
+    uint64_t nr_voxels = 0;
+    uint64_t nr_volumes = 0;    // Number of volumes seen so far
+    double global_mean = 0;     // Running mean of the volume-average signal
+    double global_m2 = 0;
+    std::vector<double> mean;
+    std::vector<double> m2, m3, m4;  // Sums of central powers
+    std::vector<double> first;  // First value, used as shift for the lag term
+    std::vector<double> prev;   // Last value seen
+    std::vector<double> lag1;   // Sum of shifted lag-1 products
+    std::vector<double> comoment_global;  // Co-moment with volume average
+    std::vector<double> odd_even;  // Alternating sum of volumes
+};
+
+void ln_temporal_moments_init(ln_temporal_moments& m, const uint64_t nr_voxels);
+void ln_temporal_moments_update(ln_temporal_moments& m, const float* volume);
+void ln_temporal_moments_finalize(const ln_temporal_moments& m,
+                                  float* mean, float* stdev, float* skew,
+                                  float* kurt, float* autocorr, float* correl,
+                                  float* noise);
+
 float dist(float x1, float y1, float z1, float x2, float y2, float z2,
            float dX, float dY, float dZ);
 float dist2d(float x1, float y1, float x2, float y2);
@@ -45,6 +71,8 @@ nifti_image* copy_nifti_as_int32(nifti_image* nii);
 nifti_image* copy_nifti_as_int16(nifti_image* nii);
 nifti_image* copy_nifti_as_int8(nifti_image* nii);
 nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii);
+void cast_to_float32(const void* data, const int datatype,
+                     const uint64_t nr_values, float* data_out);
 
 std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
     const uint32_t linear_index,
@@ -102,6 +130,188 @@ std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b);
 nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
                                  nifti_image* nii_mask, int32_t mask_value);
 
+// ============================================================================
+// UVD spatial index
+// ============================================================================
+// Uniform grid over flat (U, V) and depth (D) coordinates. Points are stored
+// cell by cell (in ascending point order within each cell) so that cylinder
+// windows only visit the few cells they overlap.
+struct ln_uvd_grid {
+    float min_u = 0, min_v = 0, min_d = 0;
+    float cell_uv = 1, cell_d = 1;
+    int nu = 0, nv = 0, nd = 0;
+    std::vector<uint32_t> cell_start;  // Offsets into point_ids (nr_cells + 1)
+    std::vector<uint32_t> point_ids;
+};
+
+void ln_uvd_grid_build(ln_uvd_grid& grid,
+                       const float* u, const float* v, const float* d,
+                       const uint32_t nr_points,
+                       const float cell_uv, const float cell_d);
+
+void ln_uvd_grid_cell_bounds(const ln_uvd_grid& grid,
+                             const float u0, const float v0, const float d0,
+                             const float radius, const float half_height,
+                             int& iu0, int& iu1, int& iv0, int& iv1,
+                             int& id0, int& id1);
+
+void ln_uvd_grid_query_cylinder(const ln_uvd_grid& grid,
+                                const float* u, const float* v, const float* d,
+                                const float u0, const float v0, const float d0,
+                                const float radius, const float half_height,
+                                std::vector<uint32_t>& neighbors);
+
+// ============================================================================
+// Flattening mapping
+// ============================================================================
+// Folded voxel to flat bin assignment of LN2_PATCH_FLATTEN. It can be saved
+// once and reused for flattening or unflattening other images with the same
+// geometry without the coordinate files.
+struct ln_flat_mapping {
+    int64_t size_x = 0, size_y = 0, size_z = 0;  // Folded image dimensions
+    int64_t bins_u = 0, bins_v = 0, bins_d = 0;  // Flat image dimensions
+    std::vector<int64_t> voxel_id;               // Folded voxel of each entry
+    std::vector<int64_t> bin_id;                 // Flat bin of each entry
+    std::vector<float> weight;                   // Weight of each entry
+    std::vector<float> bin_domain;               // Domain average per bin
+    std::vector<int64_t> fill_source;            // Voronoi source bin per bin,
+                                                 // empty unless '-voronoi_occupied'
+};
+
+bool ln_flat_mapping_write(const char* path, const ln_flat_mapping& mapping);
+bool ln_flat_mapping_read(const char* path, ln_flat_mapping& mapping);
+
+// ============================================================================
+// Geodesic floods on voxel graphs
+// ============================================================================
+// 26-neighbourhood graph over a subset of voxels (nodes) in compressed row
+// format. Built once and reused by many floods over the same domain.
+struct ln_voxel_graph {
+    std::vector<uint32_t> node;    // Volume index of each node
+    std::vector<uint32_t> offset;  // Edges of node n are [offset[n], offset[n+1])
+    std::vector<uint32_t> target;  // Node index of each edge target
+    std::vector<float> weight;     // Edge length (voxel size aware)
+    float min_weight = 0;          // Shortest possible edge
+};
+
+void ln_voxel_graph_build(ln_voxel_graph& graph,
+                          const int32_t* voi_id, const uint32_t nr_voi,
+                          const std::vector<bool>& is_target,
+                          const std::vector<bool>& face_only,
+                          const uint32_t size_x, const uint32_t size_y,
+                          const uint32_t size_z,
+                          const float dX, const float dY, const float dZ);
+
+void ln_voxel_graph_flood(const ln_voxel_graph& graph, float* dist_data,
+                          int32_t* step_data, float* value_data);
+
+// Farthest point sampling on a voxel graph. Distances of all nodes to their
+// nearest pick are kept in one field that is only updated around new picks.
+// The farthest node is found through a max-heap with outdated entries.
+struct ln_farthest_points {
+    std::vector<float> dist;       // Distance to the nearest pick (inf if none)
+    std::vector<float> tie_break;  // Larger value wins among equally far nodes
+    std::vector<std::tuple<float, float, uint32_t> > heap;
+};
+
+void ln_farthest_points_init(ln_farthest_points& fp, const ln_voxel_graph& graph,
+                             const std::vector<float>& tie_break);
+void ln_farthest_points_add(ln_farthest_points& fp, const ln_voxel_graph& graph,
+                            const uint32_t node);
+bool ln_farthest_points_next(ln_farthest_points& fp, uint32_t& node);
+
+// ============================================================================
+// Euclidean distance transform
+// ============================================================================
+// Exact (voxel size aware) Euclidean distance of every voxel to its nearest
+// seed voxel. Optionally also gives the volume index of that seed (-1 and
+// infinite distance when there are no seeds).
+void ln_distance_transform_3D(const std::vector<bool>& is_seed, float* dist_data,
+                              int32_t* nearest_data,
+                              const uint32_t size_x, const uint32_t size_y,
+                              const uint32_t size_z,
+                              const float dX, const float dY, const float dZ);
+
+// ============================================================================
+// Finite difference stencils
+// ============================================================================
+// Gradients are differences of the previous and next voxel (f[i-1] - f[i+1]),
+// zero where the stencil does not fit along its axis. Sobel and Scharr also
+// smooth across the other two axes (edges replicated). The central Laplacian
+// is the central difference of the central gradients; the second order one
+// is f[i-1] - 2 f[i] + f[i+1] summed over the axes.
+enum ln_stencil_type {
+    LN_STENCIL_CENTRAL,
+    LN_STENCIL_SOBEL,
+    LN_STENCIL_SCHARR,
+    LN_STENCIL_SECOND_ORDER
+};
+
+bool ln_stencil_from_name(const char* name, ln_stencil_type& stencil);
+
+// Outputs of one sweep. Left NULL outputs are not computed.
+struct ln_stencil_outputs {
+    float* gra_x = NULL;
+    float* gra_y = NULL;
+    float* gra_z = NULL;
+    float* magnitude = NULL;
+    float* laplacian = NULL;
+    bool normalize = false;  // Gradients become unit vectors
+};
+
+void ln_stencil_sweep_3D(const float* data, const uint32_t size_x,
+                         const uint32_t size_y, const uint32_t size_z,
+                         const ln_stencil_type gradient_stencil,
+                         const ln_stencil_type laplacian_stencil,
+                         ln_stencil_outputs& out);
+
+// ============================================================================
+// Circular (phase) stencils
+// ============================================================================
+// First and second circular derivatives of phase images. Differences are
+// f[i+1] - f[i-1] wrapped by 2 pi towards zero, zero where the stencil does
+// not fit along its axis. Second derivatives are circular differences of the
+// first ones. All maps come out of one sweep that keeps only three planes of
+// gradients. Left NULL outputs are not computed.
+struct ln_phase_stencil_outputs {
+    float* gra_x = NULL;       // First derivatives
+    float* gra_y = NULL;
+    float* gra_z = NULL;
+    float* phase_jump = NULL;  // Mean absolute first derivative
+    float* laplacian = NULL;   // D_xx + D_yy + D_zz
+    float* gra2_x = NULL;      // Mean absolute derivative of D_x (and so on)
+    float* gra2_y = NULL;
+    float* gra2_z = NULL;
+    float* jolt = NULL;        // Mean of gra2_x, gra2_y, gra2_z
+    bool mode_2D = false;      // No derivatives of the phase along z
+};
+
+void ln_phase_stencil_sweep_3D(const float* phase, const uint32_t size_x,
+                               const uint32_t size_y, const uint32_t size_z,
+                               ln_phase_stencil_outputs& out);
+
+// ============================================================================
+// Running window projections
+// ============================================================================
+// Minimum, maximum, mean or median of the voxels within `range` steps of
+// each voxel along a line direction (dir_x, dir_y, dir_z), each -1, 0 or 1.
+// Windows are clipped at the image borders. Minimum and maximum use the van
+// Herk/Gil-Werman algorithm and the mean uses prefix sums, so their cost per
+// voxel does not depend on the range. The median sorts every window.
+enum ln_projection_type {
+    LN_PROJECTION_MIN,
+    LN_PROJECTION_MAX,
+    LN_PROJECTION_MEAN,
+    LN_PROJECTION_MEDIAN
+};
+
+bool ln_projection_from_name(const char* name, ln_projection_type& type);
+
+void ln_running_projection_3D(const float* data, float* data_out,
+                              const int64_t size_x, const int64_t size_y, const int64_t size_z,
+                              const int dir_x, const int dir_y, const int dir_z,
+                              const int64_t range, const ln_projection_type type);
+
 // ============================================================================
 // Preprocessor macros.
 // ============================================================================
@@ -131,9 +341,12 @@ void ln_compute_gradients_3D_over_y(const float* data, float* data_out,
 void ln_compute_gradients_3D_over_z(const float* data, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt);
 
+// NOTE: The short Hessian is stored as six consecutive volumes (SoA) in the
+// order xx, xy, xz, yy, yz, zz.
 void ln_compute_hessian_3D(const float* data, float* data_shorthessian,
                            const int nx, const int ny, const int nz, const int nt,
-                           const int dx, const int dy, const int dz, const int nr_smth_iterations);
+                           const int dx, const int dy, const int dz, const int nr_smth_iterations,
+                           const bool log = true);
 
 void ln_compute_eigen_values_3D(const float* data_shorthessian, float* data_eigval1, float* data_eigval2, float* data_eigval3,
                                 const int nx, const int ny, const int nz, const int nt);
@@ -151,5 +364,13 @@ void ln_multiply_matrix_vector_3D(const float* data_shorthessian,
                                   float* data_gra1, float* data_gra2, float* data_gra3,
                                   const int nx, const int ny, const int nz, const int nt);
 
+// Eigen values, diffusion weights, tensor update and tensor-gradient product
+// in one pass. Eigen value and weight outputs are optional (NULL).
+void ln_compute_diffusion_flux_3D(float* data_shorthessian,
+                                  float* data_gra1, float* data_gra2, float* data_gra3,
+                                  const int nx, const int ny, const int nz, const int nt,
+                                  float* data_eigval1 = NULL, float* data_eigval2 = NULL, float* data_eigval3 = NULL,
+                                  float* data_diffw1 = NULL, float* data_diffw2 = NULL, float* data_diffw3 = NULL);
+
 void ln_compute_divergence_3D(float* data_out, const float* data_gra1, const float* data_gra2, const float* data_gra3,
                               const int nx, const int ny, const int nz, const int nt);
@@ -69,3 +69,20 @@ uint64_t ida_sub2ind_4D_Tmajor(const uint64_t t, const uint64_t x, const uint64_
     return size_time * size_x * size_y * z + size_time * size_x * y + size_time * x + t;
 }
 
+// ====================================================================================================================
+// Statistics functions
+// ====================================================================================================================
+
+void ida_temporal_mean_sd(const float* time_course, const uint64_t nt, double& mean, double& sd) {
+    // Single pass Welford update. Same running moments as ln_temporal_moments_update in LayNii's laynii_lib, here
+    // applied to one contiguous (time-major) time course.
+    double M = 0.0, S = 0.0;
+    for (uint64_t t = 0; t < nt; ++t) {
+        double x = static_cast<double>(time_course[t]);
+        double delta = x - M;
+        M += delta / static_cast<double>(t + 1);
+        S += delta * (x - M);
+    }
+    mean = M;
+    sd = std::sqrt(S / (static_cast<double>(nt) - 1));
+}
@@ -24,3 +24,7 @@ uint64_t ida_sub2ind_4D(const uint64_t x, const uint64_t y, const uint64_t z, co
 uint64_t ida_sub2ind_4D_Tmajor(const uint64_t t, const uint64_t x, const uint64_t y, const uint64_t z,
                                const uint64_t nt, const uint64_t nx, const uint64_t ny);
 
+// ============================================================================
+// Statistics functions
+// ============================================================================
+void ida_temporal_mean_sd(const float* time_course, const uint64_t nt, double& mean, double& sd);
@@ -1181,14 +1181,11 @@ namespace IDA_IO
             uint64_t k = static_cast<uint64_t>(fi.display_k);
             for (uint64_t i = 0; i < ni; ++i) {
                 for (uint64_t j = 0; j < nj; ++j) {
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, sd;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, sd);
                     uint64_t index2D = i + j*ni;
-                    fi.p_sliceK_float_QA[index2D] = 0;
-
-                    // Compute time mean
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        fi.p_sliceK_float_QA[index2D] += fi.p_data_float[index4D] / static_cast<float>(nt);
-                    }
+                    fi.p_sliceK_float_QA[index2D] = static_cast<float>(mean);
                 }
             }
         }
@@ -1202,12 +1199,11 @@ namespace IDA_IO
             uint64_t j = static_cast<uint64_t>(fi.display_j);
             for (uint64_t i = 0; i < ni; i++) {
                 for (uint64_t k = 0; k < nk; k++) {
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, sd;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, sd);
                     uint64_t index2D = i + k*ni;
-                    fi.p_sliceJ_float_QA[index2D] = 0;
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        fi.p_sliceJ_float_QA[index2D] += fi.p_data_float[index4D] / static_cast<float>(nt);
-                    }
+                    fi.p_sliceJ_float_QA[index2D] = static_cast<float>(mean);
                 }
             }
         }
@@ -1221,12 +1217,11 @@ namespace IDA_IO
             uint64_t i = static_cast<uint64_t>(fi.display_i);
             for (uint64_t j = 0; j < nj; j++) {
                 for (uint64_t k = 0; k < nk; k++) {
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, sd;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, sd);
                     uint64_t index2D = j + k*nj;
-                    fi.p_sliceI_float_QA[index2D] = 0;
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        fi.p_sliceI_float_QA[index2D] += fi.p_data_float[index4D] / static_cast<float>(nt);
-                    }
+                    fi.p_sliceI_float_QA[index2D] = static_cast<float>(mean);
                 }
             }
         }
@@ -1240,21 +1235,11 @@ namespace IDA_IO
             uint64_t nj = static_cast<uint64_t>(fi.dim_j);
             uint64_t nt = static_cast<uint64_t>(fi.dim_t);
             uint64_t k = static_cast<uint64_t>(fi.display_k);
-            double N = static_cast<double>(nt);
-
             for (uint64_t i = 0; i < ni; ++i) {
                 for (uint64_t j = 0; j < nj; ++j) {
-                    // Compute variance using Welford's method
-                    double M = 0.0, S = 0.0;
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        double x = static_cast<double>(fi.p_data_float[index4D]);
-                        double oldM = M;
-                        M = M + (x - M) / (static_cast<double>(t+1));
-                        S = S + (x - M) * (x - oldM);
-                    }
-                    double variance = S / (N - 1);
-                    double SD = std::sqrt(variance);
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, SD;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, SD);
                     uint64_t index2D = i + j*ni;
                     fi.p_sliceK_float_QA[index2D] = static_cast<float>(SD);
                 }
@@ -1268,21 +1253,11 @@ namespace IDA_IO
             uint64_t nk = static_cast<uint64_t>(fi.dim_k);
             uint64_t nt = static_cast<uint64_t>(fi.dim_t);
             uint64_t j = static_cast<uint64_t>(fi.display_j);
-            double N = static_cast<double>(nt);
-
             for (uint64_t i = 0; i < ni; i++) {
                 for (uint64_t k = 0; k < nk; k++) {
-                    // Compute variance using Welford's method
-                    double M = 0.0, S = 0.0;
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        double x = static_cast<double>(fi.p_data_float[index4D]);
-                        double oldM = M;
-                        M = M + (x - M) / (static_cast<double>(t+1));
-                        S = S + (x - M) * (x - oldM);
-                    }
-                    double variance = S / (N - 1);
-                    double SD = std::sqrt(variance);
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, SD;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, SD);
                     uint64_t index2D = i + k*ni;
                     fi.p_sliceJ_float_QA[index2D] = static_cast<float>(SD);
                 }
@@ -1296,21 +1271,11 @@ namespace IDA_IO
             uint64_t nk = static_cast<uint64_t>(fi.dim_k);
             uint64_t nt = static_cast<uint64_t>(fi.dim_t);
             uint64_t i = static_cast<uint64_t>(fi.display_i);
-            double N = static_cast<double>(nt);
-
             for (uint64_t j = 0; j < nj; j++) {
                 for (uint64_t k = 0; k < nk; k++) {
-                    // Compute variance using Welford's method
-                    double M = 0.0, S = 0.0;
-                    for (uint64_t t = 0; t < nt; ++t) {
-                        uint64_t index4D = ida_sub2ind_4D_Tmajor(t, i, j, k, nt, ni, nj);
-                        double x = static_cast<double>(fi.p_data_float[index4D]);
-                        double oldM = M;
-                        M = M + (x - M) / (static_cast<double>(t+1));
-                        S = S + (x - M) * (x - oldM);
-                    }
-                    double variance = S / (N - 1);
-                    double SD = std::sqrt(variance);
+                    uint64_t index4D = ida_sub2ind_4D_Tmajor(0, i, j, k, nt, ni, nj);
+                    double mean, SD;
+                    ida_temporal_mean_sd(&fi.p_data_float[index4D], nt, mean, SD);
                     uint64_t index2D = j + k*nj;
                     fi.p_sliceI_float_QA[index2D] = static_cast<float>(SD);
                 }
@@ -25,6 +25,17 @@ int show_help(void) {
     "                       This should not be smaller than the voxel dimension.\n"
     "    -debug           : (Optional) Save extra intermediate outputs.\n"
     "    -output          : (Optional) Output basename. Default is '_padded' as suffix.\n"
+    "\n"
+    "Notes:\n"
+    "    - The padded layers follow the Euclidean distance to the outermost\n"
+    "      (-outer) or innermost (-inner) layer. A voxel is only padded when\n"
+    "      its nearest layer voxel is in that layer, so the padding does not\n"
+    "      wrap around the existing layers to reach the other side.\n"
+    "    - Earlier versions grew step by step over the 26 neighbours. That\n"
+    "      also padded voxels that are closer to other layers, e.g. around the\n"
+    "      ends of the layers, and summed neighbour steps instead of measuring\n"
+    "      the straight distance. Outputs differ from those versions: such\n"
+    "      voxels are no longer padded.\n"
     "\n");
     return 0;
 }
@@ -115,31 +126,17 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     const float dX = nii1->pixdim[1];
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ========================================================================
     // Fix input datatype issues
     nifti_image* nii_layers = copy_nifti_as_int16(nii1);
     int16_t* nii_layers_data = static_cast<int16_t*>(nii_layers->data);
 
-    nifti_image* step = copy_nifti_as_int16(nii_layers);
-    int16_t* step_data = static_cast<int16_t*>(step->data);
-
     nifti_image* dist = copy_nifti_as_float32(nii_layers);
     float* dist_data = static_cast<float*>(dist->data);
 
@@ -158,347 +155,30 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Grow outwards
     // ========================================================================
+    // NOTE: Empty voxels get their Euclidean distance to the layer they are
+    // padded onto (outermost or innermost). Only empty voxels whose nearest
+    // layer voxel belongs to that layer are padded, so the growth does not
+    // reach through the existing layers to the other side.
     cout << "\n  Start growing ....." << endl;
 
-    if (mode_outer) {
-        // Initialize grow volume for outwards growign
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_layers_data + i) == max_layers) {  // starting point to grow at the outer most layer with the largest number
-                *(step_data + i) = 1;
-                *(dist_data + i) = 0.;
-            } else {
-                *(step_data + i) = 0.;
-                *(dist_data + i) = 0.;
-            }
-        }
-    }
+    const int16_t start_layer = mode_outer ? max_layers : 1;
 
-
-    if (mode_inner) {
-        // Initialize grow volume for outwards growign
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_layers_data + i) == 1) {  // starting point to grow at the inner most layer with value 1
-                *(step_data + i) = 1;
-                *(dist_data + i) = 0.;
-            } else {
-                *(step_data + i) = 0.;
-                *(dist_data + i) = 0.;
-            }
-        }
+    std::vector<bool> is_seed(nr_voxels);
+    std::vector<int32_t> nearest(nr_voxels);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        is_seed[i] = *(nii_layers_data + i) != 0;
     }
+    ln_distance_transform_3D(is_seed, dist_data, nearest.data(),
+                             size_x, size_y, size_z, dX, dY, dZ);
 
-    uint16_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
-    uint32_t ix, iy, iz, j, k;
-    float d;
-    while (voxel_counter != 0) {
-        cout << "\r  Growing step " << grow_step << "......"  << flush;
-        voxel_counter = 0;
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-
-            if (*(step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours (faces of cube)
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dX;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dX;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dY;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dY;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dZ;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dZ;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours (edges of cube)
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xy;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xy;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xy;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xy;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_yz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_yz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_yz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_yz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 3-jump neighbours (corners of cube)
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j)  || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_layers_data + j) == 0) {
-                        d = *(dist_data + i) + dia_xyz;
-                        if (d < *(dist_data + j) || *(dist_data + j) == 0) {
-                            *(dist_data + j) = d;
-                            *(step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-            }
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_layers_data + i) != 0 || nearest[i] < 0
+            || *(nii_layers_data + nearest[i]) != start_layer) {
+            *(dist_data + i) = 0;
         }
-        grow_step += 1;
     }
 
     if (mode_debug) {
-        save_output_nifti(fout, "step", step, false);
         save_output_nifti(fout, "dist", dist, false);
     }
 
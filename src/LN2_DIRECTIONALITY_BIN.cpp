@@ -1,4 +1,5 @@
 #include "../dep/laynii_lib.h"
+#include <algorithm>
 
 
 int show_help(void) {
@@ -16,18 +17,21 @@ int show_help(void) {
     "Options:\n"
     "    -help        : Show this help.\n"
     "    -input       : Nifti (.nii) binarized map\n"
-    "    -output      : (Optional) Output filename, including .nii or\n"
-    "                   .nii.gz, and path if needed. Overwrites existing files.\n"
-    "                   If not given, the prefix 'fPSF' is added.\n"
+    "    -output      : (Optional) Output basename for all outputs.\n"
     "\n"
     "Notes:\n"
     "    This is written foir Richard as a side project.  \n"
+    "    - Each layer and column combination (parcel) gets the most common\n"
+    "      (integer) value of its voxels. Ties go to the larger value.\n"
+    "    - Laminarity of a parcel is the fraction of its neighbouring parcels\n"
+    "      within the same layer that have the same value. Columnarity is the\n"
+    "      same within the same column. Parcels are neighbours when their\n"
+    "      voxels share a face or an edge.\n"
     "\n");
     return 0;
 }
 
 int main(int argc, char * argv[]) {
-    bool use_outpath = false;
     char  *fout = NULL;
     char *fin = NULL;
     char *fin_layers = NULL, *fin_columns = NULL;
@@ -61,7 +65,6 @@ int main(int argc, char * argv[]) {
                 fprintf(stderr, "** missing argument for -output\n");
                 return 1;
             }
-            use_outpath = true;
             fout = argv[ac];
         }
     }
@@ -148,923 +151,172 @@ int main(int argc, char * argv[]) {
     float* nii_parcelval_data = static_cast<float*>(nii_parcelval->data);
 
     // ========================================================================
-    ////////////////////////////////////////////////////////////
-    // finding number of layers and columsn to work with ///////
-    ////////////////////////////////////////////////////////////
-    
-    int Nr_columns = 0; 
-    int Nr_layers  = 0; 
-    int Nr_parcels  = 0; 
-    
-    for(int iy=0; iy<size_y; ++iy) {
-     for(int ix=0; ix<size_x; ++ix) {
-       for(int iz=0; iz<size_z; ++iz) {
-           if ((int)*(nim_columns_data  +  nxy*iz + nx*iy + ix) >= Nr_columns ) {
-                Nr_columns = (int)*(nim_columns_data +  nxy*iz + nx*iy + ix); 
-           }
-           if ((int)*(nim_layers_data   +  nxy*iz + nx*iy + ix) >= Nr_layers ) {
-                Nr_layers = (int)*(nim_layers_data +  nxy*iz + nx*iy + ix); 
-           }
-        }
-      }
+    // Find number of layers and columns to work with
+    // ========================================================================
+    int Nr_columns = 0;
+    int Nr_layers  = 0;
+    for (int i = 0; i != nxyz; ++i) {
+        Nr_columns = max(Nr_columns, *(nim_columns_data + i));
+        Nr_layers  = max(Nr_layers,  *(nim_layers_data + i));
     }
+    const int Nr_parcels = Nr_columns * Nr_layers;
     cout << "there are "<< Nr_columns << " columns"   << endl;
     cout << "there are "<< Nr_layers  << "  layers" << endl << endl;
-    Nr_parcels = Nr_columns  * Nr_layers; 
     cout << "there are "<< Nr_parcels  << " parcels" << endl << endl;
-    
-    
-    // ========================================================================
-    /////////////////////////////////////////////////////////////////////
-    // finding approximate number of voxels per parcel (layer column combination) ///////
-    /////////////////////////////////////////////////////////////////////
-    int layeridx = 0; 
-    int columnindx = 0; 
-    int voxelidx = 0;
-    int runningidx = 0; 
-    
-    // Access the parcel as; vec_nrVox_pacels[ Nr_columns * LayerIndex + ColumnIndex]
-    std::vector<double> vec_nrVox_pacels(Nr_parcels);
 
-    // Access the parcel as; vec_mostcommonval_pacels[ Nr_columns * LayerIndex + ColumnIndex]
-    std::vector<double> vec_mostcommonval_pacels(Nr_parcels);
-    
-    for (int ip=0; ip<Nr_parcels; ++ip) {
-            vec_nrVox_pacels[ip] = 0.; 
-            vec_mostcommonval_pacels[ip] = 0.; 
-    }
-    
-    for(int iy=0; iy<size_y; ++iy) {
-        for(int ix=0; ix<size_x; ++ix) {
-            for(int iz=0; iz<size_z; ++iz) {
-                //  vec_val_pacels[(int)*(nim_columns_data +  nxy*iz + nx*iy + ix)][(int)*(nim_layers_data +  nxy*iz + nx*iy + ix)] =+ ;
-                //cout <<  Nr_columns * (int)*(nim_layers_data +  nxy*iz + nx*iy + ix) + (int)*(nim_columns_data +  nxy*iz + nx*iy + ix) << endl; 
-                layeridx = (int)*(nim_layers_data +  nxy*iz + nx*iy + ix)-1;
-                columnindx = (int)*(nim_columns_data +  nxy*iz + nx*iy + ix)-1; 
-                vec_nrVox_pacels[ Nr_columns * layeridx + columnindx]++; 
-            }
+    // Parcel (layer column combination) of each voxel, -1 outside.
+    // Access the parcel as: [ Nr_columns * LayerIndex + ColumnIndex ]
+    std::vector<int32_t> voxel_parcel(nxyz, -1);
+    for (int i = 0; i != nxyz; ++i) {
+        if (*(nim_columns_data + i) > 0 && *(nim_layers_data + i) > 0) {
+            voxel_parcel[i] = Nr_columns * (*(nim_layers_data + i) - 1)
+                              + *(nim_columns_data + i) - 1;
         }
     }
-        
-    double mean_Nr_voxels_per_parcel = 0; 
-    double stdev_Nr_voxels_per_parcel = 0; 
-    
-    mean_Nr_voxels_per_parcel = ren_average(vec_nrVox_pacels.data(), Nr_layers*Nr_columns); 
-    stdev_Nr_voxels_per_parcel = ren_stdev(vec_nrVox_pacels.data(), Nr_layers*Nr_columns); 
-    
-    cout << "Mean number of voxels per pacel is " << mean_Nr_voxels_per_parcel << endl; 
-    cout << "Stdev number of voxels per pacel is " << stdev_Nr_voxels_per_parcel << endl;   
-
-    // ========================================================================
-    // Finding most common value in each parcel ///////
-    // ========================================================================
-    int MaxVoxelPerParcel = (int) mean_Nr_voxels_per_parcel + (int) stdev_Nr_voxels_per_parcel; // for very very large columns, some voxels are missed.
-    cout << "MaxVoxelPerParcel is " << MaxVoxelPerParcel << endl;   
 
-    int* val_Vox_pacels = new int[Nr_parcels*MaxVoxelPerParcel]; 
-    //Access the parcel as: val_Vox_pacels[ MaxVoxelPerParcel * Nr_columns * LayerIndex + MaxVoxelPerParcel * ColumnIndex + VoxelIndex]
-    
     // ========================================================================
-    // Loop across voxels for filling vector across parcels  ///////
+    // Joint (parcel, value) histogram
     // ========================================================================
-    for (int il=0; il<Nr_layers; ++il) {
-        for (int ic=0; ic<Nr_columns; ++ic) {   
-            vec_nrVox_pacels[Nr_columns * il +  ic] = 0.; 
-
-            for (int iv=0; iv<MaxVoxelPerParcel; ++iv) {
-                val_Vox_pacels[ MaxVoxelPerParcel * Nr_columns * il + MaxVoxelPerParcel * ic + iv] = 0; 
-            }
-        }
+    // NOTE: Input values are used as integers. They are remapped to dense bin
+    // indices, so that a binarized map needs only two bins per parcel. All
+    // voxels of a parcel are counted in one pass over the volume. There is
+    // one histogram and no per thread copies, because the tools are built
+    // without threads (no OpenMP or std::thread).
+    std::vector<int> bin_values;
+    for (int i = 0; i != nxyz; ++i) {
+        if (voxel_parcel[i] >= 0) bin_values.push_back((int)*(nii_data + i));
     }
-    cout << " Hi1 "  << endl;   
-
-    for(int iy=0; iy<size_y; ++iy) {
-        for(int ix=0; ix<size_x; ++ix) {
-            for(int iz=0; iz<size_z; ++iz) {
-                if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) {  // NOTE(Renzo): include a check somewhere above that the layer-file makes sense in all voxles where columns are defined.
-                    layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1;
-                    columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1; 
-                    vec_nrVox_pacels[Nr_columns * layeridx +  columnindx] += 1; 
-                    voxelidx = vec_nrVox_pacels[Nr_columns * layeridx +  columnindx] - 1; 
-                    voxelidx = min(voxelidx,MaxVoxelPerParcel-1);  // ignore the last voxels of gigantic column outliers. 
-         
-                    // cout << layeridx << " " << columnindx << "  "<< voxelidx << endl; 
-                    val_Vox_pacels[MaxVoxelPerParcel * Nr_columns * layeridx + MaxVoxelPerParcel * columnindx + voxelidx] =  *(nii_data +  nxy*iz + nx*iy + ix); 
-                }
-            }
+    std::sort(bin_values.begin(), bin_values.end());
+    bin_values.erase(std::unique(bin_values.begin(), bin_values.end()), bin_values.end());
+    const int Nr_bins = bin_values.size();
+    cout << "there are "<< Nr_bins << " distinct values" << endl;
+
+    std::vector<uint32_t> histogram(Nr_parcels * Nr_bins, 0);
+    for (int i = 0; i != nxyz; ++i) {
+        if (voxel_parcel[i] >= 0) {
+            int bin = std::lower_bound(bin_values.begin(), bin_values.end(),
+                                       (int)*(nii_data + i)) - bin_values.begin();
+            histogram[Nr_bins * voxel_parcel[i] + bin]++;
         }
     }
 
-    ///////////////////////////////////////////////////////////
-    // finding most common value in each parcel output  ///////
-    ///////////////////////////////////////////////////////////
-    cout << " Hi1a "  << endl;  
-
-    std::vector<int> vec_val_in_parcel(MaxVoxelPerParcel);
-
-    for (int ivox=0; ivox<MaxVoxelPerParcel; ++ivox) vec_val_in_parcel[ivox] = 0; 
-    int NRvoxel_in_this_parcel = 0; 
-   
-    for (int il=0; il<Nr_layers; ++il) {
-        for (int ic=0; ic<Nr_columns; ++ic) {
-            NRvoxel_in_this_parcel = vec_nrVox_pacels[Nr_columns * il +  ic]; 
-            NRvoxel_in_this_parcel = min(MaxVoxelPerParcel,NRvoxel_in_this_parcel); 
-      
-            for (int ivox=0; ivox<NRvoxel_in_this_parcel; ++ivox) {
-                vec_val_in_parcel[ivox] =  val_Vox_pacels[MaxVoxelPerParcel * Nr_columns * il + MaxVoxelPerParcel * ic + ivox]; 
-            }
-
-            vec_mostcommonval_pacels[ Nr_columns * il + ic] = ren_most_occurred_number(vec_val_in_parcel.data(), NRvoxel_in_this_parcel);
-            // cout << il << " " << ic << "  "<< vec_mostcommonval_pacels[ Nr_columns * il + ic]<< endl;
-        }
-    }
-    
-    for(int iy=0; iy<size_y; ++iy) {
-        for(int ix=0; ix<size_x; ++ix) {
-            for(int iz=0; iz<size_z; ++iz) {
-                if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
-                    layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1;
-                    columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1; 
-                    *(nii_parcelval_data +  nxy*iz + nx*iy + ix) = vec_mostcommonval_pacels[ Nr_columns * layeridx + columnindx];
-                }
+    // Number of voxels and most common value in each parcel. Ties go to the
+    // larger value.
+    std::vector<double> vec_nrVox_pacels(Nr_parcels, 0.);
+    std::vector<int> vec_mostcommonval_pacels(Nr_parcels, 0);
+    for (int ip = 0; ip < Nr_parcels; ++ip) {
+        uint32_t max_count = 0;
+        for (int b = 0; b < Nr_bins; ++b) {
+            uint32_t count = histogram[Nr_bins * ip + b];
+            vec_nrVox_pacels[ip] += count;
+            if (count > 0 && count >= max_count) {
+                max_count = count;
+                vec_mostcommonval_pacels[ip] = bin_values[b];
             }
         }
     }
 
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "parcel_val", nii_parcelval, true, use_outpath);
-   
-    ////////////////////////////////////////////////////////////////////////////////////
-    // finding local patch of neigbors (snipets repurposed from LN2_COLTRAIN) ///////
-    ////////////////////////////////////////////////////////////////////////////////////
-    uint32_t ix, iy, iz;
-    uint32_t iix, iiy, iiz;
-    // Voxels of interest
-    uint32_t nr_voi = 0;
-    for (uint32_t i = 0; i != nxyz; ++i) {
-        if (*(nim_columns_data + i) > 0) {
-            nr_voi += 1;
-        }
-    }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
+    double mean_Nr_voxels_per_parcel = ren_average(vec_nrVox_pacels.data(), Nr_parcels);
+    double stdev_Nr_voxels_per_parcel = ren_stdev(vec_nrVox_pacels.data(), Nr_parcels);
+    cout << "Mean number of voxels per pacel is " << mean_Nr_voxels_per_parcel << endl;
+    cout << "Stdev number of voxels per pacel is " << stdev_Nr_voxels_per_parcel << endl;
 
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nxyz; ++i) {
-        if (*(nim_columns_data + i) > 0) {
-            *(voi_id + ii) = i;
-            ii += 1;
+    for (int i = 0; i != nxyz; ++i) {
+        if (voxel_parcel[i] >= 0) {
+            *(nii_parcelval_data + i) = vec_mostcommonval_pacels[voxel_parcel[i]];
         }
     }
 
+    if (!fout) fout = fin;
+    save_output_nifti(fout, "parcel_val", nii_parcelval, true);
+
     // ========================================================================
-    // Triangulation on subset Voronoi cells
+    // Find neighbouring parcels
     // ========================================================================
-    // Keep neighbouring column ID's in an array
-    int32_t* neighbours;
-    neighbours = (int32_t*) malloc(27*sizeof(int32_t));// there are 26 neighbors of in a rubics cube.
-    for (int j=0; j<27; ++j) {
-         *(neighbours + j) = 0;
-    }
-     
-    int* ColId_in_neigh_column = new int[Nr_parcels*27];
-    // Access the parcel as: [ Nr_parcels * NeighColidx  +   parcelID ]  
-    // center parcelID: Nr_columns * layeridx + columnindx
-    int* val_in_neigh_column   = new int[Nr_parcels*27];
-    // Access the parcel as: [ Nr_parcels * NeighColidx +   parcelID ]  
-    // center parcelID: Nr_columns * layeridx + columnindx
-    for (int j=0; j<Nr_parcels*27; ++j) {
-        ColId_in_neigh_column [j] =0;
-        val_in_neigh_column [j] =0;
-    }
-    
-    int* Collumn_in_neighbor = new int[Nr_parcels*27];
-    int* layer_in_neighbor   = new int[Nr_parcels*27];
-    for (int j=0; j<Nr_parcels*27; ++j) {
-        Collumn_in_neighbor [j] =0;
-        layer_in_neighbor [j] =0;
-    }
-
-    std::vector<int> runidx_neigh_parcel(Nr_parcels);
-
-    // Access the parcel as: [ parcelID ]  
-    // center parcelID: Nr_columns * layeridx + columnindx
-    for (int j=0; j<Nr_parcels; ++j) {
-        runidx_neigh_parcel [j] = 1;
-    }
-
-    int current_column_idx = 0;
-    int current_layer_idx = 0; 
-    int current_parcel_idx = 0; 
-    int current_column_neighbor = 0;
-    int current_layer_neighbor = 0; 
-    int current_parcel_neighbor = 0;
-    int layer_of_new_neigbor = 0; 
-    int niegbor_id = 0; 
-    int is_notnew_nighbor = 0;
-    int is_notnew_parcel_nighbor = 0;
-    // int is_notnew_layer_nighbor = 0;
-   
-    cout << " Hi3 "  << endl;  
-  
-    for(uint32_t ii = 0; ii != nr_voi; ++ii) { 
-        uint32_t i = *(voi_id + ii);
-        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-        current_column_idx = (int)*(nim_columns_data + i) -1;
-        current_layer_idx  = (int)*(nim_layers_data  + i) -1;
-        current_parcel_idx =  Nr_columns * current_layer_idx + current_column_idx;
-        
-        //cout << "column, layer, parcel " << current_column_idx << " "<< current_layer_idx << " "<< current_parcel_idx << " "<< endl;
-        //*(neighbours + 0) = *(nim_columns_data + i);
-
-        layer_in_neighbor       [ Nr_parcels * 0 +  current_parcel_idx ] = current_layer_idx; 
-        Collumn_in_neighbor     [ Nr_parcels * 0 +  current_parcel_idx ] = current_column_idx; 
-        val_in_neigh_column     [ Nr_parcels * 0 +  current_parcel_idx ] = (int)*(nii_parcelval_data + i);
-        ColId_in_neigh_column   [ Nr_parcels * 0 +  current_parcel_idx ] = current_parcel_idx; 
-        
-        // 1-jump neighbours
-        if (ix > 0) {
-            int j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }
-
-//              if (current_parcel_neighbor !=current_parcel_idx &&   is_notnew_parcel_nighbor == 0 ) {
-//                   cout << " current_parcel_idx " << current_parcel_idx << " current_column_idx " << current_column_idx << " current_layer_idx " << current_layer_idx  << endl;
-//                   cout << " current_parcel_neighbor " << current_parcel_neighbor << " current_column_neighbor " << current_column_neighbor << " current_layer_neighbor " << current_layer_neighbor  << endl;
-//                   cout << ix<< " "<< iy << " " << iz <<"       " <<   runidx_neigh_parcel  [current_parcel_idx]<< "  "<< runidx_neigh_parcel  [current_parcel_idx]<<  endl; 
-//                   cout << ix-1<< " "<< iy << " " << iz <<"       " <<   runidx_neigh_parcel  [current_parcel_idx]<< "  "<< runidx_neigh_parcel  [current_parcel_idx]<<  endl; 
-
-                
-//                        for (int niegbor_id_index = 0; niegbor_id_index < 27; niegbor_id_index++ ) { 
-//                          cout << ColId_in_neigh_column[Nr_parcels * niegbor_id_index +  current_parcel_idx ] << " ";
-                            //cout << ColId_in_neigh_layer [Nr_parcels * current_column_neighboridx +  current_parcel_idx ] << " ";
-//                        }
-//                        cout << endl; 
-//                        for (int niegbor_id_index = 0; niegbor_id_index < 27; niegbor_id_index++ ) { 
-//                          cout << Collumn_in_neighbor[Nr_parcels * niegbor_id_index +  current_parcel_idx ] << " ";
-//                        }     
-//                        cout << endl; 
-//                        for (int niegbor_id_index = 0; niegbor_id_index < 27; niegbor_id_index++ ) { 
-//                          cout << layer_in_neighbor[Nr_parcels * niegbor_id_index +  current_parcel_idx ] << " ";
-//                        }     
-//                        cout << endl; 
-//                        for (int niegbor_id_index = 0; niegbor_id_index < 27; niegbor_id_index++ ) { 
-//                          cout << val_in_neigh_column[Nr_parcels * niegbor_id_index +  current_parcel_idx ] << " ";
-                            //cout << ColId_in_neigh_layer [Nr_parcels * current_column_neighboridx +  current_parcel_idx ] << " ";
-//                        }
-//                        cout << endl; 
-//              }
-                    
-            } //loop across neigbors closed
-        }
-
-
-
-        if (iy > 0) {
-            int j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iz > 0) {
-            int j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                     if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                         is_notnew_parcel_nighbor ++;
-                     }
+    // NOTE: Two parcels are neighbours when any of their voxels share a face
+    // or an edge (18-neighbourhood). Only the 9 forward offsets are visited
+    // and each pair is stored in both directions. Sorting the pairs removes
+    // duplicates and groups them by parcel, so there is no limit on the
+    // number of neighbours of a parcel.
+    const int offsets[9][3] = {
+        {1, 0, 0}, {0, 1, 0}, {0, 0, 1},
+        {1, 1, 0}, {1, -1, 0}, {1, 0, 1}, {1, 0, -1}, {0, 1, 1}, {0, 1, -1}
+    };
+    std::vector<uint64_t> pairs;
+    for (int iz = 0; iz < size_z; ++iz) {
+        for (int iy = 0; iy < size_y; ++iy) {
+            for (int ix = 0; ix < size_x; ++ix) {
+                int i = nxy * iz + nx * iy + ix;
+                int p = voxel_parcel[i];
+                if (p < 0) continue;
+                for (int k = 0; k < 9; ++k) {
+                    int jx = ix + offsets[k][0];
+                    int jy = iy + offsets[k][1];
+                    int jz = iz + offsets[k][2];
+                    if (jx >= size_x || jy < 0 || jy >= size_y || jz < 0 || jz >= size_z) continue;
+                    int q = voxel_parcel[nxy * jz + nx * jy + jx];
+                    if (q < 0 || q == p) continue;
+                    pairs.push_back((uint64_t)p * Nr_parcels + q);
+                    pairs.push_back((uint64_t)q * Nr_parcels + p);
                 }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
             }
         }
-        if (ix < size_x) {
-            int j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iy < size_y) {
-            int j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iz < size_z) {
-            int j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-
-        // 2-jump neighbours
-        if (ix > 0 && iy > 0) {
-            int j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (ix > 0 && iy < size_y) {
-            int j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (ix < size_x && iy > 0) {
-            int j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (ix < size_x && iy < size_y) {
-            int j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-       if (iy > 0 && iz > 0) {
-            int j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iy > 0 && iz < size_z) {
-            int j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iy < size_y && iz > 0) {
-            int j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (iy < size_y && iz < size_z) {
-            int j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (ix > 0 && iz > 0) {
-            int j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                             is_notnew_parcel_nighbor = 0; 
-                 current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                 current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                 current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-               // checking if this neigbor is already considered or not        
-                 for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                         if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                             is_notnew_parcel_nighbor ++;
-                         }
-                 }
-                 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                 if ( is_notnew_parcel_nighbor == 0 ) {
-                     niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                     ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                     val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                     Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                     layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                     runidx_neigh_parcel   [current_parcel_idx] ++; 
-                 }   
-            }
-        }
-        if (ix < size_x && iz > 0) {
-            int j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                             is_notnew_parcel_nighbor = 0; 
-                 current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                 current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                 current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-               // checking if this neigbor is already considered or not        
-                 for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                         if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                             is_notnew_parcel_nighbor ++;
-                         }
-                 }
-                 if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                 if ( is_notnew_parcel_nighbor == 0 ) {
-                     niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                     ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                     val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                     Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                     layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                     runidx_neigh_parcel   [current_parcel_idx] ++; 
-                 }   
-            }
-        }
-        if (ix > 0 && iz < size_z) {
-            int j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-        if (ix < size_x && iz < size_z) {
-            int j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                is_notnew_parcel_nighbor = 0; 
-                current_column_neighbor  = (int)*(nim_columns_data + j)-1;
-                current_layer_neighbor   = (int)*(nim_layers_data + j) -1; 
-                current_parcel_neighbor  =  Nr_columns * current_layer_neighbor + current_column_neighbor;
-                 
-                // checking if this neigbor is already considered or not        
-                for (int current_column_neighboridx = 0; current_column_neighboridx < 27; current_column_neighboridx++ ) { 
-                    if (current_parcel_neighbor == ColId_in_neigh_column[Nr_parcels * current_column_neighboridx +  current_parcel_idx ]) {
-                        is_notnew_parcel_nighbor ++;
-                    }
-                }
-                if (current_parcel_idx == current_parcel_neighbor )   is_notnew_parcel_nighbor = 1;
-             
-                if ( is_notnew_parcel_nighbor == 0 ) {
-                    niegbor_id = min (runidx_neigh_parcel [current_parcel_idx], 27); // this is to make sure that we are not runnign out of memory if there are more than 27 nioghbors. 
-                    ColId_in_neigh_column [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_parcel_neighbor;
-                    val_in_neigh_column   [Nr_parcels * niegbor_id +  current_parcel_idx ] = (int)*(nii_parcelval_data + j); 
-                    Collumn_in_neighbor   [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_column_neighbor; 
-                    layer_in_neighbor     [Nr_parcels * niegbor_id +  current_parcel_idx ] = current_layer_neighbor; 
-                    runidx_neigh_parcel   [current_parcel_idx] ++; 
-                }   
-            }
-        }
-
-        //  not using 3-jump neighbours 
-        if (ix > 0 && iy > 0 && iz > 0) {
-            int j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 19) = *(nim_columns_data + j);
-            }
-        }
-        if (ix > 0 && iy > 0 && iz < size_z) {
-            int j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-               // *(neighbours + 20) = *(nim_columns_data + j);
-            }
-        }
-        if (ix > 0 && iy < size_y && iz > 0) {
-            int j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 21) = *(nim_columns_data + j);
-            }
-        }
-        if (ix < size_x && iy > 0 && iz > 0) {
-            int j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 22) = *(nim_columns_data + j);
-            }
-        }
-        if (ix > 0 && iy < size_y && iz < size_z) {
-            int j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 23) = *(nim_columns_data + j);
-            }
-        }
-        if (ix < size_x && iy > 0 && iz < size_z) {
-            int j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 24) = *(nim_columns_data + j);
-            }
-        }
-        if (ix < size_x && iy < size_y && iz > 0) {
-            int j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 25) = *(nim_columns_data + j);
-            }
-        }
-        if (ix < size_x && iy < size_y && iz < size_z) {
-            int j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-            if (*(nim_columns_data + j) > 0) {
-                //*(neighbours + 26) = *(nim_columns_data + j);
-            }
-        }
-
-
-
-        /*
-        // Have an array to note down columns id's that will form triangles.
-        // NOTE(Faruk): I allocate 8 elements here because if the volume is
-        // over-parcellated (i.e. too many columns), hit count can go above 3
-        int32_t* trio;
-        trio = (int32_t*) malloc(8*sizeof(int32_t));
-
-        for (int m=0; m<8; m++) {
-            int n;
-            for (n=0; n<m; n++) {
-                if (*(neighbours + m) == *(neighbours + n)) {
-                    break;
-                }
-            }
-            if (m == n) {
-                if (*(neighbours + m) != 0) {
-                    *(trio + count_neigh) = *(neighbours + m);
-                    count_neigh += 1;
-                }
-            }
-        }
-        if (count_neigh == 3) {  // Hard-lock to triplets only
-            for (int l=0; l<count_neigh; ++l) {
-                *(triplets + count_triplets * 3 + l) = *(trio + l);
-            }
-            count_triplets += 1;
-        }
-        */
-    }
-
-
-
-    cout << " I am done filling the neighbor array "<< endl; 
-
-    ///////////////////////////////////////////////////////////////////////////
-    ///  Loop over parcels and quantifying their similary of valued across layers and columns
-    ///////////////////////////////////////////////////////////////////////////
-    std::vector<double> laminarity(Nr_parcels);  //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
-    for (int j=0; j<Nr_parcels; ++j)   laminarity [j] = 0;  
-    int count_same_val_layer = 0;    
-    int count_same_layer = 0;       
-
-    for (int paridx=0; paridx<Nr_parcels; ++paridx) {
-    //  cout << "runidx_neigh_parcel["<<paridx<<"]   "<< runidx_neigh_parcel[paridx] << endl; 
-    //    cout << "   layer_in_neighbor[Nr_parcels *"<<paridx<<" + 0]   "<< layer_in_neighbor[Nr_parcels * paridx +  0 ] << endl; 
-        count_same_val_layer = 0;    
-        count_same_layer = 0;   
-
-        for (int nigidx=1; nigidx<min(runidx_neigh_parcel[paridx],27); ++nigidx) {
-            if (layer_in_neighbor[Nr_parcels * 0 +  paridx] == layer_in_neighbor[Nr_parcels * nigidx +  paridx ]  ) {
-                count_same_layer ++;
-                if (val_in_neigh_column[Nr_parcels * 0 +  paridx ] == val_in_neigh_column[Nr_parcels * nigidx +  paridx ]  ) {
-                    count_same_val_layer++;
-                }
-            }
-        }   
-        if ( count_same_layer > 0 ) laminarity [paridx] = (double)count_same_val_layer / (double) count_same_layer; 
-         //cout << "   laminarity[ "<<paridx<<" ]   "<< laminarity [paridx]<< endl; 
     }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    cout << "there are "<< pairs.size() / 2 << " pairs of neighbouring parcels" << endl;
 
-    for(int iy=0; iy<size_y; ++iy) {
-        for(int ix=0; ix<size_x; ++ix) {
-            for(int iz=0; iz<size_z; ++iz) {
-                if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
-                    layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1;
-                    columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1; 
-                    *(nii_laminarity_data +  nxy*iz + nx*iy + ix)  = laminarity [ Nr_columns * layeridx + columnindx];
-                }
-            }
+    // ========================================================================
+    // Laminarity and columnarity
+    // ========================================================================
+    // Laminarity is the fraction of neighbours within the same layer that
+    // share the parcel value. Columnarity is the same within the same column.
+    std::vector<double> laminarity(Nr_parcels, 0.);
+    std::vector<double> columnarity(Nr_parcels, 0.);
+    std::vector<int> count_same_layer(Nr_parcels, 0), count_same_val_layer(Nr_parcels, 0);
+    std::vector<int> count_same_col(Nr_parcels, 0), count_same_val_col(Nr_parcels, 0);
+    for (size_t n = 0; n != pairs.size(); ++n) {
+        int p = pairs[n] / Nr_parcels;
+        int q = pairs[n] % Nr_parcels;
+        bool same_val = vec_mostcommonval_pacels[p] == vec_mostcommonval_pacels[q];
+        if (p / Nr_columns == q / Nr_columns) {
+            count_same_layer[p]++;
+            count_same_val_layer[p] += same_val;
+        } else if (p % Nr_columns == q % Nr_columns) {
+            count_same_col[p]++;
+            count_same_val_col[p] += same_val;
         }
     }
 
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "output_laminarity", nii_laminarity, true, use_outpath);
-
-    std::vector<double> columnarity(Nr_parcels);  //Access the parcel as: [ parcelID ]  // center parcelID: Nr_columns * layeridx + columnindx
-    for (int j=0; j<Nr_parcels; ++j)   laminarity [j] = 0;  
-    int count_same_val_col = 0;    
-    int count_same_col = 0;       
-
-    for (int paridx=0; paridx<Nr_parcels; ++paridx) {
-    //  cout << "runidx_neigh_parcel["<<paridx<<"]   "<< runidx_neigh_parcel[paridx] << endl; 
-    //    cout << "   layer_in_neighbor[Nr_parcels *"<<paridx<<" + 0]   "<< layer_in_neighbor[Nr_parcels * paridx +  0 ] << endl; 
-        count_same_val_col = 0;    
-        count_same_col = 0;   
-
-        for (int nigidx=1; nigidx<min(runidx_neigh_parcel[paridx],27); ++nigidx) {
-            if (Collumn_in_neighbor[Nr_parcels * 0 +  paridx] == Collumn_in_neighbor[Nr_parcels * nigidx +  paridx ]  ) {
-                count_same_col ++;
-                if (val_in_neigh_column[Nr_parcels * 0 +  paridx ] == val_in_neigh_column[Nr_parcels * nigidx +  paridx ]  ) {
-                    count_same_val_col++;
-                }
-            }
-        }   
-        if ( count_same_col > 0 ) columnarity [paridx] = (double)count_same_val_col / (double) count_same_col; 
-         //cout << "   columnarity[ "<<paridx<<" ]   "<< columnarity [paridx]<< endl; 
+    double mean_laminarity = 0, mean_columnarity = 0;
+    int nr_laminarity = 0, nr_columnarity = 0;
+    for (int ip = 0; ip < Nr_parcels; ++ip) {
+        if (count_same_layer[ip] > 0) {
+            laminarity[ip] = (double)count_same_val_layer[ip] / (double)count_same_layer[ip];
+            mean_laminarity += laminarity[ip];
+            nr_laminarity++;
+        }
+        if (count_same_col[ip] > 0) {
+            columnarity[ip] = (double)count_same_val_col[ip] / (double)count_same_col[ip];
+            mean_columnarity += columnarity[ip];
+            nr_columnarity++;
+        }
     }
+    if (nr_laminarity > 0) mean_laminarity /= nr_laminarity;
+    if (nr_columnarity > 0) mean_columnarity /= nr_columnarity;
+    cout << "Mean laminarity across parcels is " << mean_laminarity << endl;
+    cout << "Mean columnarity across parcels is " << mean_columnarity << endl;
 
-
-    for(int iy=0; iy<size_y; ++iy) {
-        for(int ix=0; ix<size_x; ++ix) {
-            for(int iz=0; iz<size_z; ++iz) {
-                if (*(nim_columns_data +  nxy*iz + nx*iy + ix) >0) { 
-                    layeridx = *(nim_layers_data +  nxy*iz + nx*iy + ix) -1;
-                    columnindx = *(nim_columns_data +  nxy*iz + nx*iy + ix) -1; 
-                    *(nii_laminarity_data +  nxy*iz + nx*iy + ix)  = laminarity [ Nr_columns * layeridx + columnindx];
-                    *(nii_columnarity_data +  nxy*iz + nx*iy + ix) = columnarity[ Nr_columns * layeridx + columnindx];
-                }
-            }
+    for (int i = 0; i != nxyz; ++i) {
+        if (voxel_parcel[i] >= 0) {
+            *(nii_laminarity_data + i)  = laminarity [voxel_parcel[i]];
+            *(nii_columnarity_data + i) = columnarity[voxel_parcel[i]];
         }
     }
 
-    //Collumn_in_neighbor[Nr_parcels * niegbor_id_index +  current_parcel_idx ] 
-    //layer_in_neighbor[Nr_parcels * niegbor_id_index +  current_parcel_idx ] 
-    //val_in_neigh_column[Nr_parcels * niegbor_id_index +  current_parcel_idx ] 
-    //runidx_neigh_parcel   [current_parcel_idx]
-
-    // =======================
-    //////////////////////////
-    // writing output  ///////
-    //////////////////////////
-
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "output_columnarity", nii_columnarity, true, use_outpath);
+    save_output_nifti(fout, "output_laminarity", nii_laminarity, true);
+    save_output_nifti(fout, "output_columnarity", nii_columnarity, true);
 
     cout << "  Finished." << endl;
     return 0;
-}
\ No newline at end of file
+}
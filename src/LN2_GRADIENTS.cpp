@@ -4,7 +4,7 @@
 int show_help(void) {
     printf(
     "LN2_GRADIENTS: Compute image gradients (spatial derivatives).\n"
-    "               Uses 1-jump voxel neighbors for computations.\n"
+    "               Uses 1-jump voxel neighbors for computations by default.\n"
     "\n"
     "Usage:\n"
     "    LN2_GRADIENTS -input Smagn_t-001.nii.gz\n"
@@ -17,6 +17,9 @@ int show_help(void) {
     "    -merge_outputs : (Optional) Save gradients as a 4D file. Only works\n"
     "                     with 3D images.\n"
     "    -normalize     : (Optional) Output gradients will be unit vectors.\n"
+    "    -stencil       : (Optional) 'central' (default), 'sobel' or 'scharr'.\n"
+    "                     Sobel and Scharr also smooth across the other two axes\n"
+    "                     (3x3x3 neighbourhood).\n"
     "    -output        : (Optional) Output basename for all outputs.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
     "\n");
@@ -28,6 +31,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_debug = false, mode_merge_outputs = false, mode_normalize = false;
+    ln_stencil_type stencil = LN_STENCIL_CENTRAL;
 
     nifti_image *nii_gra = NULL;
     float *nii_gra_data = NULL;
@@ -51,6 +55,16 @@ int main(int argc, char*  argv[]) {
             mode_merge_outputs = true;
         } else if (!strcmp(argv[ac], "-normalize")) {
             mode_normalize = true;
+        } else if (!strcmp(argv[ac], "-stencil")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -stencil\n");
+                return 1;
+            }
+            if (!ln_stencil_from_name(argv[ac], stencil)
+                || stencil == LN_STENCIL_SECOND_ORDER) {
+                fprintf(stderr, "** invalid stencil, '%s'\n", argv[ac]);
+                return 1;
+            }
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -86,10 +100,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     if (mode_merge_outputs && size_time > 1) {
@@ -119,13 +129,7 @@ int main(int argc, char*  argv[]) {
         nii_gra->nvox = nr_voxels * 3;
         nii_gra->nbyper = sizeof(float);
         nii_gra->data = calloc(nii_gra->nvox, nii_gra->nbyper);
-        
         nii_gra_data = static_cast<float*>(nii_gra->data);
-
-        // Set to zero
-        for (uint32_t i = 0; i != nr_voxels*3; ++i) {
-            *(nii_gra_data + i) = 0;
-        }
     } else {
         cout << "  Input is a 4D image (e.g. timeseries)." << endl;
         nii_gra_x = copy_nifti_as_float32(nii_input);
@@ -134,66 +138,29 @@ int main(int argc, char*  argv[]) {
         nii_gra_y_data = static_cast<float*>(nii_gra_y->data);
         nii_gra_z = copy_nifti_as_float32(nii_input);
         nii_gra_z_data = static_cast<float*>(nii_gra_z->data);
-
-        // Set to zero
-        for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-            *(nii_gra_x_data + i) = 0;
-            *(nii_gra_y_data + i) = 0;
-            *(nii_gra_z_data + i) = 0;        
-        }
     }
 
     // ========================================================================
-    // Find connected clusters
+    // Compute gradients
     // ========================================================================
     cout << "  Computing gradients..." << endl;
 
-    uint32_t ix, iy, iz, it, j, k;
-
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x = 0, gra_y = 0, gra_z = 0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                gra_x = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                gra_y = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                gra_z = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-
-            // ----------------------------------------------------------------
-            if (mode_normalize) {
-                float magnitude = sqrt(gra_x*gra_x + gra_y*gra_y + gra_z*gra_z);
-                gra_x /= magnitude;
-                gra_y /= magnitude;
-                gra_z /= magnitude;
-            }
-
-            if (mode_merge_outputs) {
-                *(nii_gra_data + i+nr_voxels*0) = gra_x;
-                *(nii_gra_data + i+nr_voxels*1) = gra_y;
-                *(nii_gra_data + i+nr_voxels*2) = gra_z;                                
-            } else {
-                *(nii_gra_x_data + i+nr_voxels*t) = gra_x;
-                *(nii_gra_y_data + i+nr_voxels*t) = gra_y;
-                *(nii_gra_z_data + i+nr_voxels*t) = gra_z;                                
-            }
+        ln_stencil_outputs out;
+        out.normalize = mode_normalize;
+        if (mode_merge_outputs) {
+            out.gra_x = nii_gra_data + nr_voxels*0;
+            out.gra_y = nii_gra_data + nr_voxels*1;
+            out.gra_z = nii_gra_data + nr_voxels*2;
+        } else {
+            out.gra_x = nii_gra_x_data + nr_voxels*t;
+            out.gra_y = nii_gra_y_data + nr_voxels*t;
+            out.gra_z = nii_gra_z_data + nr_voxels*t;
         }
+        ln_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z,
+                            stencil, LN_STENCIL_CENTRAL, out);
     }
     cout << endl;
 
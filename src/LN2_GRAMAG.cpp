@@ -5,18 +5,21 @@ int show_help(void) {
     printf(
     "LN2_GRAMAG: Compute gradient magnitude image that is the Euclidean norm of \n"
     "            the first spatial derivatives (sqrt(D_x^2 + D_y^2 + D_z^2)).\n"
-    "            Uses 1-jump voxel neighbors for computations.\n"
+    "            Uses 1-jump voxel neighbors for computations by default.\n"
     "\n"
     "Usage:\n"
     "    LN2_GRAMAG -input Smagn_t-001.nii.gz\n"
     "\n"
     "Options:\n"
-    "    -help   : Show this help.\n"
-    "    -input  : Nifti image that will be used to compute gradients.\n"
-    "              This can be a 4D nifti. in 4D case, 3D gradients\n"
-    "              will be computed for each volume.\n"
-    "    -output : (Optional) Output basename for all outputs.\n"
-    "    -debug  : (Optional) Save extra intermediate outputs.\n"
+    "    -help    : Show this help.\n"
+    "    -input   : Nifti image that will be used to compute gradients.\n"
+    "               This can be a 4D nifti. in 4D case, 3D gradients\n"
+    "               will be computed for each volume.\n"
+    "    -stencil : (Optional) 'central' (default), 'sobel' or 'scharr'.\n"
+    "               Sobel and Scharr also smooth across the other two axes\n"
+    "               (3x3x3 neighbourhood).\n"
+    "    -output  : (Optional) Output basename for all outputs.\n"
+    "    -debug   : (Optional) Save extra intermediate outputs.\n"
     "\n"
     "Reference and further reading:\n"
     "    - [See Figure 1 from] Gulban, O.F., Schneider, M., Marquardt, I., \n"
@@ -32,6 +35,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_debug = false;
+    ln_stencil_type stencil = LN_STENCIL_CENTRAL;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -45,6 +49,16 @@ int main(int argc, char*  argv[]) {
             }
             fin1 = argv[ac];
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-stencil")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -stencil\n");
+                return 1;
+            }
+            if (!ln_stencil_from_name(argv[ac], stencil)
+                || stencil == LN_STENCIL_SECOND_ORDER) {
+                fprintf(stderr, "** invalid stencil, '%s'\n", argv[ac]);
+                return 1;
+            }
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -80,10 +94,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -96,48 +106,18 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_gramag = copy_nifti_as_float32(nii_input);
     float* nii_gramag_data = static_cast<float*>(nii_gramag->data);
 
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_gramag_data + i) = 0;
-    }
-
     // ========================================================================
-    // Find connected clusters
+    // Compute gradient magnitude
     // ========================================================================
     cout << "  Computing gradients..." << endl;
 
-    uint32_t ix, iy, iz, it, j, k;
-
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x = 0, gra_y = 0, gra_z = 0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                gra_x = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                gra_y = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                gra_z = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-
-            // ----------------------------------------------------------------
-            // Compute magnitude
-            *(nii_gramag_data + i+nr_voxels*t) = sqrt(gra_x*gra_x + gra_y*gra_y + gra_z*gra_z);
-        }
+        ln_stencil_outputs out;
+        out.magnitude = nii_gramag_data + nr_voxels*t;
+        ln_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z,
+                            stencil, LN_STENCIL_CENTRAL, out);
     }
     cout << endl;
     cout << "  Saving output..." << endl;
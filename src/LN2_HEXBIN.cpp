@@ -8,24 +8,34 @@ int show_help(void) {
     "\n"
     "Usage:\n"
     "    LN2_HEXBIN -coord_uv coord_uv.nii -radius 10\n"
+    "    LN2_HEXBIN -coord_uv coord_uv.nii -radius 0.5,1,2 -values activation.nii\n"
     "\n"
     "Options:\n"
     "    -help     : Show this help.\n"
     "    -coord_uv : A 4D nifti file that contains 2D (UV) coordinates.\n"
     "                For example LN2_MULTILATERATE output named 'UV_coords'.\n"
     "    -radius   : Radius of the circle inscribed within hexagons.\n"
-    "                In UV coordinate metric units (e.g. mm).\n"
+    "                In UV coordinate metric units (e.g. mm). Multiple comma\n"
+    "                separated radii (e.g. '0.5,1,2') generate a multi-resolution\n"
+    "                set of bins from one read of the inputs.\n"
+    "    -values   : (Optional) A 3D nifti file (e.g. activation map). When given,\n"
+    "                mean, standard deviation and voxel count of the values\n"
+    "                within each bin are also written.\n"
     "    -output   : (Optional) Output basename for all outputs.\n"
+    "\n"
+    "Notes:\n"
+    "    - Bin of each voxel is computed directly from its UV coordinate by\n"
+    "      only checking the bin centers of the neighboring rows and columns.\n"
     "\n");
     return 0;
 }
 
 int main(int argc, char*  argv[]) {
 
-    nifti_image *nii1 = NULL;
-    char *fin1 = NULL, *fout = NULL;
+    nifti_image *nii1 = NULL, *nii2 = NULL;
+    char *fin1 = NULL, *fin2 = NULL, *fout = NULL;
     int ac;
-    float radius = 10;
+    vector<float> radii;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -44,7 +54,17 @@ int main(int argc, char*  argv[]) {
                 fprintf(stderr, "** missing argument for -radius\n");
                 return 1;
             }
-            radius = atof(argv[ac]);
+            std::istringstream iss(argv[ac]);
+            string token;
+            while (std::getline(iss, token, ',')) {
+                radii.push_back(atof(token.c_str()));
+            }
+        } else if (!strcmp(argv[ac], "-values")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -values\n");
+                return 1;
+            }
+            fin2 = argv[ac];
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -61,6 +81,9 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** missing option '-coords_uv'\n");
         return 1;
     }
+    if (radii.empty()) {
+        radii.push_back(10);
+    }
 
     // Read input dataset, including data
     nii1 = nifti_image_read(fin1, 1);
@@ -69,8 +92,19 @@ int main(int argc, char*  argv[]) {
         return 2;
     }
 
+    if (fin2) {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
+    }
+
     log_welcome("LN2_HEXBIN");
     log_nifti_descriptives(nii1);
+    if (nii2) {
+        log_nifti_descriptives(nii2);
+    }
 
     // Get dimensions of input
     const int nr_voxels = nii1->nx * nii1->ny * nii1->nz;
@@ -155,68 +189,129 @@ int main(int argc, char*  argv[]) {
     cout << "  U coordinate min & max: " << min_u << " | " << max_u << endl;
     cout << "  V coordinate min & max: " << min_v << " | " << max_v << endl;
 
-    // ========================================================================
-    // Place hexbin centers within UV range
-    // ========================================================================
-    // Figure out orthogonal step sizes
-    float diameter = radius * 2;
-    float step_u = diameter;
-    float step_v = diameter / sqrt(2);
-
-    // Guesstimate number of bins needed
-    int nr_bins_u = (abs(min_u) + abs(max_u)) / step_u;
-    int nr_bins_v = (abs(min_v) + abs(max_v)) / step_v;
-    int nr_bins = nr_bins_u * nr_bins_v;
-
-    // Initialize all elements at 0
-    float* arr_centers_u = new float[nr_bins]();
-    float* arr_centers_v = new float[nr_bins]();
-
-    // Set first center as minima
-    arr_centers_u[0] = min_u;
-    arr_centers_v[0] = min_v;
-
-    // Compute hexbins centers
-    int k;
-    for (int j = 0; j != nr_bins_v; ++j) {
-        for (int i = 0; i != nr_bins_u; ++i) {
-            k = j * nr_bins_u + i;
-            if (j % 2 == 0) {  // even rows
-                arr_centers_u[k] = min_u + step_u * i;
-                arr_centers_v[k] = min_v + step_v * j;
-            } else {
-                arr_centers_u[k] = min_u + (step_u * i) + (step_u / 2);
-                arr_centers_v[k] = min_v + step_v * j;
-            }
-        }
+    // Values to aggregate within bins
+    if (nii2 && nii2->nx * nii2->ny * nii2->nz != nr_voxels) {
+        fprintf(stderr, "** '-values' and '-coord_uv' dimensions do not match\n");
+        return 2;
+    }
+    float* nii_values_data = NULL;
+    nifti_image* nii_mean = NULL;
+    nifti_image* nii_std = NULL;
+    nifti_image* nii_count = NULL;
+    if (nii2) {
+        nifti_image* nii_values = copy_nifti_as_float32(nii2);
+        nii_values_data = static_cast<float*>(nii_values->data);
+        nii_mean = copy_nifti_as_float32(nii_values);
+        nii_std = copy_nifti_as_float32(nii_values);
+        nii_count = copy_nifti_as_float32(nii_values);
     }
 
-    // ========================================================================
-    // Evaluate each voxel against hexbin centers to find closest center
-    // ========================================================================
-    for (int ii = 0; ii != nr_voi; ++ii) {
-        int i = *(voi_id + ii);
+    for (uint32_t r = 0; r != radii.size(); ++r) {
+        const float radius = radii[r];
+        cout << "\n  Radius " << radius << "..." << endl;
+
+        // ====================================================================
+        // Place hexbin centers within UV range
+        // ====================================================================
+        // Figure out orthogonal step sizes
+        float diameter = radius * 2;
+        float step_u = diameter;
+        float step_v = diameter / sqrt(2);
+
+        // Guesstimate number of bins needed
+        int nr_bins_u = (abs(min_u) + abs(max_u)) / step_u;
+        int nr_bins_v = (abs(min_v) + abs(max_v)) / step_v;
+        int nr_bins = nr_bins_u * nr_bins_v;
+        cout << "    Number of bins: " << nr_bins << endl;
+
+        // NOTE: Bin centers are on a lattice of rows (index j) where odd
+        // rows are shifted by half a step:
+        //     u = min_u + step_u * i (+ step_u / 2), v = min_v + step_v * j
+        // The closest center is always within the two rows around v and the
+        // two columns around u. Candidates are visited in ascending bin
+        // order so that ties resolve the same way as a search over all bins.
+        for (int i = 0; i != nr_voxels; ++i) {
+            *(nii_bins_data + i) = 0;
+        }
+
+        // Per bin running statistics (Welford)
+        vector <double> bin_n, bin_mean, bin_m2;
+        if (nii2) {
+            bin_n.assign(nr_bins, 0);
+            bin_mean.assign(nr_bins, 0);
+            bin_m2.assign(nr_bins, 0);
+        }
+
+        if (nr_bins > 0) {
+            for (int ii = 0; ii != nr_voi; ++ii) {
+                int i = *(voi_id + ii);
 
-        float coord_u = *(nii_input_data + nr_voxels*0 + i);
-        float coord_v = *(nii_input_data + nr_voxels*1 + i);
+                float coord_u = *(nii_input_data + nr_voxels*0 + i);
+                float coord_v = *(nii_input_data + nr_voxels*1 + i);
 
-        // Compute distance to each bin center
-        float min_dist = std::numeric_limits<float>::max();
-        for (int32_t j = 0; j != nr_bins; j++) {
-            float bin_u = arr_centers_u[j];
-            float bin_v = arr_centers_v[j];
+                int row = static_cast<int>(std::floor((coord_v - min_v) / step_v));
+                int j_first = std::max(row - 1, 0);
+                int j_last = std::min(row + 2, nr_bins_v - 1);
+                j_first = std::min(j_first, j_last);
 
-            float dist = sqrt(pow(coord_u - bin_u, 2) + pow(coord_v - bin_v, 2));
-            if (dist < min_dist) {
-                min_dist = dist;
-                *(nii_bins_data + i) = j;
+                float min_dist = std::numeric_limits<float>::max();
+                int32_t best_bin = 0;
+                for (int j = j_first; j <= j_last; ++j) {
+                    float offset = (j % 2 == 0) ? 0 : step_u / 2;
+                    int col = static_cast<int>(std::floor((coord_u - min_u - offset) / step_u));
+                    int i_first = std::max(col - 1, 0);
+                    int i_last = std::min(col + 1, nr_bins_u - 1);
+                    i_first = std::min(i_first, i_last);
+                    for (int k = i_first; k <= i_last; ++k) {
+                        float bin_u = min_u + (step_u * k) + offset;
+                        float bin_v = min_v + step_v * j;
+
+                        float dist = sqrt(pow(coord_u - bin_u, 2) + pow(coord_v - bin_v, 2));
+                        if (dist < min_dist) {
+                            min_dist = dist;
+                            best_bin = j * nr_bins_u + k;
+                        }
+                    }
+                }
+                *(nii_bins_data + i) = best_bin;
+
+                if (nii2) {
+                    double x = *(nii_values_data + i);
+                    bin_n[best_bin] += 1;
+                    double delta = x - bin_mean[best_bin];
+                    bin_mean[best_bin] += delta / bin_n[best_bin];
+                    bin_m2[best_bin] += delta * (x - bin_mean[best_bin]);
+                }
             }
         }
-    }
 
-    std::ostringstream tag;
-    tag << radius;
-    save_output_nifti(fout, "hexbins"+tag.str(), nii_bins, true);
+        std::ostringstream tag;
+        tag << radius;
+        save_output_nifti(fout, "hexbins"+tag.str(), nii_bins, true);
+
+        if (nii2) {
+            float* nii_mean_data = static_cast<float*>(nii_mean->data);
+            float* nii_std_data = static_cast<float*>(nii_std->data);
+            float* nii_count_data = static_cast<float*>(nii_count->data);
+            for (int i = 0; i != nr_voxels; ++i) {
+                *(nii_mean_data + i) = 0;
+                *(nii_std_data + i) = 0;
+                *(nii_count_data + i) = 0;
+            }
+            if (nr_bins > 0) {
+                for (int ii = 0; ii != nr_voi; ++ii) {
+                    int i = *(voi_id + ii);
+                    int32_t b = *(nii_bins_data + i);
+                    *(nii_mean_data + i) = bin_mean[b];
+                    *(nii_std_data + i) = (bin_n[b] > 1) ? std::sqrt(bin_m2[b] / (bin_n[b] - 1)) : 0;
+                    *(nii_count_data + i) = bin_n[b];
+                }
+            }
+            save_output_nifti(fout, "hexbins"+tag.str()+"_mean", nii_mean, true);
+            save_output_nifti(fout, "hexbins"+tag.str()+"_std", nii_std, true);
+            save_output_nifti(fout, "hexbins"+tag.str()+"_count", nii_count, true);
+        }
+    }
 
     cout << "\n  Finished." << endl;
     return 0;
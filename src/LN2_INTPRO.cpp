@@ -9,17 +9,32 @@ int show_help(void) {
     "\n"
     "Usage:\n"
     "     LN2_INTPRO -input file.nii -min -range 3 \n"
+    "     LN2_INTPRO -input file.nii -max -mean -axis 0 -range 20 \n"
+    "     LN2_INTPRO -input file.nii -min -direction 1 1 0 -range 10 \n"
     "\n"
     "Options:\n"
     "    -help      : Show this help\n"
     "    -input     : Nifti (.nii) for intensity projections. \n"
-    "    -axis      : Axis of the projection. x=1, y=2, z=4. Default is '3'.\n"
+    "    -min       : Minimum intensity projection. Default if no projection\n"
+    "                 type is given. Can be combined with the other types.\n"
+    "    -max       : Maximum intensity projection.\n"
+    "    -mean      : Mean intensity projection.\n"
+    "    -median    : Median intensity projection. Slower than the others\n"
+    "                 for large ranges.\n"
+    "    -axis      : Axis of the projection. x=1, y=2, z=3. Default is '3'.\n"
     "                 Projections over each axis can be generated by using '0'.\n"
+    "    -direction : (Optional) Oblique projection along a voxel step, given\n"
+    "                 as three values of -1, 0 or 1 (e.g. '1 1 0' for the\n"
+    "                 xy diagonal). Overrides '-axis'.\n"
     "    -range     : Number of voxels in either side of the projection plane.\n"
-    "                 Default is '5'. E.g. value of '5' indicates the projection\n" 
+    "                 Default is '5'. E.g. value of '5' indicates the projection\n"
     "                 will be performed over 11 (5+1+5) voxels in total.\n"
     "    -output    : (Optional) Output filename, including .nii or\n"
     "                 .nii.gz, and path if needed. Overwrites existing files.\n"
+    "\n"
+    "Notes:\n"
+    "    - Minimum, maximum and mean projections take the same time for any\n"
+    "      range.\n"
     "\n");
     return 0;
 }
@@ -27,6 +42,9 @@ int show_help(void) {
 int main(int argc, char * argv[]) {
     char *fin = NULL, *fout = NULL;
     int64_t ac, axis = 3, range = 5;
+    int dir[3] = {0, 0, 0};
+    bool mode_direction = false;
+    std::vector<ln_projection_type> types;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -46,12 +64,29 @@ int main(int argc, char * argv[]) {
             } else {
                 axis = atof(argv[ac]);
             }
+        } else if (!strcmp(argv[ac], "-direction")) {
+            if (ac + 3 >= argc) {
+                fprintf(stderr, "** missing argument for -direction\n");
+                return 1;
+            }
+            for (int k = 0; k != 3; ++k) {
+                dir[k] = atoi(argv[++ac]);
+            }
+            mode_direction = true;
         } else if (!strcmp(argv[ac], "-range")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -range\n");
             } else {
                 range = atof(argv[ac]);
             }
+        } else if (!strcmp(argv[ac], "-min")) {
+            types.push_back(LN_PROJECTION_MIN);
+        } else if (!strcmp(argv[ac], "-max")) {
+            types.push_back(LN_PROJECTION_MAX);
+        } else if (!strcmp(argv[ac], "-mean")) {
+            types.push_back(LN_PROJECTION_MEAN);
+        } else if (!strcmp(argv[ac], "-median")) {
+            types.push_back(LN_PROJECTION_MEDIAN);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -77,6 +112,19 @@ int main(int argc, char * argv[]) {
         fprintf(stderr, "Incorrect axis value. Please choose between 0, 1, 2, 3.\n");
         return 2;
     }
+    if (mode_direction) {
+        bool valid = dir[0] != 0 || dir[1] != 0 || dir[2] != 0;
+        for (int k = 0; k != 3; ++k) {
+            valid = valid && dir[k] >= -1 && dir[k] <= 1;
+        }
+        if (!valid) {
+            fprintf(stderr, "Incorrect direction. Please use three values of -1, 0 or 1, not all 0.\n");
+            return 2;
+        }
+    }
+    if (types.empty()) {
+        types.push_back(LN_PROJECTION_MIN);
+    }
 
     log_welcome("LN2_INTPRO");
     log_nifti_descriptives(nii1);
@@ -100,89 +148,45 @@ int main(int argc, char * argv[]) {
     std::ostringstream tag_range;
     tag_range << range;
 
-    // ------------------------------------------------------------------------
-    if ( axis == 1 || axis == 0 ) {
-        cout << "  Minimum intensity projection over x..." << endl;
-
-        int64_t ix, iy, iz, it, j;
-        for (int64_t t = 0; t != size_time; ++t) {
-            cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-            for (int64_t i = 0; i != nr_voxels; ++i) {
-                tie(ix, iy, iz, it) = ind2sub_4D_64(i+nr_voxels*t, size_x, size_y, size_z);
-                float temp = std::numeric_limits<float>::max();
-
-                for (int64_t x = ix-range; x != ix+range; ++x ) {
-                    if (x > 0 && x < size_x) {
-                        j = sub2ind_4D_64(x, iy, iz, it, size_x, size_y, size_z);
-                        if ( *(nii_input_data + j) < temp) {
-                            temp = *(nii_input_data + j);
-                        }
-                    }
-                *(nii_output_data + i+nr_voxels*t) = temp;
-                }
+    // Projection lines: one per requested axis, or the oblique direction
+    std::vector<std::vector<int> > lines;
+    std::vector<string> line_tags;
+    if (mode_direction) {
+        std::ostringstream tag_dir;
+        tag_dir << "d" << dir[0] << "_" << dir[1] << "_" << dir[2];
+        lines.push_back(std::vector<int>(dir, dir + 3));
+        line_tags.push_back(tag_dir.str());
+    } else {
+        const char* axis_tags[3] = {"x", "y", "z"};
+        for (int k = 0; k != 3; ++k) {
+            if (axis == k + 1 || axis == 0) {
+                std::vector<int> d(3, 0);
+                d[k] = 1;
+                lines.push_back(d);
+                line_tags.push_back(axis_tags[k]);
             }
         }
-
-        cout << endl;
-        cout << "  Saving output..." << endl;
-        save_output_nifti(fout, "minip-x_range-"+tag_range.str(), nii_output, true);        
     }
-
-    // ------------------------------------------------------------------------
-    if ( axis == 2 || axis == 0 ) {
-        cout << "  Minimum intensity projection over y..." << endl;
-
-        int64_t ix, iy, iz, it, j;
-        for (int64_t t = 0; t != size_time; ++t) {
-            cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-            for (int64_t i = 0; i != nr_voxels; ++i) {
-                tie(ix, iy, iz, it) = ind2sub_4D_64(i+nr_voxels*t, size_x, size_y, size_z);
-                float temp = std::numeric_limits<float>::max();
-
-                for (int64_t y = iy-range; y != iy+range; ++y ) {
-                    if (y > 0 && y < size_y) {
-                        j = sub2ind_4D_64(ix, y, iz, it, size_x, size_y, size_z);
-                        if ( *(nii_input_data + j) < temp) {
-                            temp = *(nii_input_data + j);
-                        }
-                    }
-                *(nii_output_data + i+nr_voxels*t) = temp;
-                }
+    const char* type_names[4] = {"Minimum", "Maximum", "Mean", "Median"};
+    const char* type_tags[4] = {"minip", "maxip", "meanip", "medianip"};
+
+    for (size_t n = 0; n != types.size(); ++n) {
+        for (size_t k = 0; k != lines.size(); ++k) {
+            cout << "  " << type_names[types[n]] << " intensity projection over "
+                 << line_tags[k] << "..." << endl;
+
+            for (int64_t t = 0; t != size_time; ++t) {
+                cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
+                ln_running_projection_3D(nii_input_data + nr_voxels*t, nii_output_data + nr_voxels*t,
+                                         size_x, size_y, size_z,
+                                         lines[k][0], lines[k][1], lines[k][2], range, types[n]);
             }
-        }
-
-        cout << endl;
-        cout << "  Saving output..." << endl;
-        save_output_nifti(fout, "minip-y_range-"+tag_range.str(), nii_output, true);        
-    }
 
-    // ------------------------------------------------------------------------
-    if ( axis == 3 || axis == 0 ) {
-        cout << "  Minimum intensity projection over z..." << endl;
-
-        int64_t ix, iy, iz, it, j;
-        for (int64_t t = 0; t != size_time; ++t) {
-            cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-            for (int64_t i = 0; i != nr_voxels; ++i) {
-                tie(ix, iy, iz, it) = ind2sub_4D_64(i+nr_voxels*t, size_x, size_y, size_z);
-                float temp = std::numeric_limits<float>::max();
-
-                for (int64_t z = iz-range; z != iz+range; ++z ) {
-                    if (z > 0 && z < size_z) {
-                        j = sub2ind_4D_64(ix, iy, z, it, size_x, size_y, size_z);
-                        if ( *(nii_input_data + j) < temp) {
-                            temp = *(nii_input_data + j);
-                        }
-                    }
-                *(nii_output_data + i+nr_voxels*t) = temp;
-                }
-            }
+            cout << endl;
+            cout << "  Saving output..." << endl;
+            save_output_nifti(fout, string(type_tags[types[n]]) + "-" + line_tags[k]
+                              + "_range-" + tag_range.str(), nii_output, true);
         }
-
-        cout << endl;
-        cout << "  Saving output..." << endl;
-
-        save_output_nifti(fout, "minip-z_range-"+tag_range.str(), nii_output, true);        
     }
 
     cout << "\n  Finished." << endl;
@@ -15,6 +15,9 @@ int show_help(void) {
     "    -input         : Nifti image that will be used to compute gradients.\n"
     "                     This can be a 4D nifti. in 4D case, 3D gradients\n"
     "                     will be computed for each volume.\n"
+    "    -stencil       : (Optional) 'central' (default) is the central difference\n"
+    "                     of the central gradients (2-jump reach). 'second_order'\n"
+    "                     uses the compact f[i-1] - 2 f[i] + f[i+1] stencil.\n"
     "    -output        : (Optional) Output basename for all outputs.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
     "\n");
@@ -26,6 +29,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_debug = false;
+    ln_stencil_type stencil = LN_STENCIL_CENTRAL;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -39,6 +43,16 @@ int main(int argc, char*  argv[]) {
             }
             fin1 = argv[ac];
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-stencil")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -stencil\n");
+                return 1;
+            }
+            if (!ln_stencil_from_name(argv[ac], stencil)
+                || (stencil != LN_STENCIL_CENTRAL && stencil != LN_STENCIL_SECOND_ORDER)) {
+                fprintf(stderr, "** invalid stencil, '%s'\n", argv[ac]);
+                return 1;
+            }
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -74,10 +88,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -90,57 +100,33 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii_laplacian = copy_nifti_as_float32(nii_input);
     float *nii_laplacian_data = static_cast<float*>(nii_laplacian->data);
 
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_laplacian_data + i) = 0;
-    }
-
     // Prepare intermediate outputs
-    nifti_image *nii_gra_x = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_x_data = static_cast<float*>(nii_gra_x->data);
-    nifti_image *nii_gra_y = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_y_data = static_cast<float*>(nii_gra_y->data);
-    nifti_image *nii_gra_z = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_z_data = static_cast<float*>(nii_gra_z->data);
+    nifti_image *nii_gra_x = NULL, *nii_gra_y = NULL, *nii_gra_z = NULL;
+    if (mode_debug) {
+        nii_gra_x = copy_nifti_as_float32(nii_input);
+        nii_gra_y = copy_nifti_as_float32(nii_input);
+        nii_gra_z = copy_nifti_as_float32(nii_input);
+    }
 
     // ========================================================================
-    // Gradients
+    // Compute Laplacian
     // ========================================================================
-    cout << "  Computing first derivatives..." << endl;
-
-    uint32_t ix, iy, iz, it, j, k;
+    // NOTE: Gradients (only needed for debug outputs) and the Laplacian come
+    // out of the same sweep over the input.
+    cout << "  Computing second derivatives for Laplacian..." << endl;
 
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x = 0, gra_y = 0, gra_z = 0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                gra_x = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                gra_y = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                gra_z = *(nii_input_data + j) - *(nii_input_data + k);
-            }
-
-            // ----------------------------------------------------------------
-            *(nii_gra_x_data + i+nr_voxels*t) = gra_x;
-            *(nii_gra_y_data + i+nr_voxels*t) = gra_y;
-            *(nii_gra_z_data + i+nr_voxels*t) = gra_z;                                
+        ln_stencil_outputs out;
+        out.laplacian = nii_laplacian_data + nr_voxels*t;
+        if (mode_debug) {
+            out.gra_x = static_cast<float*>(nii_gra_x->data) + nr_voxels*t;
+            out.gra_y = static_cast<float*>(nii_gra_y->data) + nr_voxels*t;
+            out.gra_z = static_cast<float*>(nii_gra_z->data) + nr_voxels*t;
         }
+        ln_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z,
+                            LN_STENCIL_CENTRAL, stencil, out);
     }
     cout << endl;
 
@@ -151,43 +137,6 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "gradient_z", nii_gra_z, true);
     }
 
-    // ========================================================================
-    // Compute Laplacian
-    // ========================================================================
-    cout << "  Computing second derivatives for Laplacian..." << endl;
-
-    for (uint32_t t = 0; t != size_time; ++t) {
-        cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_xx = 0, gra_yy = 0, gra_zz = 0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                gra_xx = *(nii_gra_x_data + j) - *(nii_gra_x_data + k);
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                gra_yy = *(nii_gra_y_data + j) - *(nii_gra_y_data + k);
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                gra_zz = *(nii_gra_z_data + j) - *(nii_gra_z_data + k);
-            }
-
-            // ----------------------------------------------------------------
-            *(nii_laplacian_data + i+nr_voxels*t) = gra_xx + gra_yy + gra_zz;
-        }
-    }
-    cout << endl;
-
     cout << "  Saving output..." << endl;
     save_output_nifti(fout, "laplacian", nii_laplacian, true);
     
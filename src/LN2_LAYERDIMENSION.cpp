@@ -11,6 +11,7 @@ int show_help(void) {
     "Usage:\n"
     "    LN2_LAYERDIMENSION -values activation.nii -columns columns.nii -layers layers_equidist.nii -singleTR\n"
     "    ../LN2_LAYERDIMENSION -values lo_BOLD_act.nii -layers lo_layers.nii -columns lo_columns.nii \n"
+    "    LN2_LAYERDIMENSION -values bold.nii -columns columns.nii -layers layers.nii -compact -allTR\n"
     "\n"
     "Options:\n"
     "    -help     : Show this help.\n"
@@ -25,8 +26,17 @@ int show_help(void) {
     "                .nii.gz, and path if needed. Overwrites existing files.\n"
     "    -singleTR : flag to only look as the first time point of the value file.\n"
     "                default is ON.\n"
+    "    -allTR    : (Optional) Use all time points of the value file. Only\n"
+    "                used together with '-compact'.\n"
+    "    -compact  : (Optional) Instead of the full field of view, write a\n"
+    "                'layerdim_compact' nifti with column index along x,\n"
+    "                layer along y and time points along time.\n"
     "\n"
     "Notes:\n"
+    "    - The compact output has one voxel per column and layer, so it is much\n"
+    "      smaller than the full output and can be used directly for analyses\n"
+    "      of layer profiles over time (e.g. ICA). Its voxel positions are\n"
+    "      indices, not locations in space.\n"
     "    - This does not refer to Dr. Strange's dimensions.\n"
     "           +-----------+ \n"
     "          /           /| \n"
@@ -49,6 +59,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL;
     int ac;
     bool mode_debug = false, mode_singleTR = true, use_outpath = false;
+    bool mode_compact = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -85,6 +96,10 @@ int main(int argc, char*  argv[]) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-singleTR")) {
             mode_singleTR = true;
+        } else if (!strcmp(argv[ac], "-allTR")) {
+            mode_singleTR = false;
+        } else if (!strcmp(argv[ac], "-compact")) {
+            mode_compact = true;
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -130,6 +145,7 @@ int main(int argc, char*  argv[]) {
     const int size_x = nii1->nx;
     const int size_y = nii1->ny;
     const int size_z = nii1->nz;
+    const int size_time = nii1->nt;
     const int nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -183,6 +199,70 @@ int main(int argc, char*  argv[]) {
         }
     }
 
+    if (!use_outpath) fout = fin1;
+
+    // ========================================================================
+    // Compact output
+    // ========================================================================
+    // NOTE: The column and layer cell of every voxel is computed once. Each
+    // time point is then a single pass over the listed voxels, summing into
+    // a (columns x layers) matrix.
+    if (mode_compact) {
+        const int nr_cells = nr_columns * nr_layers;
+        const int nr_volumes = mode_singleTR ? 1 : size_time;
+
+        std::vector<int> voxel_list, cell_list;
+        std::vector<double> cell_count(nr_cells, 0.);
+        for (int i = 0; i != nr_voxels; ++i) {
+            if (*(columns_data + i) > 0 && *(layers_data + i) > 0) {
+                int cell = (*(layers_data + i) - 1) * nr_columns + *(columns_data + i) - 1;
+                voxel_list.push_back(i);
+                cell_list.push_back(cell);
+                cell_count[cell] += 1;
+            }
+        }
+        cout << "    Gathering " << voxel_list.size() << " voxels into "
+             << nr_columns << " x " << nr_layers << " x " << nr_volumes << " values." << endl;
+
+        nifti_image* compact = nifti_copy_nim_info(nii_input);
+        compact->datatype = NIFTI_TYPE_FLOAT32;
+        compact->nbyper = sizeof(float);
+        compact->dim[0] = 4;
+        compact->dim[1] = nr_columns;
+        compact->dim[2] = nr_layers;
+        compact->dim[3] = 1;
+        compact->dim[4] = nr_volumes;
+        compact->pixdim[1] = 1;
+        compact->pixdim[2] = 1;
+        compact->pixdim[3] = 1;
+        nifti_update_dims_from_array(compact);
+        compact->nvox = static_cast<int64_t>(nr_cells) * nr_volumes;
+        compact->data = calloc(compact->nvox, compact->nbyper);
+        compact->scl_slope = nii_input->scl_slope;
+        compact->scl_inter = 0;
+        compact->qform_code = 0;
+        compact->sform_code = 0;
+        float* compact_data = static_cast<float*>(compact->data);
+
+        std::vector<double> cell_sum(nr_cells);
+        for (int t = 0; t < nr_volumes; ++t) {
+            const float* vol_data = nii_input_data + static_cast<int64_t>(nr_voxels) * t;
+            std::fill(cell_sum.begin(), cell_sum.end(), 0.);
+            for (size_t k = 0; k != voxel_list.size(); ++k) {
+                cell_sum[cell_list[k]] += *(vol_data + voxel_list[k]);
+            }
+            for (int c = 0; c != nr_cells; ++c) {
+                if (cell_count[c] != 0) {
+                    *(compact_data + static_cast<int64_t>(nr_cells) * t + c) = cell_sum[c] / (float)cell_count[c];
+                }
+            }
+        }
+        save_output_nifti(fout, "layerdim_compact", compact, true, use_outpath);
+
+        cout << "\n  Finished." << endl;
+        return 0;
+    }
+
     // ========================================================================
     // Prepare outputs
     // ========================================================================
@@ -242,7 +322,6 @@ int main(int argc, char*  argv[]) {
     // Write output
     // ========================================================================
     layerdim->pixdim[4] = 1/nr_layers; // in units of cortical depth.
-    if (!use_outpath) fout = fin1;
     save_output_nifti(fout, "layerdim", layerdim, true, use_outpath);
 
     cout << "\n  Finished." << endl;
@@ -9,6 +9,7 @@ int show_help(void) {
     "Usage:\n"
     "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_control_point_0.nii -radius 10\n"
     "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_control_points.nii -radius 10\n"
+    "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_origins.nii -radius 10 -batch\n"
     "\n"
     "Options:\n"
     "    -help           : Show this help.\n"
@@ -31,6 +32,12 @@ int show_help(void) {
     "    -nomask         : (Conditional) Outputs are not masked to fall within radius.\n"
     "                      Can only be used together with 'control_points' CASE I.\n"
     "    -incl_borders   : (Conditional) Include borders as if they are labeled with 3.\n"
+    "    -batch          : (Optional) Compute many patches in one run. Every label\n"
+    "                      above 1 in '-control_points' is used as the origin of a\n"
+    "                      separate patch (CASE I), the other labels above 0 as middle\n"
+    "                      gray matter. The rim and middle gray matter domain are\n"
+    "                      prepared once and reused for every patch. Outputs are\n"
+    "                      tagged with '_patch' and the origin label.\n"
     "    -norms          : (Optional) Save L2 and Linf norm of the UV coordinates.\n"
     "    -angles         : (Optional) Save angles in radians and 4 quadrants.\n"
     "    -debug          : (Optional) Save extra intermediate outputs.\n"
@@ -50,90 +57,25 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char*  argv[]) {
-
-    nifti_image *nii1 = NULL, *nii2 = NULL;
-    char *fin1 = NULL, *fout = NULL, *fin2=NULL;
-    float thr_radius = 10;
-    int ac;
-    bool mode_debug = false, mode_mask=true, mode_incl_borders = false;
-    bool mode_norms = false, mode_angles=false;
-
-    // Process user options
-    if (argc < 2) return show_help();
-    for (ac = 1; ac < argc; ac++) {
-        if (!strncmp(argv[ac], "-h", 2)) {
-            return show_help();
-        } else if (!strcmp(argv[ac], "-rim")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -rim\n");
-                return 1;
-            }
-            fin1 = argv[ac];
-            fout = argv[ac];
-        } else if (!strcmp(argv[ac], "-control_points")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -control_points\n");
-                return 1;
-            }
-            fin2 = argv[ac];
-        } else if (!strcmp(argv[ac], "-radius")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -radius\n");
-                return 1;
-            }
-            thr_radius = atof(argv[ac]);
-        } else if (!strcmp(argv[ac], "-nomask")) {
-            mode_mask = false;
-        } else if (!strcmp(argv[ac], "-incl_borders")) {
-            mode_incl_borders = true;
-        } else if (!strcmp(argv[ac], "-norms")) {
-            mode_norms = true;
-        } else if (!strcmp(argv[ac], "-angles")) {
-            mode_angles = true;
-        } else if (!strcmp(argv[ac], "-output")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -output\n");
-                return 1;
-            }
-            fout = argv[ac];
-        } else if (!strcmp(argv[ac], "-debug")) {
-            mode_debug = true;
-        } else {
-            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
-            return 1;
-        }
-    }
-
-    if (!fin1) {
-        fprintf(stderr, "** missing option '-rim'\n");
-        return 1;
-    }
-    if (!fin2) {
-        fprintf(stderr, "** missing option '-control_points'\n");
-        return 1;
-    }
-
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin1, 1);
-    if (!nii1) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
-        return 2;
-    }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
-
-    log_welcome("LN2_MULTILATERATE");
-    log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
-
+// Compute UV coordinates of one patch. The work images are reset here so
+// that they can be reused for many patches (see '-batch').
+int multilaterate_patch(nifti_image* nii_rim, nifti_image* control_points,
+                        nifti_image* flood_step, nifti_image* flood_dist,
+                        nifti_image* perimeter, nifti_image* point_dist,
+                        nifti_image* point_coords, nifti_image* pin_axes,
+                        nifti_image* pin_coords, nifti_image* voronoi,
+                        nifti_image* smooth,
+                        const int32_t* voi_id, const uint32_t nr_voi,
+                        const int32_t* voi_id2, const uint32_t nr_voi2,
+                        const ln_voxel_graph& graph_midgm,
+                        const ln_voxel_graph& graph_gm,
+                        const float thr_radius, const bool mode_mask,
+                        const bool mode_norms, const bool mode_angles,
+                        const bool mode_debug, const string fout) {
     // Get dimensions of input
-    const uint32_t size_x = nii1->nx;
-    const uint32_t size_y = nii1->ny;
-    const uint32_t size_z = nii1->nz;
+    const uint32_t size_x = nii_rim->nx;
+    const uint32_t size_y = nii_rim->ny;
+    const uint32_t size_z = nii_rim->nz;
 
     const uint32_t end_x = size_x - 1;
     const uint32_t end_y = size_y - 1;
@@ -141,143 +83,40 @@ int main(int argc, char*  argv[]) {
 
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
-    const float dX = nii1->pixdim[1];
-    const float dY = nii1->pixdim[2];
-    const float dZ = nii1->pixdim[3];
+    const float dX = nii_rim->pixdim[1];
+    const float dY = nii_rim->pixdim[2];
+    const float dZ = nii_rim->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
     // Long diagonals
     const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
 
-    // ========================================================================
-    // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
     int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
-    free(nii1);
-    // ------------------------------------------------------------------------
-    // Include borders adjustment to rim labels
-    if (mode_incl_borders) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_rim_data + i) != 0){
-                *(nii_rim_data + i) = 3;
-            }
-        }
-    }
-    // ------------------------------------------------------------------------
-    // Control points file (modified middle gray matter)
-    nifti_image* control_points = copy_nifti_as_int32(nii2);
     int32_t* control_points_data = static_cast<int32_t*>(control_points->data);
-    free(nii2);
-
-    // Prepare flood fill related nifti images
-    nifti_image* flood_step = copy_nifti_as_int32(nii_rim);
     int32_t* flood_step_data = static_cast<int32_t*>(flood_step->data);
-    nifti_image* flood_dist = copy_nifti_as_float32(nii_rim);
     float* flood_dist_data = static_cast<float*>(flood_dist->data);
-
-    nifti_image* perimeter = copy_nifti_as_int32(nii_rim);
     int32_t* perimeter_data = static_cast<int32_t*>(perimeter->data);
-
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(flood_step_data + i) = 0;
-        *(flood_dist_data + i) = 0;
-        *(perimeter_data + i) = 0;
-    }
-
-    // ------------------------------------------------------------------------
-    // Create a 4D nifti image for point distances
-    nifti_image* point_dist = nifti_copy_nim_info(flood_dist);
-    point_dist->dim[0] = 4;  // For proper 4D nifti
-    point_dist->dim[1] = size_x;
-    point_dist->dim[2] = size_y;
-    point_dist->dim[3] = size_z;
-    point_dist->dim[4] = 4;
-    nifti_update_dims_from_array(point_dist);
-    point_dist->nvox = nr_voxels * 4;
-    point_dist->nbyper = sizeof(float);
-    point_dist->data = calloc(point_dist->nvox, point_dist->nbyper);
     float* point_dist_data = static_cast<float*>(point_dist->data);
-
-    // Create a 4D nifti image for UV coordinates
-    nifti_image* point_coords = nifti_copy_nim_info(flood_dist);
-    point_coords->dim[0] = 4;  // For proper 4D nifti
-    point_coords->dim[1] = size_x;
-    point_coords->dim[2] = size_y;
-    point_coords->dim[3] = size_z;
-    point_coords->dim[4] = 2;
-    nifti_update_dims_from_array(point_coords);
-    point_coords->nvox = nr_voxels * 2;
-    point_coords->nbyper = sizeof(float);
-    point_coords->data = calloc(point_coords->nvox, point_coords->nbyper);
     float* point_coords_data = static_cast<float*>(point_coords->data);
-
-    // Rolling pin axes
-    nifti_image* pin_axes = copy_nifti_as_int32(point_coords);
     int32_t* pin_axes_data = static_cast<int32_t*>(pin_axes->data);
-
-    // Pin coordinates
-    nifti_image* pin_coords = copy_nifti_as_float32(point_coords);
     float* pin_coords_data = static_cast<float*>(pin_coords->data);
-
-    // ------------------------------------------------------------------------
-    // Final voronoi volume to output midgm distances for whole rim
-    nifti_image* voronoi = copy_nifti_as_float32(flood_dist);
     float* voronoi_data = static_cast<float*>(voronoi->data);
-    nifti_image* smooth = copy_nifti_as_float32(flood_dist);
     float* smooth_data = static_cast<float*>(smooth->data);
 
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // ------------------------------------------------------------------------
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
+    // Reset work images
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(control_points_data + i) > 0){
-            nr_voi += 1;
-        }
-    }
-    cout << "  Nr. midgm voxels = " << nr_voi << endl;
-
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(control_points_data + i) > 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
+        *(flood_step_data + i) = 0;
+        *(flood_dist_data + i) = 0;
+        *(perimeter_data + i) = 0;
+        *(voronoi_data + i) = 0;
+        *(smooth_data + i) = 0;
     }
-
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This part is for speeding up the final Voronoi propagation
-    // ------------------------------------------------------------------------
-    // Reduce number of looped-through voxels for the second stage (Voronoi)
-    uint32_t nr_voi2 = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_rim_data + i) == 3){
-            nr_voi2 += 1;
-        }
+    for (uint32_t i = 0; i != nr_voxels * 4; ++i) {
+        *(point_dist_data + i) = 0;
     }
-    cout << "  Nr. rim (3) voxels = " << nr_voi2 << endl;
-
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id2;
-    voi_id2 = (int32_t*) malloc(nr_voi2*sizeof(int32_t));
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t iii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_rim_data + i) == 3){
-            *(voi_id2 + iii) = i;
-            iii += 1;
-        }
+    for (uint32_t i = 0; i != nr_voxels * 2; ++i) {
+        *(point_coords_data + i) = 0;
+        *(pin_axes_data + i) = 0;
+        *(pin_coords_data + i) = 0;
     }
 
     // ========================================================================
@@ -322,10 +161,7 @@ int main(int argc, char*  argv[]) {
     }
 
 
-    int32_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
     uint32_t ix, iy, iz, i, j;
-    float d;
 
     if (!mode_custom_extrema) {
         cout << "\n  Computing control point 0 distances..." << endl;
@@ -337,335 +173,7 @@ int main(int argc, char*  argv[]) {
             }
         }
 
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
+        ln_voxel_graph_flood(graph_midgm, flood_dist_data, flood_step_data, NULL);
 
         if (mode_debug) {
             save_output_nifti(fout, "centroid_dist", flood_dist, false);
@@ -1153,357 +661,32 @@ int main(int argc, char*  argv[]) {
             }
             *(control_points_data + control_point1) = 3;
 
+            // Perimeter voxels are the only flood targets here
+            std::vector<bool> is_perimeter(nr_voxels, false);
+            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                i = *(voi_id + ii);
+                is_perimeter[i] = *(perimeter_data + i) == 2;
+            }
+            ln_voxel_graph graph_perimeter;
+            ln_voxel_graph_build(graph_perimeter, voi_id, nr_voi, is_perimeter,
+                                 std::vector<bool>(), size_x, size_y, size_z,
+                                 dX, dY, dZ);
+
             // Loop until desired number of points reached
             for (int32_t n = 4; n < 7; ++n) {
-                int32_t grow_step = 1;
-                uint32_t voxel_counter = nr_voxels;
-                uint32_t ix, iy, iz, i, j;
-                float d;
-
                 // Initialize grow volume
                 for (uint32_t i = 0; i != nr_voxels; ++i) {
                     if (*(control_points_data + i) > 1) {
                         *(flood_step_data + i) = 1.;
                         *(flood_dist_data + i) = 0.;
-                    } else {
-                        *(flood_step_data + i) = 0.;
-                        *(flood_dist_data + i) = 0.;
-                    }
-                }
-
-                // Reset some parameters
-                grow_step = 1;
-                voxel_counter = nr_voxels;
-                while (voxel_counter != 0) {
-                    voxel_counter = 0;
-                    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                        i = *(voi_id + ii);  // Map subset to full set
-                        if (*(flood_step_data + i) == grow_step) {
-                            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                            voxel_counter += 1;
-
-                            // ------------------------------------------------
-                            // 1-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x) {
-                                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y) {
-                                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iz > 0) {
-                                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iz < end_z) {
-                                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            // ------------------------------------------------
-                            // 2-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y) {
-                                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y) {
-                                j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-
-                            // ------------------------------------------------
-                            // 3-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                        }
+                    } else {
+                        *(flood_step_data + i) = 0.;
+                        *(flood_dist_data + i) = 0.;
                     }
-                    grow_step += 1;
                 }
 
+                ln_voxel_graph_flood(graph_perimeter, flood_dist_data, flood_step_data, NULL);
+
                 // Find farthest point
                 float max_distance = 0;
                 int idx_new_point;
@@ -1541,339 +724,7 @@ int main(int argc, char*  argv[]) {
             }
         }
 
-        // Reset some parameters
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
+        ln_voxel_graph_flood(graph_midgm, flood_dist_data, flood_step_data, NULL);
 
         if (mode_debug) {
             save_output_nifti(fout, "control_point" + std::to_string(p-2) + "_dist", flood_dist, false);
@@ -2022,339 +873,7 @@ int main(int argc, char*  argv[]) {
             }
         }
 
-        // Reset some parameters
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
+        ln_voxel_graph_flood(graph_midgm, flood_dist_data, flood_step_data, NULL);
 
         if (mode_debug) {
             save_output_nifti(fout, "pin_axis" + std::to_string(p+1) + "_dist", flood_dist, true);
@@ -2379,399 +898,25 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Final Voronoi for propagating distances to all gray matter
     // ========================================================================
-    cout << "\n  Start Voronoi propagation..." << endl;
-    for (uint32_t t = 0; t != 2; ++t) {
-        cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
-        // Initialize grow volume
-        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
-            i = *(voi_id2 + iii);  // Map subset to full set
-            if (*(pin_coords_data + nr_voxels*t + i) != 0) {
-                *(voronoi_data + i) = *(pin_coords_data + nr_voxels*t + i);
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 1.;
-            } else {
-                *(voronoi_data + i) = 0;
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
-            }
-        }
-
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
-                i = *(voi_id2 + iii);
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    bool jump_lock = false;
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (jump_lock == false) {
-
-                        if (ix > 0 && iy > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y) {
-                            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y) {
-                            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-
-                        // ----------------------------------------------------
-                        // 3-jump neighbours
-                        // ----------------------------------------------------
-                        if (ix > 0 && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                    }
-                }
+    cout << "\n  Start Voronoi propagation..." << endl;
+    for (uint32_t t = 0; t != 2; ++t) {
+        cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
+        // Initialize grow volume
+        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+            i = *(voi_id2 + iii);  // Map subset to full set
+            if (*(pin_coords_data + nr_voxels*t + i) != 0) {
+                *(voronoi_data + i) = *(pin_coords_data + nr_voxels*t + i);
+                *(flood_step_data + i) = 1.;
+                *(flood_dist_data + i) = 1.;
+            } else {
+                *(voronoi_data + i) = 0;
+                *(flood_step_data + i) = 0.;
+                *(flood_dist_data + i) = 0.;
             }
-            grow_step += 1;
         }
 
+        ln_voxel_graph_flood(graph_gm, flood_dist_data, flood_step_data, voronoi_data);
+
         // Record into 4D nifti
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);  // Map subset to full set
@@ -3174,6 +1319,333 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "UV_radians", flood_dist, true);
         save_output_nifti(fout, "UV_quadrants", flood_step, true);
     }
+    return 0;
+}
+
+int main(int argc, char*  argv[]) {
+
+    nifti_image *nii1 = NULL, *nii2 = NULL;
+    char *fin1 = NULL, *fout = NULL, *fin2=NULL;
+    float thr_radius = 10;
+    int ac;
+    bool mode_debug = false, mode_mask=true, mode_incl_borders = false;
+    bool mode_norms = false, mode_angles=false, mode_batch = false;
+
+    // Process user options
+    if (argc < 2) return show_help();
+    for (ac = 1; ac < argc; ac++) {
+        if (!strncmp(argv[ac], "-h", 2)) {
+            return show_help();
+        } else if (!strcmp(argv[ac], "-rim")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -rim\n");
+                return 1;
+            }
+            fin1 = argv[ac];
+            fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-control_points")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -control_points\n");
+                return 1;
+            }
+            fin2 = argv[ac];
+        } else if (!strcmp(argv[ac], "-radius")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -radius\n");
+                return 1;
+            }
+            thr_radius = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-nomask")) {
+            mode_mask = false;
+        } else if (!strcmp(argv[ac], "-incl_borders")) {
+            mode_incl_borders = true;
+        } else if (!strcmp(argv[ac], "-batch")) {
+            mode_batch = true;
+        } else if (!strcmp(argv[ac], "-norms")) {
+            mode_norms = true;
+        } else if (!strcmp(argv[ac], "-angles")) {
+            mode_angles = true;
+        } else if (!strcmp(argv[ac], "-output")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -output\n");
+                return 1;
+            }
+            fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-debug")) {
+            mode_debug = true;
+        } else {
+            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
+            return 1;
+        }
+    }
+
+    if (!fin1) {
+        fprintf(stderr, "** missing option '-rim'\n");
+        return 1;
+    }
+    if (!fin2) {
+        fprintf(stderr, "** missing option '-control_points'\n");
+        return 1;
+    }
+
+    // Read input dataset, including data
+    nii1 = nifti_image_read(fin1, 1);
+    if (!nii1) {
+        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
+        return 2;
+    }
+    nii2 = nifti_image_read(fin2, 1);
+    if (!nii2) {
+        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+        return 2;
+    }
+
+    log_welcome("LN2_MULTILATERATE");
+    log_nifti_descriptives(nii1);
+    log_nifti_descriptives(nii2);
+
+    // Get dimensions of input
+    const uint32_t size_x = nii1->nx;
+    const uint32_t size_y = nii1->ny;
+    const uint32_t size_z = nii1->nz;
+
+    const uint32_t nr_voxels = size_z * size_y * size_x;
+
+    const float dX = nii1->pixdim[1];
+    const float dY = nii1->pixdim[2];
+    const float dZ = nii1->pixdim[3];
+
+    // ========================================================================
+    // Fix input datatype issues
+    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
+    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
+    free(nii1);
+    // ------------------------------------------------------------------------
+    // Include borders adjustment to rim labels
+    if (mode_incl_borders) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (*(nii_rim_data + i) != 0){
+                *(nii_rim_data + i) = 3;
+            }
+        }
+    }
+    // ------------------------------------------------------------------------
+    // Control points file (modified middle gray matter)
+    nifti_image* control_points = copy_nifti_as_int32(nii2);
+    int32_t* control_points_data = static_cast<int32_t*>(control_points->data);
+    free(nii2);
+
+    // Prepare flood fill related nifti images
+    nifti_image* flood_step = copy_nifti_as_int32(nii_rim);
+    int32_t* flood_step_data = static_cast<int32_t*>(flood_step->data);
+    nifti_image* flood_dist = copy_nifti_as_float32(nii_rim);
+    float* flood_dist_data = static_cast<float*>(flood_dist->data);
+
+    nifti_image* perimeter = copy_nifti_as_int32(nii_rim);
+    int32_t* perimeter_data = static_cast<int32_t*>(perimeter->data);
+
+    // Set to zero
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(flood_step_data + i) = 0;
+        *(flood_dist_data + i) = 0;
+        *(perimeter_data + i) = 0;
+    }
+
+    // ------------------------------------------------------------------------
+    // Create a 4D nifti image for point distances
+    nifti_image* point_dist = nifti_copy_nim_info(flood_dist);
+    point_dist->dim[0] = 4;  // For proper 4D nifti
+    point_dist->dim[1] = size_x;
+    point_dist->dim[2] = size_y;
+    point_dist->dim[3] = size_z;
+    point_dist->dim[4] = 4;
+    nifti_update_dims_from_array(point_dist);
+    point_dist->nvox = nr_voxels * 4;
+    point_dist->nbyper = sizeof(float);
+    point_dist->data = calloc(point_dist->nvox, point_dist->nbyper);
+
+    // Create a 4D nifti image for UV coordinates
+    nifti_image* point_coords = nifti_copy_nim_info(flood_dist);
+    point_coords->dim[0] = 4;  // For proper 4D nifti
+    point_coords->dim[1] = size_x;
+    point_coords->dim[2] = size_y;
+    point_coords->dim[3] = size_z;
+    point_coords->dim[4] = 2;
+    nifti_update_dims_from_array(point_coords);
+    point_coords->nvox = nr_voxels * 2;
+    point_coords->nbyper = sizeof(float);
+    point_coords->data = calloc(point_coords->nvox, point_coords->nbyper);
+
+    // Rolling pin axes
+    nifti_image* pin_axes = copy_nifti_as_int32(point_coords);
+
+    // Pin coordinates
+    nifti_image* pin_coords = copy_nifti_as_float32(point_coords);
+
+    // ------------------------------------------------------------------------
+    // Final voronoi volume to output midgm distances for whole rim
+    nifti_image* voronoi = copy_nifti_as_float32(flood_dist);
+    nifti_image* smooth = copy_nifti_as_float32(flood_dist);
+
+    // ------------------------------------------------------------------------
+    // NOTE(Faruk): This section is written to constrain the big iterative
+    // flooding distance loop to the subset of voxels. Required for substantial
+    // speed boost.
+    // ------------------------------------------------------------------------
+    // Find the subset voxels that will be used many times
+    uint32_t nr_voi = 0;  // Voxels of interest
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(control_points_data + i) > 0){
+            nr_voi += 1;
+        }
+    }
+    cout << "  Nr. midgm voxels = " << nr_voi << endl;
+
+    // Allocate memory to only the voxel of interest
+    int32_t* voi_id;
+    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
+    // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t ii = 0;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(control_points_data + i) > 0){
+            *(voi_id + ii) = i;
+            ii += 1;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // NOTE(Faruk): This part is for speeding up the final Voronoi propagation
+    // ------------------------------------------------------------------------
+    // Reduce number of looped-through voxels for the second stage (Voronoi)
+    uint32_t nr_voi2 = 0;  // Voxels of interest
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_rim_data + i) == 3){
+            nr_voi2 += 1;
+        }
+    }
+    cout << "  Nr. rim (3) voxels = " << nr_voi2 << endl;
+
+    // Allocate memory to only the voxel of interest
+    int32_t* voi_id2;
+    voi_id2 = (int32_t*) malloc(nr_voi2*sizeof(int32_t));
+    // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t iii = 0;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_rim_data + i) == 3){
+            *(voi_id2 + iii) = i;
+            iii += 1;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // Neighbour graphs used by all flood stages
+    // ------------------------------------------------------------------------
+    // NOTE: Every patch floods over the same domains (midgm voxels and rim
+    // gray matter voxels), so the graphs are built only once.
+    cout << "  Building neighbour graphs..." << endl;
+    std::vector<bool> is_midgm(nr_voxels, false), is_gm(nr_voxels, false);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        is_midgm[i] = *(control_points_data + i) > 0;
+        is_gm[i] = *(nii_rim_data + i) == 3;
+    }
+    ln_voxel_graph graph_midgm;
+    ln_voxel_graph_build(graph_midgm, voi_id, nr_voi, is_midgm,
+                         std::vector<bool>(), size_x, size_y, size_z, dX, dY, dZ);
+
+    // Gray matter voxels touching other (non-zero) rim labels only propagate
+    // to their face neighbours, so that coordinates do not jump across thin
+    // sulci or gyri.
+    std::vector<bool> face_only(nr_voxels, false);
+    for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+        uint32_t i = *(voi_id2 + iii);
+        uint32_t ix, iy, iz;
+        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+        const int32_t n[6] = {
+            ix > 0 ? *(nii_rim_data + i - 1) : 0,
+            ix < size_x - 1 ? *(nii_rim_data + i + 1) : 0,
+            iy > 0 ? *(nii_rim_data + i - size_x) : 0,
+            iy < size_y - 1 ? *(nii_rim_data + i + size_x) : 0,
+            iz > 0 ? *(nii_rim_data + i - size_x * size_y) : 0,
+            iz < size_z - 1 ? *(nii_rim_data + i + size_x * size_y) : 0};
+        for (int k = 0; k != 6; ++k) {
+            if (n[k] != 0 && n[k] != 3) {
+                face_only[i] = true;
+            }
+        }
+    }
+    ln_voxel_graph graph_gm;
+    ln_voxel_graph_build(graph_gm, voi_id2, nr_voi2, is_gm, face_only,
+                         size_x, size_y, size_z, dX, dY, dZ);
+
+    // ========================================================================
+    // Single patch or batch of patches
+    // ========================================================================
+    int status = 0;
+    if (!mode_batch) {
+        status = multilaterate_patch(nii_rim, control_points, flood_step, flood_dist,
+                                     perimeter, point_dist, point_coords, pin_axes,
+                                     pin_coords, voronoi, smooth,
+                                     voi_id, nr_voi, voi_id2, nr_voi2,
+                                     graph_midgm, graph_gm, thr_radius, mode_mask, mode_norms, mode_angles,
+                                     mode_debug, fout);
+        if (status != 0) {
+            return status;
+        }
+    } else {
+        // Every label above 1 is the origin of a separate patch (CASE I)
+        std::vector<int32_t> midgm(control_points_data, control_points_data + nr_voxels);
+        std::vector<int32_t> patch_labels;
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (midgm[i] > 1) {
+                patch_labels.push_back(midgm[i]);
+            }
+        }
+        std::sort(patch_labels.begin(), patch_labels.end());
+        patch_labels.erase(std::unique(patch_labels.begin(), patch_labels.end()),
+                           patch_labels.end());
+        cout << "  Nr. patches = " << patch_labels.size() << endl;
+
+        // Output basename of each patch gets the patch label
+        const string fout_str(fout);
+        size_t pos_file = fout_str.find_last_of("/\\");
+        pos_file = (pos_file == string::npos) ? 0 : pos_file + 1;
+        const size_t pos_ext = fout_str.find_first_of('.', pos_file);
+
+        for (uint32_t n = 0; n != patch_labels.size(); ++n) {
+            const int32_t label = patch_labels[n];
+            cout << "\n  ====================" << endl;
+            cout << "  Patch " << n + 1 << "/" << patch_labels.size()
+                 << " (label " << label << ")" << endl;
+
+            for (uint32_t i = 0; i != nr_voxels; ++i) {
+                if (midgm[i] == label) {
+                    *(control_points_data + i) = 2;
+                } else if (midgm[i] > 0) {
+                    *(control_points_data + i) = 1;
+                } else {
+                    *(control_points_data + i) = 0;
+                }
+            }
+
+            const string tag = "_patch" + std::to_string(label);
+            string fout_patch;
+            if (pos_ext == string::npos) {
+                fout_patch = fout_str + tag;
+            } else {
+                fout_patch = fout_str.substr(0, pos_ext) + tag + fout_str.substr(pos_ext);
+            }
+
+            status = multilaterate_patch(nii_rim, control_points, flood_step, flood_dist,
+                                         perimeter, point_dist, point_coords, pin_axes,
+                                         pin_coords, voronoi, smooth,
+                                         voi_id, nr_voi, voi_id2, nr_voi2,
+                                         graph_midgm, graph_gm, thr_radius, mode_mask, mode_norms, mode_angles,
+                                         mode_debug, fout_patch);
+            if (status != 0) {
+                return status;
+            }
+        }
+    }
 
     cout << "\n  Finished." << endl;
     return 0;
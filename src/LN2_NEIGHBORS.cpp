@@ -4,7 +4,6 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
-#include <set>
 #include <vector>
 #include <string>
 
@@ -27,6 +26,10 @@ int show_help(void) {
     "                    Other volumes contain the labels of the neighbors for each voxel.\n"
     "                    Note that different labels can have different number of neighbors.\n"
     "                    Therefore, later volumes can contains more zeros.\n"
+    "    -export_counts: (Optional) Export a second text file with one row per\n"
+    "                    pair of neighboring labels. The last column is the\n"
+    "                    number of voxels of the first label that touch the\n"
+    "                    second label (shared boundary size).\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -38,7 +41,7 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
     int ac;
-    bool export_nifti = false;
+    bool export_nifti = false, export_counts = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -54,6 +57,8 @@ int main(int argc, char*  argv[]) {
             fout = argv[ac];
         } else if (!strcmp(argv[ac], "-export_nifti")) {
             export_nifti = true;
+        } else if (!strcmp(argv[ac], "-export_counts")) {
+            export_counts = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -86,10 +91,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -98,16 +99,6 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_input = copy_nifti_as_int32(nii1);
     int32_t* nii_input_data = static_cast<int32_t*>(nii_input->data);
 
-    // TODO[Faruk]: I cannot think of a way to avoid this right now but I think
-    // this nifti can be avoided to decrease RAM load, when needed. E.g. I
-    // might hold a small vector that holds the indices of the labels. But I
-    // need to query that vector by the label value. Grumble grumble...
-    nifti_image* idx_label = copy_nifti_as_int32(nii_input);
-    int32_t* idx_label_data = static_cast<int32_t*>(idx_label->data);
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(idx_label_data + i) = 0;
-    }
-
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is written to constrain the big iterative
     // flooding distance loop to the subset of voxels. Required for substantial
@@ -135,24 +126,22 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Find unique labels
     // ========================================================================
-    set<int> set_labels;
-
+    // NOTE: Labels are kept sorted, so that the index of a label (row of the
+    // adjacency) can be queried by its value with a binary search.
+    std::vector<int32_t> labels(nr_voi);
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t i = *(voi_id + ii);  // Map subset to full set
-        set_labels.insert(*(nii_input_data + i));
+        labels[ii] = *(nii_input_data + *(voi_id + ii));
     }
+    std::sort(labels.begin(), labels.end());
+    labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+    const uint32_t nr_labels = labels.size();
 
     cout << "  Unique labels: ";
-    for (int value : set_labels) {
-        cout << value << " ";
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        cout << labels[n] << " ";
     }
     cout << "\n" << endl;
-    cout << "  Number of unique labels: " << set_labels.size() << "\n" << endl;
-
-    // Prepare a vector of vectors to hold the neighbournood information
-    // NOTE[Faruk]: This is basically like an excel sheet, rows by columns.
-    // But the columns are 'jagged'
-    std::vector<std::vector<int>> vec_neighbors;
+    cout << "  Number of unique labels: " << nr_labels << "\n" << endl;
 
     // ========================================================================
     // Prepare text output
@@ -197,159 +186,90 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Find first order neighbors
     // ========================================================================
+    // NOTE: A single pass over all labeled voxels. Each voxel contributes one
+    // (label, neighbor label) pair per distinct neighboring label. Sorting the
+    // pairs groups them into rows of a compressed sparse row (CSR) adjacency,
+    // and the number of repeats of a pair is the number of voxels of the
+    // label that touch the neighbor label.
     cout << "  Start finding neighbors (3-jump neighborhood)..." << endl;
     uint32_t i, j, ix, iy, iz, max_nr_neighbors = 0;
 
-    // Loop through all unique labels
-    int c = 0;
-    for (int k : set_labels) {
-        set<uint32_t> set_neighbors;
-        // Loop though voxels
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            // Map subset to full set
-            i = *(voi_id + ii);
-            if (*(nii_input_data + i) == k) {
-                *(idx_label_data + i) = c;
-
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
+    // Pairs are packed into 64 bits with the sign bit flipped, so that sorting
+    // them orders labels as signed integers
+    auto pack = [](int32_t a, int32_t b) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(a) ^ 0x80000000u) << 32)
+            | (static_cast<uint32_t>(b) ^ 0x80000000u);
+    };
 
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
+    std::vector<uint64_t> pairs;
+    const int64_t size_xy = static_cast<int64_t>(size_x) * size_y;
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        i = *(voi_id + ii);  // Map subset to full set
+        const int32_t k = *(nii_input_data + i);
+        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+
+        int32_t found[26];
+        int nr_found = 0;
+        const int z0 = (iz == 0) ? 0 : -1, z1 = (iz == size_z - 1) ? 0 : 1;
+        const int y0 = (iy == 0) ? 0 : -1, y1 = (iy == size_y - 1) ? 0 : 1;
+        const int x0 = (ix == 0) ? 0 : -1, x1 = (ix == size_x - 1) ? 0 : 1;
+        for (int dz = z0; dz <= z1; ++dz) {
+            for (int dy = y0; dy <= y1; ++dy) {
+                for (int dx = x0; dx <= x1; ++dx) {
+                    j = i + dx + dy * static_cast<int64_t>(size_x) + dz * size_xy;
+                    const int32_t l = *(nii_input_data + j);
+                    if (l == 0 || l == k) continue;
+                    bool is_new = true;
+                    for (int m = 0; m != nr_found; ++m) {
+                        if (found[m] == l) {
+                            is_new = false;
+                            break;
+                        }
+                    }
+                    if (is_new) {
+                        found[nr_found++] = l;
+                        pairs.push_back(pack(k, l));
+                    }
                 }
             }
         }
-
-        // Remove unwanted elements
-        set_neighbors.erase(0);
-        set_neighbors.erase(k);
-
-        cout << "    Label " << k << " neighbors: ";
-        for (uint32_t value : set_neighbors) {
-            cout << value << " ";
+    }
+    std::sort(pairs.begin(), pairs.end());
+
+    // Build the adjacency, rows follow the sorted labels
+    std::vector<uint32_t> row_start(nr_labels + 1, 0);
+    std::vector<int32_t> neighbors;
+    std::vector<uint32_t> boundary_counts;
+    uint32_t row = 0;
+    for (size_t p = 0; p != pairs.size();) {
+        size_t q = p + 1;
+        while (q != pairs.size() && pairs[q] == pairs[p]) ++q;
+        const int32_t a = static_cast<int32_t>(static_cast<uint32_t>(pairs[p] >> 32) ^ 0x80000000u);
+        const int32_t b = static_cast<int32_t>(static_cast<uint32_t>(pairs[p]) ^ 0x80000000u);
+        while (labels[row] != a) {
+            row_start[++row] = neighbors.size();
         }
-        cout << endl;
+        neighbors.push_back(b);
+        boundary_counts.push_back(q - p);
+        p = q;
+    }
+    while (row != nr_labels) {
+        row_start[++row] = neighbors.size();
+    }
+    std::vector<uint64_t>().swap(pairs);
 
-        // Insert the set as a vector into the main vector
-        vector<int> vec_temp(set_neighbors.begin(), set_neighbors.end());
-        vec_neighbors.push_back(vec_temp);
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        const uint32_t nr_neighbors = row_start[n + 1] - row_start[n];
+        cout << "    Label " << labels[n] << " neighbors: ";
+        for (uint32_t e = row_start[n]; e != row_start[n + 1]; ++e) {
+            cout << neighbors[e] << " ";
+        }
+        cout << "\n";
 
         // Update maximum number of neighbors (useful for preparing 4D output)
-        if (max_nr_neighbors < set_neighbors.size()) {
-            max_nr_neighbors = set_neighbors.size();
+        if (max_nr_neighbors < nr_neighbors) {
+            max_nr_neighbors = nr_neighbors;
         }
-
-        c += 1;
     }
     cout << endl;
     cout << "  Maximum number of neighbors:" << max_nr_neighbors << endl;
@@ -366,18 +286,34 @@ int main(int argc, char*  argv[]) {
     output_file << "\n";
 
     // Insert values in each row
-    c = 0;
-    for (int value : set_labels) {
-        output_file << value << ",";
-        for (int m = 0; m != vec_neighbors[c].size(); ++m) {
-            output_file << vec_neighbors[c][m] << ",";
+    for (uint32_t n = 0; n != nr_labels; ++n) {
+        output_file << labels[n] << ",";
+        for (uint32_t e = row_start[n]; e != row_start[n + 1]; ++e) {
+            output_file << neighbors[e] << ",";
         }
         output_file << "\n";
-        c += 1;
     }
 
     output_file.close();
 
+    // One row per pair of neighboring labels with the shared boundary size
+    if (export_counts) {
+        csv_path_out = dir + sep + basename + "_neighbor_counts" + ".csv";
+        std::ofstream counts_file(csv_path_out);
+        if (!counts_file.is_open()) {
+            std::cout << "  Unable to open text file!\n";
+            return 1;
+        }
+        counts_file << "Label,Neighbor,Nr_boundary_voxels\n";
+        for (uint32_t n = 0; n != nr_labels; ++n) {
+            for (uint32_t e = row_start[n]; e != row_start[n + 1]; ++e) {
+                counts_file << labels[n] << "," << neighbors[e] << ","
+                            << boundary_counts[e] << "\n";
+            }
+        }
+        counts_file.close();
+    }
+
     // ========================================================================
     // Export a 4D nifti output
     // ========================================================================
@@ -403,9 +339,10 @@ int main(int argc, char*  argv[]) {
             *(nii_output_data + i) = *(nii_input_data + i);
 
             // Populate the neighbors
-            j = *(idx_label_data + i);
-            for (int m = 0; m != vec_neighbors[j].size(); ++m) {
-                *(nii_output_data + nr_voxels*(m+1) + i) = vec_neighbors[j][m];
+            j = std::lower_bound(labels.begin(), labels.end(),
+                                 *(nii_input_data + i)) - labels.begin();
+            for (uint32_t e = row_start[j]; e != row_start[j + 1]; ++e) {
+                *(nii_output_data + nr_voxels*(e - row_start[j] + 1) + i) = neighbors[e];
             }
         }
 
@@ -9,6 +9,8 @@ int show_help(void) {
     "\n"
     "Usage:\n"
     "    LN2_PATCH_FLATTEN -values curvature.nii -coord_uv uv_coord.nii -coord_d metric_equidist.nii -domain perimeter_chunk.nii -bins_u 50 -bins_v 50 -bins_d 21\n"
+    "    LN2_PATCH_FLATTEN -values curvature.nii -coord_uv uv_coord.nii -coord_d metric_equidist.nii -domain perimeter_chunk.nii -bins_u 50 -bins_v 50 -bins_d 21 -save_mapping flat.map\n"
+    "    LN2_PATCH_FLATTEN -values T1.nii -mapping flat.map\n"
     "\n"
     "Options:\n"
     "    -help      : Show this help.\n"
@@ -27,9 +29,25 @@ int show_help(void) {
     "                 Only use if '-coord_d' input is a metric file.\n"
     "    -voronoi   : (Optional) Fill empty bin in flat image using Voronoi propagation.\n"
     "                 Same as nearest neighbour filling in the empty bins.\n"
+    "                 Bins with non-zero values are the seeds, separately for\n"
+    "                 each timepoint.\n"
+    "    -voronoi_occupied : (Optional) Same as '-voronoi', but the seeds are all\n"
+    "                 bins with at least one voxel, so zero values are kept and\n"
+    "                 the filling is computed once for all timepoints. Together\n"
+    "                 with '-save_mapping' this filling is also stored.\n"
+    "    -splat     : (Optional) Distribute each voxel over the four nearest flat\n"
+    "                 bins in U and V using bilinear weights instead of assigning\n"
+    "                 it to a single bin. Gives smooth flat images at high bin\n"
+    "                 numbers, usually without the need for '-voronoi'.\n"
     "    -density   : (Optional) Additional output showing how many voxel fall into\n"
-    "                 the same flat bin.\n"
+    "                 the same flat bin (sum of weights when '-splat' is used).\n"
     "    -norm_mask : (Optional) Mask out flat domain voxels using L2 norm of coordinates.\n"
+    "    -save_mapping : (Optional) Write the voxel to bin assignments (and the\n"
+    "                 filling if '-voronoi_occupied' is used) into a binary\n"
+    "                 mapping file with this name.\n"
+    "    -mapping   : (Optional) Mapping file written by '-save_mapping'. Replaces\n"
+    "                 '-coord_uv', '-coord_d', '-domain', and the bin options, so\n"
+    "                 other images with the same geometry are flattened quickly.\n"
     "    -debug     : (Optional) Save extra intermediate outputs.\n"
     "    -output    : (Optional) Output basename for all outputs.\n"
     "\n"
@@ -42,14 +60,107 @@ int show_help(void) {
     return 0;
 }
 
+// Voronoi (nearest neighbor) filling of empty flat bins. Flooding starts from
+// the non-zero seed bins and propagates their indices, so that the source bin
+// of every flat bin is known and can be used for any number of images.
+void voronoi_fill_sources(const float* seed_data, const int64_t size_x,
+                          const int64_t size_y, const int64_t size_z,
+                          std::vector<int64_t>& flood_source) {
+    const int64_t nr_bins = size_x * size_y * size_z;
+
+    const float dX = 1;
+    const float dY = 1;
+    const float dZ = 1;
+
+    // Short diagonals
+    const float dia_xy = sqrt(dX * dX + dY * dY);
+    const float dia_xz = sqrt(dX * dX + dZ * dZ);
+    const float dia_yz = sqrt(dY * dY + dZ * dZ);
+    // Long diagonals
+    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
+
+    // Neighbor offsets in visiting order with their distances
+    const int nr_neighbors = 26;
+    const int off_x[nr_neighbors] = {
+        -1, 1, 0, 0, 0, 0,
+        -1, -1, 1, 1, 0, 0, 0, 0, -1, 1, -1, 1,
+        -1, -1, -1, 1, -1, 1, 1, 1};
+    const int off_y[nr_neighbors] = {
+        0, 0, -1, 1, 0, 0,
+        -1, 1, -1, 1, -1, -1, 1, 1, 0, 0, 0, 0,
+        -1, -1, 1, -1, 1, -1, 1, 1};
+    const int off_z[nr_neighbors] = {
+        0, 0, 0, 0, -1, 1,
+        0, 0, 0, 0, -1, 1, -1, 1, -1, -1, 1, 1,
+        -1, 1, -1, -1, 1, 1, -1, 1};
+    const float off_dist[nr_neighbors] = {
+        dX, dX, dY, dY, dZ, dZ,
+        dia_xy, dia_xy, dia_xy, dia_xy, dia_yz, dia_yz, dia_yz, dia_yz,
+        dia_xz, dia_xz, dia_xz, dia_xz,
+        dia_xyz, dia_xyz, dia_xyz, dia_xyz, dia_xyz, dia_xyz, dia_xyz, dia_xyz};
+
+    // NOTE: Bins grow in steps as in a rescan of all bins per step, but only
+    // the bins reached in the previous step are visited. They are visited in
+    // ascending order, so ties are resolved the same way as by the rescan.
+    flood_source.resize(nr_bins);
+    std::vector<int64_t> flood_step(nr_bins, 0);
+    std::vector<float> flood_dist(nr_bins, 0);
+    std::vector<int64_t> front, next;
+    for (int64_t i = 0; i != nr_bins; ++i) {
+        flood_source[i] = i;
+        if (*(seed_data + i) != 0) {
+            flood_step[i] = 1;
+            front.push_back(i);
+        }
+    }
+
+    int64_t grow_step = 1;
+    int64_t ix, iy, iz, j;
+    float d;
+    while (!front.empty()) {
+        next.clear();
+        for (int64_t i : front) {
+            if (flood_step[i] != grow_step) {
+                continue;  // Reached again, visited in the next step
+            }
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+
+            for (int n = 0; n != nr_neighbors; ++n) {
+                int64_t jx = ix + off_x[n];
+                int64_t jy = iy + off_y[n];
+                int64_t jz = iz + off_z[n];
+                if (jx < 0 || jx >= size_x || jy < 0 || jy >= size_y
+                    || jz < 0 || jz >= size_z) {
+                    continue;
+                }
+                j = sub2ind_3D(jx, jy, jz, size_x, size_y);
+                d = flood_dist[i] + off_dist[n];
+                if (d < flood_dist[j] || flood_dist[j] == 0) {
+                    flood_source[j] = flood_source[i];
+                    flood_dist[j] = d;
+                    flood_step[j] = grow_step + 1;
+                    next.push_back(j);
+                }
+            }
+        }
+        std::sort(next.begin(), next.end());
+        next.erase(std::unique(next.begin(), next.end()), next.end());
+        front.swap(next);
+        grow_step += 1;
+    }
+}
+
 int main(int argc, char*  argv[]) {
 
     nifti_image *nii1 = NULL, *nii2 = NULL, *nii3 = NULL, *nii4 = NULL;
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL, *fin4=NULL;
+    char *fin_map = NULL, *fout_map = NULL;
     int ac;
     int64_t bins_u = 10, bins_v = 10, bins_d = 1;
     bool mode_debug = false, mode_voronoi = false, mode_norm_mask = false;
-    bool mode_density = false;
+    bool mode_voronoi_occupied = false;
+    bool mode_density = false, mode_splat = false;
+
 
     // Process user options
     if (argc < 2) return show_help();
@@ -101,10 +212,27 @@ int main(int argc, char*  argv[]) {
             bins_d = atof(argv[ac]);
         } else if (!strcmp(argv[ac], "-voronoi")) {
             mode_voronoi = true;
+        } else if (!strcmp(argv[ac], "-voronoi_occupied")) {
+            mode_voronoi = true;
+            mode_voronoi_occupied = true;
+        } else if (!strcmp(argv[ac], "-splat")) {
+            mode_splat = true;
         } else if (!strcmp(argv[ac], "-density")) {
             mode_density = true;
         } else if (!strcmp(argv[ac], "-norm_mask")) {
             mode_norm_mask = true;
+        } else if (!strcmp(argv[ac], "-mapping")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -mapping\n");
+                return 1;
+            }
+            fin_map = argv[ac];
+        } else if (!strcmp(argv[ac], "-save_mapping")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -save_mapping\n");
+                return 1;
+            }
+            fout_map = argv[ac];
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -123,17 +251,19 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** missing option '-values'\n");
         return 1;
     }
-    if (!fin2) {
-        fprintf(stderr, "** missing option '-coords_uv'\n");
-        return 1;
-    }
-    if (!fin3) {
-        fprintf(stderr, "** missing option '-coords_d'\n");
-        return 1;
-    }
-    if (!fin4) {
-        fprintf(stderr, "** missing option '-domain'\n");
-        return 1;
+    if (!fin_map) {
+        if (!fin2) {
+            fprintf(stderr, "** missing option '-coords_uv'\n");
+            return 1;
+        }
+        if (!fin3) {
+            fprintf(stderr, "** missing option '-coords_d'\n");
+            return 1;
+        }
+        if (!fin4) {
+            fprintf(stderr, "** missing option '-domain'\n");
+            return 1;
+        }
     }
 
     // Read input dataset, including data
@@ -142,27 +272,31 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
-    nii3 = nifti_image_read(fin3, 1);
-    if (!nii3) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
-        return 2;
-    }
-    nii4 = nifti_image_read(fin4, 1);
-    if (!nii4) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin4);
-        return 2;
+    if (!fin_map) {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
+        nii3 = nifti_image_read(fin3, 1);
+        if (!nii3) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
+            return 2;
+        }
+        nii4 = nifti_image_read(fin4, 1);
+        if (!nii4) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin4);
+            return 2;
+        }
     }
 
     log_welcome("LN2_PATCH_FLATTEN");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
-    log_nifti_descriptives(nii3);
-    log_nifti_descriptives(nii4);
+    if (!fin_map) {
+        log_nifti_descriptives(nii2);
+        log_nifti_descriptives(nii3);
+        log_nifti_descriptives(nii4);
+    }
 
     // Get dimensions of input
     const int64_t size_x = nii1->nx;
@@ -176,68 +310,241 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     nifti_image* nii_input = copy_nifti_as_float32(nii1);
     float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* coords_uv = copy_nifti_as_float32(nii2);
-    float* coords_uv_data = static_cast<float*>(coords_uv->data);
-    nifti_image* coords_d = copy_nifti_as_float32(nii3);
-    float* coords_d_data = static_cast<float*>(coords_d->data);
-    nifti_image* domain = copy_nifti_as_int32(nii4);
-    int32_t* domain_data = static_cast<int32_t*>(domain->data);
 
     // ========================================================================
-    // Determine the type of depth file
+    // Voxel to bin mapping
     // ========================================================================
-    float min_d = std::numeric_limits<float>::max();
-    float max_d = std::numeric_limits<float>::min();
-
-    // Check D coordinate min & max
-    for (int64_t i = 0; i != nr_voxels; ++i) {
-        if (*(coords_d_data + i) != 0) {
-            if (*(coords_d_data + i) < min_d) {
-                min_d = *(coords_d_data + i);
+    // NOTE: The mapping only depends on the coordinates. It is either read
+    // from a mapping file or computed once here, and then applied to every
+    // timepoint of the values.
+    ln_flat_mapping mapping;
+    if (fin_map) {
+        if (!ln_flat_mapping_read(fin_map, mapping)) {
+            fprintf(stderr, "** failed to read mapping from '%s'\n", fin_map);
+            return 2;
+        }
+        if (mapping.size_x != size_x || mapping.size_y != size_y
+            || mapping.size_z != size_z) {
+            fprintf(stderr, "** '-values' and '-mapping' dimensions do not match\n");
+            return 2;
+        }
+        bins_u = mapping.bins_u;
+        bins_v = mapping.bins_v;
+        bins_d = mapping.bins_d;
+        mode_splat = false;
+        for (size_t n = 0; n != mapping.weight.size(); ++n) {
+            if (mapping.weight[n] != 1) {
+                mode_splat = true;
+                break;
             }
-            if (*(coords_d_data + i) > max_d) {
-                max_d = *(coords_d_data + i);
+        }
+        cout << "  Using flattening mapping: " << fin_map << endl;
+    } else {
+        nifti_image* coords_uv = copy_nifti_as_float32(nii2);
+        float* coords_uv_data = static_cast<float*>(coords_uv->data);
+        nifti_image* coords_d = copy_nifti_as_float32(nii3);
+        float* coords_d_data = static_cast<float*>(coords_d->data);
+        nifti_image* domain = copy_nifti_as_int32(nii4);
+        int32_t* domain_data = static_cast<int32_t*>(domain->data);
+
+        // --------------------------------------------------------------------
+        // Determine the type of depth file
+        // --------------------------------------------------------------------
+        float min_d = std::numeric_limits<float>::max();
+        float max_d = std::numeric_limits<float>::min();
+
+        // Check D coordinate min & max
+        for (int64_t i = 0; i != nr_voxels; ++i) {
+            if (*(coords_d_data + i) != 0) {
+                if (*(coords_d_data + i) < min_d) {
+                    min_d = *(coords_d_data + i);
+                }
+                if (*(coords_d_data + i) > max_d) {
+                    max_d = *(coords_d_data + i);
+                }
             }
         }
-    }
 
-    // Determine whether depth input is a metric file or a layer file
-    bool mode_depth_metric = false;
-    if (min_d >= 0 && max_d <= 1) {
-        cout << "  Depth input is a metric file (values are in between 0-1)." << endl;
-        mode_depth_metric = true;
-    } else if (min_d >= 0) {
-        cout << "  Depth input is a layer file (values are positive integers)." << endl;
-        mode_depth_metric = false;
-    } else {
-        cout << "  ERROR! Depth input contains negative values!" << endl;
-        return 1;
+        // Determine whether depth input is a metric file or a layer file
+        bool mode_depth_metric = false;
+        if (min_d >= 0 && max_d <= 1) {
+            cout << "  Depth input is a metric file (values are in between 0-1)." << endl;
+            mode_depth_metric = true;
+        } else if (min_d >= 0) {
+            cout << "  Depth input is a layer file (values are positive integers)." << endl;
+            mode_depth_metric = false;
+        } else {
+            cout << "  ERROR! Depth input contains negative values!" << endl;
+            return 1;
+        }
+
+        // Determine flat image dimensions
+        if (mode_depth_metric == false) {  // Layer file
+            bins_d = max_d;
+        }
+        const int64_t nr_cells = bins_u * bins_v;
+        const int64_t nr_bins = nr_cells * bins_d;
+
+        // --------------------------------------------------------------------
+        // Find coordinate ranges within the domain
+        // --------------------------------------------------------------------
+        float min_u = std::numeric_limits<float>::max();
+        float max_u = std::numeric_limits<float>::min();
+        float min_v = std::numeric_limits<float>::max();
+        float max_v = std::numeric_limits<float>::min();
+
+        for (int64_t i = 0; i != nr_voxels; ++i) {
+            if (*(domain_data + i) == 0) {
+                continue;
+            }
+            // Check U coordinate min & max
+            if (*(coords_uv_data + nr_voxels*0 + i) < min_u) {
+                min_u = *(coords_uv_data + nr_voxels*0 + i);
+            }
+            if (*(coords_uv_data + nr_voxels*0 + i) > max_u) {
+                max_u = *(coords_uv_data + nr_voxels*0 + i);
+            }
+            // Check V coordinate min & max
+            if (*(coords_uv_data + nr_voxels*1 + i) < min_v) {
+                min_v = *(coords_uv_data + nr_voxels*1 + i);
+            }
+            if (*(coords_uv_data + nr_voxels*1 + i) > max_v) {
+                max_v = *(coords_uv_data + nr_voxels*1 + i);
+            }
+        }
+        cout << "  U coordinate min & max: " << min_u << " | " << max_u << endl;
+        cout << "  V coordinate min & max: " << min_v << " | " << max_v << endl;
+
+        // --------------------------------------------------------------------
+        // Visit each domain voxel to compute its bin
+        // --------------------------------------------------------------------
+        std::vector<float> bin_count(nr_bins, 0);
+        mapping.bin_domain.assign(nr_bins, 0);
+        for (int64_t i = 0; i != nr_voxels; ++i) {
+            if (*(domain_data + i) == 0) {
+                continue;
+            }
+
+            float u = *(coords_uv_data + nr_voxels*0 + i);
+            float v = *(coords_uv_data + nr_voxels*1 + i);
+
+            // Normalize coordinates to 0-1 range
+            u = (u - min_u) / (max_u + std::numeric_limits<float>::min() - min_u);
+            v = (v - min_v) / (max_v + std::numeric_limits<float>::min() - min_v);
+            // Scale with grid size
+            u *= static_cast<float>(bins_u);
+            v *= static_cast<float>(bins_v);
+            // Handle depth separately
+            float d = static_cast<float>(*(coords_d_data + i));
+            int64_t cell_idx_d = 0;
+            if (mode_depth_metric) {  // Metric file
+                if (d >= 1) {  // Include 1 in the max index
+                    cell_idx_d = bins_d - 1;
+                } else {  // Scale up and floor
+                    d *= bins_d;
+                    cell_idx_d = static_cast<int64_t>(d);
+                }
+            } else {  // Layer file
+                cell_idx_d = static_cast<int64_t>(d - 1);
+            }
+
+            if (cell_idx_d < 0 || cell_idx_d >= bins_d) {  // e.g. zero layer
+                continue;
+            }
+
+            if (mode_splat) {
+                // Bilinear weights to the four bins with the nearest centers
+                float pos_u = u - 0.5;
+                float pos_v = v - 0.5;
+                int64_t u0 = static_cast<int64_t>(std::floor(pos_u));
+                int64_t v0 = static_cast<int64_t>(std::floor(pos_v));
+                float frac_u = pos_u - u0;
+                float frac_v = pos_v - v0;
+                for (int b = 0; b != 2; ++b) {
+                    int64_t cv = std::min(std::max(v0 + b, static_cast<int64_t>(0)), bins_v - 1);
+                    float w_v = (b == 0) ? 1 - frac_v : frac_v;
+                    for (int a = 0; a != 2; ++a) {
+                        int64_t cu = std::min(std::max(u0 + a, static_cast<int64_t>(0)), bins_u - 1);
+                        float w = ((a == 0) ? 1 - frac_u : frac_u) * w_v;
+                        if (w <= 0) {
+                            continue;
+                        }
+                        int64_t k = cell_idx_d * nr_cells + bins_u * cv + cu;
+                        mapping.voxel_id.push_back(i);
+                        mapping.bin_id.push_back(k);
+                        mapping.weight.push_back(w);
+                        bin_count[k] += w;
+                        mapping.bin_domain[k] += w * *(domain_data + i);
+                    }
+                }
+            } else {
+                // Cast to integer (floor & cast)
+                int64_t cell_idx_u = static_cast<int64_t>(u);
+                int64_t cell_idx_v = static_cast<int64_t>(v);
+
+                // Flat image cell index
+                int64_t j = bins_u * cell_idx_v + cell_idx_u;
+                int64_t k = cell_idx_d * nr_cells + j;
+                if (k < 0 || k >= nr_bins) {
+                    continue;
+                }
+                mapping.voxel_id.push_back(i);
+                mapping.bin_id.push_back(k);
+                mapping.weight.push_back(1);
+                bin_count[k] += 1;
+                mapping.bin_domain[k] += *(domain_data + i);
+            }
+        }
+
+        // Take the (weighted) mean of domain values per bin
+        for (int64_t i = 0; i != nr_bins; ++i) {
+            if (bin_count[i] > 0) {
+                mapping.bin_domain[i] /= bin_count[i];
+                // Ceil domain average to ensure the edges are prioritized.
+                // Tolerance avoids rounding of weight sums pushing 1 up to 2.
+                if (mode_splat) {
+                    mapping.bin_domain[i] = std::ceil(mapping.bin_domain[i] - 1e-4);
+                } else {
+                    mapping.bin_domain[i] = std::ceil(mapping.bin_domain[i]);
+                }
+            }
+        }
+
+        mapping.size_x = size_x;
+        mapping.size_y = size_y;
+        mapping.size_z = size_z;
+        mapping.bins_u = bins_u;
+        mapping.bins_v = bins_v;
+        mapping.bins_d = bins_d;
     }
 
     // ========================================================================
     // Prepare outputs
     // ========================================================================
-    nifti_image* out_cells = copy_nifti_as_int32(domain);
+    const int64_t nr_cells = bins_u * bins_v;
+    const int64_t nr_bins = nr_cells * bins_d;
+    const int64_t nr_mapped = mapping.voxel_id.size();
+
+    // Folded image with the flat cell index of each voxel
+    nifti_image* out_cells = nifti_copy_nim_info(nii1);
+    out_cells->datatype = NIFTI_TYPE_INT32;
+    out_cells->dim[0] = 3;
+    out_cells->dim[4] = 1;
+    nifti_update_dims_from_array(out_cells);
+    out_cells->nvox = nr_voxels;
+    out_cells->nbyper = sizeof(int32_t);
+    out_cells->data = calloc(out_cells->nvox, out_cells->nbyper);
+    out_cells->scl_slope = 1;
     int32_t* out_cells_data = static_cast<int32_t*>(out_cells->data);
 
-    for (int64_t i = 0; i != nr_voxels; ++i) {
-        *(out_cells_data + i) = 0;
-    }
-
-    // ------------------------------------------------------------------------
-    // Determine flat image dimensions
-    // ------------------------------------------------------------------------
-    int64_t nr_cells = bins_u * bins_v;
-    if (mode_depth_metric == false) {  // Layer file
-        bins_d = max_d;
-    }
-    int64_t nr_bins = nr_cells * bins_d;
-
     // Add bin dimensions into the output tag
     std::ostringstream tag_u, tag_v, tag_d;
     tag_u << bins_u;
     tag_v << bins_v;
     tag_d << bins_d;
+    if (mode_splat) {
+        tag_d << "_splat";
+    }
 
     // Allocating new 4D nifti for flat images
     nifti_image* flat_4D = nifti_copy_nim_info(nii1);
@@ -320,131 +627,73 @@ int main(int argc, char*  argv[]) {
     }
 
     // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // Find the subset voxels that will be used many times
-    int64_t nr_voi = 0;  // Voxels of interest
-    for (int64_t i = 0; i != nr_voxels; ++i) {
-        if (*(domain_data + i) != 0){
-            nr_voi += 1;
+    // Apply mapping to geometry
+    // ------------------------------------------------------------------------
+    // NOTE: Each entry carries a weight, which is 1 unless splatting was
+    // used. Values, coordinates and density are accumulated with it and
+    // normalized by the density (sum of weights) at the end.
+    std::vector<float> cell_weight(nr_voxels, 0);
+    for (int64_t n = 0; n != nr_mapped; ++n) {
+        int64_t i = mapping.voxel_id[n];
+        int64_t k = mapping.bin_id[n];
+        float w = mapping.weight[n];
+
+        // Write cell index (with the largest weight) to output
+        if (w > cell_weight[i]) {
+            *(out_cells_data + i) = k % nr_cells + 1;
+            cell_weight[i] = w;
         }
-    }
-    // Allocate memory to only the voxel of interest
-    int64_t* voi_id;
-    voi_id = (int64_t*) malloc(nr_voi*sizeof(int64_t));
 
-    // Fill in indices to be able to remap from subset to full set of voxels
-    int64_t ii = 0;
-    for (int64_t i = 0; i != nr_voxels; ++i) {
-        if (*(domain_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
-    }
+        // Project folded data coordinates
+        int64_t ix, iy, iz;
+        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+        *(flat_coords_data + k + nr_bins*0) += w * static_cast<float>(ix);
+        *(flat_coords_data + k + nr_bins*1) += w * static_cast<float>(iy);
+        *(flat_coords_data + k + nr_bins*2) += w * static_cast<float>(iz);
 
-    // ========================================================================
-    // Find coordinate ranges
-    // ========================================================================
-    float min_u = std::numeric_limits<float>::max();
-    float max_u = std::numeric_limits<float>::min();
-    float min_v = std::numeric_limits<float>::max();
-    float max_v = std::numeric_limits<float>::min();
+        *(flat_density_data + k) += w;
+    }
 
-    for (int64_t ii = 0; ii != nr_voi; ++ii) {
-        int64_t i = *(voi_id + ii);
-        // Check U coordinate min & max
-        if (*(coords_uv_data + nr_voxels*0 + i) < min_u) {
-            min_u = *(coords_uv_data + nr_voxels*0 + i);
-        }
-        if (*(coords_uv_data + nr_voxels*0 + i) > max_u) {
-            max_u = *(coords_uv_data + nr_voxels*0 + i);
-        }
-        // Check V coordinate min & max
-        if (*(coords_uv_data + nr_voxels*1 + i) < min_v) {
-            min_v = *(coords_uv_data + nr_voxels*1 + i);
-        }
-        if (*(coords_uv_data + nr_voxels*1 + i) > max_v) {
-            max_v = *(coords_uv_data + nr_voxels*1 + i);
+    // Take the mean of each projected cell coordinate
+    for (int64_t i = 0; i != nr_bins; ++i) {
+        if (*(flat_density_data + i) > 0) {
+            *(flat_coords_data + i + nr_bins*0) /= *(flat_density_data + i);
+            *(flat_coords_data + i + nr_bins*1) /= *(flat_density_data + i);
+            *(flat_coords_data + i + nr_bins*2) /= *(flat_density_data + i);
         }
+        *(flat_domain_data + i) = mapping.bin_domain[i];
     }
-    cout << "  U coordinate min & max: " << min_u << " | " << max_u << endl;
-    cout << "  V coordinate min & max: " << min_v << " | " << max_v << endl;
 
-    // ========================================================================
-    // Visit each voxel to check their coordinate
-    // ========================================================================
+    // ------------------------------------------------------------------------
+    // Apply mapping to each timepoint
+    // ------------------------------------------------------------------------
     for (int64_t t = 0; t != size_time; ++t) {
-        for (int64_t ii = 0; ii != nr_voi; ++ii) {
-            int64_t i = *(voi_id + ii);
-
-            float u = *(coords_uv_data + nr_voxels*0 + i);
-            float v = *(coords_uv_data + nr_voxels*1 + i);
-
-            // Normalize coordinates to 0-1 range
-            u = (u - min_u) / (max_u + std::numeric_limits<float>::min() - min_u);
-            v = (v - min_v) / (max_v + std::numeric_limits<float>::min() - min_v);
-            // Scale with grid size
-            u *= static_cast<float>(bins_u);
-            v *= static_cast<float>(bins_v);
-            // Cast to integer (floor & cast)
-            int64_t cell_idx_u = static_cast<int64_t>(u);
-            int64_t cell_idx_v = static_cast<int64_t>(v);
-
-            // Handle depth separately
-            float d = static_cast<float>(*(coords_d_data + i));
-            int64_t cell_idx_d = 0;
-            if (mode_depth_metric) {  // Metric file
-                if (d >= 1) {  // Include 1 in the max index
-                    cell_idx_d = bins_d;
-                } else {  // Scale up and floor
-                    d *= bins_d;
-                    cell_idx_d = static_cast<int64_t>(d);
-                }
-            } else {  // Layer file
-                cell_idx_d = static_cast<int64_t>(d - 1);
-            }
-
-            // Flat image cell index
-            int64_t j = bins_u * cell_idx_v + cell_idx_u;
-            int64_t k = cell_idx_d * nr_cells + j;
-
-            // Write cell index to output
-            *(out_cells_data + i) = j + 1;
-
-            // Write visited voxel value to flat cell
-            *(flat_values_data + k + t*nr_bins) += *(nii_input_data + i + t*nr_voxels);
-
-            // Project folded data coordinates
-            int64_t ix, iy, iz;
-            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-            *(flat_coords_data + k + nr_bins*0) += static_cast<float>(ix);
-            *(flat_coords_data + k + nr_bins*1) += static_cast<float>(iy);
-            *(flat_coords_data + k + nr_bins*2) += static_cast<float>(iz);
-
-            if (t==0) {  // Write 3D values once
-                *(flat_density_data + k) += 1;
-                *(flat_domain_data + k) += *(domain_data + i);
+        float* values_t = nii_input_data + t*nr_voxels;
+        float* flat_t = flat_values_data + t*nr_bins;
+        for (int64_t n = 0; n != nr_mapped; ++n) {
+            *(flat_t + mapping.bin_id[n]) += mapping.weight[n] * *(values_t + mapping.voxel_id[n]);
+        }
+        // Take the mean of each projected cell value
+        for (int64_t i = 0; i != nr_bins; ++i) {
+            if (*(flat_density_data + i) > 0) {
+                *(flat_t + i) /= *(flat_density_data + i);
             }
         }
     }
 
-    // Take the mean of each projected cell value
-    for (int64_t t = 0; t != size_time; ++t) {
-        for (int64_t i = 0; i != nr_bins; ++i) {
-            if (*(flat_density_data + i) > 1) {
-                *(flat_values_data + i + t*nr_bins) /= *(flat_density_data + i);
-
-                *(flat_coords_data + i + nr_bins*0) /= *(flat_density_data + i);
-                *(flat_coords_data + i + nr_bins*1) /= *(flat_density_data + i);
-                *(flat_coords_data + i + nr_bins*2) /= *(flat_density_data + i);
-
-                if (t==0) {  // Do once for 3D values
-                    *(flat_domain_data + i) /= *(flat_density_data + i);
-                    // Ceil domain average to ensure the edges are prioritized
-                    *(flat_domain_data + i) = std::ceil(*(flat_domain_data + i));
-                }
-            }
+    // ------------------------------------------------------------------------
+    // Voronoi filling sources and optional mapping file
+    // ------------------------------------------------------------------------
+    // NOTE: The filling is only stored in the mapping when it was computed,
+    // so that unflattening can tell which Voronoi mode a mapping belongs to.
+    if (mode_voronoi_occupied && mapping.fill_source.empty()) {
+        voronoi_fill_sources(flat_density_data, bins_u, bins_v, bins_d,
+                             mapping.fill_source);
+    }
+    if (fout_map) {
+        if (!ln_flat_mapping_write(fout_map, mapping)) {
+            fprintf(stderr, "** failed to write mapping to '%s'\n", fout_map);
+            return 2;
         }
     }
 
@@ -454,463 +703,52 @@ int main(int argc, char*  argv[]) {
     if (mode_voronoi) {
         cout << "\n  Start Voronoi (nearest neighbor) filling-in..." << endl;
 
-        // Prepare additional flat niftis
-        nifti_image* flood_step = copy_nifti_as_float32(flat_4D);
-        float* flood_step_data = static_cast<float*>(flood_step->data);
-        nifti_image* flood_dist = copy_nifti_as_float32(flat_4D);
-        float* flood_dist_data = static_cast<float*>(flood_dist->data);
-
         // --------------------------------------------------------------------
-        const int64_t size_x = bins_u;
-        const int64_t size_y = bins_v;
-        const int64_t size_z = bins_d;
-        const int64_t end_x = size_x - 1;
-        const int64_t end_y = size_y - 1;
-        const int64_t end_z = size_z - 1;
-
-        const float dX = 1;
-        const float dY = 1;
-        const float dZ = 1;
-
-        // Short diagonals
-        const float dia_xy = sqrt(dX * dX + dY * dY);
-        const float dia_xz = sqrt(dX * dX + dZ * dZ);
-        const float dia_yz = sqrt(dY * dY + dZ * dZ);
-        // Long diagonals
-        const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
-        for (int64_t t=0; t!=size_time; ++t) {
-            // Initialize grow volume
+        // Gather from source bins
+        // --------------------------------------------------------------------
+        // NOTE: Seeds are the bins with non-zero values of each timepoint,
+        // unless all occupied bins are used. Density, domain and coordinates
+        // follow the filling of the first timepoint.
+        std::vector<float> scratch(nr_bins);
+        auto gather = [&](float* data, const std::vector<int64_t>& source) {
+            std::copy(data, data + nr_bins, scratch.begin());
             for (int64_t i = 0; i != nr_bins; ++i) {
-                if (*(flat_values_data + i + t*nr_bins) != 0) {
-                    *(flood_step_data + i) = 1.;
-                    *(flood_dist_data + i) = 0.;
-                } else {
-                    *(flood_step_data + i) = 0.;
-                    *(flood_dist_data + i) = 0.;
-                }
-            }
-            int64_t grow_step = 1, bin_counter = 1;
-            int64_t ix, iy, iz, j;
-            float d;
-            if (size_time > 1) {
-                cout << "  Doing 4th dimension: " << t+1 << endl;
+                *(data + i) = scratch[source[i]];
             }
-            bin_counter = nr_bins;
-
-            while (bin_counter != 0) {
-                bin_counter = 0;
+        };
+        // The filling only depends on which bins are seeds, so it is reused
+        // while the seed pattern stays the same (e.g. masked time series).
+        std::vector<int64_t> flood_source;
+        std::vector<bool> seeds(nr_bins), prev_seeds;
+        int nr_floods = 0;
+        for (int64_t t = 0; t != size_time; ++t) {
+            if (mode_voronoi_occupied) {
+                flood_source = mapping.fill_source;
+            } else {
                 for (int64_t i = 0; i != nr_bins; ++i) {
-                    if (*(flood_step_data + i) == grow_step) {
-                        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                        bin_counter += 1;
-
-                        // --------------------------------------------------------
-                        // 1-jump neighbours
-                        // --------------------------------------------------------
-                        if (ix > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x) {
-                            j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y) {
-                            j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iz > 0) {
-                            j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iz < end_z) {
-                            j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-
-                        // --------------------------------------------------------
-                        // 2-jump neighbours
-                        // --------------------------------------------------------
-
-                        if (ix > 0 && iy > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y) {
-                            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y) {
-                            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-
-                        // --------------------------------------------------------
-                        // 3-jump neighbours
-                        // --------------------------------------------------------
-                        if (ix > 0 && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                    }
+                    seeds[i] = *(flat_values_data + t*nr_bins + i) != 0;
+                }
+                if (t == 0 || seeds != prev_seeds) {
+                    voronoi_fill_sources(flat_values_data + t*nr_bins, bins_u, bins_v, bins_d,
+                                         flood_source);
+                    prev_seeds = seeds;
+                    nr_floods += 1;
                 }
-            grow_step += 1;
+                if (size_time > 1) {
+                    cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
+                }
+            }
+            if (t == 0) {
+                gather(flat_density_data, flood_source);
+                gather(flat_domain_data, flood_source);
+                gather(flat_coords_data + nr_bins*0, flood_source);
+                gather(flat_coords_data + nr_bins*1, flood_source);
+                gather(flat_coords_data + nr_bins*2, flood_source);
             }
+            gather(flat_values_data + t*nr_bins, flood_source);
+        }
+        if (size_time > 1 && !mode_voronoi_occupied) {
+            cout << "\n    Filled " << nr_floods << " distinct seed patterns." << endl;
         }
 
         // NOTE(Option 2) Mask values based on radius
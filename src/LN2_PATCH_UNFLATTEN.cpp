@@ -7,7 +7,8 @@ int show_help(void) {
     "                     flattened image values to the folded image."
     "\n"
     "Usage:\n"
-    "    LN2_PATCH_UNFLATTEN -values labels.nii -coord_xyz foldedcoords.nii\n"
+    "    LN2_PATCH_UNFLATTEN -values labels.nii -coord_xyz foldedcoords.nii -ref values.nii\n"
+    "    LN2_PATCH_UNFLATTEN -values labels.nii -mapping flat.map -ref values.nii\n"
     "\n"
     "Options:\n"
     "    -help      : Show this help.\n"
@@ -19,6 +20,13 @@ int show_help(void) {
     "    -ref       : A nifti image that will be used to extract the folded space\n"
     "                 data dimension information. For instance, '-values' input\n"
     "                 to LN2_PATCH_FLATTEN.\n"
+    "    -mapping   : (Optional) Mapping file written by LN2_PATCH_FLATTEN\n"
+    "                 '-save_mapping'. Replaces '-coord_xyz'.\n"
+    "    -voronoi_occupied : (Optional) Use together with '-mapping' when the\n"
+    "                 values were flattened with '-voronoi_occupied'. The mapping\n"
+    "                 must have been saved with that option as well. Values\n"
+    "                 flattened with '-voronoi' are unflattened with '-coord_xyz'\n"
+    "                 and the 'foldedcoords_voronoi' output instead.\n"
     "    -output    : (Optional) Output basename for all outputs.\n"
     "\n"
     "Note:\n"
@@ -31,8 +39,9 @@ int show_help(void) {
 int main(int argc, char*  argv[]) {
 
     nifti_image *nii1 = NULL, *nii2 = NULL, *nii3 = NULL;
-    char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL;
+    char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL, *fin_map=NULL;
     int ac;
+    bool mode_voronoi_occupied = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -58,6 +67,14 @@ int main(int argc, char*  argv[]) {
                 return 1;
             }
             fin3 = argv[ac];
+        } else if (!strcmp(argv[ac], "-mapping")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -mapping\n");
+                return 1;
+            }
+            fin_map = argv[ac];
+        } else if (!strcmp(argv[ac], "-voronoi_occupied")) {
+            mode_voronoi_occupied = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -74,7 +91,7 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** missing option '-values'\n");
         return 1;
     }
-    if (!fin2) {
+    if (!fin_map && !fin2) {
         fprintf(stderr, "** missing option '-coords_uv'\n");
         return 1;
     }
@@ -89,10 +106,12 @@ int main(int argc, char*  argv[]) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
+    if (!fin_map) {
+        nii2 = nifti_image_read(fin2, 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+            return 2;
+        }
     }
     nii3 = nifti_image_read(fin3, 1);
     if (!nii3) {
@@ -102,7 +121,9 @@ int main(int argc, char*  argv[]) {
 
     log_welcome("LN2_PATCH_UNFLATTEN");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
+    if (!fin_map) {
+        log_nifti_descriptives(nii2);
+    }
     log_nifti_descriptives(nii3);
 
     // Get dimensions of source input
@@ -122,8 +143,84 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     nifti_image* flat = copy_nifti_as_float32(nii1);
     float* flat_data = static_cast<float*>(flat->data);
-    nifti_image* coords_xyz = copy_nifti_as_float32(nii2);
-    float* coords_xyz_data = static_cast<float*>(coords_xyz->data);
+
+    // ========================================================================
+    // Folded voxel of each flat bin
+    // ========================================================================
+    std::vector<int64_t> bin_target(nr_voxels_flat, -1);
+    if (fin_map) {
+        ln_flat_mapping mapping;
+        if (!ln_flat_mapping_read(fin_map, mapping)) {
+            fprintf(stderr, "** failed to read mapping from '%s'\n", fin_map);
+            return 2;
+        }
+        if (mapping.bins_u != size_x_flat || mapping.bins_v != size_y_flat
+            || mapping.bins_d != size_z_flat) {
+            fprintf(stderr, "** '-values' and '-mapping' dimensions do not match\n");
+            return 2;
+        }
+        if (mapping.size_x != size_x_folded || mapping.size_y != size_y_folded
+            || mapping.size_z != size_z_folded) {
+            fprintf(stderr, "** '-ref' and '-mapping' dimensions do not match\n");
+            return 2;
+        }
+        if (mode_voronoi_occupied && mapping.fill_source.empty()) {
+            fprintf(stderr, "** '-mapping' was not saved with '-voronoi_occupied'\n");
+            return 2;
+        }
+
+        // Mean folded coordinates of each bin, same as 'foldedcoords' output
+        std::vector<float> sum_x(nr_voxels_flat, 0), sum_y(nr_voxels_flat, 0);
+        std::vector<float> sum_z(nr_voxels_flat, 0), count(nr_voxels_flat, 0);  // Sum of weights
+        for (size_t n = 0; n != mapping.voxel_id.size(); ++n) {
+            int64_t ix, iy, iz;
+            tie(ix, iy, iz) = ind2sub_3D(mapping.voxel_id[n], size_x_folded, size_y_folded);
+            int64_t k = mapping.bin_id[n];
+            float w = mapping.weight[n];
+            sum_x[k] += w * static_cast<float>(ix);
+            sum_y[k] += w * static_cast<float>(iy);
+            sum_z[k] += w * static_cast<float>(iz);
+            count[k] += w;
+        }
+
+        for (int i = 0; i != nr_voxels_flat; ++i) {
+            int64_t k = i;
+            if (mode_voronoi_occupied) {
+                if (mapping.bin_domain[mapping.fill_source[i]] != 1) {
+                    continue;  // Masked out of the flattened disk
+                }
+                k = mapping.fill_source[i];
+            }
+            if (count[k] == 0) {
+                continue;
+            }
+            float x = sum_x[k], y = sum_y[k], z = sum_z[k];
+            if (count[k] > 0) {
+                x /= count[k];
+                y /= count[k];
+                z /= count[k];
+            }
+            bin_target[i] = size_x_folded * size_y_folded * static_cast<int>(z)
+                            + size_x_folded * static_cast<int>(y) + static_cast<int>(x);
+        }
+    } else {
+        nifti_image* coords_xyz = copy_nifti_as_float32(nii2);
+        float* coords_xyz_data = static_cast<float*>(coords_xyz->data);
+
+        for (int i = 0; i != nr_voxels_flat; ++i) {
+            float x = *(coords_xyz_data + nr_voxels_flat*0 + i);
+            float y = *(coords_xyz_data + nr_voxels_flat*1 + i);
+            float z = *(coords_xyz_data + nr_voxels_flat*2 + i);
+
+            // Cast to integer (floor & cast)
+            int cell_idx_x = static_cast<int>(x);
+            int cell_idx_y = static_cast<int>(y);
+            int cell_idx_z = static_cast<int>(z);
+
+            // Folded image cell index
+            bin_target[i] = size_x_folded * size_y_folded * cell_idx_z + size_x_folded * cell_idx_y + cell_idx_x;
+        }
+    }
 
     // ========================================================================
     // Prepare outputs
@@ -144,19 +241,8 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     for (int i = 0; i != nr_voxels_flat; ++i) {
 
-        if (*(flat_data + i) != 0) {
-
-            float x = *(coords_xyz_data + nr_voxels_flat*0 + i);
-            float y = *(coords_xyz_data + nr_voxels_flat*1 + i);
-            float z = *(coords_xyz_data + nr_voxels_flat*2 + i);
-
-            // Cast to integer (floor & cast)
-            int cell_idx_x = static_cast<int>(x);
-            int cell_idx_y = static_cast<int>(y);
-            int cell_idx_z = static_cast<int>(z);
-
-            // Folded image cell index
-            int j = size_x_folded * size_y_folded * cell_idx_z + size_x_folded * cell_idx_y + cell_idx_x;
+        if (*(flat_data + i) != 0 && bin_target[i] >= 0) {
+            int64_t j = bin_target[i];
 
             // Write visited voxel value to folded cell
             *(folded_data + j) += *(flat_data + i);
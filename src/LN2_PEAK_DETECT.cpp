@@ -1,30 +1,64 @@
 #include "../dep/laynii_lib.h"
 #include <sstream>
+#include <fstream>
 
 int show_help(void) {
     printf(
-    "LN2_PEAK_DETECT: WIP... maximum filter to detect image peaks.\n"
+    "LN2_PEAK_DETECT: Detect image peaks with a maximum (or minimum) filter.\n"
     "\n"
     "Usage:\n"
     "    LN2_PEAK_DETECT -values activation.nii -max\n"
+    "    LN2_PEAK_DETECT -values activation.nii -max -radius 1.5 -prominence 0.2 -subvoxel\n"
     "\n"
     "Options:\n"
-    "    -help      : Show this help.\n"
-    "    -values    : Nifti image with values that will be filtered.\n"
-    "                 For example an activation map or anatomical T1w images.\n"
-    "    -max       : (Default) Detect peaks with maximum filter.\n"
-    "    -min       : Detect peaks with minimum filter.\n"
-    "    -output    : (Optional) Output basename for all outputs.\n"
+    "    -help       : Show this help.\n"
+    "    -values     : Nifti image with values that will be filtered.\n"
+    "                  For example an activation map or anatomical T1w images.\n"
+    "    -max        : (Default) Detect peaks with maximum filter.\n"
+    "    -min        : Detect peaks with minimum filter.\n"
+    "    -radius     : (Optional) Half width of the filter window in mm. It is\n"
+    "                  converted to voxels along each axis, so the window\n"
+    "                  follows anisotropic voxels. Default is one voxel along\n"
+    "                  each axis (3x3x3 window).\n"
+    "    -prominence : (Optional) Minimum difference between a peak and the\n"
+    "                  lowest (highest for -min) value within its window.\n"
+    "                  Default is '0'.\n"
+    "    -subvoxel   : (Optional) Refine peak coordinates in the peak list by\n"
+    "                  fitting a parabola along each axis.\n"
+    "    -output     : (Optional) Output basename for all outputs.\n"
+    "\n"
+    "Notes:\n"
+    "    - A voxel is a peak when it is non-zero and no voxel within its window\n"
+    "      is higher (lower for -min). Voxels of flat peaks are all kept.\n"
+    "    - Besides the 'peaks' mask, a '_peaks.csv' file lists voxel\n"
+    "      coordinates, volume index, value and prominence of every peak.\n"
     "\n");
     return 0;
 }
 
+// Peak found in one volume
+struct peak_entry {
+    float x, y, z;
+    uint32_t t;
+    float value;
+    float prominence;
+};
+
+// Vertex offset of a parabola through three samples around its center
+float parabola_offset(const float a, const float b, const float c) {
+    float den = a - 2 * b + c;
+    if (den == 0) return 0;
+    float offset = 0.5 * (a - c) / den;
+    return std::max(-0.5f, std::min(0.5f, offset));
+}
+
 int main(int argc, char* argv[]) {
 
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
     int ac;
-    bool mode_max = true, mode_min = false;
+    bool mode_max = true, mode_subvoxel = false;
+    float RADIUS = 0, PROMINENCE = 0;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -41,10 +75,22 @@ int main(int argc, char* argv[]) {
             fout = argv[ac];
         } else if (!strcmp(argv[ac], "-max")) {
             mode_max = true;
-            mode_min = false;
         } else if (!strcmp(argv[ac], "-min")) {
             mode_max = false;
-            mode_min = true;
+        } else if (!strcmp(argv[ac], "-radius")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -radius\n");
+                return 1;
+            }
+            RADIUS = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-prominence")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -prominence\n");
+                return 1;
+            }
+            PROMINENCE = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-subvoxel")) {
+            mode_subvoxel = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -76,6 +122,7 @@ int main(int argc, char* argv[]) {
     const uint32_t size_x = nii1->nx;
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
+    const uint32_t size_time = nii1->nt;
 
     const uint32_t end_x = size_x - 1;
     const uint32_t end_y = size_y - 1;
@@ -83,6 +130,16 @@ int main(int argc, char* argv[]) {
 
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
+    // Window half widths in voxels
+    int64_t range_x = 1, range_y = 1, range_z = 1;
+    if (RADIUS > 0) {
+        range_x = std::max(1, static_cast<int>(std::round(RADIUS / nii1->pixdim[1])));
+        range_y = std::max(1, static_cast<int>(std::round(RADIUS / nii1->pixdim[2])));
+        range_z = std::max(1, static_cast<int>(std::round(RADIUS / nii1->pixdim[3])));
+    }
+    cout << "  Window half widths (voxels): " << range_x << " " << range_y << " "
+         << range_z << endl;
+
     // ========================================================================
     // Fix input datatype issues
     nifti_image* nii_input = copy_nifti_as_float32(nii1);
@@ -94,253 +151,122 @@ int main(int argc, char* argv[]) {
     float* nii_output_data = static_cast<float*>(nii_output->data);
 
     // ========================================================================
-    // Visit each voxel to check their 27 neighbours
+    // Separable window filters
+    // ========================================================================
+    // NOTE: The box maximum (or minimum) is a running filter along x, then y,
+    // then z. Its cost does not depend on the window size. Peaks are voxels
+    // equal to their filtered value. The opposite extremum is only needed for
+    // the prominence threshold.
+    const ln_projection_type type = mode_max ? LN_PROJECTION_MAX : LN_PROJECTION_MIN;
+    const ln_projection_type type_opposite = mode_max ? LN_PROJECTION_MIN : LN_PROJECTION_MAX;
+    std::vector<float> filtered(nr_voxels), opposite(nr_voxels), temp(nr_voxels);
 
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        float ref = *(nii_input_data + i);
-        float n_max = *(nii_input_data + i);
-        float n_min = *(nii_input_data + i);
+    auto box_filter = [&](const float* data, std::vector<float>& out, ln_projection_type t) {
+        ln_running_projection_3D(data, out.data(), size_x, size_y, size_z,
+                                 1, 0, 0, range_x, t);
+        ln_running_projection_3D(out.data(), temp.data(), size_x, size_y, size_z,
+                                 0, 1, 0, range_y, t);
+        ln_running_projection_3D(temp.data(), out.data(), size_x, size_y, size_z,
+                                 0, 0, 1, range_z, t);
+    };
 
-        uint32_t ix, iy, iz, j;
-        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+    std::vector<peak_entry> peaks;
+    for (uint32_t t = 0; t != size_time; ++t) {
+        cout << "\r  Detecting peaks, volume: " << t+1 << "/" << size_time << flush;
+        const float* data = nii_input_data + nr_voxels*t;
+        float* mask = nii_output_data + nr_voxels*t;
 
-        // ------------------------------------------------------------
-        // 1-jump neighbours
-        // ------------------------------------------------------------
-        if (ix > 0) {
-            j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x) {
-            j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy > 0) {
-            j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy < end_y) {
-            j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iz > 0) {
-            j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iz < end_z) {
-            j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        // ------------------------------------------------------------
-        // 2-jump neighbours
-        // ------------------------------------------------------------
-        if (ix > 0 && iy > 0) {
-            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iy < end_y) {
-            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy > 0) {
-            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy < end_y) {
-            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iz > 0) {
-            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iz > 0) {
-            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
+        box_filter(data, filtered, type);
+        if (PROMINENCE > 0) {
+            box_filter(data, opposite, type_opposite);
         }
 
-        // ------------------------------------------------------------
-        // 3-jump neighbours
-        // ------------------------------------------------------------
-        if (ix > 0 && iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix > 0 && iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
-        if (ix < end_x && iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-            if (*(nii_input_data + j) > n_max) {
-                n_max = *(nii_input_data + j);
-            } else if (*(nii_input_data + j) < n_min) {
-                n_min = *(nii_input_data + j);
-            }
-        }
+        // --------------------------------------------------------------------
+        // Non-maximum suppression and prominence threshold
+        // --------------------------------------------------------------------
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            float ref = *(data + i);
+            *(mask + i) = 0;
+            if (ref == 0 || ref != filtered[i]) continue;
 
-        // Write results inside nifti
-        if (mode_max) {
-            if (n_max > ref || ref == 0) {
-                *(nii_output_data + i) = 0;
-            } else {
-                *(nii_output_data + i) = 1;
+            float prominence = 0;
+            if (PROMINENCE > 0) {
+                prominence = std::abs(ref - opposite[i]);
+                if (prominence < PROMINENCE) continue;
             }
-        } else if (mode_min) {
-            if (n_min < ref || ref == 0) {
-                *(nii_output_data + i) = 0;
-            } else {
-                *(nii_output_data + i) = 1;
+            *(mask + i) = 1;
+
+            uint32_t ix, iy, iz;
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+            peak_entry p = {static_cast<float>(ix), static_cast<float>(iy),
+                            static_cast<float>(iz), t, ref, prominence};
+
+            // Sub-voxel refinement (not across the image borders)
+            if (mode_subvoxel) {
+                if (ix > 0 && ix < end_x) {
+                    p.x += parabola_offset(*(data + i - 1), ref, *(data + i + 1));
+                }
+                if (iy > 0 && iy < end_y) {
+                    p.y += parabola_offset(*(data + i - size_x), ref, *(data + i + size_x));
+                }
+                if (iz > 0 && iz < end_z) {
+                    p.z += parabola_offset(*(data + i - size_x*size_y), ref,
+                                           *(data + i + size_x*size_y));
+                }
             }
+            peaks.push_back(p);
         }
     }
+    cout << endl;
+    cout << "  Number of peaks: " << peaks.size() << endl;
 
     save_output_nifti(fout, "peaks", nii_output, true);
 
+    // ========================================================================
+    // Write peak list
+    // ========================================================================
+    string path = fout;
+    std::string dir, file, basename, sep, csv_path_out;
+    auto pos1 = path.find_last_of('/');
+    if (pos1 != string::npos) {  // For Unix
+        sep = "/";
+        dir = path.substr(0, pos1);
+        file = path.substr(pos1 + 1);
+    } else {  // For Windows
+        pos1 = path.find_last_of('\\');
+        if (pos1 != string::npos) {
+            sep = "\\";
+            dir = path.substr(0, pos1);
+            file = path.substr(pos1 + 1);
+        } else {  // Only the filename
+            sep = "";
+            dir = "";
+            file = path;
+        }
+    }
+
+    // Parse filename
+    basename = file;
+    auto const pos2 = file.find_first_of('.');
+    if (pos2 != string::npos) {
+        basename = file.substr(0, pos2);
+    }
+    csv_path_out = dir + sep + basename + "_peaks" + ".csv";
+
+    std::ofstream output_file(csv_path_out);
+    if (!output_file.is_open()) {
+        std::cout << "  Unable to open text file!\n";
+        return 1;
+    }
+    output_file << "x,y,z,volume,value,prominence\n";
+    for (const peak_entry& p : peaks) {
+        output_file << p.x << "," << p.y << "," << p.z << "," << p.t << ","
+                    << p.value << "," << p.prominence << "\n";
+    }
+    output_file.close();
+    cout << "  Peak list is saved as:" << endl;
+    cout << "    " << csv_path_out << endl;
+
     cout << "\n  Finished." << endl;
     return 0;
 }
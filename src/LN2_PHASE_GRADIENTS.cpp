@@ -22,6 +22,9 @@ int show_help(void) {
     "                     is used to store the phase values.\n"
     "    -merge_outputs : (Optional) Save gradients as a 4D file. Only works\n"
     "                     with 3D images.\n"
+    "    -all           : (Optional) Also save the phase jump, phase Laplacian\n"
+    "                     and phase jolt maps. All maps are computed in the same\n"
+    "                     pass over the input.\n"
     "    -output        : (Optional) Output basename for all outputs.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
     "\n");
@@ -33,6 +36,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_int13 = false, mode_debug = false, mode_merge_outputs = false;
+    bool mode_all = false;
 
     nifti_image *nii_gra = NULL;
     float *nii_gra_data = NULL;
@@ -56,6 +60,8 @@ int main(int argc, char*  argv[]) {
             mode_int13 = true;
         } else if (!strcmp(argv[ac], "-merge_outputs")) {
             mode_merge_outputs = true;
+        } else if (!strcmp(argv[ac], "-all")) {
+            mode_all = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -91,10 +97,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -117,13 +119,7 @@ int main(int argc, char*  argv[]) {
         nii_gra->nvox = nr_voxels * 3;
         nii_gra->nbyper = sizeof(float);
         nii_gra->data = calloc(nii_gra->nvox, nii_gra->nbyper);
-        
         nii_gra_data = static_cast<float*>(nii_gra->data);
-
-        // Set to zero
-        for (uint32_t i = 0; i != nr_voxels*3; ++i) {
-            *(nii_gra_data + i) = 0;
-        }
     } else {
         cout << "  Input is a 4D image (e.g. timeseries)." << endl;
         nii_gra_x = copy_nifti_as_float32(nii_input);
@@ -132,13 +128,13 @@ int main(int argc, char*  argv[]) {
         nii_gra_y_data = static_cast<float*>(nii_gra_y->data);
         nii_gra_z = copy_nifti_as_float32(nii_input);
         nii_gra_z_data = static_cast<float*>(nii_gra_z->data);
+    }
 
-        // Set to zero
-        for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-            *(nii_gra_x_data + i) = 0;
-            *(nii_gra_y_data + i) = 0;
-            *(nii_gra_z_data + i) = 0;        
-        }
+    nifti_image *nii_jump = NULL, *nii_laplacian = NULL, *nii_jolt = NULL;
+    if (mode_all) {
+        nii_jump = copy_nifti_as_float32(nii_input);
+        nii_laplacian = copy_nifti_as_float32(nii_input);
+        nii_jolt = copy_nifti_as_float32(nii_input);
     }
 
     // ========================================================================
@@ -157,87 +153,29 @@ int main(int argc, char*  argv[]) {
     }
 
     // ========================================================================
-    // Find connected clusters
+    // Compute gradients
     // ========================================================================
     cout << "  Computing gradients..." << endl;
 
-    uint32_t ix, iy, iz, it, j, k;
-
-    const float ONEPI = 3.14159265358979f;
-    const float TWOPI = 2.0f * 3.14159265358979f;
-
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-
-            if (mode_merge_outputs) {
-                *(nii_gra_data + i+nr_voxels*0) = gra_x;
-                *(nii_gra_data + i+nr_voxels*1) = gra_y;
-                *(nii_gra_data + i+nr_voxels*2) = gra_z;                                
-            } else {
-                *(nii_gra_x_data + i+nr_voxels*t) = gra_x;
-                *(nii_gra_y_data + i+nr_voxels*t) = gra_y;
-                *(nii_gra_z_data + i+nr_voxels*t) = gra_z;                                
-            }
-
-        // Average differences across neighbourhood types
-        // *(nii_gramag_data + i+nr_voxels*t) = (gra_x + gra_y + gra_z) / count_1;
+        ln_phase_stencil_outputs out;
+        if (mode_merge_outputs) {
+            out.gra_x = nii_gra_data + nr_voxels*0;
+            out.gra_y = nii_gra_data + nr_voxels*1;
+            out.gra_z = nii_gra_data + nr_voxels*2;
+        } else {
+            out.gra_x = nii_gra_x_data + nr_voxels*t;
+            out.gra_y = nii_gra_y_data + nr_voxels*t;
+            out.gra_z = nii_gra_z_data + nr_voxels*t;
         }
+        if (mode_all) {
+            out.phase_jump = static_cast<float*>(nii_jump->data) + nr_voxels*t;
+            out.laplacian = static_cast<float*>(nii_laplacian->data) + nr_voxels*t;
+            out.jolt = static_cast<float*>(nii_jolt->data) + nr_voxels*t;
+        }
+        ln_phase_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z, out);
     }
     cout << endl;
 
@@ -251,6 +189,11 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "phase_gradient_y", nii_gra_y, true);
         save_output_nifti(fout, "phase_gradient_z", nii_gra_z, true);
     }
+    if (mode_all) {
+        save_output_nifti(fout, "phase_jump", nii_jump, true);
+        save_output_nifti(fout, "phase_laplacian", nii_laplacian, true);
+        save_output_nifti(fout, "phase_jolt", nii_jolt, true);
+    }
 
     cout << "\n  Finished." << endl;
     return 0;
@@ -24,6 +24,9 @@ int show_help(void) {
     "                      is used to store the phase values.\n"
     "    -phase_jump     : (Optional) Output L1 norm of the 1st spatial derivative.\n"
     "    -2D             : (Optional) Do not compute along z. Experimental.\n"
+    "    -all            : (Optional) Also save the phase gradients, phase jump and\n"
+    "                      phase Laplacian maps. All maps are computed in the same\n"
+    "                      pass over the input.\n"
     "    -output         : (Optional) Output basename for all outputs.\n"
     "    -debug          : (Optional) Save extra intermediate outputs.\n"
     "\n"
@@ -36,9 +39,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_int13 = false, mode_debug = false, mode_phase_jump = false;
-    bool mode_2D = false;
-    const float ONEPI = 3.14159265358979f;
-    const float TWOPI = 2.0f * 3.14159265358979f;
+    bool mode_2D = false, mode_all = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -58,6 +59,8 @@ int main(int argc, char*  argv[]) {
             mode_phase_jump = true;
         } else if (!strcmp(argv[ac], "-2D")) {
             mode_2D = true;
+        } else if (!strcmp(argv[ac], "-all")) {
+            mode_all = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -93,10 +96,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -105,39 +104,28 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_input = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii1);
     float* nii_input_data = static_cast<float*>(nii_input->data);
 
-    // Prepare output image
-    nifti_image* nii_gra_x = copy_nifti_as_float32(nii_input);
-    float* nii_gra_x_data = static_cast<float*>(nii_gra_x->data);
-
-    nifti_image* nii_gra_y = copy_nifti_as_float32(nii_input);
-    float* nii_gra_y_data = static_cast<float*>(nii_gra_y->data);
-
-    nifti_image* nii_gra_z = copy_nifti_as_float32(nii_input);
-    float* nii_gra_z_data = static_cast<float*>(nii_gra_z->data);
-
-
-    nifti_image* nii_gra2_x = copy_nifti_as_float32(nii_input);
-    float* nii_gra2_x_data = static_cast<float*>(nii_gra2_x->data);
+    // Prepare output images
+    nifti_image* nii_jolt = copy_nifti_as_float32(nii_input);
+    float* nii_jolt_data = static_cast<float*>(nii_jolt->data);
 
-    nifti_image* nii_gra2_y = copy_nifti_as_float32(nii_input);
-    float* nii_gra2_y_data = static_cast<float*>(nii_gra2_y->data);
-
-    nifti_image* nii_gra2_z = copy_nifti_as_float32(nii_input);
-    float* nii_gra2_z_data = static_cast<float*>(nii_gra2_z->data);
-
-
-    nifti_image* nii_divergence = copy_nifti_as_float32(nii_input);
-    float* nii_divergence_data = static_cast<float*>(nii_divergence->data);
-
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_gra_x_data + i) = 0.;
-        *(nii_gra_y_data + i) = 0.;
-        *(nii_gra_z_data + i) = 0.;
-        *(nii_gra2_x_data + i) = 0.;
-        *(nii_gra2_y_data + i) = 0.;
-        *(nii_gra2_z_data + i) = 0.;
-        *(nii_divergence_data + i) = 0.;
+    nifti_image *nii_gra_x = NULL, *nii_gra_y = NULL, *nii_gra_z = NULL;
+    nifti_image *nii_gra2_x = NULL, *nii_gra2_y = NULL, *nii_gra2_z = NULL;
+    if (mode_debug || mode_all) {
+        nii_gra_x = copy_nifti_as_float32(nii_input);
+        nii_gra_y = copy_nifti_as_float32(nii_input);
+        nii_gra_z = copy_nifti_as_float32(nii_input);
+    }
+    if (mode_debug) {
+        nii_gra2_x = copy_nifti_as_float32(nii_input);
+        nii_gra2_y = copy_nifti_as_float32(nii_input);
+        nii_gra2_z = copy_nifti_as_float32(nii_input);
+    }
+    nifti_image *nii_jump = NULL, *nii_laplacian = NULL;
+    if (mode_phase_jump || mode_all) {
+        nii_jump = copy_nifti_as_float32(nii_input);
+    }
+    if (mode_all) {
+        nii_laplacian = copy_nifti_as_float32(nii_input);
     }
 
     // ========================================================================
@@ -152,81 +140,33 @@ int main(int argc, char*  argv[]) {
     }
 
     // ========================================================================
-    // Find connected clusters
+    // Compute first and second derivatives
     // ========================================================================
-    cout << "  Computing gradients..." << endl;
-
-    uint32_t ix, iy, iz, it, j, k;
+    cout << "  Computing gradients and L1 norm on 2nd derivative matrices..." << endl;
 
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ------------------------------------------------------------
-            // 1-jump neighbours
-            // ------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z && mode_2D == false) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-            *(nii_gra_x_data + i+nr_voxels*t) = gra_x;
-            *(nii_gra_y_data + i+nr_voxels*t) = gra_y;
-            *(nii_gra_z_data + i+nr_voxels*t) = gra_z;
-
-            // Compute L1 norm of the first spatial derivative (phase jump)
-            if (mode_phase_jump && mode_2D == false) {
-                *(nii_divergence_data + i+nr_voxels*t) = (std::abs(gra_x) + std::abs(gra_y) + std::abs(gra_z)) / 3;
-            } else if (mode_phase_jump && mode_2D == true) {
-                *(nii_divergence_data + i+nr_voxels*t) = (std::abs(gra_x) + std::abs(gra_y)) / 2;
-            }
+        ln_phase_stencil_outputs out;
+        out.mode_2D = mode_2D;
+        out.jolt = nii_jolt_data + nr_voxels*t;
+        if (nii_gra_x != NULL) {
+            out.gra_x = static_cast<float*>(nii_gra_x->data) + nr_voxels*t;
+            out.gra_y = static_cast<float*>(nii_gra_y->data) + nr_voxels*t;
+            out.gra_z = static_cast<float*>(nii_gra_z->data) + nr_voxels*t;
+        }
+        if (nii_gra2_x != NULL) {
+            out.gra2_x = static_cast<float*>(nii_gra2_x->data) + nr_voxels*t;
+            out.gra2_y = static_cast<float*>(nii_gra2_y->data) + nr_voxels*t;
+            out.gra2_z = static_cast<float*>(nii_gra2_z->data) + nr_voxels*t;
+        }
+        if (nii_jump != NULL) {
+            out.phase_jump = static_cast<float*>(nii_jump->data) + nr_voxels*t;
         }
+        if (nii_laplacian != NULL) {
+            out.laplacian = static_cast<float*>(nii_laplacian->data) + nr_voxels*t;
+        }
+        ln_phase_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z, out);
     }
     cout << endl;
 
@@ -239,225 +179,9 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "gra_z_circular", nii_gra_z, true);
     }
 
-    if (mode_phase_jump) {
+    if (mode_phase_jump || mode_all) {
         cout << "  Saving phase jump..." << endl;
-        save_output_nifti(fout, "phase_jump", nii_divergence, true);
-    }
-
-    // ========================================================================
-    // Compute second derivative summary metrics
-    // ========================================================================
-    cout << "  Computing L1 norm on 2nd derivative matrices..." << endl;
-    
-    // ========================================================================
-    // Second derivatives of x
-    // ========================================================================
-    cout << "    Second derivatives on x..." << endl;
-
-    for (uint32_t t = 0; t != size_time; ++t) {
-        cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_x_data + j);
-                b = *(nii_gra_x_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_x_data + j);
-                b = *(nii_gra_x_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_gra_x_data + j);
-                b = *(nii_gra_x_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-
-            // *(nii_gra2_x_data + i+nr_voxels*t) = gra_x*gra_x + gra_y*gra_y + gra_z*gra_z;
-            *(nii_gra2_x_data + i+nr_voxels*t) = (std::abs(gra_x) + std::abs(gra_y) + std::abs(gra_z)) / 3;
-        }
-    }
-    cout << endl;
-
-    // ========================================================================
-    // Second derivatives of y
-    // ========================================================================
-    cout << "    Second derivatives on y..." << endl;
-    
-    for (uint32_t t = 0; t != size_time; ++t) {
-        cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_y_data + j);
-                b = *(nii_gra_y_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_y_data + j);
-                b = *(nii_gra_y_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_gra_y_data + j);
-                b = *(nii_gra_y_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-
-            // *(nii_gra2_y_data + i+nr_voxels*t) = gra_x*gra_x + gra_y*gra_y + gra_z*gra_z;
-            *(nii_gra2_y_data + i+nr_voxels*t) = (std::abs(gra_x) + std::abs(gra_y) + std::abs(gra_z)) / 3;
-        }
-    }
-    cout << endl;
-
-    // ========================================================================
-    // Second derivatives of z
-    // ========================================================================
-    if (mode_2D == false) {
-    cout << "    Second derivatives on z..." << endl;
-
-    for (uint32_t t = 0; t != size_time; ++t) {
-        cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_z_data + j);
-                b = *(nii_gra_z_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_z_data + j);
-                b = *(nii_gra_z_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_gra_z_data + j);
-                b = *(nii_gra_z_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-
-            *(nii_gra2_z_data + i+nr_voxels*t) = (std::abs(gra_x) + std::abs(gra_y) + std::abs(gra_z)) / 3;
-        }
-    }
-    cout << endl;
+        save_output_nifti(fout, "phase_jump", nii_jump, true);
     }
 
     if (mode_debug) {
@@ -467,24 +191,15 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "gra2_z", nii_gra2_z, true);
     }
 
-    // ========================================================================
-    // Compute jolt
-    // ========================================================================
     cout << "  Saving L1 norms of second derivatives..." << endl;
-    float xx, yy, zz;
-    for (uint32_t t = 0; t != size_time; ++t) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            xx = *(nii_gra2_x_data + i+nr_voxels*t);
-            yy = *(nii_gra2_y_data + i+nr_voxels*t);
-            zz = *(nii_gra2_z_data + i+nr_voxels*t);
-            if (mode_2D) {
-                *(nii_divergence_data + i+nr_voxels*t) = (xx + yy) / 2.;
-            } else {
-                *(nii_divergence_data + i+nr_voxels*t) = (xx + yy + zz) / 3.;                
-            }
-        }
+    save_output_nifti(fout, "phase_jolt", nii_jolt, true);
+
+    if (mode_all) {
+        save_output_nifti(fout, "phase_gradient_x", nii_gra_x, true);
+        save_output_nifti(fout, "phase_gradient_y", nii_gra_y, true);
+        save_output_nifti(fout, "phase_gradient_z", nii_gra_z, true);
+        save_output_nifti(fout, "phase_laplacian", nii_laplacian, true);
     }
-    save_output_nifti(fout, "phase_jolt", nii_divergence, true);
 
     cout << "\n  Finished." << endl;
     return 0;
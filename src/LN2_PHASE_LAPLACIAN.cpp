@@ -22,6 +22,9 @@ int show_help(void) {
     "              is int13, even though the data type is uint16 and only int12 portion\n"
     "              is used to store the phase values.\n"
     "    -2D     : (Optional) Do not compute along z. Experimental.\n"
+    "    -all    : (Optional) Also save the phase gradients, phase jump and\n"
+    "              phase jolt maps. All maps are computed in the same pass over\n"
+    "              the input.\n"
     "    -output : (Optional) Output basename for all outputs.\n"
     "    -debug  : (Optional) Save extra intermediate outputs.\n"
     "\n");
@@ -32,9 +35,7 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
     int ac;
-    bool mode_int13 = false, mode_debug = false, mode_2D = false;
-    const float ONEPI = 3.14159265358979f;
-    const float TWOPI = 2.0f * 3.14159265358979f;
+    bool mode_int13 = false, mode_debug = false, mode_2D = false, mode_all = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -52,6 +53,8 @@ int main(int argc, char*  argv[]) {
             mode_int13 = true;
         } else if (!strcmp(argv[ac], "-2D")) {
             mode_2D = true;
+        } else if (!strcmp(argv[ac], "-all")) {
+            mode_all = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -87,10 +90,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -102,17 +101,17 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii_laplacian = copy_nifti_as_float32(nii_input);
     float *nii_laplacian_data = static_cast<float*>(nii_laplacian->data);
 
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_laplacian_data + i) = 0;
+    nifti_image *nii_gra_x = NULL, *nii_gra_y = NULL, *nii_gra_z = NULL;
+    if (mode_debug || mode_all) {
+        nii_gra_x = copy_nifti_as_float32(nii_input);
+        nii_gra_y = copy_nifti_as_float32(nii_input);
+        nii_gra_z = copy_nifti_as_float32(nii_input);
+    }
+    nifti_image *nii_jump = NULL, *nii_jolt = NULL;
+    if (mode_all) {
+        nii_jump = copy_nifti_as_float32(nii_input);
+        nii_jolt = copy_nifti_as_float32(nii_input);
     }
-
-    nifti_image *nii_gra_x = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_x_data = static_cast<float*>(nii_gra_x->data);
-    nifti_image *nii_gra_y = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_y_data = static_cast<float*>(nii_gra_y->data);
-    nifti_image *nii_gra_z = copy_nifti_as_float32(nii_laplacian);
-    float *nii_gra_z_data = static_cast<float*>(nii_gra_z->data);
 
     // ========================================================================
     // Convert ranges to 0 to 2*pi if opted for
@@ -130,74 +129,26 @@ int main(int argc, char*  argv[]) {
     }
 
     // ========================================================================
-    // Find connected clusters
+    // Compute first and second derivatives
     // ========================================================================
-    cout << "  Computing gradients..." << endl;
-
-    uint32_t ix, iy, iz, it, j, k;
+    cout << "  Computing Laplacian..." << endl;
 
     for (uint32_t t = 0; t != size_time; ++t) {
         cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
 
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_x=0, gra_y=0, gra_z=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_x = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_x = diff3;
-                } else {
-                    gra_x = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_y = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_y = diff3;
-                } else {
-                    gra_y = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z && mode_2D == false) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_input_data + j);
-                b = *(nii_input_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_z = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_z = diff3;
-                } else {
-                    gra_z = diff1;
-                }
-            }
-            *(nii_gra_x_data + i+nr_voxels*t) = gra_x;
-            *(nii_gra_y_data + i+nr_voxels*t) = gra_y;
-            *(nii_gra_z_data + i+nr_voxels*t) = gra_z;                                
+        ln_phase_stencil_outputs out;
+        out.mode_2D = mode_2D;
+        out.laplacian = nii_laplacian_data + nr_voxels*t;
+        if (mode_debug || mode_all) {
+            out.gra_x = static_cast<float*>(nii_gra_x->data) + nr_voxels*t;
+            out.gra_y = static_cast<float*>(nii_gra_y->data) + nr_voxels*t;
+            out.gra_z = static_cast<float*>(nii_gra_z->data) + nr_voxels*t;
         }
+        if (mode_all) {
+            out.phase_jump = static_cast<float*>(nii_jump->data) + nr_voxels*t;
+            out.jolt = static_cast<float*>(nii_jolt->data) + nr_voxels*t;
+        }
+        ln_phase_stencil_sweep_3D(nii_input_data + nr_voxels*t, size_x, size_y, size_z, out);
     }
     cout << endl;
 
@@ -208,83 +159,17 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "gradient_z", nii_gra_z, true);
     }
 
-    // ========================================================================
-    // Compute second derivative
-    // ========================================================================
-    cout << "  Computing Laplacian..." << endl;
-
-    for (uint32_t t = 0; t != size_time; ++t) {
-        cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
-
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            tie(ix, iy, iz, it) = ind2sub_4D(i+nr_voxels*t, size_x, size_y, size_z);
-            float gra_xx=0, gra_yy=0, gra_zz=0, diff1=0, diff2=0, diff3=0, a=0, b=0;
-
-            // ------------------------------------------------------------
-            // 1-jump neighbours
-            // ------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_4D(ix-1, iy, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix+1, iy, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_x_data + j);
-                b = *(nii_gra_x_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_xx = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_xx = diff3;
-                } else {
-                    gra_xx = diff1;
-                }
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_4D(ix, iy-1, iz, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy+1, iz, it, size_x, size_y, size_z);
-                a = *(nii_gra_y_data + j);
-                b = *(nii_gra_y_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_yy = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_yy = diff3;
-                } else {
-                    gra_yy = diff1;
-                }
-            }
-            if (iz > 0 && iz < end_z && mode_2D == false) {
-                j = sub2ind_4D(ix, iy, iz-1, it, size_x, size_y, size_z);
-                k = sub2ind_4D(ix, iy, iz+1, it, size_x, size_y, size_z);
-                a = *(nii_gra_z_data + j);
-                b = *(nii_gra_z_data + k);
-                diff1 = b - a;
-                diff2 = TWOPI + b - a;
-                diff3 = b - (TWOPI + a);
-                if (std::abs(diff2) < std::abs(diff1)) {
-                    gra_zz = diff2;
-                } else if (std::abs(diff3) < std::abs(diff1)) {
-                    gra_zz = diff3;
-                } else {
-                    gra_zz = diff1;
-                }
-            }
-            // Laplacian
-            if (mode_2D) {
-                *(nii_laplacian_data + i+nr_voxels*t) = gra_xx + gra_yy;
-            } else {
-                *(nii_laplacian_data + i+nr_voxels*t) = gra_xx + gra_yy + gra_zz;
-            }
-        }
-    }
-    cout << endl;
-
     // ========================================================================
     cout << "  Saving output..." << endl;
 
     save_output_nifti(fout, "phase_laplacian", nii_laplacian, true);
+    if (mode_all) {
+        save_output_nifti(fout, "phase_gradient_x", nii_gra_x, true);
+        save_output_nifti(fout, "phase_gradient_y", nii_gra_y, true);
+        save_output_nifti(fout, "phase_gradient_z", nii_gra_z, true);
+        save_output_nifti(fout, "phase_jump", nii_jump, true);
+        save_output_nifti(fout, "phase_jolt", nii_jolt, true);
+    }
 
     cout << "\n  Finished." << endl;
     return 0;
@@ -1,9 +1,8 @@
 // WORK in PROGRESS
-// TODO(Renzo): Think about what to do with time series data.
-// E.g. carpet plot: https://github.com/layerfMRI/repository/tree/master/Layer_me
 
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
 
 #include "../dep/laynii_lib.h"
 
@@ -21,6 +20,7 @@ int show_help(void) {
     "    LN2_PROFILE -input activitymap.nii -layers layers.nii -plot \n"
     "    LN2_PROFILE -input activitymap.nii -layers layers.nii -plot -output layer_profile.txt \n"
     "    ../LN2_PROFILE -input sc_VASO_act.nii -layers sc_layers.nii -plot -debug \n"
+    "    LN2_PROFILE -input timeseries.nii -layers layers.nii -columns columns.nii -labels rois.nii \n"
     "\n"
     "Options:\n"
     "    -help   : Show this help.\n"
@@ -35,6 +35,12 @@ int show_help(void) {
     "              This is usefull, if the layer input is larder than the ROI.\n"
     "              For many concentional pipelines this might be the output of LN2_MASK.\n"
     "              This 3D nii file must have the same dimension as the layer file.\n"
+    "    -columns: (Optional) Integer column labels (e.g. output of LN2_COLUMNS).\n"
+    "              Profiles are split by column. Zero is ignored.\n"
+    "    -labels : (Optional) Integer ROI labels, any number of them.\n"
+    "              Profiles are split by label. Zero is ignored.\n"
+    "    -table  : (Optional) Write the statistics table (see notes). This is\n"
+    "              implied by '-columns', '-labels' or a 4D input.\n"
     "    -plot   : (Optional)\n"
     "              this option tries to plot the profile as ASKII art in the terminal \n"
     "              This option can be useful if you do not have a graphical plotting profile ready\n"
@@ -46,6 +52,13 @@ int show_help(void) {
     "Notes:\n"
     "    - The averaging is done across all voxels layers, independent of their value.\n"
     "    - If you only want to use average across a subset of layers, consider restricting the layer mask.\n"
+    "    - The text file above is computed from the first volume only, using\n"
+    "      voxels within the labels and columns when these are given.\n"
+    "    - The table is a '_table.csv' file next to the text file. It has one\n"
+    "      row per volume, label, column and layer with the number of voxels,\n"
+    "      mean, STDEV, median, minimum and maximum. Label and column are '0'\n"
+    "      when '-labels' or '-columns' is not given. All of it is computed\n"
+    "      in one run, so thousands of ROIs do not need one call each.\n"
     "\n");
     return 0;
 }
@@ -55,11 +68,14 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii1 = NULL;
     nifti_image *niil = NULL;
     nifti_image *niim = NULL;
-    char *fin = NULL, *finl = NULL, *finm = NULL;
+    nifti_image *niic = NULL;
+    nifti_image *niir = NULL;
+    char *fin = NULL, *finl = NULL, *finm = NULL, *finc = NULL, *finr = NULL;
     char const *fout = "profile.txt";
     bool  mode_debug = false,  mode_plot = false;
     bool  use_outpath = false;
     bool  use_mask = false;
+    bool  mode_table = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -86,6 +102,22 @@ int main(int argc, char*  argv[]) {
             }
             use_mask = true; 
             finm = argv[ac];
+        } else if (!strcmp(argv[ac], "-columns")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -columns\n");
+                return 1;
+            }
+            finc = argv[ac];
+            mode_table = true;
+        } else if (!strcmp(argv[ac], "-labels")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -labels\n");
+                return 1;
+            }
+            finr = argv[ac];
+            mode_table = true;
+        } else if (!strcmp(argv[ac], "-table")) {
+            mode_table = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -131,6 +163,20 @@ int main(int argc, char*  argv[]) {
             return 2;
         }
     }
+    if (finc) {
+        niic = nifti_image_read(finc, 1);
+        if (!niic) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", finc);
+            return 2;
+        }
+    }
+    if (finr) {
+        niir = nifti_image_read(finr, 1);
+        if (!niir) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", finr);
+            return 2;
+        }
+    }
     
     log_welcome("LN2_PROFILE");
     log_nifti_descriptives(nii1);
@@ -139,13 +185,15 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_x = nii1->nx;
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
+    const uint32_t size_time = nii1->nt;
     const uint32_t nr_voxels = size_z * size_y * size_x;
+    if (size_time > 1) mode_table = true;
 
     // ========================================================================
     // Load input
     // ========================================================================
-    nifti_image* layers = copy_nifti_as_int16(niil);
-    int16_t* layers_data = static_cast<int16_t*>(layers->data);
+    nifti_image* layers = copy_nifti_as_int32(niil);
+    int32_t* layers_data = static_cast<int32_t*>(layers->data);
      
     nifti_image* act = copy_nifti_as_float32(nii1);
     float* act_data = static_cast<float*>(act->data);
@@ -170,8 +218,8 @@ int main(int argc, char*  argv[]) {
     // remove voxels outside mask, if ther is one specified.
     // ========================================================================
     if (use_mask == true ) {
-	  nifti_image* mask = copy_nifti_as_int16(niim);
-      int16_t* mask_data = static_cast<int16_t*>(mask->data);	
+	  nifti_image* mask = copy_nifti_as_int32(niim);
+      int32_t* mask_data = static_cast<int32_t*>(mask->data);	
       
 	  for (int j = 0; j != nr_voxels; ++j) {
             if (*(mask_data + j) == 0  ) {
@@ -192,29 +240,85 @@ int main(int argc, char*  argv[]) {
     }
     cout << "    There are " << nr_layers<< " layers. " << endl << endl;
 
-    // double numb_voxels[nr_layers];
-    // double mean_layers[nr_layers];
-    // double std_layers [nr_layers];
-    std::vector<double> numb_voxels(nr_layers);
-    std::vector<double> mean_layers(nr_layers);
-    std::vector<double> std_layers (nr_layers);
+    std::vector<double> numb_voxels(nr_layers, 0.);
+    std::vector<double> mean_layers(nr_layers, 0.);
+    std::vector<double> std_layers (nr_layers, 0.);
 
-    for (int i = 0; i < nr_layers; i++) {
-        mean_layers[i] = 0.;
-        std_layers[i] = 0.;
-        numb_voxels[i] = 0.;
-    }
-	  
     // ========================================================================
-    // Look how many voxels we have per layer
+    // Group voxels by label, column and layer
     // ========================================================================
-    for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
-            if (*(layers_data + j) == i+1 ) {
-                numb_voxels[i] ++;
-            }
+    // NOTE: Every voxel with a non-zero layer (and label and column, if given)
+    // belongs to one group. Groups are remapped to dense indices and their
+    // voxels are listed contiguously (counting sort), so each volume is
+    // visited once no matter how many groups there are.
+    int32_t* columns_data = NULL;
+    int32_t* labels_data = NULL;
+    if (niic) {
+        columns_data = static_cast<int32_t*>(copy_nifti_as_int32(niic)->data);
+    }
+    if (niir) {
+        labels_data = static_cast<int32_t*>(copy_nifti_as_int32(niir)->data);
+    }
+
+    typedef std::tuple<int32_t, int32_t, int32_t> group_key;  // label, column, layer
+    std::vector<group_key> groups;
+    std::vector<int32_t> voxel_group(nr_voxels, -1);
+    auto key_of = [&](uint32_t j) {
+        return group_key(labels_data ? *(labels_data + j) : 0,
+                         columns_data ? *(columns_data + j) : 0,
+                         *(layers_data + j));
+    };
+    auto in_groups = [&](uint32_t j) {
+        return *(layers_data + j) > 0
+               && (!labels_data || *(labels_data + j) != 0)
+               && (!columns_data || *(columns_data + j) != 0);
+    };
+    for (uint32_t j = 0; j != nr_voxels; ++j) {
+        if (in_groups(j)) groups.push_back(key_of(j));
+    }
+    std::sort(groups.begin(), groups.end());
+    groups.erase(std::unique(groups.begin(), groups.end()), groups.end());
+
+    std::vector<uint32_t> group_start(groups.size() + 1, 0);
+    for (uint32_t j = 0; j != nr_voxels; ++j) {
+        if (in_groups(j)) {
+            voxel_group[j] = std::lower_bound(groups.begin(), groups.end(), key_of(j))
+                             - groups.begin();
+            group_start[voxel_group[j] + 1]++;
         }
     }
+    for (uint32_t g = 0; g != groups.size(); ++g) {
+        group_start[g + 1] += group_start[g];
+    }
+    std::vector<uint32_t> group_voxels(group_start.back());
+    std::vector<uint32_t> cursor(group_start.begin(), group_start.end() - 1);
+    for (uint32_t j = 0; j != nr_voxels; ++j) {
+        if (voxel_group[j] >= 0) group_voxels[cursor[voxel_group[j]]++] = j;
+    }
+    cout << "    There are " << groups.size() << " label, column and layer groups. " << endl;
+
+    // ------------------------------------------------------------------------
+    // Layer profile of the first volume
+    // ------------------------------------------------------------------------
+    // Voxels of each layer are listed in ascending order, as the averages
+    // depend on the summation order.
+    std::vector<uint32_t> layer_start(nr_layers + 1, 0);
+    for (uint32_t j = 0; j != nr_voxels; ++j) {
+        if (voxel_group[j] >= 0) layer_start[*(layers_data + j)]++;
+    }
+    for (int i = 0; i < nr_layers; i++) {
+        layer_start[i + 1] += layer_start[i];
+        numb_voxels[i] = layer_start[i + 1] - layer_start[i];
+    }
+    std::vector<double> vec1(layer_start[nr_layers]);
+    std::vector<uint32_t> layer_cursor(layer_start.begin(), layer_start.end() - 1);
+    for (uint32_t j = 0; j != nr_voxels; ++j) {
+        if (voxel_group[j] >= 0) vec1[layer_cursor[*(layers_data + j) - 1]++] = *(act_data + j);
+    }
+    for (int i = 0; i < nr_layers; i++) {
+        mean_layers[i] = ren_average(vec1.data() + layer_start[i], numb_voxels[i])*act->scl_slope;
+        std_layers[i]  = ren_stdev  (vec1.data() + layer_start[i], numb_voxels[i])*act->scl_slope;
+    }
 
     //-------------- finding layer with maximal number of voxels
     int max_layer_number = 0;
@@ -228,25 +332,6 @@ int main(int argc, char*  argv[]) {
 
     if(mode_debug) cout << "   Layer  " <<   max_layer_number_layer+1 << " has the most voxels: " <<  max_layer_number << endl;
 
-    // ========================================================================
-    // Go through layers MAIN loop
-    // ========================================================================
-    // double vec1[max_layer_number];
-    std::vector<double> vec1(max_layer_number);
-    int dummy_index = 0;
-
-    for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
-            if (*(layers_data + j) == i+1 ) {
-                vec1[dummy_index] = *(act_data + j);
-                dummy_index ++;
-            }
-        }
-        dummy_index = 0;
-        mean_layers[i] = ren_average(vec1.data(), numb_voxels[i])*act->scl_slope;
-        std_layers[i]  = ren_stdev  (vec1.data(), numb_voxels[i])*act->scl_slope;
-    }
-
     // ========================================================================
     // Write layer profiles to terminal
     // ========================================================================
@@ -313,6 +398,62 @@ int main(int argc, char*  argv[]) {
      }
     outf.close();
 
+    // ========================================================================
+    // Write statistics table of all volumes and groups
+    // ========================================================================
+    if (mode_table) {
+        string path_table = path_out;
+        auto pos3 = path_table.find_last_of("/\\");
+        pos3 = path_table.find_first_of('.', pos3 == string::npos ? 0 : pos3 + 1);
+        if (pos3 != string::npos) {
+            path_table = path_table.substr(0, pos3);
+        }
+        path_table += "_table.csv";
+
+        ofstream outt(path_table);
+        if (!outt) {
+            cout << "error when opening the table file" << endl;
+            return 1;
+        }
+        cout << "    writing to disk " << path_table << endl;
+        outt << "volume,label,column,layer,count,mean,stdev,median,min,max\n";
+
+        const double slope = act->scl_slope;
+        std::vector<double> values;
+        for (uint32_t t = 0; t != size_time; ++t) {
+            cout << "\r    Volume: " << t+1 << "/" << size_time << flush;
+            const float* vol_data = act_data + nr_voxels * t;
+            for (uint32_t g = 0; g != groups.size(); ++g) {
+                const uint32_t n = group_start[g + 1] - group_start[g];
+                values.resize(n);
+                for (uint32_t k = 0; k != n; ++k) {
+                    values[k] = *(vol_data + group_voxels[group_start[g] + k]);
+                }
+                double mean = ren_average(values.data(), n) * slope;
+                double stdev = ren_stdev(values.data(), n) * std::abs(slope);
+                auto minmax = std::minmax_element(values.begin(), values.end());
+                double v_min = *minmax.first * slope;
+                double v_max = *minmax.second * slope;
+                if (slope < 0) std::swap(v_min, v_max);
+
+                // Median, the mean of the two middle values for even counts
+                auto mid = values.begin() + n / 2;
+                std::nth_element(values.begin(), mid, values.end());
+                double median = *mid;
+                if (n % 2 == 0) {
+                    median = 0.5 * (median + *std::max_element(values.begin(), mid));
+                }
+                median *= slope;
+
+                outt << t << "," << std::get<0>(groups[g]) << "," << std::get<1>(groups[g])
+                     << "," << std::get<2>(groups[g]) << "," << n << "," << mean << ","
+                     << stdev << "," << median << "," << v_min << "," << v_max << "\n";
+            }
+        }
+        cout << endl;
+        outt.close();
+    }
+
     // ========================================================================
     // Plot in terminal, use ASCII to avoid issues with terminal types
     // ========================================================================
@@ -1,28 +1,122 @@
 #include "../dep/laynii_lib.h"
 #include <sstream>
+#include <fstream>
 
 int show_help(void) {
     printf(
-    "LN2_REGRESS_OUT: Regress one timeseries from another, voxel-wise.\n"
+    "LN2_REGRESS_OUT: Regress nuisance timeseries out of a timeseries, voxel-wise.\n"
+    "\n"
+    "    Fits a general linear model (intercept + nuisance regressors) in every\n"
+    "    voxel. Regressors can be shared by all voxels (text file, e.g. motion\n"
+    "    or physiological traces) or voxel-specific (4D nifti).\n"
     "\n"
     "Usage:\n"
-    "    LN2_REGRESS_OUT -input input.nii\n"
-    "    ../LN2_REGRESS_OUT -input input.nii\n"
+    "    LN2_REGRESS_OUT -input1 data.nii -input2 nuisance.nii\n"
+    "    LN2_REGRESS_OUT -input1 data.nii -regressors motion.txt\n"
+    "    LN2_REGRESS_OUT -input1 data.nii -input2 a.nii -input2 b.nii -regressors physio.txt\n"
     "\n"
     "Options:\n"
-    "    -help   : Show this help.\n"
-    "    -input1 : First timeseries nifti (4D)"
-    "    -input2 : Second timeseries nifti (4D)"
-    "    -output : (Optional) Output basename for all outputs.\n"
-    "    -debug  : (Optional) Save extra intermediate outputs.\n"
+    "    -help       : Show this help.\n"
+    "    -input1     : Timeseries nifti (4D) that will be cleaned.\n"
+    "    -input2     : (Optional) Voxel-specific regressor timeseries nifti (4D).\n"
+    "                  Can be given multiple times.\n"
+    "    -regressors : (Optional) Text file with shared regressors. One row per\n"
+    "                  time point, one column per regressor (white space or\n"
+    "                  comma separated). Non-numeric header lines are skipped.\n"
+    "    -output     : (Optional) Output basename for all outputs.\n"
+    "    -debug      : (Optional) Save extra intermediate outputs.\n"
     "\n"
+    "Notes:\n"
+    "    - An intercept is always included in the model. Voxels where the\n"
+    "      voxel-specific regressors are collinear (e.g. constant) are fit\n"
+    "      with the shared regressors only. Their voxel-specific betas are 0.\n"
+    "    - With a single regressor, its coefficient is written as 'slope'.\n"
+    "      Otherwise all coefficients are written as a 4D 'betas' image, shared\n"
+    "      regressors first, followed by the voxel-specific ones.\n"
+    "    - The normal equations of the shared regressors are factorized once.\n"
+    "      Voxel-specific regressors are appended per voxel by a block\n"
+    "      Cholesky update, so the cost per voxel only depends on their number.\n"
     "\n");
     return 0;
 }
 
+// ============================================================================
+// Small dense linear algebra helpers (row-major, p x p)
+// ============================================================================
+bool cholesky_inplace(double* a, const int p) {
+    // Lower triangular Cholesky factor is written into the lower half of a
+    for (int j = 0; j < p; ++j) {
+        double d = a[j*p + j];
+        for (int k = 0; k < j; ++k) {
+            d -= a[j*p + k] * a[j*p + k];
+        }
+        if (d <= 1e-12 * std::max(1.0, std::fabs(a[j*p + j]))) {
+            return false;
+        }
+        d = std::sqrt(d);
+        a[j*p + j] = d;
+        for (int i = j + 1; i < p; ++i) {
+            double s = a[i*p + j];
+            for (int k = 0; k < j; ++k) {
+                s -= a[i*p + k] * a[j*p + k];
+            }
+            a[i*p + j] = s / d;
+        }
+    }
+    return true;
+}
+
+void forward_substitute(const double* l, const int p, double* b) {
+    // Solve L x = b in place
+    for (int i = 0; i < p; ++i) {
+        double s = b[i];
+        for (int k = 0; k < i; ++k) {
+            s -= l[i*p + k] * b[k];
+        }
+        b[i] = s / l[i*p + i];
+    }
+}
+
+void backward_substitute(const double* l, const int p, double* b) {
+    // Solve L^T x = b in place
+    for (int i = p - 1; i >= 0; --i) {
+        double s = b[i];
+        for (int k = i + 1; k < p; ++k) {
+            s -= l[k*p + i] * b[k];
+        }
+        b[i] = s / l[i*p + i];
+    }
+}
+
+bool read_regressors(const char* filename, std::vector<std::vector<double>>& rows) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+    string line;
+    while (std::getline(file, line)) {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::replace(line.begin(), line.end(), '\t', ' ');
+        std::istringstream iss(line);
+        std::vector<double> row;
+        double value;
+        while (iss >> value) {
+            row.push_back(value);
+        }
+        if (iss.fail() && !iss.eof()) {  // Header or comment line
+            continue;
+        }
+        if (!row.empty()) {
+            rows.push_back(row);
+        }
+    }
+    return true;
+}
+
 int main(int argc, char*  argv[]) {
-    nifti_image *nii1 = NULL, *nii2 = NULL;
-    char *fin1 = NULL, *fin2 = NULL, *fout = NULL;
+    nifti_image *nii1 = NULL;
+    char *fin1 = NULL, *fout = NULL, *freg = NULL;
+    std::vector<char*> fin2;
     int ac;
     bool mode_debug = false;
 
@@ -43,7 +137,13 @@ int main(int argc, char*  argv[]) {
                 fprintf(stderr, "** missing argument for -input2\n");
                 return 1;
             }
-            fin2 = argv[ac];
+            fin2.push_back(argv[ac]);
+        } else if (!strcmp(argv[ac], "-regressors")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -regressors\n");
+                return 1;
+            }
+            freg = argv[ac];
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -59,7 +159,11 @@ int main(int argc, char*  argv[]) {
     }
 
     if (!fin1) {
-        fprintf(stderr, "** missing option '-input'\n");
+        fprintf(stderr, "** missing option '-input1'\n");
+        return 1;
+    }
+    if (fin2.empty() && !freg) {
+        fprintf(stderr, "** missing option '-input2' or '-regressors'\n");
         return 1;
     }
 
@@ -70,15 +174,8 @@ int main(int argc, char*  argv[]) {
         return 2;
     }
 
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
-
     log_welcome("LN2_REGRESS_OUT");
     log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
 
     // Get dimensions of input
     const uint32_t size_x = nii1->nx;
@@ -86,114 +183,279 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
-    const uint32_t nr_voxels = size_z * size_y * size_x;
+    const uint64_t nr_voxels = static_cast<uint64_t>(size_z) * size_y * size_x;
 
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
     nifti_image* nii_input1 = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii1);
     float* nii_input1_data = static_cast<float*>(nii_input1->data);
-    nifti_image* nii_input2 = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii2);
-    float* nii_input2_data = static_cast<float*>(nii_input2->data);
 
-    // Prepare output image
-    nifti_image* nii_residual = copy_nifti_as_float32(nii_input1);
-    float* nii_residual_data = static_cast<float*>(nii_residual->data);
-
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_residual_data + i) = 0;
+    // Voxel-specific regressors
+    std::vector<nifti_image*> nii_voxreg;
+    for (uint32_t j = 0; j != fin2.size(); ++j) {
+        nifti_image* nii2 = nifti_image_read(fin2[j], 1);
+        if (!nii2) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2[j]);
+            return 2;
+        }
+        log_nifti_descriptives(nii2);
+        if (nii2->nx != nii1->nx || nii2->ny != nii1->ny || nii2->nz != nii1->nz
+            || nii2->nt != nii1->nt) {
+            fprintf(stderr, "** '%s' does not match dimensions of '%s'\n", fin2[j], fin1);
+            return 2;
+        }
+        nii_voxreg.push_back(copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii2));
+        nifti_image_free(nii2);
     }
 
-    nifti_image* nii_predicted = copy_nifti_as_float32(nii_residual);
-    float* nii_predicted_data = static_cast<float*>(nii_predicted->data);
-
-    // Create a 4D nifti image for point distances
-    nifti_image *nii_intercept = NULL;
-    float *nii_intercept_data = NULL;
+    // Shared regressors
+    std::vector<std::vector<double>> rows;
+    if (freg) {
+        if (!read_regressors(freg, rows)) {
+            fprintf(stderr, "** failed to read regressors from '%s'\n", freg);
+            return 2;
+        }
+        if (rows.size() != size_time) {
+            fprintf(stderr, "** '%s' has %d rows but input has %d time points\n",
+                    freg, static_cast<int>(rows.size()), size_time);
+            return 2;
+        }
+        for (uint32_t t = 1; t != size_time; ++t) {
+            if (rows[t].size() != rows[0].size()) {
+                fprintf(stderr, "** '%s' has an inconsistent number of columns\n", freg);
+                return 2;
+            }
+        }
+    }
 
-    nii_intercept = nifti_copy_nim_info(nii1);
-    nii_intercept->dim[0] = 4;  // For 3D nifti
-    nii_intercept->dim[1] = size_x;
-    nii_intercept->dim[2] = size_y;
-    nii_intercept->dim[3] = size_z;
-    nii_intercept->dim[4] = 1;
-    nifti_update_dims_from_array(nii_intercept);
-    nii_intercept->nvox = nr_voxels;
-    nii_intercept->nbyper = sizeof(float);
-    nii_intercept->data = calloc(nii_intercept->nvox, nii_intercept->nbyper);
-    nii_intercept_data = static_cast<float*>(nii_intercept->data);
+    const int nr_shared = freg ? static_cast<int>(rows[0].size()) : 0;
+    const int nr_voxreg = static_cast<int>(nii_voxreg.size());
+    const int ps = 1 + nr_shared;  // Shared design columns, incl. intercept
+    const int p = ps + nr_voxreg;
+    cout << "  Shared regressors: " << nr_shared << endl;
+    cout << "  Voxel-specific regressors: " << nr_voxreg << endl;
 
-    nifti_image* nii_slope = copy_nifti_as_float32(nii_intercept);
-    float* nii_slope_data = static_cast<float*>(nii_slope->data);
+    // Shared design matrix (time x ps), first column is the intercept
+    std::vector<double> xs(size_time * ps);
+    for (uint32_t t = 0; t != size_time; ++t) {
+        xs[t*ps] = 1;
+        for (int k = 1; k < ps; ++k) {
+            xs[t*ps + k] = rows[t][k-1];
+        }
+    }
 
-    nifti_image* nii_meanx = copy_nifti_as_float32(nii_intercept);
-    float* nii_meanx_data = static_cast<float*>(nii_meanx->data);
-    nifti_image* nii_meany = copy_nifti_as_float32(nii_intercept);
-    float* nii_meany_data = static_cast<float*>(nii_meany->data);
+    // ========================================================================
+    cout << "  Factorizing shared design..." << endl;
+    // ========================================================================
+    std::vector<double> ls(ps * ps, 0);
+    for (uint32_t t = 0; t != size_time; ++t) {
+        for (int a = 0; a < ps; ++a) {
+            for (int b = 0; b <= a; ++b) {
+                ls[a*ps + b] += xs[t*ps + a] * xs[t*ps + b];
+            }
+        }
+    }
+    if (!cholesky_inplace(ls.data(), ps)) {
+        fprintf(stderr, "** shared regressors are rank deficient\n");
+        return 2;
+    }
 
     // ========================================================================
-    cout << "  Calculating means..." << endl;
+    cout << "  Accumulating cross products..." << endl;
     // ========================================================================
-    float n = static_cast<float>(size_time);
+    // NOTE: Time is the outer loop so that all voxel-wise sums stream
+    // through the nifti data in memory order (vectorizes over voxels).
+    std::vector<double> xty(nr_voxels * ps, 0);  // Shared design x data
+    std::vector<double> vty(nr_voxels * nr_voxreg, 0);  // Voxel regressors x data
+    std::vector<double> xtv(nr_voxels * ps * nr_voxreg, 0);  // Shared x voxel regressors
+    std::vector<double> vtv(nr_voxels * nr_voxreg * nr_voxreg, 0);  // Voxel regressors
+
+    std::vector<float*> voxreg_data(nr_voxreg);
+    for (int m = 0; m < nr_voxreg; ++m) {
+        voxreg_data[m] = static_cast<float*>(nii_voxreg[m]->data);
+    }
+
     for (uint32_t t = 0; t != size_time; ++t) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_meany_data + i) += *(nii_input1_data + i + nr_voxels*t) / n;
-            *(nii_meanx_data + i) += *(nii_input2_data + i + nr_voxels*t) / n;
+        const float* y = nii_input1_data + nr_voxels * t;
+        for (int k = 0; k < ps; ++k) {
+            const double x = xs[t*ps + k];
+            double* acc = &xty[nr_voxels * k];
+            for (uint64_t i = 0; i != nr_voxels; ++i) {
+                acc[i] += x * y[i];
+            }
+        }
+        for (int m = 0; m < nr_voxreg; ++m) {
+            const float* v = voxreg_data[m] + nr_voxels * t;
+            double* acc = &vty[nr_voxels * m];
+            for (uint64_t i = 0; i != nr_voxels; ++i) {
+                acc[i] += static_cast<double>(v[i]) * y[i];
+            }
+            for (int k = 0; k < ps; ++k) {
+                const double x = xs[t*ps + k];
+                double* acc2 = &xtv[nr_voxels * (m*ps + k)];
+                for (uint64_t i = 0; i != nr_voxels; ++i) {
+                    acc2[i] += x * v[i];
+                }
+            }
+            for (int n = 0; n <= m; ++n) {
+                const float* w = voxreg_data[n] + nr_voxels * t;
+                double* acc3 = &vtv[nr_voxels * (m*nr_voxreg + n)];
+                for (uint64_t i = 0; i != nr_voxels; ++i) {
+                    acc3[i] += static_cast<double>(v[i]) * w[i];
+                }
+            }
         }
     }
 
     // ========================================================================
-    cout << "  Calculating slope and intercept..." << endl;
+    cout << "  Solving voxel-wise models..." << endl;
     // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        float y_mean = *(nii_meany_data + i);
-        float x_mean = *(nii_meanx_data + i);
-        float term1 = 0, term2 = 0;
+    // Prepare outputs
+    nifti_image* nii_intercept = nifti_copy_nim_info(nii_input1);
+    nii_intercept->dim[0] = 4;
+    nii_intercept->dim[4] = 1;
+    nifti_update_dims_from_array(nii_intercept);
+    nii_intercept->nvox = nr_voxels;
+    nii_intercept->datatype = NIFTI_TYPE_FLOAT32;
+    nii_intercept->nbyper = sizeof(float);
+    nii_intercept->data = calloc(nii_intercept->nvox, nii_intercept->nbyper);
+    float* nii_intercept_data = static_cast<float*>(nii_intercept->data);
+
+    nifti_image* nii_betas = nifti_copy_nim_info(nii_intercept);
+    nii_betas->dim[0] = 4;
+    nii_betas->dim[4] = p - 1;
+    nifti_update_dims_from_array(nii_betas);
+    nii_betas->nvox = nr_voxels * (p - 1);
+    nii_betas->data = calloc(nii_betas->nvox, nii_betas->nbyper);
+    float* nii_betas_data = static_cast<float*>(nii_betas->data);
+
+    std::vector<double> beta(p), l(p * p), b(ps * nr_voxreg);
+    std::vector<double> s(nr_voxreg * nr_voxreg);
+    uint64_t nr_singular = 0;
+    for (uint64_t i = 0; i != nr_voxels; ++i) {
+        // Right hand side
+        for (int k = 0; k < ps; ++k) {
+            beta[k] = xty[nr_voxels * k + i];
+        }
+        for (int m = 0; m < nr_voxreg; ++m) {
+            beta[ps + m] = vty[nr_voxels * m + i];
+        }
+
+        // Block Cholesky: reuse the shared factor, only factorize the Schur
+        // complement of the voxel-specific regressors
+        for (int a = 0; a < ps; ++a) {
+            for (int c = 0; c <= a; ++c) {
+                l[a*p + c] = ls[a*ps + c];
+            }
+        }
+        bool is_ok = true;
+        if (nr_voxreg > 0) {
+            for (int m = 0; m < nr_voxreg; ++m) {
+                for (int k = 0; k < ps; ++k) {
+                    b[m*ps + k] = xtv[nr_voxels * (m*ps + k) + i];
+                }
+                forward_substitute(ls.data(), ps, &b[m*ps]);
+                for (int k = 0; k < ps; ++k) {
+                    l[(ps + m)*p + k] = b[m*ps + k];
+                }
+            }
+            for (int m = 0; m < nr_voxreg; ++m) {
+                for (int n = 0; n <= m; ++n) {
+                    double val = vtv[nr_voxels * (m*nr_voxreg + n) + i];
+                    for (int k = 0; k < ps; ++k) {
+                        val -= b[m*ps + k] * b[n*ps + k];
+                    }
+                    s[m*nr_voxreg + n] = val;
+                }
+                // Collinear with the shared regressors
+                if (s[m*nr_voxreg + m] <= 1e-10 * vtv[nr_voxels * (m*nr_voxreg + m) + i]) {
+                    is_ok = false;
+                }
+            }
+            is_ok = is_ok && cholesky_inplace(s.data(), nr_voxreg);
+            for (int m = 0; m < nr_voxreg; ++m) {
+                for (int n = 0; n <= m; ++n) {
+                    l[(ps + m)*p + ps + n] = s[m*nr_voxreg + n];
+                }
+            }
+        }
 
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float y = *(nii_input1_data + i + nr_voxels*t);
-            float x = *(nii_input2_data + i + nr_voxels*t);
-            term1 += (x - x_mean) * (y - y_mean);
-            term2 += (x - x_mean) * (x - x_mean);
+        if (!is_ok) {  // E.g. voxels outside of the brain
+            // Shared regressors only model, voxel-specific betas stay 0
+            nr_singular++;
+            forward_substitute(ls.data(), ps, beta.data());
+            backward_substitute(ls.data(), ps, beta.data());
+            for (int m = 0; m < nr_voxreg; ++m) {
+                beta[ps + m] = 0;
+            }
+        } else {
+            forward_substitute(l.data(), p, beta.data());
+            backward_substitute(l.data(), p, beta.data());
         }
 
-        *(nii_slope_data + i) = term1 / term2;
-        *(nii_intercept_data + i) = y_mean - *(nii_slope_data + i) * x_mean;
+        *(nii_intercept_data + i) = beta[0];
+        for (int k = 1; k < p; ++k) {
+            *(nii_betas_data + nr_voxels * (k-1) + i) = beta[k];
+        }
+    }
+    if (nr_singular > 0) {
+        cout << "    " << nr_singular << " voxels with singular models are fit with the shared regressors only." << endl;
     }
 
-    save_output_nifti(fout, "slope", nii_slope, true);
+    if (p == 2) {
+        save_output_nifti(fout, "slope", nii_betas, true);
+    } else {
+        save_output_nifti(fout, "betas", nii_betas, true);
+    }
     save_output_nifti(fout, "intercept", nii_intercept, true);
 
     // ========================================================================
-    cout << "  Computing fitted timeseries..." << endl;
+    cout << "  Computing fitted timeseries and residuals..." << endl;
     // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float slope = *(nii_slope_data + i);
-            float intercept = *(nii_intercept_data + i);
-            float x = *(nii_input2_data + i + nr_voxels*t);
-            *(nii_predicted_data + i + nr_voxels*t) = intercept +  slope * x;
+    nifti_image* nii_predicted = copy_nifti_as_float32(nii_input1);
+    float* nii_predicted_data = static_cast<float*>(nii_predicted->data);
+    nifti_image* nii_residual = copy_nifti_as_float32(nii_input1);
+    float* nii_residual_data = static_cast<float*>(nii_residual->data);
+
+    for (uint32_t t = 0; t != size_time; ++t) {
+        float* fit = nii_predicted_data + nr_voxels * t;
+        float* res = nii_residual_data + nr_voxels * t;
+        const float* y = nii_input1_data + nr_voxels * t;
+
+        for (uint64_t i = 0; i != nr_voxels; ++i) {
+            fit[i] = *(nii_intercept_data + i);
+        }
+        for (int k = 1; k < ps; ++k) {
+            const float x = xs[t*ps + k];
+            const float* beta_k = nii_betas_data + nr_voxels * (k-1);
+            for (uint64_t i = 0; i != nr_voxels; ++i) {
+                fit[i] += beta_k[i] * x;
+            }
+        }
+        for (int m = 0; m < nr_voxreg; ++m) {
+            const float* v = voxreg_data[m] + nr_voxels * t;
+            const float* beta_m = nii_betas_data + nr_voxels * (ps + m - 1);
+            for (uint64_t i = 0; i != nr_voxels; ++i) {
+                fit[i] += beta_m[i] * v[i];
+            }
+        }
+        for (uint64_t i = 0; i != nr_voxels; ++i) {
+            res[i] = y[i] - fit[i];
         }
     }
     save_output_nifti(fout, "fitted", nii_predicted, true);
+    save_output_nifti(fout, "residuals", nii_residual, true);
 
-    // ========================================================================
-    cout << "  Computing residuals..." << endl;
-    // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float y_fitted = *(nii_predicted_data + i + nr_voxels*t);
-            float y = *(nii_input1_data + i + nr_voxels*t);
-
-            *(nii_residual_data + i + nr_voxels*t) = y - y_fitted;
+    if (mode_debug) {
+        // Voxel-wise means of the data, handy for checking the intercept
+        nifti_image* nii_meany = copy_nifti_as_float32(nii_intercept);
+        float* nii_meany_data = static_cast<float*>(nii_meany->data);
+        for (uint64_t i = 0; i != nr_voxels; ++i) {
+            *(nii_meany_data + i) = xty[i] / size_time;
         }
+        save_output_nifti(fout, "mean", nii_meany, true);
     }
-    save_output_nifti(fout, "residuals", nii_residual, true);
 
     cout << "\n  Finished." << endl;
     return 0;
@@ -9,17 +9,23 @@ int show_help(void) {
     "Usage:\n"
     "    LN2_RIM_BORDERIZE -rim rim.nii\n"
     "    LN2_RIM_BORDERIZE -rim rim.nii -jumps 3\n"
+    "    LN2_RIM_BORDERIZE -rim rim.nii -thickness 4\n"
     "\n"
     "Options:\n"
-    "    -help   : Show this help.\n"
-    "    -rim    : Any nifti file with integers. For instance segmentation results,\n"
-    "              parcellations, or 'winner maps'.\n"
-    "    -jumps  : (Optional) 1, 2 or 3 jump neighbourhood. Default is 1.\n"
-    "              1 gives thinnest borders and 3 gives thickest borders, because:\n"
-    "              1 jump means voxels touching all faces will be zeroed.\n"
-    "              2 jump means voxels touching all faces and edges will be zeroed.\n"
-    "              3 jump means voxels touching all faces, edges, and corners will be zeroed.\n"
-    "    -output : (Optional) Output basename for all outputs.\n"
+    "    -help      : Show this help.\n"
+    "    -rim       : Any nifti file with integers. For instance segmentation results,\n"
+    "                 parcellations, or 'winner maps'.\n"
+    "    -jumps     : (Optional) 1, 2 or 3 jump neighbourhood. Default is 1.\n"
+    "                 1 gives thinnest borders and 3 gives thickest borders, because:\n"
+    "                 1 jump means voxels touching all faces will be zeroed.\n"
+    "                 2 jump means voxels touching all faces and edges will be zeroed.\n"
+    "                 3 jump means voxels touching all faces, edges, and corners will be zeroed.\n"
+    "    -thickness : (Optional) Border thickness in voxels (of the smallest voxel\n"
+    "                 dimension). Overrides -jumps. Voxels closer than this\n"
+    "                 Euclidean distance to the 1 jump borders are kept, so 1\n"
+    "                 gives the 1 jump borders. Thick borders cost the same as\n"
+    "                 thin ones.\n"
+    "    -output    : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
 }
@@ -29,6 +35,7 @@ int main(int argc, char*  argv[]) {
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
     int ac, jumps = 1, label = 0;
+    float thickness = 0;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -48,6 +55,12 @@ int main(int argc, char*  argv[]) {
             } else {
                 jumps = atof(argv[ac]);
             }
+        } else if (!strcmp(argv[ac], "-thickness")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -thickness\n");
+                return 1;
+            }
+            thickness = atof(argv[ac]);
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -87,6 +100,9 @@ int main(int argc, char*  argv[]) {
 
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
+    // Thick borders grow from the 1 jump borders
+    if (thickness > 0) jumps = 1;
+
     // ========================================================================
     // Fix input datatype issues
     nifti_image* nii_rim = copy_nifti_as_int32(nii1);
@@ -330,6 +346,33 @@ int main(int argc, char*  argv[]) {
         }
     }
 
+    // ------------------------------------------------------------------------
+    // Thicken borders
+    // ------------------------------------------------------------------------
+    // NOTE: A single distance transform from the 1 jump borders, instead of
+    // repeated neighbourhood passes.
+    if (thickness > 1) {
+        cout << "  Thickening borders..." << endl;
+        const float d_min = std::min(nii1->pixdim[1], std::min(nii1->pixdim[2], nii1->pixdim[3]));
+
+        std::vector<bool> is_seed(nr_voxels);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);
+            is_seed[i] = *(nii_borderized_data + i) == 1 || *(nii_borderized_data + i) == 2;
+        }
+        std::vector<float> dist(nr_voxels);
+        ln_distance_transform_3D(is_seed, dist.data(), NULL, size_x, size_y, size_z,
+                                 nii1->pixdim[1] / d_min, nii1->pixdim[2] / d_min,
+                                 nii1->pixdim[3] / d_min);
+
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);
+            if ((*(nii_rim_data + i) == 1 || *(nii_rim_data + i) == 2) && dist[i] < thickness) {
+                *(nii_borderized_data + i) = *(nii_rim_data + i);
+            }
+        }
+    }
+
     // ------------------------------------------------------------------------
 
     save_output_nifti(fout, "borderized", nii_borderized, true, use_outpath);
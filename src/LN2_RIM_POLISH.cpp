@@ -16,20 +16,25 @@ int show_help(void) {
     "                     gray matter border voxels (facing mostly CSF), 2 to code inner\n"
     "                     gray matter border voxels (facing mostly white matter), and\n"
     "                     3 to code pure gray matter voxels.\n"
-    "    -steps         : (Optional) Number of erosion dilation steps applied before\n"
-    "                     the Gaussian smoothing step. It is recommended to only\n"
-    "                     increase this for <0.2 mm isotropic resolution \n"
-    "                     corticalimages. '1' by default, chosen for 0.2 mm iso. images.\n"
+    "    -steps         : (Optional) Erosion and dilation distance (in voxels)\n"
+    "                     applied before the Gaussian smoothing step. It is\n"
+    "                     recommended to only increase this for <0.2 mm isotropic\n"
+    "                     resolution cortical images. '1' by default, chosen for\n"
+    "                     0.2 mm iso. images.\n"
     "    -iter_smooth   : (Optional) Number of smoothing iterations. Higher values\n"
     "                     will result in smoother boundaries. However, this also means\n"
     "                     that fundi of the sulci and crowns of the gyri might get \n"
     "                     smoothed out. '6' by default, chosen for 0.2 mm iso. images.\n"
-    "    -steps_voronoi : (Optional) Number of voronoi dilation steps. Useful for\n"
+    "    -steps_voronoi : (Optional) Voronoi dilation distance (in voxels). Useful for\n"
     "                     preventing smoothing artifacts around the edges of partially\n" 
     "                     segmented volumes. '5' by default, chosen for 0.2 mm iso. images.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
     "    -output        : (Optional) Output filename, including .nii or\n"
     "                     .nii.gz, and path if needed. Overwrites existing files.\n"
+    "\n"
+    "Notes:\n"
+    "    - Dilations and erosions are thresholded Euclidean distance transforms.\n"
+    "      Distances are measured in units of the smallest voxel dimension.\n"
     "\n");
     return 0;
 }
@@ -66,6 +71,10 @@ int main(int argc, char *argv[]) {
             }
             iter_smooth = std::stoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-steps_voronoi")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -steps_voronoi\n");
+                return 2;
+            }
             steps_voronoi = std::stoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
@@ -104,9 +113,15 @@ int main(int argc, char *argv[]) {
     const int size_z = nii_in->nz;
     const int nr_voxels = size_z * size_y * size_x;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
+    // Distances are in units of the smallest voxel dimension
+    const float d_min = std::min(nii_in->pixdim[1], std::min(nii_in->pixdim[2], nii_in->pixdim[3]));
+    const float dX = nii_in->pixdim[1] / d_min;
+    const float dY = nii_in->pixdim[2] / d_min;
+    const float dZ = nii_in->pixdim[3] / d_min;
+
+    std::vector<bool> is_seed(nr_voxels);
+    std::vector<float> dist(nr_voxels);
+    std::vector<int32_t> nearest(nr_voxels);
 
     // Prepare images
     nifti_image *nii_rim = copy_nifti_as_int16(nii_in);
@@ -118,56 +133,15 @@ int main(int argc, char *argv[]) {
     nifti_image* nii_temp = copy_nifti_as_int16(nii_rim);
     int16_t* nii_temp_data = static_cast<int16_t*>(nii_temp->data);
 
-    uint32_t ix, iy, iz, j;
-    for (uint32_t n = 0; n != steps_voronoi; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_rim_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_rim_data + i);
+    // Unlabeled voxels take the label of the nearest labeled voxel
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        is_seed[i] = *(nii_rim_data + i) != 0;
+    }
+    ln_distance_transform_3D(is_seed, dist.data(), nearest.data(),
+                             size_x, size_y, size_z, dX, dY, dZ);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_rim_data + i) == 0 && dist[i] <= steps_voronoi) {
+            *(nii_rim_data + i) = *(nii_temp_data + nearest[i]);
         }
     }
 
@@ -216,62 +190,14 @@ int main(int argc, char *argv[]) {
     cout << "  Polishing white matter (wm)..." << endl;
     cout << "    Dilating..." << endl;
 
-    // Clean temporary nifti
+    // Dilate
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wm_data + i);
+        is_seed[i] = *(nii_wm_data + i) != 0;
     }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wm_data + i);
-        }
+    ln_distance_transform_3D(is_seed, dist.data(), NULL,
+                             size_x, size_y, size_z, dX, dY, dZ);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(nii_wm_data + i) = dist[i] <= steps;
     }
 
     if (mode_debug == true) {
@@ -325,62 +251,14 @@ int main(int argc, char *argv[]) {
     // Erode back wm
     // ------------------------------------------------------------------------
     cout << "    Eroding..." << endl;
-    // Clean temporary nifti
+    // Erode
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wm_data + i);
+        is_seed[i] = *(nii_wm_data + i) == 0;
     }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 1) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wm_data + i);
-        }
+    ln_distance_transform_3D(is_seed, dist.data(), NULL,
+                             size_x, size_y, size_z, dX, dY, dZ);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(nii_wm_data + i) = dist[i] > steps;
     }
 
     if (mode_debug == true) {
@@ -393,62 +271,14 @@ int main(int argc, char *argv[]) {
     cout << "  Polishing white + gray matter (wmgm)..." << endl;
     cout << "    Eroding..." << endl;
 
-    // Clean temporary nifti
+    // Erode
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wmgm_data + i);
+        is_seed[i] = *(nii_wmgm_data + i) == 0;
     }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 1) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) == 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wmgm_data + i);
-        }
+    ln_distance_transform_3D(is_seed, dist.data(), NULL,
+                             size_x, size_y, size_z, dX, dY, dZ);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(nii_wmgm_data + i) = dist[i] > steps;
     }
 
     if (mode_debug == true) {
@@ -491,62 +321,14 @@ int main(int argc, char *argv[]) {
     // ------------------------------------------------------------------------
     cout << "    Eroding..." << endl;
 
-    // Clean temporary nifti
+    // Dilate
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(nii_temp_data + i) = *(nii_wmgm_data + i);
+        is_seed[i] = *(nii_wmgm_data + i) != 0;
     }
-
-    // Dilate
-    for (uint32_t n = 0; n != steps; ++n) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_temp_data + i) == 0) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_temp_data + j) != 0) {
-                        *(nii_wmgm_data + i) = *(nii_temp_data + j);
-                    }
-                }
-            }
-        }
-        // Swap temp1 and temp2
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_temp_data + i) = *(nii_wmgm_data + i);
-        }
+    ln_distance_transform_3D(is_seed, dist.data(), NULL,
+                             size_x, size_y, size_z, dX, dY, dZ);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(nii_wmgm_data + i) = dist[i] <= steps;
     }
 
     if (mode_debug == true) {
@@ -1,6 +1,80 @@
 #include "../dep/laynii_lib.h"
 #include <sstream>
-#include <set>
+
+// ============================================================================
+// Simple point test
+// ============================================================================
+// NOTE: A voxel is a simple point (26/6 connectivity) if its object
+// neighbours form exactly one 26-connected component and the background
+// voxels of its 18-neighbourhood form exactly one 6-connected component that
+// touches a face of the voxel. Neighbourhoods are 27 bit masks (x fastest,
+// bit 13 is the center), so neighbourhood members are grown into components
+// with a few shifts. The masks that stop shifts from wrapping around the
+// 3x3x3 cube are tabulated once.
+uint32_t mask_not_x0 = 0, mask_not_x2 = 0, mask_not_y0 = 0, mask_not_y2 = 0;
+uint32_t mask_n6 = 0, mask_n18 = 0;
+const uint32_t mask_n27 = (1u << 27) - 1;
+
+void init_neighbourhood_tables() {
+    for (int a = 0; a != 27; ++a) {
+        const int ax = a % 3, ay = (a / 3) % 3, az = a / 9;
+        const int dist = abs(ax - 1) + abs(ay - 1) + abs(az - 1);
+        if (ax != 0) mask_not_x0 |= 1u << a;
+        if (ax != 2) mask_not_x2 |= 1u << a;
+        if (ay != 0) mask_not_y0 |= 1u << a;
+        if (ay != 2) mask_not_y2 |= 1u << a;
+        if (dist == 1) mask_n6 |= 1u << a;
+        if (dist == 1 || dist == 2) mask_n18 |= 1u << a;
+    }
+}
+
+// Shifts of all members by one voxel along each axis
+inline uint32_t shift_x(const uint32_t m) {
+    return ((m << 1) & mask_not_x0) | ((m >> 1) & mask_not_x2);
+}
+inline uint32_t shift_y(const uint32_t m) {
+    return ((m << 3) & mask_not_y0) | ((m >> 3) & mask_not_y2);
+}
+inline uint32_t shift_z(const uint32_t m) {
+    return ((m << 9) | (m >> 9)) & mask_n27;
+}
+
+inline uint32_t dilate_26(uint32_t m) {
+    m |= shift_x(m);
+    m |= shift_y(m);
+    return m | shift_z(m);
+}
+inline uint32_t dilate_6(const uint32_t m) {
+    return m | shift_x(m) | shift_y(m) | shift_z(m);
+}
+
+// Number of connected components of 'set' that contain a member of 'seeds'
+int count_components(uint32_t set, const bool is_26, const uint32_t seeds) {
+    int nr_components = 0;
+    while (set != 0) {
+        uint32_t component = set & (~set + 1);  // Lowest member
+        uint32_t previous = 0;
+        while (component != previous) {
+            previous = component;
+            component = (is_26 ? dilate_26(component) : dilate_6(component)) & set;
+        }
+        if ((component & seeds) != 0) nr_components += 1;
+        set &= ~component;
+    }
+    return nr_components;
+}
+
+bool is_simple_point(const uint32_t nb) {
+    const uint32_t object = nb & ~(1u << 13);
+    if (count_components(object, true, object) != 1) return false;
+    const uint32_t background = ~nb & mask_n18;
+    return count_components(background, false, mask_n6) == 1;
+}
+
+bool is_end_point(const uint32_t nb) {
+    const uint32_t object = nb & ~(1u << 13);
+    return object != 0 && (object & (object - 1)) == 0;  // Single neighbour
+}
 
 int show_help(void) {
     printf(
@@ -15,10 +89,16 @@ int show_help(void) {
     "Options:\n"
     "    -help   : Show this help.\n"
     "    -input  : Binary nifti image.\n"
-    "              will be computed for each volume.\n"
     "    -output : (Optional) Output basename for all outputs.\n"
-    "    -debug  : (Optional) Save extra intermediate outputs.\n"
+    "    -debug  : (Optional) Write the peeling depth of all input voxels,\n"
+    "              instead of only the skeleton voxels.\n"
     "\n"
+    "Notes:\n"
+    "    - Topology preserving thinning. The result is a curve skeleton that\n"
+    "      has the same connected components, cavities and tunnels as the input.\n"
+    "    - The second output (depth) is the number of peeling iterations until\n"
+    "      a voxel reached the border, i.e. its distance to the background in\n"
+    "      voxels. On the skeleton, this is the local half thickness.\n"
     "\n");
     return 0;
 }
@@ -75,10 +155,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -87,227 +163,153 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_input = copy_nifti_as_int16(nii1);
     int16_t* nii_input_data = static_cast<int16_t*>(nii_input->data);
 
-    // Prepare output image
+    // Prepare output images
     nifti_image* nii_output = copy_nifti_as_int16(nii_input);
     int16_t* nii_output_data = static_cast<int16_t*>(nii_output->data);
+    nifti_image* nii_depth = copy_nifti_as_int16(nii_input);
+    int16_t* nii_depth_data = static_cast<int16_t*>(nii_depth->data);
 
     // Set to zero
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         *(nii_output_data + i) = 0;
+        *(nii_depth_data + i) = 0;
     }
 
-    // Temporary voxels
-    nifti_image* nii_temp = copy_nifti_as_int16(nii_output);
-    int16_t* nii_temp_data = static_cast<int16_t*>(nii_temp->data);
-
     // ========================================================================
-    // Skeletonize WIP
+    // Prepare work volume
     // ========================================================================
-    cout << "  Computing..." << endl;
- 
-    std::set<uint32_t> set_initial;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) == 1) {
-            set_initial.insert(i);
+    // NOTE: The mask is padded with one background voxel on each side so that
+    // neighbourhoods never need boundary checks.
+    const int64_t px = size_x + 2, py = size_y + 2, pz = size_z + 2;
+    const int64_t nr_padded = px * py * pz;
+    std::vector<uint8_t> mask(nr_padded, 0);
+    std::vector<uint16_t> depth(nr_padded, 0);
+    auto padded = [&](uint32_t x, uint32_t y, uint32_t z) {
+        return (static_cast<int64_t>(z) + 1) * px * py + (static_cast<int64_t>(y) + 1) * px + x + 1;
+    };
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        for (uint32_t iy = 0; iy != size_y; ++iy) {
+            for (uint32_t ix = 0; ix != size_x; ++ix) {
+                if (*(nii_input_data + sub2ind_3D(ix, iy, iz, size_x, size_y)) != 0) {
+                    mask[padded(ix, iy, iz)] = 1;
+                }
+            }
         }
     }
 
-    int count = 1;
-    while (!set_initial.empty()) {
-    // int max_iter = 1;
-    // while (!set_initial.empty() && count <= max_iter) {
-        
-        cout << "  " << count << endl;
-
-        // ========================================================================
-        // Step 1: Separate fully connected voxels
-        // ========================================================================
-        std::set<uint32_t> set_connected, set_candidate;
-        uint32_t ix, iy, iz, j, k;
-        for (const auto i : set_initial) {
-            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-            uint8_t count = 0;
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                if (*(nii_input_data + j) == 1) count += 1;
-                if (*(nii_input_data + k) == 1) count += 1;
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                if (*(nii_input_data + j) == 1) count += 1;
-                if (*(nii_input_data + k) == 1) count += 1;
-            }
-            // ----------------------------------------------------------------
-            // 2-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                if (*(nii_input_data + j) == 1) count += 1;
-                if (*(nii_input_data + k) == 1) count += 1;
+    // Offsets of the 27 neighbourhood members, bit 13 is the center voxel
+    int64_t offset[27];
+    for (int dz = -1; dz <= 1; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                offset[(dz + 1) * 9 + (dy + 1) * 3 + dx + 1] = dz * px * py + dy * px + dx;
             }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                if (*(nii_input_data + j) == 1) count += 1;
-                if (*(nii_input_data + k) == 1) count += 1;
-            }
-
-            if (count == 8) {
-                set_connected.insert(i);
-            } else {
-                set_candidate.insert(i);
-            }
-        }
-
-        for (const auto i : set_connected) {
-            *(nii_temp_data + i) = 2;
-        }
-        for (const auto i : set_candidate) {
-            *(nii_temp_data + i) = 1;
-        }
-
-        if (mode_debug) {
-            save_output_nifti(fout, "step-1", nii_temp, false);
         }
+    }
+    // Face neighbours in the order of the directional sub-iterations
+    const int face[6] = {12, 14, 10, 16, 4, 22};  // -x, +x, -y, +y, -z, +z
+    const uint32_t face_mask = (1u << 4) | (1u << 10) | (1u << 12)
+                             | (1u << 14) | (1u << 16) | (1u << 22);
 
-        // ====================================================================
-        // Step 2: Eliminate candidates that are neighbouring fully connected
-        // ====================================================================
-        std::set<uint32_t> set_candidate2;
-        for (const auto i : set_candidate) {
-            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-            bool detector = false;
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 2) detector = true;
-                if (*(nii_temp_data + k) == 2) detector = true;
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 2) detector = true;
-                if (*(nii_temp_data + k) == 2) detector = true;
-            }
-            // ----------------------------------------------------------------
-            // 2-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 2) detector = true;
-                if (*(nii_temp_data + k) == 2) detector = true;
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 2) detector = true;
-                if (*(nii_temp_data + k) == 2) detector = true;
-            }
-
-            if (detector == false) {
-                set_candidate2.insert(i);
-            } 
-        }
+    init_neighbourhood_tables();
 
-        for (const auto i : set_candidate2) {
-            *(nii_temp_data + i) = 3;
+    auto get_neighbourhood = [&](const int64_t i) {
+        uint32_t nb = 0;
+        for (int n = 0; n != 27; ++n) {
+            nb |= static_cast<uint32_t>(mask[i + offset[n]]) << n;
         }
-
-        if (mode_debug) {
-            save_output_nifti(fout, "step-2", nii_temp, false);
+        return nb;
+    };
+
+    // Border voxels (object voxels with a background face neighbour) are the
+    // only ones that can be removed. Only these are kept in the queue.
+    std::vector<int64_t> queue, queue_next, candidates;
+    std::vector<uint8_t> in_queue(nr_padded, 0);
+    for (int64_t i = 0; i != nr_padded; ++i) {
+        if (mask[i] == 1 && (~get_neighbourhood(i) & face_mask) != 0) {
+            queue.push_back(i);
+            in_queue[i] = 1;
+            depth[i] = 1;
         }
+    }
 
-        // ====================================================================
-        // Step 3: Keep voxels that touch on selected
-        // ====================================================================
-        for (const auto i : set_candidate) {
-            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-            bool detector = false;
-            // ----------------------------------------------------------------
-            // 1-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 3) detector = true;
-                if (*(nii_temp_data + k) == 3) detector = true;
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 3) detector = true;
-                if (*(nii_temp_data + k) == 3) detector = true;
-            }
-            // ----------------------------------------------------------------
-            // 2-jump neighbours
-            // ----------------------------------------------------------------
-            if (ix > 0 && ix < end_x) {
-                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 3) detector = true;
-                if (*(nii_temp_data + k) == 3) detector = true;
-            }
-            if (iy > 0 && iy < end_y) {
-                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                k = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                if (*(nii_temp_data + j) == 3) detector = true;
-                if (*(nii_temp_data + k) == 3) detector = true;
+    // ========================================================================
+    // Skeletonize
+    // ========================================================================
+    // NOTE: Topology preserving thinning with six directional sub-iterations.
+    // In each sub-iteration, border voxels facing one direction that are
+    // simple points and not end points are collected first and then removed
+    // one by one, re-checking simplicity, so that topology is preserved.
+    // Voxels that can not be removed stay out of the queue until one of their
+    // neighbours is removed.
+    cout << "  Computing..." << endl;
+    int iteration = 1;
+    uint64_t nr_removed = 1;
+    while (nr_removed != 0) {
+        nr_removed = 0;
+        for (int d = 0; d != 6; ++d) {
+            // Collect candidates
+            candidates.clear();
+            queue_next.clear();
+            for (const int64_t i : queue) {
+                if (mask[i] == 0) {
+                    in_queue[i] = 0;
+                    continue;
+                }
+                const uint32_t nb = get_neighbourhood(i);
+                if ((~nb & face_mask) == 0 || is_end_point(nb) || !is_simple_point(nb)) {
+                    in_queue[i] = 0;
+                    continue;
+                }
+                queue_next.push_back(i);
+                if (mask[i + offset[face[d]]] == 0) {
+                    candidates.push_back(i);
+                }
             }
-
-            if (detector == true) {
-                set_candidate2.insert(i);
+            queue.swap(queue_next);
+
+            // Remove candidates that are still simple points
+            for (const int64_t i : candidates) {
+                const uint32_t nb = get_neighbourhood(i);
+                if (is_end_point(nb) || !is_simple_point(nb)) continue;
+                mask[i] = 0;
+                nr_removed += 1;
+                for (int n = 0; n != 27; ++n) {
+                    const int64_t j = i + offset[n];
+                    if (mask[j] == 1 && in_queue[j] == 0) {
+                        queue.push_back(j);
+                        in_queue[j] = 1;
+                    }
+                    if (mask[j] == 1 && depth[j] == 0 && ((face_mask >> n) & 1)) {
+                        depth[j] = iteration + 1;
+                    }
+                }
             }
         }
-
-        // ====================================================================
-        // Step 6: Replace the initial set with fully connected voxels
-        // ====================================================================
-        // Only operate on the fully connected voxels in the next iteration
-        for (const auto i : set_candidate) {
-            *(nii_input_data + i) = 0;
-        }
-
-        // Clear temporary data
-        for (const auto i : set_initial) {
-            *(nii_temp_data + i) = 0;
-        }
-
-        // Write out the determined skeleton pieces
-        for (const auto i : set_candidate2) {
-            // *(nii_output_data + i) = count;
-            *(nii_output_data + i) = 1;
-        }
-
-        // Refresh the sets in preparation to the next iteration
-        set_initial.swap(set_connected);
-        set_connected.clear();
-        set_candidate.clear();
-        set_candidate2.clear();
-
-        count += 1;
+        cout << "\r    Iteration " << iteration << ", removed voxels: "
+             << nr_removed << "          " << flush;
+        iteration += 1;
     }
-
-    // ========================================================================
-    // Step 4?: Dilate chosen?
-    // ========================================================================
-
-    // ========================================================================
-    // Step 5?: Symmetry filter
-    // ========================================================================
+    cout << endl;
 
     // ========================================================================
     cout << "  Saving output..." << endl;
-    save_output_nifti(fout, "test", nii_output, true);
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        for (uint32_t iy = 0; iy != size_y; ++iy) {
+            for (uint32_t ix = 0; ix != size_x; ++ix) {
+                const uint32_t i = sub2ind_3D(ix, iy, iz, size_x, size_y);
+                const int64_t p = padded(ix, iy, iz);
+                if (mask[p] == 1) {
+                    *(nii_output_data + i) = 1;
+                    *(nii_depth_data + i) = depth[p];
+                } else if (mode_debug && *(nii_input_data + i) != 0) {
+                    *(nii_depth_data + i) = depth[p];
+                }
+            }
+        }
+    }
+    save_output_nifti(fout, "skeleton", nii_output, true);
+    save_output_nifti(fout, "skeleton_depth", nii_depth, true);
 
     cout << "\n  Finished." << endl;
     return 0;
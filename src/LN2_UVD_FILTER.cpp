@@ -185,7 +185,7 @@ int main(int argc, char* argv[]) {
         return 2;
     }
     nii4 = nifti_image_read(fin4, 1);
-    if (!nii3) {
+    if (!nii4) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin4);
         return 2;
     }
@@ -256,31 +256,41 @@ int main(int argc, char* argv[]) {
     }
 
     // ========================================================================
-    // Visit each voxel to check their coordinate
+    // Build spatial index over UVD coordinates
     // ========================================================================
+    // NOTE: Cells are as wide as the cylinder radius and half as high, so
+    // each window only visits a handful of cells instead of all voxels.
     float half_height = height / 2;
-    float radius_sqr = radius * radius;
+    ln_uvd_grid grid;
+    ln_uvd_grid_build(grid, vec_u.data(), vec_v.data(), vec_d.data(), nr_voi,
+                      radius, half_height);
+
+    // ========================================================================
+    // Visit each voxel to check their coordinate
+    // ========================================================================
+    vector <uint32_t> neighbors;
+    vector <float> temp_vec;
+    vector <int> temp_vec_id;
+    vector <float> temp_vec_d;
     for (int i = 0; i != nr_voi; ++i) {
-        cout << "\r    " << i * 100 / nr_voi << " %" << flush;
-        vector <float> temp_vec;
-        vector <int> temp_vec_id;
-        vector <float> temp_vec_d;
+        if (i % 1000 == 0) {
+            cout << "\r    " << i * 100 / nr_voi << " %" << flush;
+        }
 
         // --------------------------------------------------------------------
         // Cylinder windowing in UVD space
         // --------------------------------------------------------------------
-        for (int j = 0; j != nr_voi; ++j) {
-            // Compute distances relative to reference UVD
-            if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    temp_vec.push_back(vec_val[j]);
-                    temp_vec_id.push_back(vec_voi_id[j]);
-                    temp_vec_d.push_back(vec_d[j]);
-
-                }
-            }
+        neighbors.clear();
+        ln_uvd_grid_query_cylinder(grid, vec_u.data(), vec_v.data(), vec_d.data(),
+                                   vec_u[i], vec_v[i], vec_d[i],
+                                   radius, half_height, neighbors);
+        temp_vec.clear();
+        temp_vec_id.clear();
+        temp_vec_d.clear();
+        for (uint32_t j : neighbors) {
+            temp_vec.push_back(vec_val[j]);
+            temp_vec_id.push_back(vec_voi_id[j]);
+            temp_vec_d.push_back(vec_d[j]);
         }
 
         int n = temp_vec.size();
@@ -290,15 +300,14 @@ int main(int argc, char* argv[]) {
         if (mode_median) {
             float m;
             if (n % 2 == 0) {  // even
+                // Lower middle is the largest value below the upper middle
                 std::nth_element(temp_vec.begin(),
                 temp_vec.begin() + n / 2,
                 temp_vec.end());
+                float lower = *std::max_element(temp_vec.begin(),
+                                                temp_vec.begin() + n / 2);
 
-                std::nth_element(temp_vec.begin(),
-                temp_vec.begin() + (n - 1) / 2,
-                temp_vec.end());
-
-                m = (temp_vec[n / 2] + temp_vec[(n - 1) / 2]) / 2.0;
+                m = (temp_vec[n / 2] + lower) / 2.0;
 
             } else {  // odd
                 std::nth_element(temp_vec.begin(),
@@ -412,14 +421,19 @@ int main(int argc, char* argv[]) {
         // NOTE: temp_mask = 1 or 0
         // --------------------------------------------------------------------
         if (mode_peak) {
-            float temp_ref = vec_val[i];
+            // NOTE: Window members are not visited in voxel order anymore.
+            // Ties are resolved to the lowest voxel index, as before.
             float temp_max = vec_val[i];
             float temp_peak = vec_d[i];
+            int temp_peak_id = -1;
 
             for (int j = 0; j != n; ++j) {
-                if (temp_vec[j] > temp_max) {
+                if (temp_vec[j] > temp_max
+                    || (temp_peak_id != -1 && temp_vec[j] == temp_max
+                        && temp_vec_id[j] < temp_peak_id)) {
                     temp_max = temp_vec[j];
                     temp_peak = temp_vec_d[j];
+                    temp_peak_id = temp_vec_id[j];
                 }
             }
             *(nii_output_data + vec_voi_id[i]) = temp_peak;
@@ -455,6 +469,9 @@ int main(int argc, char* argv[]) {
         save_output_nifti(fout, "UVD_columns_mode_filter", nii_output, true);
         save_output_nifti(fout, "UVD_columns_mode_filter_window_count_ratio", nii_output_extra, true);
         save_output_nifti(fout, "UVD_columns_mode_filter_window_count", temp_nii_output_extra, true);
+    } else if (mode_count_uniques) {
+        save_output_nifti(fout, "UVD_count_uniques", nii_output, true);
+        save_output_nifti(fout, "UVD_count_uniques_window_count", temp_nii_output_extra, true);
     }
 
     cout << "\n  Finished." << endl;
@@ -2,28 +2,6 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
-#include <numeric>
-
-// ============================================================================
-// NOTE(Faruk): From <https://stackoverflow.com/questions/1577475/c-sorting-and-keeping-track-of-indexes>
-template <typename T>
-vector<size_t> sort_indexes(const vector<T> &v) {
-
-    // initialize original index locations
-    vector<size_t> idx(v.size());
-    iota(idx.begin(), idx.end(), 0);
-
-    // sort indexes based on comparing values in v
-    // using std::stable_sort instead of std::sort
-    // to avoid unnecessary index re-orderings
-    // when v contains elements of equal values
-    stable_sort(idx.begin(), idx.end(),
-        [&v](size_t i1, size_t i2) {return v[i1] < v[i2];});
-
-    return idx;
-}
-
-// ============================================================================
 
 int show_help(void) {
     printf(
@@ -42,12 +20,23 @@ int show_help(void) {
     "                For example either LN2_LAYERS output named 'metric'.\n"
     "    -radius   : Radius of cylinder that will be passed over UV coordinates.\n"
     "                In units of UV coordinates, which often are in mm.\n"
+    "                Multiple comma separated radii (e.g. '1,2,3') can be given\n"
+    "                to fit all of them in one run. Outputs are then tagged\n"
+    "                with '_r<radius>'.\n"
     "    -height   : Height of cylinder that will be passed over D (depth)\n"
     "                coordinates. In units of normalized depth metric, which\n"
     "                are often in 0-1 range. The cylinder is centered around each voxel\n"
     "                therefore, to ensure all depth is included, this parameter should be\n"
     "                set to 2 when normalized depth metrics are being used.\n"
+    "    -depth    : (Optional) Use depth as regressor (linear depth profile).\n"
+    "                By default a flat profile is fitted, where the intercept\n"
+    "                is the mean and the slope is zero.\n"
     "    -output   : (Optional) Output basename for all outputs.\n"
+    "\n"
+    "Notes:\n"
+    "    - Voxels are binned into a fine UVD grid with per cell sums (sufficient\n"
+    "      statistics). Cells that are fully inside a cylinder are added as a\n"
+    "      whole, only cells on the cylinder border are visited voxel by voxel.\n"
     "\n");
     return 0;
 }
@@ -57,7 +46,10 @@ int main(int argc, char* argv[]) {
     nifti_image *nii1 = NULL, *nii2 = NULL, *nii3 = NULL;
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL;
     int ac;
-    float radius = 3, height = 0.25;
+    float height = 0.25;
+    vector<float> radii;
+    vector<string> radii_str;
+    bool mode_depth = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -89,13 +81,20 @@ int main(int argc, char* argv[]) {
                 fprintf(stderr, "** missing argument for -radius\n");
                 return 1;
             }
-            radius = atof(argv[ac]);
+            std::istringstream iss(argv[ac]);
+            string token;
+            while (std::getline(iss, token, ',')) {
+                radii.push_back(atof(token.c_str()));
+                radii_str.push_back(token);
+            }
         } else if (!strcmp(argv[ac], "-height")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -height\n");
                 return 1;
             }
             height = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-depth")) {
+            mode_depth = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -120,6 +119,10 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "** missing option '-coords_d'\n");
         return 1;
     }
+    if (radii.empty()) {
+        radii.push_back(3);
+        radii_str.push_back("3");
+    }
 
     // Read input dataset, including data
     nii1 = nifti_image_read(fin1, 1);
@@ -166,14 +169,6 @@ int main(int argc, char* argv[]) {
     nifti_image* nii_residuals = copy_nifti_as_float32(nii_input);
     float* nii_residual_data = static_cast<float*>(nii_residuals->data);
 
-    // Zero output niftis
-    for (int i = 0; i != nr_voxels; ++i) {
-        *(nii_slope_data + i) = 0;
-        *(nii_intercept_data + i) = 0;
-        *(nii_samples_data + i) = 0;
-        *(nii_residual_data + i) = 0;
-    }
-
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is required for substantial
     // speed boost.
@@ -193,98 +188,172 @@ int main(int argc, char* argv[]) {
     }
 
     // ========================================================================
-    // Visit each voxel
+    // Accumulate sufficient statistics per grid cell
     // ========================================================================
-    cout << "  Fitting..." << endl;
-
-    float half_height = height / 2;
-    float radius_sqr = radius * radius;
-    for (int i = 0; i != nr_voi; ++i) {
-        // --------------------------------------------------------------------
-        // Cylinder windowing in UVD space
-        // --------------------------------------------------------------------
-        vector <float> vec_y;
-        for (int j = 0; j != nr_voi; ++j) {
-            cout << "\r    " << i << "/" << nr_voi << flush;
+    // NOTE: Cells are a fraction of the smallest cylinder, so most cells
+    // of a window are fully inside and enter the fit as a few sums.
+    const float half_height = height / 2;
+    const float min_radius = *std::min_element(radii.begin(), radii.end());
+    ln_uvd_grid grid;
+    ln_uvd_grid_build(grid, vec_u.data(), vec_v.data(), vec_d.data(), nr_voi,
+                      min_radius / 4, half_height / 2);
+
+    const uint64_t nr_cells = grid.cell_start.size() - 1;
+    // Per cell: n, sum x, sum y, sum xx, sum xy, sum yy
+    vector <double> cell_sums(nr_cells * 6, 0);
+    // Per cell: bounding box of its voxels (u, v, d minimum and maximum)
+    vector <float> cell_box(nr_cells * 6, 0);
+
+    // Design matrix is [1, x]. Flat profile (x = 1) or linear depth (x = d)
+    vector <float> vec_x(nr_voi, 1.0);
+    if (mode_depth) {
+        vec_x = vec_d;
+    }
 
-            // Compute distances relative to reference UVD
-            if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    vec_y.push_back(vec_val[j]);
-                }
+    for (uint64_t c = 0; c != nr_cells; ++c) {
+        double* sums = &cell_sums[c * 6];
+        float* box = &cell_box[c * 6];
+        for (uint32_t k = grid.cell_start[c]; k != grid.cell_start[c + 1]; ++k) {
+            const uint32_t j = grid.point_ids[k];
+            const double x = vec_x[j], y = vec_val[j];
+            sums[0] += 1;
+            sums[1] += x;
+            sums[2] += y;
+            sums[3] += x * x;
+            sums[4] += x * y;
+            sums[5] += y * y;
+            if (k == grid.cell_start[c]) {
+                box[0] = box[1] = vec_u[j];
+                box[2] = box[3] = vec_v[j];
+                box[4] = box[5] = vec_d[j];
+            } else {
+                box[0] = std::min(box[0], vec_u[j]);
+                box[1] = std::max(box[1], vec_u[j]);
+                box[2] = std::min(box[2], vec_v[j]);
+                box[3] = std::max(box[3], vec_v[j]);
+                box[4] = std::min(box[4], vec_d[j]);
+                box[5] = std::max(box[5], vec_d[j]);
             }
         }
+    }
 
-        int n = vec_y.size();
-        if (n > 1) {
-            // ----------------------------------------------------------------
-            // Sort vector by depth
-            // ----------------------------------------------------------------
-            vector <float> vec_y_sorted(n);
-            int k = 0;
-            for (auto j: sort_indexes(vec_d)) {
-              vec_y_sorted[k] = vec_y[j];
-              k += 1;
-            }
+    // ========================================================================
+    // Visit each voxel
+    // ========================================================================
+    for (uint32_t r = 0; r != radii.size(); ++r) {
+        const float radius = radii[r];
+        const float radius_sqr = radius * radius;
+        cout << "  Fitting (radius " << radii_str[r] << ")..." << endl;
+        for (int i = 0; i != nr_voxels; ++i) {
+            *(nii_slope_data + i) = 0;
+            *(nii_intercept_data + i) = 0;
+            *(nii_samples_data + i) = 0;
+            *(nii_residual_data + i) = 0;
+        }
 
-            // ----------------------------------------------------------------
-            // Create design matrix
-            // ----------------------------------------------------------------
-            // TODO(Faruk): All ones flat profile for now. I need to find a way
-            // to allow users to choose this.
-            vector <float> vec_x(n, 1.0);
+        for (int i = 0; i != nr_voi; ++i) {
+            if (i % 1000 == 0) {
+                cout << "\r    " << i << "/" << nr_voi << flush;
+            }
+            const float u0 = vec_u[i], v0 = vec_v[i], d0 = vec_d[i];
 
             // ----------------------------------------------------------------
-            // Compute the least-squares solution to a linear matrix equation
+            // Cylinder windowing in UVD space
             // ----------------------------------------------------------------
-            float vec_x_sum = std::accumulate(vec_x.begin(), vec_x.end(), 0);
-            float vec_y_sum = std::accumulate(vec_y.begin(), vec_y.end(), 0);
-            float vec_x_avg = vec_x_sum / n;
-            float vec_y_avg = vec_y_sum / n;
-
-
-            float var_x = 0;
-            float cov_xy = 0;
-            float slope = 0, intercept_y = 0, residual = 0;
-
-            for (int j = 0; j != n; ++j) {
-                float temp = vec_x[j] - vec_x_avg;
-                var_x += temp * temp;
-                cov_xy += temp * (vec_y[j] - vec_y_avg);
+            double sums[6] = {0, 0, 0, 0, 0, 0};
+            int iu0, iu1, iv0, iv1, id0, id1;
+            ln_uvd_grid_cell_bounds(grid, u0, v0, d0, radius, half_height,
+                                    iu0, iu1, iv0, iv1, id0, id1);
+            for (int id = id0; id <= id1; ++id) {
+                for (int iv = iv0; iv <= iv1; ++iv) {
+                    for (int iu = iu0; iu <= iu1; ++iu) {
+                        const uint64_t c = (static_cast<uint64_t>(id) * grid.nv + iv) * grid.nu + iu;
+                        if (grid.cell_start[c] == grid.cell_start[c + 1]) {
+                            continue;
+                        }
+                        const float* box = &cell_box[c * 6];
+
+                        // Farthest and nearest points of the cell box
+                        float du_far = std::max(std::abs(u0 - box[0]), std::abs(u0 - box[1]));
+                        float dv_far = std::max(std::abs(v0 - box[2]), std::abs(v0 - box[3]));
+                        float dd_far = std::max(std::abs(d0 - box[4]), std::abs(d0 - box[5]));
+                        float du_near = std::max(std::max(box[0] - u0, u0 - box[1]), 0.f);
+                        float dv_near = std::max(std::max(box[2] - v0, v0 - box[3]), 0.f);
+                        float dd_near = std::max(std::max(box[4] - d0, d0 - box[5]), 0.f);
+
+                        if (du_near*du_near + dv_near*dv_near >= radius_sqr
+                            || dd_near >= half_height) {  // Fully outside
+                            continue;
+                        }
+                        if (du_far*du_far + dv_far*dv_far < radius_sqr
+                            && dd_far < half_height) {  // Fully inside
+                            for (int m = 0; m != 6; ++m) {
+                                sums[m] += cell_sums[c * 6 + m];
+                            }
+                            continue;
+                        }
+                        for (uint32_t k = grid.cell_start[c]; k != grid.cell_start[c + 1]; ++k) {
+                            const uint32_t j = grid.point_ids[k];
+                            if (std::abs(d0 - vec_d[j]) < half_height) {  // Check height
+                                float dist_uv = (u0 - vec_u[j])*(u0 - vec_u[j])
+                                    + (v0 - vec_v[j])*(v0 - vec_v[j]);
+                                if (dist_uv < radius_sqr) {  // Check Euclidean distance
+                                    const double x = vec_x[j], y = vec_val[j];
+                                    sums[0] += 1;
+                                    sums[1] += x;
+                                    sums[2] += y;
+                                    sums[3] += x * x;
+                                    sums[4] += x * y;
+                                    sums[5] += y * y;
+                                }
+                            }
+                        }
+                    }
+                }
             }
 
-            if (var_x != 0) {
-                slope = cov_xy / var_x;
-                intercept_y = vec_y_avg - (slope * vec_x_avg);
-            } else {
-                slope = 0;  // avoid nans
-                intercept_y = vec_y_avg;
-            }
+            const double n = sums[0];
+            if (n > 1) {
+                // ------------------------------------------------------------
+                // Least-squares solution from the normal equations
+                // ------------------------------------------------------------
+                const double x_avg = sums[1] / n;
+                const double y_avg = sums[2] / n;
+                const double var_x = sums[3] - n * x_avg * x_avg;
+                const double cov_xy = sums[4] - n * x_avg * y_avg;
+                const double var_y = sums[5] - n * y_avg * y_avg;
+
+                double slope, intercept_y, residual;
+                if (var_x > 1e-12 * sums[3]) {
+                    slope = cov_xy / var_x;
+                    intercept_y = y_avg - (slope * x_avg);
+                    residual = (var_y - slope * cov_xy) / n;
+                } else {
+                    slope = 0;  // avoid nans
+                    intercept_y = y_avg;
+                    residual = var_y / n;
+                }
 
-            // Compute residuals
-            for (int j = 0; j != n; ++j) {
-                float y_hat = vec_x[j] * slope + intercept_y;
-                residual += (vec_y[j] - y_hat) * (vec_y[j] - y_hat);
+                // ------------------------------------------------------------
+                // Write results inside nifti
+                // ------------------------------------------------------------
+                *(nii_slope_data + vec_voi_id[i]) = slope;
+                *(nii_intercept_data + vec_voi_id[i]) = intercept_y;
+                *(nii_samples_data + vec_voi_id[i]) = n;
+                *(nii_residual_data + vec_voi_id[i]) = std::max(residual, 0.0);
             }
-            residual /= n;
+        }
+        cout << endl;
 
-            // ----------------------------------------------------------------
-            // Write median inside nifti
-            // ----------------------------------------------------------------
-            *(nii_slope_data + vec_voi_id[i]) = slope;
-            *(nii_intercept_data + vec_voi_id[i]) = intercept_y;
-            *(nii_samples_data + vec_voi_id[i]) = n;
-            *(nii_residual_data + vec_voi_id[i]) = residual;
+        string tag = "";
+        if (radii.size() > 1) {
+            tag = "_r" + radii_str[r];
         }
+        save_output_nifti(fout, "UVD_lstsqr_slope" + tag, nii_slope, true);
+        save_output_nifti(fout, "UVD_lstsqr_intercept" + tag, nii_intercept, true);
+        save_output_nifti(fout, "UVD_lstsqr_samples" + tag, nii_samples, true);
+        save_output_nifti(fout, "UVD_lstsqr_residuals" + tag, nii_residuals, true);
     }
-    cout << endl;
-
-    save_output_nifti(fout, "UVD_lstsqr_slope", nii_slope, true);
-    save_output_nifti(fout, "UVD_lstsqr_intercept", nii_intercept, true);
-    save_output_nifti(fout, "UVD_lstsqr_samples", nii_samples, true);
-    save_output_nifti(fout, "UVD_lstsqr_residuals", nii_residuals, true);
 
     cout << "\n  Finished." << endl;
     return 0;
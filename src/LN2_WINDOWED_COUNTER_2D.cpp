@@ -1,14 +1,15 @@
 
 #include "../dep/laynii_lib.h"
 #include <sstream>
-#include <set>
-#include <unordered_set>
+#include <algorithm>
 
 
 int show_help(void) {
     printf(
     "LN2_WINDOWED_COUNTER_2D: Count uniquely labeled voxels using circular windows.\n"
-    "                         Expects isotropic input.\n"
+    "                         Expects isotropic input. Counts are computed for\n"
+    "                         every voxel within the circle inscribed in the\n"
+    "                         image (first slice only).\n"
     "\n"
     "!!! EXPERIMENTAL !!!\n"
     "\n"
@@ -87,9 +88,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_x = nii_input->nx;
     const uint32_t size_y = nii_input->ny;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-
     const uint32_t nr_voxels = size_x * size_y;
 
     // ========================================================================
@@ -100,156 +98,138 @@ int main(int argc, char*  argv[]) {
     // Prepare output nifti
     nifti_image* nii2 = copy_nifti_as_int32(nii1);
     int32_t* nii2_data = static_cast<int32_t*>(nii2->data);
-    for (int i = 0; i != nr_voxels; ++i) {
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
         *(nii2_data + i) = 0;
     }
-    nifti_image* nii3 = copy_nifti_as_int32(nii2);
-    int32_t* nii3_data = static_cast<int32_t*>(nii3->data);
-
-    // Prepare coordinates
-    nifti_image* coord_x = copy_nifti_as_float32(nii_input);
-    float* coord_x_data = static_cast<float*>(coord_x->data);
-    nifti_image* coord_y = copy_nifti_as_float32(nii_input);
-    float* coord_y_data = static_cast<float*>(coord_y->data);
-
-    float ix, iy, iz;
-    for (int i = 0; i != nr_voxels; ++i) {
-        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-        *(coord_x_data + i) = ix;
-        *(coord_y_data + i) = iy;
-    }
-
-    if (mode_debug) {
-        save_output_nifti(fout, "coord-x", coord_x, true);
-        save_output_nifti(fout, "coord-y", coord_y, true);
-    }
 
     // ========================================================================
-    // Prepare voxels of interest that will be looped through
+    // Prepare voxels of interest
     // ========================================================================
-    // NOTE[Faruk]: Hardcoding 3 step jumps for now.
-    float radius_inscribed = (size_x/2) * (size_x/2);
-    std::set<uint32_t> idx;
-    for (int x = 1; x < size_x; x+=3) {
-        for (int y = 1; y < size_y; y+=3) {
-            uint32_t i = x * size_y + y;  // sub2ind_2D
-
-            // Check if the voxel is in the inscribed circle.
-            // NOTE: Assumes equal data dimensions. e.g. 1000 x 1000
-            float xx = *(coord_x_data + i) - (size_x-1)/2;
-            float yy = *(coord_y_data + i) - (size_y-1)/2;
+    // Only voxels within the circle inscribed in the image are used, both as
+    // window centers and as window members.
+    const uint32_t size_min = std::min(size_x, size_y);
+    float radius_inscribed = (size_min/2) * (size_min/2);
+    float center_x = (size_x - 1) / 2;
+    float center_y = (size_y - 1) / 2;
+
+    // Remap labels to dense indices so that label counts can be kept in a
+    // plain vector. Zero labels and voxels outside of the circle are -1.
+    std::vector<int32_t> labels_sorted;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii1_data + i) != 0) {
+            labels_sorted.push_back(*(nii1_data + i));
+        }
+    }
+    std::sort(labels_sorted.begin(), labels_sorted.end());
+    labels_sorted.erase(std::unique(labels_sorted.begin(), labels_sorted.end()),
+                        labels_sorted.end());
+
+    std::vector<int32_t> dense(nr_voxels, -1);
+    std::vector<bool> mask(nr_voxels, false);
+    uint32_t nr_samples = 0;
+    for (uint32_t y = 0; y != size_y; ++y) {
+        for (uint32_t x = 0; x != size_x; ++x) {
+            uint32_t i = y * size_x + x;
+            float xx = x - center_x;
+            float yy = y - center_y;
             if ((xx*xx + yy*yy) < radius_inscribed) {
-                idx.insert(i);
+                mask[i] = true;
+                nr_samples++;
+                if (*(nii1_data + i) != 0) {
+                    dense[i] = std::lower_bound(labels_sorted.begin(), labels_sorted.end(),
+                                                *(nii1_data + i)) - labels_sorted.begin();
+                }
             }
         }
     }
 
     std::cout << "  Number of voxels : " << nr_voxels << std::endl;
-    std::cout << "  Number of samples: " << idx.size() << std::endl;
-
-    for (auto i = idx.begin(); i != idx.end(); ++i) {
-        *(nii2_data + *i) = 1;
-    }
+    std::cout << "  Number of samples: " << nr_samples << std::endl;
+    std::cout << "  Number of labels : " << labels_sorted.size() << std::endl;
 
     if (mode_debug) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(nii2_data + i) = mask[i];
+        }
         save_output_nifti(fout, "samples", nii2, true);
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(nii2_data + i) = 0;
+        }
     }
 
     // ========================================================================
     // Evaluate windows
     // ========================================================================
+    // NOTE: The circular window slides along each row. Per label reference
+    // counts are updated by removing the column of voxels leaving the window
+    // on the left and adding the column entering on the right, for each row
+    // offset of the window. This is O(radius) work per voxel.
     cout << "\n  Start counting unique voxels within windows..." << endl;
 
     float RADSQR = RADIUS*RADIUS;
 
-    std::unordered_set<int32_t> unique_ids;
-    unique_ids.reserve(idx.size());
-
-    int progressInterval = 100;
-    int progressCounter = 0;
-    int k = 1;
-    float jx, jy;
-    for (auto i = idx.begin(); i != idx.end(); ++i) {
-        ix = *(coord_x_data + *i);
-        iy = *(coord_y_data + *i);
-
-        for (auto j = idx.begin(); j != idx.end(); ++j) {
-            jx = *(coord_x_data + *j) - ix;
-            jy = *(coord_y_data + *j) - iy;
-
-            if (abs(jx) < RADIUS && abs(jy) < RADIUS) {
-                if ((jx*jx + jy*jy) < RADSQR) {
-                    unique_ids.insert(*(nii1_data + *j));
-                }
+    // Half width of the window for each row offset
+    int r_max = std::max(RADIUS, 0);
+    std::vector<int> half_width(2 * r_max + 1, -1);
+    for (int dy = -r_max; dy <= r_max; ++dy) {
+        for (int dx = 0; dx <= r_max; ++dx) {
+            if (static_cast<float>(dx*dx + dy*dy) < RADSQR) {
+                half_width[dy + r_max] = dx;
             }
         }
-        unique_ids.erase(0);
-        *(nii2_data + *i) = static_cast<int32_t>(unique_ids.size());
-        unique_ids.clear();
-
-        // Output progress in intervals iterations
-        progressCounter++;
-        if (progressCounter == progressInterval) {
-            std::cout << "\r    Processed: " << k << " out of " << idx.size() << std::flush;
-            progressCounter = 0;
-        }
-        ++k;
-    }
-    std::cout << "\r    Processed: " << k-1 << " out of " << idx.size() << std::endl;
-
-    if (mode_debug) {
-        save_output_nifti(fout, "first_samples", nii2, true);
     }
 
-    // ========================================================================
-    // Fill unsampled voxels
-    // ========================================================================
-    cout << "\n  Start filling in unsampled voxels..." << endl;
-
-    uint32_t j;
-    for (auto i = idx.begin(); i != idx.end(); ++i) {
-        tie(ix, iy, iz) = ind2sub_3D(*i, size_x, size_y);
-
-        // --------------------------------------------------------------------
-        // 1-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0) {
-            j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
+    const int sx = size_x;
+    const int sy = size_y;
+    std::vector<uint32_t> label_count(labels_sorted.size(), 0);
+    uint32_t nr_unique = 0;
+
+    auto add_voxel = [&](int x, int y) {
+        if (x < 0 || x >= sx || y < 0 || y >= sy) return;
+        int32_t l = dense[y * sx + x];
+        if (l >= 0) {
+            if (label_count[l] == 0) nr_unique++;
+            label_count[l]++;
         }
-        if (ix < end_x) {
-            j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
+    };
+    auto remove_voxel = [&](int x, int y) {
+        if (x < 0 || x >= sx || y < 0 || y >= sy) return;
+        int32_t l = dense[y * sx + x];
+        if (l >= 0) {
+            label_count[l]--;
+            if (label_count[l] == 0) nr_unique--;
         }
-        if (iy > 0) {
-            j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
-        }
-        if (iy < end_y) {
-            j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
+    };
+
+    for (int y = 0; y != sy; ++y) {
+        // Initial window at the start of the row
+        std::fill(label_count.begin(), label_count.end(), 0);
+        nr_unique = 0;
+        for (int dy = -r_max; dy <= r_max; ++dy) {
+            int w = half_width[dy + r_max];
+            for (int dx = -w; dx <= w; ++dx) {
+                add_voxel(dx, y + dy);
+            }
         }
 
-        // --------------------------------------------------------------------
-        // 2-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0 && iy > 0) {
-            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
-        }
-        if (ix > 0 && iy < end_y) {
-            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
-        }
-        if (ix < end_x && iy > 0) {
-            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
-        }
-        if (ix < end_x && iy < end_y) {
-            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-            *(nii2_data + j) = *(nii2_data + *i);
+        for (int x = 0; x != sx; ++x) {
+            if (x > 0) {
+                for (int dy = -r_max; dy <= r_max; ++dy) {
+                    int w = half_width[dy + r_max];
+                    if (w < 0) continue;
+                    remove_voxel(x - 1 - w, y + dy);
+                    add_voxel(x + w, y + dy);
+                }
+            }
+            uint32_t i = y * sx + x;
+            if (mask[i]) {
+                *(nii2_data + i) = static_cast<int32_t>(nr_unique);
+            }
         }
+
+        std::cout << "\r    Processed rows: " << y + 1 << " out of " << sy << std::flush;
     }
+    std::cout << std::endl;
 
     // Save
     save_output_nifti(fout, "counts_rad-"+tag_rad.str(), nii2, true);
@@ -1,5 +1,6 @@
 #include "../dep/laynii_lib.h"
 #include <sstream>
+#include <fstream>
 
 int show_help(void) {
     printf(
@@ -15,6 +16,12 @@ int show_help(void) {
     "    -domain : 3D nifti file that contains non-zero voxel where zero crossings\n"
     "              will be computed. In other words, a mask file.\n"
     "    -output : (Optional) Output basename for all outputs.\n"
+    "\n"
+    "Notes:\n"
+    "    - Besides the voxel mask, the zero surface within the domain is saved\n"
+    "      as a binary '_zero_crossing.ply' triangle mesh. Vertices are linearly\n"
+    "      interpolated between voxels and given in scanner coordinates (sform,\n"
+    "      else qform). Normals point towards positive values.\n"
     "\n");
     return 0;
 }
@@ -103,299 +110,230 @@ int main(int argc, char*  argv[]) {
     // Output nifti
     nifti_image* nii_out = copy_nifti_as_int32(nii1);
     int32_t* nii_out_data = static_cast<int32_t*>(nii_out->data);
-    free(nii1);
 
     // Clean output array
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         *(nii_out_data + i) = 0;
     }
 
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_domain_data + i) != 0) {
-            nr_voi += 1;
-        }
-    }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
-
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_domain_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
-    }
-
     // ========================================================================
-    // Find zero crossing neighboring voxels
+    // Find zero crossings cell by cell
     // ========================================================================
-    cout << "\n  Finding zero crossing neighbour voxels..." << endl;
+    // NOTE: A cell is a 2x2x2 block of voxels. Any two 26-neighbours share at
+    // least one cell, and all corners of a cell are 26-neighbours of each
+    // other. So a domain voxel has a domain neighbour of opposite sign exactly
+    // when it is a corner of a cell whose domain corners have both signs.
+    // Cells with all corners in the domain are also split into six
+    // tetrahedra (sharing the main diagonal) to extract the zero surface with
+    // linearly interpolated vertices. Vertices sit on tetrahedra edges, which
+    // all run from a corner to a corner with more bits set. An edge is keyed
+    // by its start voxel and its direction (7 directions), so vertices are
+    // shared between cells through two slices of vertex ids, without a hash.
+    cout << "\n  Finding zero crossings..." << endl;
 
-    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t ix, iy, iz, i, j;
-        i = *(voi_id + ii);
-        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+    const uint32_t nxy = size_x * size_y;
+    const uint32_t cells_x = size_x > 1 ? end_x : 1;
+    const uint32_t cells_y = size_y > 1 ? end_y : 1;
+    const uint32_t cells_z = size_z > 1 ? end_z : 1;
+    const bool mode_mesh = size_x > 1 && size_y > 1 && size_z > 1;
 
-        // Check sign changes between neighbouring voxels
-        float m = *(nii_values_data + i);
-        float n;
+    // Cube corner c has offsets (c & 1, (c >> 1) & 1, (c >> 2) & 1)
+    uint32_t corner_offset[8];
+    for (int c = 0; c != 8; ++c) {
+        corner_offset[c] = std::min(c & 1, static_cast<int>(end_x))
+                           + std::min((c >> 1) & 1, static_cast<int>(end_y)) * size_x
+                           + std::min((c >> 2) & 1, static_cast<int>(end_z)) * nxy;
+    }
+    // Six tetrahedra as corner paths from corner 0 to corner 7
+    const int tetrahedra[6][4] = {{0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7},
+                                  {0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7}};
 
-        // --------------------------------------------------------------------
-        // 1-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0) {
-            j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix < end_x) {
-            j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy > 0) {
-            j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy < end_y) {
-            j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iz > 0) {
-            j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iz < end_z) {
-            j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        // --------------------------------------------------------------------
-        // 2-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0 && iy > 0) {
-            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix > 0 && iy < end_y) {
-            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix < end_x && iy > 0) {
-            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix < end_x && iy < end_y) {
-            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix > 0 && iz > 0) {
-            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix < end_x && iz > 0) {
-            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
-        }
-        if (ix > 0 && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
+    std::vector<float> vertices;  // x, y, z in voxel coordinates
+    std::vector<int32_t> triangles;
+    std::vector<int32_t> edge_ids_lower(mode_mesh ? nxy * 7 : 0, -1);
+    std::vector<int32_t> edge_ids_upper(mode_mesh ? nxy * 7 : 0, -1);
+
+    for (uint32_t cz = 0; cz != cells_z; ++cz) {
+        for (uint32_t cy = 0; cy != cells_y; ++cy) {
+            for (uint32_t cx = 0; cx != cells_x; ++cx) {
+                const uint32_t i0 = cz * nxy + cy * size_x + cx;
+                float f[8];
+                bool negative[8], in_domain[8];
+                int nr_domain = 0, nr_negative = 0;
+                for (int c = 0; c != 8; ++c) {
+                    const uint32_t j = i0 + corner_offset[c];
+                    f[c] = *(nii_values_data + j);
+                    negative[c] = signbit(f[c]);
+                    in_domain[c] = *(nii_domain_data + j) != 0;
+                    if (in_domain[c]) {
+                        nr_domain += 1;
+                        nr_negative += negative[c];
+                    }
                 }
-            }
-        }
-        if (ix < end_x && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
+                if (nr_negative == 0 || nr_negative == nr_domain) continue;
+
+                // Voxel mask
+                for (int c = 0; c != 8; ++c) {
+                    if (in_domain[c]) {
+                        *(nii_out_data + i0 + corner_offset[c]) = 1;
+                    }
                 }
-            }
-        }
+                if (!mode_mesh || nr_domain != 8) continue;
 
-        // --------------------------------------------------------------------
-        // 3-jump neighbours
-        // --------------------------------------------------------------------
-        if (ix > 0 && iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
+                // Surface triangles
+                auto edge_vertex = [&](int u, int v) {
+                    if (u > v) std::swap(u, v);  // u is a subset of v
+                    const uint32_t start = cy * size_x + cx + (u & 1) + ((u >> 1) & 1) * size_x;
+                    std::vector<int32_t>& ids = (u >> 2) & 1 ? edge_ids_upper : edge_ids_lower;
+                    int32_t& id = ids[start * 7 + (u ^ v) - 1];
+                    if (id < 0) {
+                        const float t = f[u] / (f[u] - f[v]);
+                        id = vertices.size() / 3;
+                        vertices.push_back(cx + (u & 1) + t * ((v & 1) - (u & 1)));
+                        vertices.push_back(cy + ((u >> 1) & 1) + t * (((v >> 1) & 1) - ((u >> 1) & 1)));
+                        vertices.push_back(cz + ((u >> 2) & 1) + t * (((v >> 2) & 1) - ((u >> 2) & 1)));
+                    }
+                    return id;
+                };
+                auto add_triangle = [&](const int (&e)[3][2], int from, int to) {
+                    // Orient the normal from negative (corner `from`) to
+                    // positive (corner `to`) values. Edge midpoints are used
+                    // as they never form a degenerate triangle, unlike
+                    // vertices on exact zeros.
+                    float p[3][3], e1[3], e2[3], d[3];
+                    for (int j = 0; j != 3; ++j) {
+                        for (int k = 0; k != 3; ++k) {
+                            p[j][k] = 0.5 * (((e[j][0] >> k) & 1) + ((e[j][1] >> k) & 1));
+                        }
+                    }
+                    for (int k = 0; k != 3; ++k) {
+                        e1[k] = p[1][k] - p[0][k];
+                        e2[k] = p[2][k] - p[0][k];
+                        d[k] = ((to >> k) & 1) - ((from >> k) & 1);
+                    }
+                    float dot = (e1[1]*e2[2] - e1[2]*e2[1]) * d[0]
+                                + (e1[2]*e2[0] - e1[0]*e2[2]) * d[1]
+                                + (e1[0]*e2[1] - e1[1]*e2[0]) * d[2];
+                    int32_t a = edge_vertex(e[0][0], e[0][1]);
+                    int32_t b = edge_vertex(e[1][0], e[1][1]);
+                    int32_t c = edge_vertex(e[2][0], e[2][1]);
+                    triangles.push_back(a);
+                    triangles.push_back(dot < 0 ? c : b);
+                    triangles.push_back(dot < 0 ? b : c);
+                };
+
+                for (int k = 0; k != 6; ++k) {
+                    int neg[4], pos[4], nr_neg = 0, nr_pos = 0;
+                    for (int c = 0; c != 4; ++c) {
+                        const int corner = tetrahedra[k][c];
+                        if (negative[corner]) {
+                            neg[nr_neg++] = corner;
+                        } else {
+                            pos[nr_pos++] = corner;
+                        }
+                    }
+                    if (nr_neg == 1) {
+                        const int e[3][2] = {{neg[0], pos[0]}, {neg[0], pos[1]}, {neg[0], pos[2]}};
+                        add_triangle(e, neg[0], pos[0]);
+                    } else if (nr_neg == 3) {
+                        const int e[3][2] = {{pos[0], neg[0]}, {pos[0], neg[1]}, {pos[0], neg[2]}};
+                        add_triangle(e, neg[0], pos[0]);
+                    } else if (nr_neg == 2) {
+                        // Quad (ac, ad, bd, bc) split along its ac-bd diagonal
+                        const int e1[3][2] = {{neg[0], pos[0]}, {neg[0], pos[1]}, {neg[1], pos[1]}};
+                        const int e2[3][2] = {{neg[0], pos[0]}, {neg[1], pos[1]}, {neg[1], pos[0]}};
+                        add_triangle(e1, neg[0], pos[0]);
+                        add_triangle(e2, neg[0], pos[0]);
+                    }
                 }
             }
         }
-        if (ix > 0 && iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
+        // Edges starting in the upper slice are the lower ones of the next cells
+        if (mode_mesh) {
+            std::swap(edge_ids_lower, edge_ids_upper);
+            std::fill(edge_ids_upper.begin(), edge_ids_upper.end(), -1);
         }
-        if (ix > 0 && iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
+    }
+
+    // Save output nifti
+    save_output_nifti(fout, "zero_crossing", nii_out, true);
+
+    // ========================================================================
+    // Save surface mesh
+    // ========================================================================
+    if (mode_mesh) {
+        cout << "  Number of vertices : " << vertices.size() / 3 << endl;
+        cout << "  Number of triangles: " << triangles.size() / 3 << endl;
+
+        // Voxel to scanner coordinates
+        nifti_dmat44 ijk_to_xyz = nii_values->sto_xyz;
+        if (nii_values->sform_code <= 0) {
+            ijk_to_xyz = nii_values->qto_xyz;
         }
-        if (ix < end_x && iy > 0 && iz > 0) {
-            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
+        for (uint32_t v = 0; v != vertices.size() / 3; ++v) {
+            float* p = &vertices[v * 3];
+            float q[3];
+            for (int r = 0; r != 3; ++r) {
+                q[r] = ijk_to_xyz.m[r][0] * p[0] + ijk_to_xyz.m[r][1] * p[1]
+                       + ijk_to_xyz.m[r][2] * p[2] + ijk_to_xyz.m[r][3];
             }
+            p[0] = q[0], p[1] = q[1], p[2] = q[2];
         }
-        if (ix > 0 && iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
+
+        string path = fout;
+        std::string dir, file, basename, sep, ply_path_out;
+        auto pos1 = path.find_last_of('/');
+        if (pos1 != string::npos) {  // For Unix
+            sep = "/";
+            dir = path.substr(0, pos1);
+            file = path.substr(pos1 + 1);
+        } else {  // For Windows
+            pos1 = path.find_last_of('\\');
+            if (pos1 != string::npos) {
+                sep = "\\";
+                dir = path.substr(0, pos1);
+                file = path.substr(pos1 + 1);
+            } else {  // Only the filename
+                sep = "";
+                dir = "";
+                file = path;
             }
         }
-        if (ix < end_x && iy > 0 && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
+
+        // Parse filename
+        basename = file;
+        auto const pos2 = file.find_first_of('.');
+        if (pos2 != string::npos) {
+            basename = file.substr(0, pos2);
         }
-        if (ix < end_x && iy < end_y && iz > 0) {
-            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
+        ply_path_out = dir + sep + basename + "_zero_crossing" + ".ply";
+
+        // Binary PLY, little endian as written by x86 and ARM machines
+        std::ofstream ply(ply_path_out, std::ios::binary);
+        if (!ply.is_open()) {
+            std::cout << "  Unable to open mesh file!\n";
+            return 1;
         }
-        if (ix < end_x && iy < end_y && iz < end_z) {
-            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-            n = *(nii_values_data + j);
-            if (*(nii_domain_data + j) != 0) {
-                if (signbit(m) - signbit(n) != 0) {
-                    *(nii_out_data + i) = 1;
-                }
-            }
+        ply << "ply\n"
+            << "format binary_little_endian 1.0\n"
+            << "comment LN2_ZERO_CROSSING zero surface\n"
+            << "element vertex " << vertices.size() / 3 << "\n"
+            << "property float x\n"
+            << "property float y\n"
+            << "property float z\n"
+            << "element face " << triangles.size() / 3 << "\n"
+            << "property list uchar int vertex_indices\n"
+            << "end_header\n";
+        ply.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(float));
+        const unsigned char nr_corners = 3;
+        for (uint32_t t = 0; t != triangles.size() / 3; ++t) {
+            ply.write(reinterpret_cast<const char*>(&nr_corners), 1);
+            ply.write(reinterpret_cast<const char*>(&triangles[t * 3]), 3 * sizeof(int32_t));
         }
+        ply.close();
+        cout << "  Mesh is saved as:" << endl;
+        cout << "    " << ply_path_out << endl;
     }
-
-    // Save output nifti
-    save_output_nifti(fout, "zero_crossing", nii_out, true);
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "../dep/laynii_lib.h"
 #include <sstream>
+#include <chrono>
 
 int show_help(void) {
     printf(
@@ -19,13 +20,225 @@ int show_help(void) {
     "               to scalar image. No smoothing ('0') by default.\n"
     "    -fscale  : (Optional) Feature scale. Number of Gaussian smoothing iterations applied \n"
     "               to first order gradients (vector field). No smoothing ('0') by default.\n"
+    "    -tile    : (Optional) Edge length of cubic tiles, in voxels. Saves memory:\n"
+    "               each tile (plus halo) is diffused separately with tile sized\n"
+    "               work buffers, so peak memory drops to two copies of the\n"
+    "               image. Results are identical to the untiled path, but it is\n"
+    "               slower (about 2-3x in our tests) because the halos are\n"
+    "               computed again for every tile. Only use it when memory is\n"
+    "               the limit. Disabled ('0') by default.\n"
+    "    -tile_iter : (Optional) Number of iterations advanced per tile visit.\n"
+    "               Larger values need larger halos. '2' by default.\n"
     "    -output  : (Optional) Output basename for all outputs.\n"
-    "    -debug   : (Optional) Save extra intermediate outputs.\n"
+    "    -debug   : (Optional) Save extra intermediate outputs. Not used with\n"
+    "               '-tile'.\n"
     "\n"
+    "Notes:\n"
+    "    - Diffusion time and voxel iterations per second are reported at the\n"
+    "      end.\n"
     "\n");
     return 0;
 }
 
+void save_hessian_trace(const char* fout, const std::string prefix, const float* data_hessian,
+                        const uint32_t data_size, nifti_image* nii_out) {
+    // Save trace and off-trace sums of the SoA short Hessian (for testing)
+    float* data_out = static_cast<float*>(nii_out->data);
+    const float* h = data_hessian;
+    std::printf("  DEBUG: Saving output...\n");
+    for (uint32_t i = 0; i != data_size; ++i) {
+        *(data_out + i) = h[0*data_size + i] + h[3*data_size + i] + h[5*data_size + i];
+    }
+    save_output_nifti(fout, prefix + "-hessian_trace", nii_out, true);
+    for (uint32_t i = 0; i != data_size; ++i) {
+        *(data_out + i) = h[1*data_size + i] + h[2*data_size + i] + h[4*data_size + i];
+    }
+    save_output_nifti(fout, prefix + "-hessian_offtrace", nii_out, true);
+}
+
+// Work buffers of one diffusion iteration. The Hessian is stored as six
+// consecutive volumes (xx, xy, xz, yy, yz, zz). Eigen values and diffusion
+// weights are only kept for debug outputs.
+struct nolad_buffers {
+    float *gra1 = NULL, *gra2 = NULL, *gra3 = NULL;
+    float *hessian = NULL, *difference = NULL;
+    float *eigval1 = NULL, *eigval2 = NULL, *eigval3 = NULL;
+    float *diffw1 = NULL, *diffw2 = NULL, *diffw3 = NULL;
+};
+
+void nolad_allocate(nolad_buffers& buf, const uint32_t data_size, const bool with_debug) {
+    buf.gra1 = (float*)malloc(data_size * sizeof(float));
+    buf.gra2 = (float*)malloc(data_size * sizeof(float));
+    buf.gra3 = (float*)malloc(data_size * sizeof(float));
+    buf.hessian = (float*)malloc(data_size * 6 * sizeof(float));
+    buf.difference = (float*)malloc(data_size * sizeof(float));
+    if (with_debug) {
+        buf.eigval1 = (float*)malloc(data_size * sizeof(float));
+        buf.eigval2 = (float*)malloc(data_size * sizeof(float));
+        buf.eigval3 = (float*)malloc(data_size * sizeof(float));
+        buf.diffw1 = (float*)malloc(data_size * sizeof(float));
+        buf.diffw2 = (float*)malloc(data_size * sizeof(float));
+        buf.diffw3 = (float*)malloc(data_size * sizeof(float));
+    }
+}
+
+void nolad_free(nolad_buffers& buf) {
+    float* all[11] = {buf.gra1, buf.gra2, buf.gra3, buf.hessian, buf.difference,
+                      buf.eigval1, buf.eigval2, buf.eigval3, buf.diffw1, buf.diffw2, buf.diffw3};
+    for (int k = 0; k != 11; ++k) free(all[k]);
+    buf = nolad_buffers();
+}
+
+void save_debug_volume(const char* fout, const std::string tag, const float* data,
+                       const uint32_t data_size, nifti_image* nii_out) {
+    float* data_out = static_cast<float*>(nii_out->data);
+    for (uint32_t i = 0; i != data_size; ++i) *(data_out + i) = *(data + i);
+    save_output_nifti(fout, tag, nii_out, true);
+}
+
+void nolad_iteration(float* data, const int nx, const int ny, const int nz, const int nt,
+                     const float dx, const float dy, const float dz,
+                     const int NSCALE, const int FSCALE, nolad_buffers& buf, const bool log,
+                     const char* fout_debug = NULL, nifti_image* nii_debug = NULL) {
+    // NOTE: One explicit diffusion step. The tiled path calls this on small
+    // tile volumes, so it must only depend on voxels within a fixed radius:
+    // NSCALE (noise smoothing) + FSCALE (gradient smoothing) + 2 (Hessian)
+    // + 1 (divergence).
+    const uint32_t data_size = nx * ny * nz * nt;
+    const bool debug = fout_debug != NULL;
+
+    // ========================================================================
+    // Noise scale smoothing
+    // ========================================================================
+    float FWHM = 0.5;  // Default
+    if (NSCALE > 0) {
+        if (log) std::printf("\n  Smoothing (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, NSCALE);
+        ln_smooth_gaussian_iterative_3D(data, nx, ny, nz, nt, dx, dy, dz, FWHM, NSCALE, log);
+
+        if (debug) {
+            std::printf("  DEBUG: Saving output...\n");
+            save_debug_volume(fout_debug, "DEBUG2-smooth_gaussian", data, data_size, nii_debug);
+        }
+    }
+
+    // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+    // TODO: This gradient computation here is unnecesary if I retain the gradient where it is first computed above.
+    ln_compute_gradients_3D(data, buf.gra1, buf.gra2, buf.gra3, nx, ny, nz, nt);
+    ln_smooth_gaussian_iterative_3D(buf.gra1, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE, log);
+    ln_smooth_gaussian_iterative_3D(buf.gra2, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE, log);
+    ln_smooth_gaussian_iterative_3D(buf.gra3, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE, log);
+    // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+
+    // ========================================================================
+    // Compute Hessian
+    // ========================================================================
+    if (log) std::printf("\n  Computing Hessian matrices...\n");
+    ln_compute_hessian_3D(data, buf.hessian, nx, ny, nz, nt, dx, dy, dz, FSCALE, log);
+
+    if (debug) {
+        save_hessian_trace(fout_debug, "DEBUG3", buf.hessian, data_size, nii_debug);
+    }
+
+    // ========================================================================
+    // Compute diffusion tensors and negative flux field
+    // ========================================================================
+    // Eigen values, diffusion weights and the direct tensor update are done
+    // per voxel in one pass, followed by the dot product matrix vector.
+    // Weickert, 1998, eq. 1.1 (Fick's law). Yields vector fields.
+    if (log) std::printf("\n  Computing Eigen values, diffusion weights and tensors...\n");
+    ln_compute_diffusion_flux_3D(buf.hessian, buf.gra1, buf.gra2, buf.gra3, nx, ny, nz, nt,
+                                 buf.eigval1, buf.eigval2, buf.eigval3,
+                                 buf.diffw1, buf.diffw2, buf.diffw3);
+
+    if (debug) {
+        std::printf("  DEBUG: Saving output...\n");
+        save_debug_volume(fout_debug, "DEBUG4-eigen_value_1", buf.eigval1, data_size, nii_debug);
+        save_debug_volume(fout_debug, "DEBUG4-eigen_value_2", buf.eigval2, data_size, nii_debug);
+        save_debug_volume(fout_debug, "DEBUG4-eigen_value_3", buf.eigval3, data_size, nii_debug);
+        save_debug_volume(fout_debug, "DEBUG5-diffweight_1", buf.diffw1, data_size, nii_debug);
+        save_debug_volume(fout_debug, "DEBUG5-diffweight_2", buf.diffw2, data_size, nii_debug);
+        save_debug_volume(fout_debug, "DEBUG5-diffweight_3", buf.diffw3, data_size, nii_debug);
+        save_hessian_trace(fout_debug, "DEBUG6", buf.hessian, data_size, nii_debug);
+    }
+
+    // Compute divergence. Weickert, 1998, eq. 1.2 (continuity equation). Yields scalar field.
+    ln_compute_divergence_3D(buf.difference, buf.gra1, buf.gra2, buf.gra3, nx, ny, nz, nt);
+
+    // Update image (diffuse image using the difference)
+    float GAMMA = 0.25;
+    for (uint32_t i = 0; i != data_size; ++i) {
+        *(data + i) += *(buf.difference + i) * GAMMA;
+    }
+}
+
+void nolad_tiled(float* data, const int nx, const int ny, const int nz, const int nt,
+                 const float dx, const float dy, const float dz,
+                 const int NSCALE, const int FSCALE, const int NR_ITER,
+                 const int TILE, const int TILE_ITER) {
+    // NOTE: Each tile is copied out with a halo wide enough for TILE_ITER
+    // iterations, advanced TILE_ITER iterations, and only its core is written
+    // back. Tiles read from the state at the start of the block, so results
+    // match the untiled path. This bounds the work buffers by the tile size,
+    // but the halos are recomputed by every tile, so it is slower.
+    const int nxy = nx * ny;
+    const int nxyz = nxy * nz;
+    const int radius = NSCALE + FSCALE + 3;
+
+    float* data_next = (float*)malloc(nxyz * nt * sizeof(float));
+
+    for (int it = 0; it < NR_ITER; it += TILE_ITER) {
+        const int nr_steps = std::min(TILE_ITER, NR_ITER - it);
+        const int halo = nr_steps * radius;
+        std::printf("\r  Iterations: %d-%d/%d", it+1, it+nr_steps, NR_ITER);
+        std::fflush(stdout);
+
+        nolad_buffers buf;
+        const int edge = TILE + 2 * halo;
+        nolad_allocate(buf, edge * edge * edge, false);
+        std::vector<float> tile(edge * edge * edge);
+
+        for (int t = 0; t != nt; ++t) {
+            const float* src = data + t * nxyz;
+            float* dst = data_next + t * nxyz;
+            for (int z0 = 0; z0 < nz; z0 += TILE) {
+                for (int y0 = 0; y0 < ny; y0 += TILE) {
+                    for (int x0 = 0; x0 < nx; x0 += TILE) {
+                        // Core and halo bounds, clipped to the image
+                        const int x1 = std::min(x0 + TILE, nx);
+                        const int y1 = std::min(y0 + TILE, ny);
+                        const int z1 = std::min(z0 + TILE, nz);
+                        const int hx0 = std::max(x0 - halo, 0), hx1 = std::min(x1 + halo, nx);
+                        const int hy0 = std::max(y0 - halo, 0), hy1 = std::min(y1 + halo, ny);
+                        const int hz0 = std::max(z0 - halo, 0), hz1 = std::min(z1 + halo, nz);
+                        const int tx = hx1 - hx0, ty = hy1 - hy0, tz = hz1 - hz0;
+
+                        for (int z = hz0; z != hz1; ++z) {
+                            for (int y = hy0; y != hy1; ++y) {
+                                std::copy(src + z*nxy + y*nx + hx0, src + z*nxy + y*nx + hx1,
+                                          tile.begin() + ((z-hz0)*ty + (y-hy0))*tx);
+                            }
+                        }
+                        for (int s = 0; s != nr_steps; ++s) {
+                            nolad_iteration(tile.data(), tx, ty, tz, 1, dx, dy, dz,
+                                            NSCALE, FSCALE, buf, false);
+                        }
+                        for (int z = z0; z != z1; ++z) {
+                            for (int y = y0; y != y1; ++y) {
+                                const float* row = tile.data() + ((z-hz0)*ty + (y-hy0))*tx;
+                                std::copy(row + (x0-hx0), row + (x1-hx0), dst + z*nxy + y*nx + x0);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        nolad_free(buf);
+        std::copy(data_next, data_next + nxyz * nt, data);
+    }
+    std::printf("\n");
+    free(data_next);
+}
+
 // NOTE[Faruk]: References are:
 // - Weickert, J. (1998). Anisotropic diffusion in image processing. Image Rochester NY, 256(3), 170.
 // - Mirebeau, J.-M., Fehrenbach, J., Risser, L., & Tobji, S. (2015). Anisotropic Diffusion in ITK, 1-9.
@@ -35,7 +248,7 @@ int main(int argc, char*  argv[]) {
     char *fin1 = NULL, *fout = NULL;
     int ac;
     bool mode_debug = false;
-    int NSCALE = 0, FSCALE = 0, NR_ITER = 5;
+    int NSCALE = 0, FSCALE = 0, NR_ITER = 5, TILE = 0, TILE_ITER = 2;
     float LAMBDA=0.001, ALPHA=0.001, M=4;
 
 
@@ -69,6 +282,22 @@ int main(int argc, char*  argv[]) {
             } else {
                 FSCALE = atof(argv[ac]);
             }
+        } else if (!strcmp(argv[ac], "-tile")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -tile\n");
+                return 1;
+            }
+            TILE = atoi(argv[ac]);
+        } else if (!strcmp(argv[ac], "-tile_iter")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -tile_iter\n");
+                return 1;
+            }
+            TILE_ITER = atoi(argv[ac]);
+            if (TILE_ITER < 1) {
+                fprintf(stderr, "** -tile_iter must be at least 1\n");
+                return 1;
+            }
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
         } else if (!strcmp(argv[ac], "-output")) {
@@ -123,7 +352,6 @@ int main(int argc, char*  argv[]) {
 
     // Prepare generic output niftis
     nifti_image* nii_out_float32 = copy_nifti_as_float32(nii1);
-    float* nii_out_float32_data = static_cast<float*>(nii_out_float32->data);
 
     // ========================================================================
     // Normalize by maximum
@@ -133,184 +361,33 @@ int main(int argc, char*  argv[]) {
 
     save_output_nifti(fout, "normalized_to_zero_one", nii_input, true);        
 
-    for (uint32_t ii = 0; ii != NR_ITER; ++ii) {
-        std::printf("  Iteration: %d\n", ii+1);
-
-        // ========================================================================
-        // Noise scale smoothing
-        // ========================================================================
-        float FWHM = 0.5;  // Default
-        if (NSCALE > 0) {
-            std::printf("\n  Smoothing (iterative 3D Gaussian [FWHM = %f, iterations = %i])...\n", FWHM, NSCALE);
-            ln_smooth_gaussian_iterative_3D(data_input, nx, ny, nz, nt, dx, dy, dz, FWHM, NSCALE);
-
-            if (mode_debug) {
-                std::printf("  DEBUG: Saving output...\n");
-                save_output_nifti(fout, "DEBUG2-smooth_gaussian", nii_input, true);            
-            }
-        }
-
-        // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-        // TODO: This gradient computation here is unnecesary if I retain the gradient where it is first computed above.
-        float* data_gra1 = (float*)malloc(data_size * sizeof(float));
-        float* data_gra2 = (float*)malloc(data_size * sizeof(float));
-        float* data_gra3 = (float*)malloc(data_size * sizeof(float));
-        ln_compute_gradients_3D(data_input, data_gra1, data_gra2, data_gra3, nx, ny, nz, nt);
-        ln_smooth_gaussian_iterative_3D(data_gra1, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE);
-        ln_smooth_gaussian_iterative_3D(data_gra2, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE);
-        ln_smooth_gaussian_iterative_3D(data_gra3, nx, ny, nz, nt, dx, dy, dz, FWHM, FSCALE);
-        // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-
-        
-        // ========================================================================
-        // Compute Hessian
-        // ========================================================================
-        std::printf("\n  Computing Hessian matrices...\n");
-
-        float* data_hessian  = (float*)malloc(data_size * 6 * sizeof(float));
-        ln_compute_hessian_3D(data_input, data_hessian, nx, ny, nz, nt, dx, dy, dz, FSCALE);
-        
-        // ------------------------------------------------------------------------
-        if (mode_debug) {
-            // Compute trace (for testing)
-            float* data_trace = (float*)malloc(data_size * sizeof(float));
-            for (uint32_t i = 0; i != data_size; ++i) {
-                *(data_trace + i) = *(data_hessian + i*6 + 0) + *(data_hessian + i*6 + 3) + *(data_hessian + i*6 + 5);
-            }
-            std::printf("  DEBUG: Saving output...\n");
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_trace + i);
-            free(data_trace);
-            save_output_nifti(fout, "DEBUG3-hessian_trace", nii_out_float32, true);
-
-            // Compute off-trace (for testing)
-            float* data_offtrace = (float*)malloc(data_size * sizeof(float));
-            for (uint32_t i = 0; i != data_size; ++i) {
-                *(data_offtrace + i) = *(data_hessian + i*6 + 1) + *(data_hessian + i*6 + 2) + *(data_hessian + i*6 + 4);
-            }
-            std::printf("  DEBUG: Saving output...\n");
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_offtrace + i);
-            free(data_offtrace);
-            save_output_nifti(fout, "DEBUG3-hessian_offtrace", nii_out_float32, true);  
-        }
-
-        // ========================================================================
-        // Compute Eigen values
-        // ========================================================================
-        std::printf("\n  Computing Eigen values...\n");
-
-        float* data_eigval1 = (float*)malloc(data_size * sizeof(float));
-        float* data_eigval2 = (float*)malloc(data_size * sizeof(float));
-        float* data_eigval3 = (float*)malloc(data_size * sizeof(float));
-        ln_compute_eigen_values_3D(data_hessian, data_eigval1, data_eigval2, data_eigval3, nx, ny, nz, nt);
-
-        // ------------------------------------------------------------------------
+    std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+    if (TILE > 0) {
         if (mode_debug) {
-            std::printf("  DEBUG: Saving output...\n"); 
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_eigval1 + i);
-            save_output_nifti(fout, "DEBUG4-eigen_value_1", nii_out_float32, true);
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_eigval2 + i);
-            save_output_nifti(fout, "DEBUG4-eigen_value_2", nii_out_float32, true);
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_eigval3 + i);
-            save_output_nifti(fout, "DEBUG4-eigen_value_3", nii_out_float32, true);        
+            std::printf("  NOTE: Debug outputs are not saved with -tile.\n");
         }
-
-        // ========================================================================
-        // Compute diffusion weights
-        // ========================================================================
-        std::printf("\n  Computing diffusion weights...\n");
-
-        float* data_diffw1 = (float*)malloc(data_size * sizeof(float));
-        float* data_diffw2 = (float*)malloc(data_size * sizeof(float));
-        float* data_diffw3 = (float*)malloc(data_size * sizeof(float));
-
-        for (uint32_t i = 0; i != data_size; ++i) {
-            // Preserve signs
-            float sign1 = std::copysignf(1.0f, *(data_eigval1 + i));
-            float sign2 = std::copysignf(1.0f, *(data_eigval2 + i)); 
-            float sign3 = std::copysignf(1.0f, *(data_eigval3 + i));
-            
-            // Apply compositional closure
-            float eigvalsum = std::abs(*(data_eigval1 + i)) + std::abs(*(data_eigval2 + i)) + std::abs(*(data_eigval3 + i));
-            if (eigvalsum == 0) {
-                *(data_diffw1 + i) = 0;
-                *(data_diffw2 + i) = 0;
-                *(data_diffw3 + i) = 0;
+        std::printf("\n  Diffusing in %d^3 tiles, %d iterations per tile visit...\n", TILE, TILE_ITER);
+        nolad_tiled(data_input, nx, ny, nz, nt, dx, dy, dz, NSCALE, FSCALE, NR_ITER, TILE, TILE_ITER);
+    } else {
+        nolad_buffers buf;
+        nolad_allocate(buf, data_size, mode_debug);
+        for (uint32_t ii = 0; ii != NR_ITER; ++ii) {
+            std::printf("  Iteration: %d\n", ii+1);
+            if (mode_debug) {
+                nolad_iteration(data_input, nx, ny, nz, nt, dx, dy, dz, NSCALE, FSCALE, buf, true,
+                                fout, nii_out_float32);
             } else {
-                *(data_diffw1 + i) =  1 - ( std::abs(*(data_eigval1 + i)) / eigvalsum );
-                *(data_diffw2 + i) =  1 - ( std::abs(*(data_eigval2 + i)) / eigvalsum );
-                *(data_diffw3 + i) =  1 - ( std::abs(*(data_eigval3 + i)) / eigvalsum );
-
-                // Reclose for balance
-                eigvalsum = *(data_diffw1 + i) + *(data_diffw2 + i) + *(data_diffw3 + i);
-                *(data_diffw1 + i) /= eigvalsum;
-                *(data_diffw2 + i) /= eigvalsum;
-                *(data_diffw3 + i) /= eigvalsum;
-
-                // Reassign signs
-                *(data_diffw1 + i) *= sign1;
-                *(data_diffw2 + i) *= sign2;
-                *(data_diffw3 + i) *= sign3;
+                nolad_iteration(data_input, nx, ny, nz, nt, dx, dy, dz, NSCALE, FSCALE, buf, true);
             }
         }
+        nolad_free(buf);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
 
-        // -------------------------------------------------------------------------
-        if (mode_debug) {
-            std::printf("  DEBUG: Saving output...\n"); 
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_diffw1 + i);
-            save_output_nifti(fout, "DEBUG5-diffweight_1", nii_out_float32, true);
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_diffw2 + i);
-            save_output_nifti(fout, "DEBUG5-diffweight_2", nii_out_float32, true);
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_diffw3 + i);
-            save_output_nifti(fout, "DEBUG5-diffweight_3", nii_out_float32, true);        
-        }
-
-        // ========================================================================
-        // Construct diffusion tensor with direct update
-        // ========================================================================
-        std::printf("\n  Constructing diffusion tensors...\n");
-        ln_update_shorthessian(data_hessian, data_diffw1, data_diffw2, data_diffw3, nx, ny, nz, nt);
-
-        // ------------------------------------------------------------------------
-        if (mode_debug) {
-            // Compute trace (for testing)
-            float* data_trace = (float*)malloc(data_size * sizeof(float));
-            for (uint32_t i = 0; i != data_size; ++i) {
-                *(data_trace + i) = *(data_hessian + i*6 + 0) + *(data_hessian + i*6 + 3) + *(data_hessian + i*6 + 5);
-            }
-            std::printf("  DEBUG: Saving output...\n");
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_trace + i);
-            free(data_trace);
-            save_output_nifti(fout, "DEBUG6-hessian_trace", nii_out_float32, true);
-
-            // Compute off-trace (for testing)
-            float* data_offtrace = (float*)malloc(data_size * sizeof(float));
-            for (uint32_t i = 0; i != data_size; ++i) {
-                *(data_offtrace + i) = *(data_hessian + i*6 + 1) + *(data_hessian + i*6 + 2) + *(data_hessian + i*6 + 4);
-            }
-            std::printf("  DEBUG: Saving output...\n");
-            for (uint32_t i = 0; i != data_size; ++i) *(nii_out_float32_data + i) = *(data_offtrace + i);
-            free(data_offtrace);
-            save_output_nifti(fout, "DEBUG6-hessian_offtrace", nii_out_float32, true);  
-
-        }
+    double voxel_iterations = static_cast<double>(data_size) * NR_ITER;
+    std::printf("\n  Diffusion time          : %.3f s\n", elapsed);
+    std::printf("  Voxel iterations per s  : %.3e\n", voxel_iterations / elapsed);
 
-        // ========================================================================
-        // Compute negative flux field
-        // ========================================================================
-        
-        // Compute dot_product_matrix_vector. Weickert, 1998, eq. 1.1 (Fick's law). Yields vector fields.
-        ln_multiply_matrix_vector_3D(data_hessian, data_gra1, data_gra2, data_gra3, nx, ny, nz, nt);
-
-        // Compute divergence. Weickert, 1998, eq. 1.2 (continuity equation). Yields scalar field.
-        float* data_diffusion_difference = (float*)malloc(data_size * sizeof(float));
-        ln_compute_divergence_3D(data_diffusion_difference, data_gra1, data_gra2, data_gra3, nx, ny, nz, nt);
-
-        // Update image (diffuse image using the difference)
-        float GAMMA = 0.25;
-        for (uint32_t i = 0; i != data_size; ++i) {
-            *(data_input + i) += *(data_diffusion_difference + i) * GAMMA;
-        }
-    }
     save_output_nifti(fout, "TEST-FINAL", nii_input, true);  
 
     cout << "\n  Finished." << endl;
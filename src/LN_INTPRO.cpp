@@ -93,7 +93,7 @@ int main(int argc, char * argv[]) {
         fprintf(stderr, "** Do either maximum or minimum. Not both.\n");
         return 1;
     }
-    if (is_direction-2 >1) {
+    if (is_direction < 1 || is_direction > 3) {
         cout << "  Invalid direction. ";
         return 1;
     }
@@ -117,8 +117,6 @@ int main(int argc, char * argv[]) {
     int size_y = nii_input->ny;
     int size_z = nii_input->nz;
     int size_time = nii_input->nt;
-    int nx = nii_input->nx;
-    int nxy = nii_input->nx * nii_input->ny;
     int nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
 
     if (is_range > 0) {
@@ -146,107 +144,48 @@ int main(int argc, char * argv[]) {
     // ========================================================================
     cout << "  Starting with dimensionality collapse = " << endl;
 
-    float extreme_val = 0.0;
-    if (is_min == 1) {
-        extreme_val = std::numeric_limits<float>::max();
+    // Running projection within the range along the direction, for every
+    // volume, then collapsed across time. Non-positive values are ignored by
+    // the minimum projection; the maximum projection starts from zero.
+    const ln_projection_type type = is_min == 1 ? LN_PROJECTION_MIN : LN_PROJECTION_MAX;
+    const float excluded = std::numeric_limits<float>::infinity();
+    std::vector<float> volume(nxyz), projected(nxyz);
+    std::vector<bool> is_positive(nxyz, false);
+    for (int i = 0; i != nxyz; ++i) {
+        *(nii_collapse_data + i) = is_min == 1 ? excluded : 0.0;
     }
 
-    for (int ix = 0; ix < size_y; ++ix) {
-        for (int iy = 0; iy < size_x; ++iy) {
-            for (int iz = 0; iz < size_z; ++iz) {
-                int voxel_i, voxel_j;
-                if (is_min == 1) extreme_val = std::numeric_limits<float>::max();
-                if (is_max == 1) extreme_val = 0.0;
-                // ------------------------------------------------------------
-                if (is_direction == 1) {
-                    for (int ix_i = max(ix - is_range, 0);
-                         ix_i < min(ix + is_range, size_y); ++ix_i) {
-                        for (int it = 0; it < size_time; ++it) {
-                            voxel_i = nxyz * it + nxy * iz + nx * ix + iy;
-                            voxel_j = nxyz * it + nxy * iz + nx * ix_i + iy;
-                            if (is_min == 1
-                                && *(nii_data + voxel_j) < extreme_val
-                                && *(nii_data + voxel_j) > 0.0) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                            if (is_max == 1
-                                && *(nii_data + voxel_j) > extreme_val) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                        }
-                    }
-                    for (int it = 0; it < size_time; ++it) {
-                        if (is_min == 1
-                            && *(nii_data + voxel_i) >= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                        if (is_max == 1
-                            && *(nii_data + voxel_i) <= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                    }
-                    // ------------------------------------------------------------
-                } else if (is_direction == 2) {
-                    for (int iy_i = max(iy - is_range, 0);
-                         iy_i < min(iy + is_range, size_x); ++iy_i) {
-                        for (int it = 0; it < size_time; ++it) {
-                            voxel_i = nxyz * it + nxy * iz + nx * ix + iy;
-                            voxel_j = nxyz * it + nxy * iz + nx * ix + iy_i;
-
-                            if (is_min == 1
-                                && *(nii_data + voxel_j) < extreme_val
-                                && *(nii_data + voxel_j) > 0.0) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                            if (is_max == 1
-                                && *(nii_data + voxel_j) > extreme_val) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                        }
-                    }
-                    for (int it = 0; it < size_time; ++it) {
-                        if (is_min == 1
-                            && *(nii_data + voxel_i) >= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                        if (is_max == 1
-                            && *(nii_data + voxel_i) <= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                    }
-                    // ------------------------------------------------------------
-                } else if (is_direction == 3) {
-                    for (int iz_i = max(iz - is_range, 0);
-                         iz_i < min(iz + is_range, size_z); ++iz_i) {
-                        for (int it = 0; it < size_time; ++it) {
-                            voxel_i = nxyz * it + nxy * iz + nx * ix + iy;
-                            voxel_j = nxyz * it + nxy * iz_i + nx * ix + iy;
-                            if (is_min == 1
-                                && *(nii_data + voxel_j) < extreme_val
-                                && *(nii_data + voxel_j) > 0.0) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                            if (is_max == 1
-                                && *(nii_data + voxel_j) > extreme_val) {
-                                extreme_val = *(nii_data + voxel_j);
-                            }
-                        }
-                    }
-                    for (int it = 0; it < size_time; ++it) {
-                        if (is_min == 1
-                            && *(nii_data + voxel_i) >= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                        if (is_max == 1
-                            && *(nii_data + voxel_i) <= extreme_val) {
-                            *(nii_collapse_data + voxel_i) = extreme_val;
-                        }
-                    }
-                }
+    for (int it = 0; it < size_time; ++it) {
+        const float* nii_volume_data = nii_data + nxyz * it;
+        for (int i = 0; i != nxyz; ++i) {
+            float v = *(nii_volume_data + i);
+            if (is_min == 1 && !(v > 0.0)) {
+                v = excluded;
+            } else if (is_min == 1) {
+                is_positive[i] = true;
+            }
+            volume[i] = v;
+        }
+        ln_running_projection_3D(volume.data(), projected.data(), size_x, size_y, size_z,
+                                  is_direction == 1, is_direction == 2, is_direction == 3,
+                                  is_range, type);
+        for (int i = 0; i != nxyz; ++i) {
+            if (is_min == 1) {
+                *(nii_collapse_data + i) = min(*(nii_collapse_data + i), projected[i]);
+            } else {
+                *(nii_collapse_data + i) = max(*(nii_collapse_data + i), projected[i]);
             }
         }
     }
 
+    // Voxels without positive values are not part of the minimum projection
+    if (is_min == 1) {
+        for (int i = 0; i != nxyz; ++i) {
+            if (!is_positive[i]) {
+                *(nii_collapse_data + i) = 0.0;
+            }
+        }
+    }
 
     if (!use_outpath) fout = fin_1;
     save_output_nifti(fout, "collapsed", nii_collapse, true, use_outpath);
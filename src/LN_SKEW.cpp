@@ -16,6 +16,10 @@ int show_help(void) {
     "    -input  : Nifti (.nii or nii.gz) time series.\n"
     "    -output : (Optional) Output filename, including .nii or .nii.gz\n"
     "              and path if needed. Overwrites existing files.\n"    
+    "    -chunk  : (Optional) Number of volumes that are read into memory at\n"
+    "              once. Statistics are computed in a single pass over the\n"
+    "              time series, so data larger than memory can be processed.\n"
+    "              Default is to read all volumes at once.\n"
     "\n"
     "Notes:\n"
     "    - Applications of this program are described in this blog post:\n"
@@ -32,7 +36,7 @@ int main(int argc, char * argv[]) {
     bool use_outpath = false;
     char  *fout = NULL;
     char *fin = NULL;
-    int ac;
+    int ac, chunk_size = 0;
     if (argc < 2) return show_help();
 
     // Process user options
@@ -52,6 +56,12 @@ int main(int argc, char * argv[]) {
             }
             use_outpath = true;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-chunk")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -chunk\n");
+                return 1;
+            }
+            chunk_size = atoi(argv[ac]);
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -63,8 +73,8 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image * nii_input = nifti_image_read(fin, 1);
+    // Read input header, the data is read in chunks of volumes below
+    nifti_image * nii_input = nifti_image_read(fin, 0);
     if (!nii_input) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
@@ -77,20 +87,20 @@ int main(int argc, char * argv[]) {
     const uint64_t size_x = nii_input->nx;
     const uint64_t size_y = nii_input->ny;
     const uint64_t size_z = nii_input->nz;
-    uint64_t size_time = nii_input->nt;
+    const uint64_t size_time = nii_input->nt;
     const uint64_t nx = nii_input->nx;
     const uint64_t nxy = nii_input->nx * nii_input->ny;
     const uint64_t nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
 
-    // ========================================================================
-    // Fix data type issues
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
+    if (chunk_size <= 0 || static_cast<uint64_t>(chunk_size) > size_time) {
+        chunk_size = size_time;
+    }
 
+    // ========================================================================
     // Allocate new nifti
-    nifti_image* nii_skew = nifti_copy_nim_info(nii);
+    nifti_image* nii_skew = nifti_copy_nim_info(nii_input);
     nii_skew->nt = 1;
-    nii_skew->nvox = nii->nvox / size_time;
+    nii_skew->nvox = nxyz;
     nii_skew->datatype = NIFTI_TYPE_FLOAT32;
     nii_skew->nbyper = sizeof(float);
     nii_skew->data = calloc(nii_skew->nvox, nii_skew->nbyper);
@@ -124,28 +134,39 @@ int main(int argc, char * argv[]) {
     float* nii_NOISESTDEV_data = static_cast<float*>(nii_NOISESTDEV->data);
 
     // ========================================================================
-    cout << "    Calculating skew, kurtosis, and autocorrelation..." << endl;
-
-    std::vector<double> vec1(size_time);
-    std::vector<double> vec2(size_time);
-    std::vector<double> vecl(27);  // Vector for spatial gradient (number of voxel neighbours)
+    cout << "    Calculating skew, kurtosis, autocorrelation, correlation with" << endl;
+    cout << "    everything and image SNR in a single pass..." << endl;
+
+    ln_temporal_moments moments;
+    ln_temporal_moments_init(moments, nxyz);
+
+    std::vector<float> volume(nxyz);
+    std::vector<int64_t> brick_list(chunk_size);
+    for (uint64_t t0 = 0; t0 < size_time; t0 += chunk_size) {
+        const uint64_t nr_bricks = std::min(static_cast<uint64_t>(chunk_size), size_time - t0);
+        for (uint64_t j = 0; j < nr_bricks; ++j) {
+            brick_list[j] = t0 + j;
+        }
 
-    uint64_t voxel_i = 0; 
-    for (uint64_t iz = 0; iz < size_z; ++iz) {
-        for (uint64_t iy = 0; iy < size_y; ++iy) {
-            for (uint64_t ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (uint64_t it = 0; it < size_time; ++it) {
-                    vec1[it] = static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                }
-                *(nii_skew_data + voxel_i) = ren_skew(vec1.data(), size_time);
-                *(nii_kurt_data + voxel_i) = ren_kurt(vec1.data(), size_time);
-                *(nii_autocorr_data + voxel_i) = ren_autocor(vec1.data(), size_time);
-                *(nii_mean_data + voxel_i) =  ren_average(vec1.data(), size_time);
-                *(nii_stdev_data + voxel_i) = ren_stdev(vec1.data(), size_time);
-                *(nii_tSNR_data + voxel_i) = ren_average(vec1.data(), size_time) / ren_stdev(vec1.data(), size_time);
-            }
+        nifti_brick_list NBL;
+        if (nifti_image_load_bricks(nii_input, nr_bricks, brick_list.data(), &NBL) <= 0) {
+            fprintf(stderr, "** failed to read volumes from '%s'\n", fin);
+            return 2;
+        }
+        for (uint64_t j = 0; j < nr_bricks; ++j) {
+            cast_to_float32(NBL.bricks[j], nii_input->datatype, nxyz, volume.data());
+            ln_temporal_moments_update(moments, volume.data());
         }
+        nifti_free_NBL(&NBL);
+    }
+
+    ln_temporal_moments_finalize(moments, nii_mean_data, nii_stdev_data,
+                                 nii_skew_data, nii_kurt_data,
+                                 nii_autocorr_data, nii_conc_data,
+                                 nii_NOISE_data);
+
+    for (uint64_t voxel_i = 0; voxel_i < nxyz; voxel_i++) {
+        *(nii_tSNR_data + voxel_i) = *(nii_mean_data + voxel_i) / *(nii_stdev_data + voxel_i);
     }
 
     for (uint64_t voxel_i = 0; voxel_i < nxyz; voxel_i++) {
@@ -166,62 +187,12 @@ int main(int argc, char * argv[]) {
     save_output_nifti(fout, "stdev", nii_stdev, true);
     save_output_nifti(fout, "tSNR", nii_tSNR, true);
 
-    // ========================================================================
-    cout << "    Calculating correlation with everything..." << endl;
-
-    for (uint64_t it = 0; it < size_time; ++it) {
-        vec1[it] = 0;
-        vec2[it] = 0;
-    }
-
-    // Mean time course of everything
-    for (uint64_t iz = 0; iz < size_z; ++iz) {
-        for (uint64_t iy = 0; iy < size_y; ++iy) {
-            for (uint64_t ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (uint64_t it = 0; it < size_time; ++it) {
-                    vec1[it] += static_cast<double>(*(nii_data + nxyz * it + voxel_i) / nxyz);
-                }
-            }
-        }
-    }
-
-    // Voxel-wise corelation to mean of everything
-    for (uint64_t iz = 0; iz < size_z; ++iz) {
-        for (uint64_t iy = 0; iy < size_y; ++iy) {
-            for (uint64_t ix = 0; ix <size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (uint64_t it = 0; it < size_time; ++it)   {
-                    vec2[it] = static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                }
-                *(nii_conc_data + voxel_i) = ren_correl(vec1.data(), vec2.data(), size_time);
-            }
-        }
-    }
     save_output_nifti(fout, "overall_correl", nii_conc, true);
-
-    // ========================================================================
-    cout << "    Calculating image SNR ..." << endl;
-    if (size_time%2 == 1) {
-        size_time = size_time - 1;  // Make sure it has even number of time points 
-    }
-
-    for (uint64_t it = 0; it < size_time-1; it = it + 2 )   {
-        for (uint64_t voxel_i = 0; voxel_i < nxyz; voxel_i++) {
-            *(nii_NOISE_data + voxel_i) += static_cast<double>(*(nii_data + nxyz * it     + voxel_i));
-            *(nii_NOISE_data + voxel_i) -= static_cast<double>(*(nii_data + nxyz * (it+1) + voxel_i));
-        }
-    }
-  
-    // Normalizing to time course duration
-    for (uint64_t voxel_i = 0; voxel_i < nxyz; ++voxel_i) {
-        *(nii_NOISE_data + voxel_i) = *(nii_NOISE_data + voxel_i) / sqrt((double) (size_time)/2 );
-    }
-
     save_output_nifti(fout, "noise", nii_NOISE, true);
 
     // ------------------------------------------------------------------------
     // Estimating local gradient of mean  
+    std::vector<double> vecl(27);  // Vector for spatial gradient (number of voxel neighbours)
     int64_t vic_counter = 0;  // Vicinity counter
     int64_t vic = 1;  // This will result in 26 neighbors (27 voxels) and is sufficient for decent STDEV estimation
     int64_t sx = static_cast<int64_t>(size_x);
@@ -231,9 +202,9 @@ int main(int argc, char * argv[]) {
         for (int64_t iy = 0; iy < sy; ++iy) {
             for (int64_t ix = 0; ix <sx; ++ix) {
                 vic_counter = 0; 
-                for (int64_t iz_i = std::max(0LL, iz-vic); iz_i <= std::min(iz+vic, sz-1LL); ++iz_i) {
-                    for (int64_t iy_i = std::max(0LL, iy-vic); iy_i <= std::min(iy+vic, sy-1LL); ++iy_i) {
-                        for (int64_t ix_i = std::max(0LL, ix-vic); ix_i <= std::min(ix+vic, sx-1LL); ++ix_i) {
+                for (int64_t iz_i = std::max(static_cast<int64_t>(0), iz - vic); iz_i <= std::min(iz + vic, sz - 1); ++iz_i) {
+                    for (int64_t iy_i = std::max(static_cast<int64_t>(0), iy - vic); iy_i <= std::min(iy + vic, sy - 1); ++iy_i) {
+                        for (int64_t ix_i = std::max(static_cast<int64_t>(0), ix - vic); ix_i <= std::min(ix + vic, sx - 1); ++ix_i) {
                             vecl[vic_counter] = *(nii_mean_data + nxy * iz_i + nx * iy_i + ix_i);  
                             vic_counter++;
                         }
@@ -252,9 +223,9 @@ int main(int argc, char * argv[]) {
         for (int64_t iy = 0; iy < sy; ++iy) {
             for (int64_t ix = 0; ix <sx; ++ix) {
                 vic_counter = 0; 
-                for (int64_t iz_i = std::max(0LL, iz-vic); iz_i <= std::min(iz+vic, sz-1LL); ++iz_i) {
-                    for (int64_t iy_i = std::max(0LL, iy-vic); iy_i <= std::min(iy+vic, sy-1LL); ++iy_i) {
-                        for (int64_t ix_i = std::max(0LL, ix-vic); ix_i <= std::min(ix+vic, sx-1LL); ++ix_i) {
+                for (int64_t iz_i = std::max(static_cast<int64_t>(0), iz - vic); iz_i <= std::min(iz + vic, sz - 1); ++iz_i) {
+                    for (int64_t iy_i = std::max(static_cast<int64_t>(0), iy - vic); iy_i <= std::min(iy + vic, sy - 1); ++iy_i) {
+                        for (int64_t ix_i = std::max(static_cast<int64_t>(0), ix - vic); ix_i <= std::min(ix + vic, sx - 1); ++ix_i) {
                             vecl[vic_counter] = *(nii_NOISE_data + nxy * iz_i + nx * iy_i + ix_i);  
                             vic_counter++;
                         }